@@ -152,6 +152,20 @@ void syscall(struct trapframe *tf)
 		err = sys_fstat(tf->tf_a0, (userptr_t) tf->tf_a1);
 		break;
 
+	case SYS_ioctl:
+		err = sys_ioctl(tf->tf_a0, tf->tf_a1, (userptr_t) tf->tf_a2);
+		break;
+
+	case SYS_getdirentry:
+		err = sys_getdirentry(tf->tf_a0, (userptr_t) tf->tf_a1,
+				      tf->tf_a2, &retval_hi);
+		break;
+
+	case SYS_getdirentries:
+		err = sys_getdirentries(tf->tf_a0, (userptr_t) tf->tf_a1,
+					tf->tf_a2, tf->tf_a3, &retval_hi);
+		break;
+
 	case SYS_fork:
 		err = sys_fork(tf, &retval_hi);
 		break;
@@ -160,6 +174,10 @@ void syscall(struct trapframe *tf)
 		err = sys_getpid(&retval_hi);
 		break;
 
+	case SYS_sbrk:
+		err = sys_sbrk((intptr_t) tf->tf_a0, &retval_hi);
+		break;
+
 	case SYS_waitpid:
 		err = sys_waitpid(tf->tf_a0, (userptr_t) tf->tf_a1, tf->tf_a2,
 				  &retval_hi);
@@ -0,0 +1,254 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <proc.h>
+#include <current.h>
+#include <mips/tlb.h>
+#include <addrspace.h>
+#include <pagetable.h>
+#include <coremap.h>
+#include <vm.h>
+
+/*
+ * MIPS side of the VM system: kernel pages, which come straight from
+ * the coremap and are reached through kseg0, and the TLB, which is
+ * loaded from the address space's page table on each miss. The
+ * machine-independent part is in vm/addrspace.c.
+ *
+ * TLB misses are counted per CPU; see cpu_printtlbstats.
+ */
+
+void
+vm_bootstrap(void)
+{
+	coremap_bootstrap();
+}
+
+/*
+ * Check that we're in a context that can sleep; faults and page
+ * allocation may.
+ */
+static
+void
+vm_can_sleep(void)
+{
+	if (CURCPU_EXISTS()) {
+		/* must not hold spinlocks */
+		KASSERT(curcpu->c_spinlocks == 0);
+
+		/* must not be in an interrupt handler */
+		KASSERT(curthread->t_in_interrupt == 0);
+	}
+}
+
+/* Allocate/free some kernel-space virtual pages */
+vaddr_t
+alloc_kpages(unsigned npages)
+{
+	paddr_t pa;
+
+	vm_can_sleep();
+	pa = coremap_alloc(npages, NULL, 0);
+	if (pa == 0) {
+		return 0;
+	}
+	return PADDR_TO_KVADDR(pa);
+}
+
+void
+free_kpages(vaddr_t addr)
+{
+	KASSERT(addr >= MIPS_KSEG0 && addr < MIPS_KSEG1);
+
+	coremap_free(KVADDR_TO_PADDR(addr));
+}
+
+void
+vm_tlbflush(void)
+{
+	int i, spl;
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	splx(spl);
+}
+
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+	int i, spl;
+
+	if (ts->ts_vaddr == VM_TLB_ALL) {
+		vm_tlbflush();
+		return;
+	}
+
+	spl = splhigh();
+	i = tlb_probe(ts->ts_vaddr, 0);
+	if (i >= 0) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	splx(spl);
+}
+
+/*
+ * This waits for the other CPUs, so once it returns nobody can be
+ * using the old mapping; the pager counts on that.
+ */
+void
+vm_tlbinvalidate(struct addrspace *as, vaddr_t vaddr)
+{
+	struct tlbshootdown ts;
+	int spl;
+
+	ts.ts_vaddr = vaddr;
+
+	spl = splhigh();
+	if (curcpu->c_tlbas == as) {
+		vm_tlbshootdown(&ts);
+	}
+	splx(spl);
+
+	ipi_tlbshootdown_as(as, &ts);
+}
+
+/*
+ * Load a TLB entry mapping VADDR to PADDR, replacing any entry for
+ * VADDR already there. Otherwise the hardware picks a slot at random,
+ * which costs less than looking for an empty one and does about as
+ * well once the TLB has filled up.
+ */
+void
+vm_tlbload(vaddr_t vaddr, paddr_t paddr, bool writeable)
+{
+	uint32_t ehi, elo;
+	int i, spl;
+
+	ehi = vaddr;
+	elo = paddr | TLBLO_VALID;
+	if (writeable) {
+		elo |= TLBLO_DIRTY;
+	}
+
+	spl = splhigh();
+
+	DEBUG(DB_VM, "vm: 0x%x -> 0x%x\n", vaddr, paddr);
+	i = tlb_probe(ehi, 0);
+	if (i >= 0) {
+		tlb_write(ehi, elo, i);
+	}
+	else {
+		tlb_random(ehi, elo);
+	}
+
+	splx(spl);
+}
+
+/*
+ * Fast path for TLB misses: if the page table already has an entry
+ * for VADDR that allows the access, load it and we're done, without
+ * taking the address space lock. Returns false if the slow way is
+ * needed, which includes a page left without an owner after the
+ * others sharing it went away.
+ *
+ * This is safe because it's done at splhigh. Whatever takes a mapping
+ * away changes the page table entry first and then shoots down the
+ * TLB entries and waits; we either see the new entry, or load the old
+ * one before the shootdown can be handled here.
+ */
+static
+bool
+vm_tlbrefill(struct addrspace *as, vaddr_t vaddr, int faulttype)
+{
+	pte_t *pte, entry;
+	bool writeable, ok;
+	int spl;
+
+	spl = splhigh();
+
+	curcpu->c_tlbfaults++;
+
+	pte = pt_get(as->as_pt, vaddr);
+	entry = pte == NULL ? 0 : *pte;
+	writeable = (entry & PTE_WRITE) != 0;
+	switch (faulttype) {
+	    case VM_FAULT_READ:
+		ok = (entry & PTE_VALID) != 0;
+		break;
+	    case VM_FAULT_WRITE:
+		ok = (entry & PTE_VALID) && writeable;
+		break;
+	    default:
+		/* Write to a read-only mapping; may need copying */
+		ok = false;
+		break;
+	}
+
+	if (ok) {
+		/* If nobody owns the page, as_fault has to claim it. */
+		ok = coremap_touch(entry & PTE_FRAME);
+	}
+	if (ok) {
+		vm_tlbload(vaddr, entry & PTE_FRAME, writeable);
+	}
+	else {
+		curcpu->c_tlbslowfaults++;
+	}
+
+	splx(spl);
+	return ok;
+}
+
+int
+vm_fault(int faulttype, vaddr_t faultaddress)
+{
+	struct addrspace *as;
+
+	faultaddress &= PAGE_FRAME;
+
+	DEBUG(DB_VM, "vm: fault: 0x%x\n", faultaddress);
+
+	switch (faulttype) {
+	    case VM_FAULT_READONLY:
+	    case VM_FAULT_READ:
+	    case VM_FAULT_WRITE:
+		break;
+	    default:
+		return EINVAL;
+	}
+
+	if (curproc == NULL) {
+		/*
+		 * No process. This is probably a kernel fault early
+		 * in boot. Return EFAULT so as to panic instead of
+		 * getting into an infinite faulting loop.
+		 */
+		return EFAULT;
+	}
+
+	as = proc_getas();
+	if (as == NULL) {
+		/*
+		 * No address space set up. This is probably also a
+		 * kernel fault early in boot.
+		 */
+		return EFAULT;
+	}
+
+	if (faultaddress >= USERSPACETOP) {
+		return EFAULT;
+	}
+
+	if (vm_tlbrefill(as, faultaddress, faulttype)) {
+		return 0;
+	}
+
+	vm_can_sleep();
+
+	return as_fault(as, faultaddress, faulttype);
+}
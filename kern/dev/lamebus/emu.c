@@ -1081,6 +1081,7 @@ static const struct vnode_ops emufs_fileops = {
 	.vop_read = emufs_read,
 	.vop_readlink = emufs_readlink_notlink,
 	.vop_getdirentry = emufs_uio_op_notdir,
+	.vop_getdirentries = vopfail_getdirentries_notdir,
 	.vop_write = emufs_write,
 	.vop_ioctl = emufs_ioctl,
 	.vop_stat = emufs_stat,
@@ -1115,6 +1116,7 @@ static const struct vnode_ops emufs_dirops = {
 	.vop_read = emufs_uio_op_isdir,
 	.vop_readlink = emufs_uio_op_isdir,
 	.vop_getdirentry = emufs_getdirentry,
+	.vop_getdirentries = vopfail_getdirentries_nosys,
 	.vop_write = emufs_uio_op_isdir,
 	.vop_ioctl = emufs_ioctl,
 	.vop_stat = emufs_stat,
@@ -1225,6 +1227,17 @@ emufs_sync(struct fs *fs)
 	return 0;
 }
 
+/*
+ * FSOP_WRITEBACK
+ */
+static
+int
+emufs_writeback(struct fs *fs)
+{
+	(void)fs;
+	return 0;
+}
+
 /*
  * FSOP_GETVOLNAME
  */
@@ -1275,6 +1288,7 @@ emufs_unmount(struct fs *fs)
  */
 static const struct fs_ops emufs_fsops = {
 	.fsop_sync = emufs_sync,
+	.fsop_writeback = emufs_writeback,
 	.fsop_getvolname = emufs_getvolname,
 	.fsop_getroot = emufs_getroot,
 	.fsop_unmount = emufs_unmount,
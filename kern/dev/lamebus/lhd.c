@@ -36,7 +36,7 @@
 #include <lib.h>
 #include <uio.h>
 #include <membar.h>
-#include <synch.h>
+#include <wchan.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
@@ -95,42 +95,269 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 	return EAGAIN;
 }
 
+////////////////////////////////////////////////////////////
+// Request queue
+//
+// Requests wait on lh_queue, sorted by starting sector, and are
+// served in C-LOOK order: the disk moves upward through the queue
+// from where it last was, and when nothing is left above it, jumps
+// back to the lowest pending request. This keeps the head sweeping
+// one way across the disk rather than seeking back and forth between
+// concurrent callers, and since it never goes backwards mid-sweep a
+// steady stream of requests in one area can't starve the rest.
+//
+// The card only has a one-sector buffer, so a multi-sector request
+// is done one sector at a time, each started from the interrupt
+// handler when the previous one finishes. The request stays active
+// until all its sectors are done, so it isn't interleaved with others.
+
+/*
+ * Start the disk on the next sector of the active request.
+ * Call with lh_lock held.
+ */
+static
+void
+lhd_startsect(struct lhd_softc *lh)
+{
+	struct devreq *req = lh->lh_active;
+	uint32_t statval = LHD_WORKING;
+	uint32_t sector;
+	int result;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+	KASSERT(req != NULL);
+	KASSERT(req->dr_blocksdone < req->dr_nblocks);
+
+	/*
+	 * Are we writing? If so, transfer the data to the
+	 * on-card buffer.
+	 */
+	if (req->dr_uio->uio_rw == UIO_WRITE) {
+		result = uiomove(lh->lh_buf, LHD_SECTSIZE, req->dr_uio);
+		/* The uio is in kernel memory, so this can't fail. */
+		KASSERT(result == 0);
+		membar_store_store();
+		statval |= LHD_ISWRITE;
+	}
+
+	sector = req->dr_block + req->dr_blocksdone;
+	lh->lh_headpos = sector;
+
+	/* Tell it what sector we want... */
+	lhd_wreg(lh, LHD_REG_SECT, sector);
+
+	/* and start the operation. */
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+}
+
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * If the disk is idle, pick the next request (C-LOOK) and start it.
+ * Call with lh_lock held.
  */
 static
 void
-lhd_iodone(struct lhd_softc *lh, int err)
+lhd_startnext(struct lhd_softc *lh)
 {
-	lh->lh_result = err;
-	V(lh->lh_done);
+	struct devreq **rp;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	if (lh->lh_active != NULL || lh->lh_queue == NULL) {
+		return;
+	}
+
+	/* First request at or above the head... */
+	for (rp = &lh->lh_queue; *rp != NULL; rp = &(*rp)->dr_next) {
+		if ((*rp)->dr_block >= lh->lh_headpos) {
+			break;
+		}
+	}
+	/* ...or, if none, wrap around to the lowest. */
+	if (*rp == NULL) {
+		rp = &lh->lh_queue;
+	}
+
+	lh->lh_active = *rp;
+	*rp = lh->lh_active->dr_next;
+	lh->lh_active->dr_next = NULL;
+
+	lhd_startsect(lh);
 }
 
 /*
  * Interrupt handler for lhd.
  * Read the status register; if an operation finished, clear the status
- * register and report completion.
+ * register and either go on to the next sector of the request or
+ * complete it and start the next request.
  */
 void
 lhd_irq(void *vlh)
 {
 	struct lhd_softc *lh = vlh;
+	struct devreq *req;
 	uint32_t val;
+	int result;
 
 	val = lhd_rdreg(lh, LHD_REG_STAT);
 
 	switch (val & LHD_STATEMASK) {
 	    case LHD_IDLE:
 	    case LHD_WORKING:
-		break;
+		return;
 	    case LHD_OK:
 	    case LHD_INVSECT:
 	    case LHD_MEDIA:
 		lhd_wreg(lh, LHD_REG_STAT, 0);
-		lhd_iodone(lh, lhd_code_to_errno(lh, val));
 		break;
 	}
+
+	spinlock_acquire(&lh->lh_lock);
+
+	req = lh->lh_active;
+	if (req == NULL) {
+		/* Nothing was running; spurious. */
+		spinlock_release(&lh->lh_lock);
+		return;
+	}
+
+	result = lhd_code_to_errno(lh, val);
+
+	/*
+	 * Are we reading? If so, and if we succeeded,
+	 * transfer the data out of the on-card buffer.
+	 */
+	if (result == 0 && req->dr_uio->uio_rw == UIO_READ) {
+		membar_load_load();
+		result = uiomove(lh->lh_buf, LHD_SECTSIZE, req->dr_uio);
+		KASSERT(result == 0);
+	}
+
+	if (result == 0 && ++req->dr_blocksdone < req->dr_nblocks) {
+		lhd_startsect(lh);
+		spinlock_release(&lh->lh_lock);
+		return;
+	}
+
+	/* The request is finished (or failed); start the next one. */
+	lh->lh_active = NULL;
+	lhd_startnext(lh);
+	spinlock_release(&lh->lh_lock);
+
+	req->dr_done(req, result);
+}
+
+/*
+ * Asynchronous I/O function: queue a request.
+ */
+static
+int
+lhd_submit(struct device *d, struct devreq *req)
+{
+	struct lhd_softc *lh = d->d_data;
+	struct uio *uio = req->dr_uio;
+	struct devreq **rp;
+
+	uint32_t sector = uio->uio_offset / LHD_SECTSIZE;
+	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
+	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
+	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
+
+	KASSERT(uio->uio_segflg == UIO_SYSSPACE);
+
+	/* Don't allow I/O that isn't sector-aligned. */
+	if (sectoff != 0 || lenoff != 0) {
+		return EINVAL;
+	}
+
+	/* Don't allow I/O past the end of the disk. */
+	if (sector > lh->lh_dev.d_blocks ||
+	    len > lh->lh_dev.d_blocks - sector) {
+		return EINVAL;
+	}
+
+	if (len == 0) {
+		req->dr_done(req, 0);
+		return 0;
+	}
+
+	req->dr_block = sector;
+	req->dr_nblocks = len;
+	req->dr_blocksdone = 0;
+
+	spinlock_acquire(&lh->lh_lock);
+
+	/* Insert in sector order, after any others for the same sector. */
+	for (rp = &lh->lh_queue; *rp != NULL; rp = &(*rp)->dr_next) {
+		if ((*rp)->dr_block > sector) {
+			break;
+		}
+	}
+	req->dr_next = *rp;
+	*rp = req;
+
+	lhd_startnext(lh);
+	spinlock_release(&lh->lh_lock);
+
+	return 0;
+}
+
+/*
+ * State for a synchronous request made through the queue.
+ */
+struct lhd_syncreq {
+	struct lhd_softc *sr_lh;
+	bool sr_done;
+	int sr_result;
+};
+
+/*
+ * Completion function for synchronous requests: wake up the waiter.
+ */
+static
+void
+lhd_syncdone(struct devreq *req, int result)
+{
+	struct lhd_syncreq *sr = req->dr_data;
+	struct lhd_softc *lh = sr->sr_lh;
+
+	spinlock_acquire(&lh->lh_lock);
+	sr->sr_result = result;
+	sr->sr_done = true;
+	wchan_wakeall(lh->lh_wchan, &lh->lh_lock);
+	spinlock_release(&lh->lh_lock);
+}
+
+/*
+ * Queue a request with a kernel-space uio and wait for it.
+ */
+static
+int
+lhd_syncio(struct lhd_softc *lh, struct uio *uio)
+{
+	struct devreq req;
+	struct lhd_syncreq sr;
+	int result;
+
+	sr.sr_lh = lh;
+	sr.sr_done = false;
+	sr.sr_result = 0;
+
+	req.dr_uio = uio;
+	req.dr_done = lhd_syncdone;
+	req.dr_data = &sr;
+
+	result = lhd_submit(&lh->lh_dev, &req);
+	if (result) {
+		return result;
+	}
+
+	spinlock_acquire(&lh->lh_lock);
+	while (!sr.sr_done) {
+		wchan_sleep(lh->lh_wchan, &lh->lh_lock);
+	}
+	spinlock_release(&lh->lh_lock);
+
+	return sr.sr_result;
 }
 
 /*
@@ -181,93 +408,66 @@ lhd_reset(struct lhd_softc *lh)
 
 /*
  * I/O function (for both reads and writes)
+ *
+ * Goes through the request queue and waits for the result. Since the
+ * queue transfers data from the interrupt handler, user-space I/O is
+ * bounced through a kernel buffer a sector at a time.
  */
 static
 int
 lhd_io(struct device *d, struct uio *uio)
 {
 	struct lhd_softc *lh = d->d_data;
+	struct iovec iov;
+	struct uio ku;
+	char *bounce;
+	int result = 0;
 
-	uint32_t sector = uio->uio_offset / LHD_SECTSIZE;
-	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
-	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
-	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
-	uint32_t i;
-	uint32_t statval = LHD_WORKING;
-	int result;
-
-	/* Don't allow I/O that isn't sector-aligned. */
-	if (sectoff != 0 || lenoff != 0) {
-		return EINVAL;
+	if (uio->uio_segflg == UIO_SYSSPACE) {
+		return lhd_syncio(lh, uio);
 	}
 
-	/* Don't allow I/O past the end of the disk. */
-	/* XXX this check can overflow */
-	if (sector+len > lh->lh_dev.d_blocks) {
+	/* Don't allow I/O that isn't sector-aligned. */
+	if (uio->uio_offset % LHD_SECTSIZE != 0 ||
+	    uio->uio_resid % LHD_SECTSIZE != 0) {
 		return EINVAL;
 	}
 
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
+	bounce = kmalloc(LHD_SECTSIZE);
+	if (bounce == NULL) {
+		return ENOMEM;
 	}
 
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
-
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
-
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
+	while (uio->uio_resid > 0) {
+		uio_kinit(&iov, &ku, bounce, LHD_SECTSIZE, uio->uio_offset,
+			  uio->uio_rw);
 		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-			membar_store_store();
+			result = uiomove(bounce, LHD_SECTSIZE, uio);
 			if (result) {
-				V(lh->lh_clear);
-				return result;
+				break;
 			}
 		}
-
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
-
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
-
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
-
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
-
-		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
-		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			membar_load_load();
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-		}
-
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
-
-		/* If we failed, return the error. */
+		result = lhd_syncio(lh, &ku);
 		if (result) {
-			return result;
+			break;
+		}
+		if (uio->uio_rw == UIO_READ) {
+			result = uiomove(bounce, LHD_SECTSIZE, uio);
+			if (result) {
+				break;
+			}
 		}
 	}
 
-	return 0;
+	kfree(bounce);
+	return result;
 }
 
 static const struct device_ops lhd_devops = {
 	.devop_eachopen = lhd_eachopen,
 	.devop_io = lhd_io,
 	.devop_ioctl = lhd_ioctl,
+	.devop_submit = lhd_submit,
 };
 
 /*
@@ -277,6 +477,7 @@ int
 config_lhd(struct lhd_softc *lh, int lhdno)
 {
 	char name[32];
+	int result;
 
 	/* Figure out what our name is. */
 	snprintf(name, sizeof(name), "lhd%d", lhdno);
@@ -284,15 +485,15 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
-		return ENOMEM;
-	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
+	/* Set up the request queue. */
+	spinlock_init(&lh->lh_lock);
+	lh->lh_active = NULL;
+	lh->lh_queue = NULL;
+	lh->lh_headpos = 0;
+	/* wchan_create keeps the pointer, so it can't be NAME. */
+	lh->lh_wchan = wchan_create("lhd");
+	if (lh->lh_wchan == NULL) {
+		spinlock_cleanup(&lh->lh_lock);
 		return ENOMEM;
 	}
 
@@ -304,5 +505,11 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	lh->lh_dev.d_data = lh;
 
 	/* Add the VFS device structure to the VFS device list. */
-	return vfs_adddev(name, &lh->lh_dev, 1);
+	result = vfs_adddev(name, &lh->lh_dev, 1);
+	if (result) {
+		wchan_destroy(lh->lh_wchan);
+		spinlock_cleanup(&lh->lh_lock);
+		return result;
+	}
+	return 0;
 }
@@ -40,7 +40,7 @@
 // fs-level operations
 
 /*
- * Sync doesn't need to do anything.
+ * Sync doesn't need to do anything. (Also used for writeback.)
  */
 static
 int
@@ -146,6 +146,7 @@ semfs_unmount(struct fs *fs)
  */
 static const struct fs_ops semfs_fsops = {
 	.fsop_sync = semfs_sync,
+	.fsop_writeback = semfs_sync,
 	.fsop_getvolname = semfs_getvolname,
 	.fsop_getroot = semfs_getroot,
 	.fsop_unmount = semfs_unmount,
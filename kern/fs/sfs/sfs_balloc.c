@@ -33,59 +33,300 @@
  * Block allocation.
  */
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <bitmap.h>
+#include <synch.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
 /*
- * Zero out a disk block.
+ * Note that the bitmap block holding bit INDEX of a freemap or inode
+ * bitmap has changed. DIRTYMAP is the map's dirty-block map. Call
+ * with the freemap locked.
+ */
+static
+void
+sfs_mapdirty(struct sfs_fs *sfs, struct bitmap *dirtymap, uint32_t index)
+{
+	uint32_t mapblock;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
+	mapblock = index / SFS_BITSPERBLOCK(sfs->sfs_blocksize);
+	if (!bitmap_isset(dirtymap, mapblock)) {
+		bitmap_mark(dirtymap, mapblock);
+		sfs->sfs_mapdirtycount++;
+	}
+}
+
+/*
+ * Clear LEN consecutive freemap bits starting at block START. Call
+ * with the freemap locked.
+ */
+static
+void
+sfs_bunmark(struct sfs_fs *sfs, daddr_t start, uint32_t len)
+{
+	uint32_t bitsperblock = SFS_BITSPERBLOCK(sfs->sfs_blocksize);
+	uint32_t i;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
+	bitmap_unmarkrange(sfs->sfs_freemap, start, len);
+	for (i = start - start % bitsperblock; i < start + len;
+	     i += bitsperblock) {
+		sfs_mapdirty(sfs, sfs->sfs_freemapdirty, i);
+	}
+}
+
+/*
+ * Remember a block to free at the next journal commit. Call with the
+ * freemap locked. Returns ENOMEM if there's no room to remember it.
  */
 static
 int
+sfs_bfree_defer(struct sfs_fs *sfs, daddr_t diskblock)
+{
+	uint32_t *newfreed;
+	unsigned newmax;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
+	if (sfs->sfs_nfreed == sfs->sfs_maxfreed) {
+		newmax = sfs->sfs_maxfreed == 0 ? 16 : sfs->sfs_maxfreed * 2;
+		newfreed = kmalloc(newmax * sizeof(uint32_t));
+		if (newfreed == NULL) {
+			return ENOMEM;
+		}
+		if (sfs->sfs_nfreed > 0) {
+			memcpy(newfreed, sfs->sfs_freed,
+			       sfs->sfs_nfreed * sizeof(uint32_t));
+		}
+		kfree(sfs->sfs_freed);
+		sfs->sfs_freed = newfreed;
+		sfs->sfs_maxfreed = newmax;
+	}
+	sfs->sfs_freed[sfs->sfs_nfreed++] = diskblock;
+	return 0;
+}
+
+/*
+ * Zero out a disk block.
+ */
+int
 sfs_clearblock(struct sfs_fs *sfs, daddr_t block)
 {
-	/* static -> automatically initialized to zero */
-	static char zeros[SFS_BLOCKSIZE];
+	struct buf *buf;
+	int result;
+
+	result = buffer_get(sfs->sfs_device, block, &buf);
+	if (result) {
+		return result;
+	}
+	bzero(buffer_map(buf), sfs->sfs_blocksize);
+	buffer_mark_dirty(buf);
+	buffer_release(buf);
+	return 0;
+}
+
+/*
+ * Choose a free block and mark it in use. Call with the freemap
+ * locked.
+ *
+ * HINT is the block we'd most like, normally the one just after the
+ * previous block of the same file; 0 means no preference, in which
+ * case we carry on from wherever the last allocation left off. If
+ * the hint is taken, we look for a free run of SFS_ALLOCRUN blocks
+ * after it so the file has room to grow contiguously, and only if
+ * there's no such run settle for the next free block.
+ */
+static
+int
+sfs_bchoose(struct sfs_fs *sfs, daddr_t hint, daddr_t *diskblock)
+{
+	int result;
 
-	return sfs_writeblock(sfs, block, zeros, SFS_BLOCKSIZE);
+	if (hint == 0) {
+		hint = sfs->sfs_allocnext;
+	}
+	if (hint >= sfs->sfs_sb.sb_nblocks) {
+		hint = 0;
+	}
+
+	if (!bitmap_isset(sfs->sfs_freemap, hint)) {
+		bitmap_mark(sfs->sfs_freemap, hint);
+		*diskblock = hint;
+		return 0;
+	}
+
+	result = bitmap_findrun(sfs->sfs_freemap, hint, SFS_ALLOCRUN,
+				diskblock);
+	if (result == 0) {
+		bitmap_mark(sfs->sfs_freemap, *diskblock);
+		return 0;
+	}
+
+	return bitmap_alloc_near(sfs->sfs_freemap, hint, diskblock);
 }
 
 /*
- * Allocate a block.
+ * Allocate a block, preferably HINT or somewhere after it. If ZERO is
+ * set, the block is cleared; otherwise the caller must fill in all of
+ * it before anyone can read it. Anything that is metadata or that
+ * will only be partly written must be cleared.
  */
 int
-sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock)
+sfs_balloc(struct sfs_fs *sfs, daddr_t hint, bool zero, daddr_t *diskblock)
 {
 	int result;
 
-	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+
+	result = sfs_bchoose(sfs, hint, diskblock);
 	if (result) {
+		lock_release(sfs->sfs_freemaplock);
 		return result;
 	}
-	sfs->sfs_freemapdirty = true;
+	sfs_mapdirty(sfs, sfs->sfs_freemapdirty, *diskblock);
+	sfs->sfs_allocnext = *diskblock + 1;
 
 	if (*diskblock >= sfs->sfs_sb.sb_nblocks) {
 		panic("sfs: %s: balloc: invalid block %u\n",
 		      sfs->sfs_sb.sb_volname, *diskblock);
 	}
 
-	/* Clear block before returning it */
+	lock_release(sfs->sfs_freemaplock);
+
+	if (!zero) {
+		return 0;
+	}
+
+	/*
+	 * Clear block before returning it. The block is ours now, so
+	 * this doesn't need the freemap lock.
+	 */
 	result = sfs_clearblock(sfs, *diskblock);
 	if (result) {
+		lock_acquire(sfs->sfs_freemaplock);
 		bitmap_unmark(sfs->sfs_freemap, *diskblock);
+		lock_release(sfs->sfs_freemaplock);
 	}
 	return result;
 }
 
+/*
+ * Allocate up to WANT consecutive blocks, preferably starting at HINT
+ * or somewhere after it, and hand back the first in *START and how
+ * many were taken in *GOT. If there's no free run that long, take
+ * the first run of half as many, and so on. The blocks are not
+ * cleared; they are for reserving space ahead of writes
+ * (sfs_prealloc), and must not be read until written.
+ */
+int
+sfs_ballocrun(struct sfs_fs *sfs, daddr_t hint, uint32_t want,
+	      daddr_t *start, uint32_t *got)
+{
+	uint32_t i;
+	int result;
+
+	KASSERT(want > 0);
+
+	lock_acquire(sfs->sfs_freemaplock);
+
+	if (hint == 0) {
+		hint = sfs->sfs_allocnext;
+	}
+	while ((result = bitmap_findrun(sfs->sfs_freemap, hint, want,
+					start)) != 0 && want > 1) {
+		want /= 2;
+	}
+	if (result) {
+		lock_release(sfs->sfs_freemaplock);
+		return result;
+	}
+	if (*start + want > sfs->sfs_sb.sb_nblocks) {
+		panic("sfs: %s: ballocrun: invalid blocks %u-%u\n",
+		      sfs->sfs_sb.sb_volname, *start, *start + want - 1);
+	}
+
+	for (i=0; i<want; i++) {
+		bitmap_mark(sfs->sfs_freemap, *start + i);
+		sfs_mapdirty(sfs, sfs->sfs_freemapdirty, *start + i);
+	}
+	sfs->sfs_allocnext = *start + want;
+
+	lock_release(sfs->sfs_freemaplock);
+
+	*got = want;
+	return 0;
+}
+
+/*
+ * Free LEN consecutive blocks starting at START, taking the freemap
+ * lock once for all of them.
+ *
+ * With a journal, the blocks stay marked in use until the next
+ * commit (sfs_bfree_deferred): until then, the last committed
+ * metadata may still point at them, and if we crashed after one had
+ * been reused, replaying the journal would leave it in two places.
+ */
+void
+sfs_bfreerange(struct sfs_fs *sfs, daddr_t start, uint32_t len)
+{
+	uint32_t i;
+
+	KASSERT(len > 0 && start + len <= sfs->sfs_sb.sb_nblocks);
+
+	/* Don't bother writing back anything cached for the blocks. */
+	for (i=0; i<len; i++) {
+		buffer_drop(sfs->sfs_device, start + i);
+	}
+
+	lock_acquire(sfs->sfs_freemaplock);
+	i = 0;
+	if (SFS_JOURNALED(sfs)) {
+		while (i < len && sfs_bfree_defer(sfs, start + i) == 0) {
+			i++;
+		}
+	}
+	/* (If we're out of memory, take the chance and free them now.) */
+	if (i < len) {
+		sfs_bunmark(sfs, start + i, len - i);
+	}
+	lock_release(sfs->sfs_freemaplock);
+}
+
 /*
  * Free a block.
  */
 void
 sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock)
 {
-	bitmap_unmark(sfs->sfs_freemap, diskblock);
-	sfs->sfs_freemapdirty = true;
+	sfs_bfreerange(sfs, diskblock, 1);
+}
+
+/*
+ * Free the blocks sfs_bfree put off freeing, a run of consecutive
+ * ones at a time. Call with the freemap locked, when committing.
+ */
+void
+sfs_bfree_deferred(struct sfs_fs *sfs)
+{
+	unsigned i, j;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
+	for (i=0; i<sfs->sfs_nfreed; i=j) {
+		for (j=i+1; j<sfs->sfs_nfreed; j++) {
+			if (sfs->sfs_freed[j] != sfs->sfs_freed[j-1] + 1) {
+				break;
+			}
+		}
+		sfs_bunmark(sfs, sfs->sfs_freed[i], j - i);
+	}
+	sfs->sfs_nfreed = 0;
 }
 
 /*
@@ -94,10 +335,99 @@ sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock)
 int
 sfs_bused(struct sfs_fs *sfs, daddr_t diskblock)
 {
+	int result;
+
 	if (diskblock >= sfs->sfs_sb.sb_nblocks) {
 		panic("sfs: %s: sfs_bused called on out of range block %u\n",
 		      sfs->sfs_sb.sb_volname, diskblock);
 	}
-	return bitmap_isset(sfs->sfs_freemap, diskblock);
+
+	lock_acquire(sfs->sfs_freemaplock);
+	result = bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_release(sfs->sfs_freemaplock);
+
+	return result;
 }
 
+
+/*
+ * Allocate an inode. In the original format an inode is a block; in
+ * the dense format it's a slot in the inode table, which we clear
+ * here (freed slots are not cleared).
+ */
+int
+sfs_ialloc(struct sfs_fs *sfs, uint32_t *ino)
+{
+	struct buf *buf;
+	int result;
+
+	if (!SFS_DENSE(sfs)) {
+		return sfs_balloc(sfs, 0, true, ino);
+	}
+
+	lock_acquire(sfs->sfs_freemaplock);
+	result = bitmap_alloc(sfs->sfs_inomap, ino);
+	if (result) {
+		lock_release(sfs->sfs_freemaplock);
+		return result;
+	}
+	sfs_mapdirty(sfs, sfs->sfs_inomapdirty, *ino);
+	if (*ino >= sfs->sfs_sb.sb_ninodes) {
+		panic("sfs: %s: ialloc: invalid inode %u\n",
+		      sfs->sfs_sb.sb_volname, *ino);
+	}
+	lock_release(sfs->sfs_freemaplock);
+
+	result = buffer_read(sfs->sfs_device, sfs_inoblock(sfs, *ino), &buf);
+	if (result) {
+		sfs_ifree(sfs, *ino);
+		return result;
+	}
+	bzero((char *)buffer_map(buf) +
+	      (*ino % SFS_FS_INOPERBLOCK(sfs)) * SFS_DINODE_DENSESIZE,
+	      SFS_DINODE_DENSESIZE);
+	sfs_jdirty(sfs, buf);
+	buffer_release(buf);
+	return 0;
+}
+
+/*
+ * Free an inode.
+ */
+void
+sfs_ifree(struct sfs_fs *sfs, uint32_t ino)
+{
+	if (!SFS_DENSE(sfs)) {
+		sfs_bfree(sfs, ino);
+		return;
+	}
+
+	lock_acquire(sfs->sfs_freemaplock);
+	bitmap_unmark(sfs->sfs_inomap, ino);
+	sfs_mapdirty(sfs, sfs->sfs_inomapdirty, ino);
+	lock_release(sfs->sfs_freemaplock);
+}
+
+/*
+ * Check if an inode is in use.
+ */
+int
+sfs_iused(struct sfs_fs *sfs, uint32_t ino)
+{
+	int result;
+
+	if (!SFS_DENSE(sfs)) {
+		return sfs_bused(sfs, ino);
+	}
+
+	if (ino >= sfs->sfs_sb.sb_ninodes) {
+		panic("sfs: %s: sfs_iused called on out of range inode %u\n",
+		      sfs->sfs_sb.sb_volname, ino);
+	}
+
+	lock_acquire(sfs->sfs_freemaplock);
+	result = bitmap_isset(sfs->sfs_inomap, ino);
+	lock_release(sfs->sfs_freemaplock);
+
+	return result;
+}
@@ -35,39 +35,83 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <vfs.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
 /*
- * Look up the disk block number (from 0 up to the number of blocks on
- * the disk) given a file and the logical block number within that
- * file. If DOALLOC is set, and no such block exists, one will be
- * allocated.
+ * Pick where to put block FILEBLOCK of a file, for those blocks that
+ * live in the inode: right after the block before it if there is
+ * one, otherwise right after the inode. (The indirect block counts as
+ * coming after the last direct block.) The data blocks under the
+ * indirect block are handled in sfs_bmap.
+ */
+static
+daddr_t
+sfs_bmap_hint(struct sfs_vnode *sv, uint32_t fileblock)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+
+	KASSERT(fileblock <= SFS_NDIRECT);
+
+	if (fileblock > 0 && sv->sv_i.sfi_direct[fileblock-1] != 0) {
+		return SFS_BLOCKNUM(sv->sv_i.sfi_direct[fileblock-1]) + 1;
+	}
+	if (SFS_DENSE(sfs)) {
+		/* The inode isn't among the data blocks; no preference */
+		return 0;
+	}
+	return sv->sv_ino + 1;
+}
+
+/*
+ * Block BLOCK, reserved by sfs_prealloc, is about to be written for
+ * the first time. Like a newly allocated block, it must be zeroed
+ * unless the caller is going to fill in all of it (FRESH not NULL).
  */
+static
 int
-sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
-	 daddr_t *diskblock)
+sfs_bmap_unwritten(struct sfs_fs *sfs, daddr_t block, bool *fresh)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	if (fresh != NULL) {
+		*fresh = true;
+		return 0;
+	}
+	return sfs_clearblock(sfs, block);
+}
 
+/*
+ * The guts of sfs_bmap. The block pointer is handed back as it is
+ * stored, so it may have SFS_UNWRITTEN set if DOALLOC isn't. If
+ * NEWBLOCK isn't 0 and the slot for FILEBLOCK is empty, NEWBLOCK is
+ * put there instead of allocating a block (indirect blocks on the
+ * way are still allocated as needed).
+ */
+static
+int
+sfs_bmap_get(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
+	     daddr_t newblock, bool *fresh, daddr_t *diskblock)
+{
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *idbuf;
+	uint32_t *iddata;
+	uint32_t *idslot;
 	daddr_t block;
 	daddr_t idblock;
-	uint32_t idnum, idoff;
+	daddr_t hint;
+	uint32_t off, idoff, span, i;
+	unsigned level;
+	bool deep;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT((sv->sv_i.sfi_flags & SFS_IFLAG_INLINE) == 0);
 
-	/* Since we're using a static buffer, we'd better be locked. */
-	KASSERT(vfs_biglock_do_i_hold());
+	if (fresh != NULL) {
+		*fresh = false;
+	}
 
 	/*
 	 * If the block we want is one of the direct blocks...
@@ -81,151 +125,515 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		/*
 		 * Do we need to allocate?
 		 */
-		if (block==0 && doalloc) {
-			result = sfs_balloc(sfs, &block);
+		if (block==0 && doalloc && newblock != 0) {
+			block = newblock;
+			sv->sv_i.sfi_direct[fileblock] = block;
+			sfs_dirty_inode(sv);
+		}
+		else if (block==0 && doalloc) {
+			result = sfs_balloc(sfs, sfs_bmap_hint(sv, fileblock),
+					    fresh == NULL, &block);
 			if (result) {
 				return result;
 			}
+			if (fresh != NULL) {
+				*fresh = true;
+			}
 
 			/* Remember what we allocated; mark inode dirty */
 			sv->sv_i.sfi_direct[fileblock] = block;
-			sv->sv_dirty = true;
+			sfs_dirty_inode(sv);
+		}
+		else if ((block & SFS_UNWRITTEN) && doalloc &&
+			 newblock == 0) {
+			/* First write to a reserved block */
+			block = SFS_BLOCKNUM(block);
+			result = sfs_bmap_unwritten(sfs, block, fresh);
+			if (result) {
+				return result;
+			}
+			sv->sv_i.sfi_direct[fileblock] = block;
+			sfs_dirty_inode(sv);
 		}
 
 		/*
 		 * Hand back the block
 		 */
-		if (block != 0 && !sfs_bused(sfs, block)) {
+		if (block != 0 && !sfs_bused(sfs, SFS_BLOCKNUM(block))) {
 			panic("sfs: %s: Data block %u (block %u of file %u) "
 			      "marked free\n", sfs->sfs_sb.sb_volname,
-			      block, fileblock, sv->sv_ino);
+			      SFS_BLOCKNUM(block), fileblock, sv->sv_ino);
 		}
 		*diskblock = block;
 		return 0;
 	}
 
 	/*
-	 * It's not a direct block; it must be in the indirect block.
-	 * Subtract off the number of direct blocks, so FILEBLOCK is
-	 * now the offset into the indirect block space.
+	 * It's not a direct block; it must be under one of the
+	 * indirect blocks. Work out which one, and the offset into the
+	 * range of file blocks it maps.
 	 */
+	off = fileblock - SFS_NDIRECT;
+	span = SFS_FS_DBPERIDB(sfs);
+	for (level = 1; level <= 3; level++) {
+		if (off < span) {
+			break;
+		}
+		off -= span;
+		span *= SFS_FS_DBPERIDB(sfs);
+	}
+	switch (level) {
+	    case 1: idslot = &sv->sv_i.sfi_indirect; break;
+	    case 2: idslot = &sv->sv_i.sfi_dindirect; break;
+	    case 3: idslot = &sv->sv_i.sfi_tindirect; break;
+	    default:
+		/* Past what the triple indirect block can map */
+		return EFBIG;
+	}
 
-	fileblock -= SFS_NDIRECT;
-
-	/* Get the indirect block number and offset w/i that indirect block */
-	idnum = fileblock / SFS_DBPERIDB;
-	idoff = fileblock % SFS_DBPERIDB;
+	/* From here on SPAN is how many file blocks each entry maps */
+	span /= SFS_FS_DBPERIDB(sfs);
 
 	/*
-	 * We only have one indirect block. If the offset we were asked for
-	 * is too large, we can't handle it, so fail.
+	 * If we went through the bottom-level indirect block covering
+	 * this block last time, start there instead of at the top.
 	 */
-	if (idnum >= SFS_NINDIRECT) {
-		return EFBIG;
+	deep = level > 1;
+	idoff = off % SFS_FS_DBPERIDB(sfs);
+	if (deep && sv->sv_idcacheblock != 0 &&
+	    sv->sv_idcachebase == fileblock - idoff) {
+		idblock = sv->sv_idcacheblock;
+		level = 1;
+		span = 1;
+		off = idoff;
+	}
+	else {
+		/* Get the disk block number of the top indirect block. */
+		idblock = *idslot;
+
+		if (idblock==0 && !doalloc) {
+			/*
+			 * There's no indirect block allocated. We
+			 * weren't asked to allocate anything, so
+			 * pretend it was filled with all zeros.
+			 */
+			*diskblock = 0;
+			return 0;
+		}
+		else if (idblock==0) {
+			/*
+			 * We need to allocate a block whose number
+			 * goes under this indirect block, so allocate
+			 * the indirect block. sfs_balloc zeroes it, so
+			 * we can then load it like any other.
+			 */
+			result = sfs_balloc(sfs, sfs_bmap_hint(sv, SFS_NDIRECT),
+					    true, &idblock);
+			if (result) {
+				return result;
+			}
+			*idslot = idblock;
+			sfs_dirty_inode(sv);
+		}
 	}
 
-	/* Get the disk block number of the indirect block. */
-	idblock = sv->sv_i.sfi_indirect;
+	/*
+	 * Walk down the levels. Anything missing along the way is
+	 * allocated if DOALLOC is set; lower indirect blocks are zeroed
+	 * like the top one, and the data block at the bottom is treated
+	 * like a direct block.
+	 */
+	for (; level > 0; level--, span /= SFS_FS_DBPERIDB(sfs)) {
+		if (level == 1 && deep) {
+			/* Remember this bottom-level block for next time */
+			sv->sv_idcacheblock = idblock;
+			sv->sv_idcachebase = fileblock - idoff;
+		}
 
-	if (idblock==0 && !doalloc) {
-		/*
-		 * There's no indirect block allocated. We weren't
-		 * asked to allocate anything, so pretend the indirect
-		 * block was filled with all zeros.
-		 */
-		*diskblock = 0;
-		return 0;
-	}
-	else if (idblock==0) {
-		/*
-		 * There's no indirect block allocated, but we need to
-		 * allocate a block whose number needs to be stored in
-		 * the indirect block. Thus, we need to allocate an
-		 * indirect block.
-		 */
-		result = sfs_balloc(sfs, &idblock);
+		/* Load the indirect block. */
+		result = buffer_read(sfs->sfs_device, idblock, &idbuf);
 		if (result) {
 			return result;
 		}
+		iddata = buffer_map(idbuf);
+
+		/* Get the next block out of the indirect block */
+		i = off / span;
+		off %= span;
+		block = iddata[i];
+
+		/* If there's no block there, allocate one */
+		if (block==0 && doalloc && level == 1 && newblock != 0) {
+			block = newblock;
+			iddata[i] = block;
+			sfs_jdirty(sfs, idbuf);
+		}
+		else if (block==0 && doalloc) {
+			if (i > 0 && iddata[i-1] != 0) {
+				hint = SFS_BLOCKNUM(iddata[i-1]) + 1;
+			}
+			else {
+				hint = idblock + 1;
+			}
+			result = sfs_balloc(sfs, hint,
+					    level > 1 || fresh == NULL, &block);
+			if (result) {
+				buffer_release(idbuf);
+				return result;
+			}
+			if (level == 1 && fresh != NULL) {
+				*fresh = true;
+			}
 
-		/* Remember the block we just allocated */
-		sv->sv_i.sfi_indirect = idblock;
+			/* Remember the block we allocated */
+			iddata[i] = block;
 
-		/* Mark the inode dirty */
-		sv->sv_dirty = true;
+			/* The indirect block is now dirty */
+			sfs_jdirty(sfs, idbuf);
+		}
+		else if (level == 1 && (block & SFS_UNWRITTEN) && doalloc &&
+			 newblock == 0) {
+			/* First write to a reserved block */
+			block = SFS_BLOCKNUM(block);
+			result = sfs_bmap_unwritten(sfs, block, fresh);
+			if (result) {
+				buffer_release(idbuf);
+				return result;
+			}
+			iddata[i] = block;
+			sfs_jdirty(sfs, idbuf);
+		}
 
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
-	}
-	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
-		if (result) {
-			return result;
+		buffer_release(idbuf);
+
+		if (block == 0) {
+			/* Not allocated, and we weren't asked to */
+			KASSERT(!doalloc);
+			break;
+		}
+		if (!sfs_bused(sfs, SFS_BLOCKNUM(block))) {
+			panic("sfs: %s: %s block %u (block %u of file %u) "
+			      "marked free\n", sfs->sfs_sb.sb_volname,
+			      level > 1 ? "Indirect" : "Data",
+			      SFS_BLOCKNUM(block), fileblock, sv->sv_ino);
 		}
+		idblock = block;
 	}
 
-	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
+	/* Hand back the result and return. */
+	*diskblock = block;
+	return 0;
+}
 
-	/* If there's no block there, allocate one */
-	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
+/*
+ * Look up the disk block number (from 0 up to the number of blocks on
+ * the disk) given a file and the logical block number within that
+ * file. If DOALLOC is set, and no such block exists, one will be
+ * allocated. Call with the vnode locked.
+ *
+ * New blocks are zeroed, unless FRESH is not NULL: then the caller is
+ * going to overwrite the whole block, and *FRESH says whether it was
+ * just allocated and so must be completely filled in. (Indirect
+ * blocks are always zeroed.)
+ *
+ * A block reserved by sfs_prealloc and not written yet is reported as
+ * 0, like a hole, unless DOALLOC is set; then it counts as written
+ * from now on, and is zeroed or reported fresh like a new block.
+ */
+int
+sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
+	 bool *fresh, daddr_t *diskblock)
+{
+	int result;
+
+	result = sfs_bmap_get(sv, fileblock, doalloc, 0, fresh, diskblock);
+	if (result == 0 && (*diskblock & SFS_UNWRITTEN)) {
+		KASSERT(!doalloc);
+		*diskblock = 0;
+	}
+	return result;
+}
+
+/*
+ * Write back indirect block IDBLOCK, at indirection LEVEL, and all the
+ * indirect blocks under it.
+ */
+static
+int
+sfs_sync_indirect_level(struct sfs_fs *sfs, daddr_t idblock, unsigned level)
+{
+	struct buf *idbuf;
+	daddr_t child;
+	unsigned j;
+	int result;
+
+	if (idblock == 0) {
+		return 0;
+	}
+
+	/*
+	 * Don't hold the buffer while syncing what's under it; get each
+	 * entry separately instead.
+	 */
+	for (j=0; level > 1 && j<SFS_FS_DBPERIDB(sfs); j++) {
+		result = buffer_read(sfs->sfs_device, idblock, &idbuf);
 		if (result) {
 			return result;
 		}
+		child = ((uint32_t *)buffer_map(idbuf))[j];
+		buffer_release(idbuf);
 
-		/* Remember the block we allocated */
-		idbuf[idoff] = block;
-
-		/* The indirect block is now dirty; write it back */
-		result = sfs_writeblock(sfs, idblock, idbuf, sizeof(idbuf));
+		result = sfs_sync_indirect_level(sfs, child, level - 1);
 		if (result) {
 			return result;
 		}
 	}
+	return buffer_syncblock(sfs->sfs_device, idblock);
+}
 
-	/* Hand back the result and return. */
-	if (block != 0 && !sfs_bused(sfs, block)) {
-		panic("sfs: %s: Data block %u (block %u of file %u) "
-		      "marked free\n", sfs->sfs_sb.sb_volname,
-		      block, fileblock, sv->sv_ino);
+/*
+ * Write back all of a file's indirect blocks. Call with the vnode
+ * locked.
+ */
+int
+sfs_sync_indirect(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	result = sfs_sync_indirect_level(sfs, sv->sv_i.sfi_indirect, 1);
+	if (result) {
+		return result;
 	}
-	*diskblock = block;
+	result = sfs_sync_indirect_level(sfs, sv->sv_i.sfi_dindirect, 2);
+	if (result) {
+		return result;
+	}
+	return sfs_sync_indirect_level(sfs, sv->sv_i.sfi_tindirect, 3);
+}
+
+/*
+ * Move the contents of an inline file out of the inode into a data
+ * block (block 0 of the file), so it can grow past SFS_INLINEMAX.
+ * Call with the vnode locked.
+ */
+int
+sfs_inline_evict(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *buf;
+	daddr_t diskblock;
+	bool fresh;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(sv->sv_i.sfi_flags & SFS_IFLAG_INLINE);
+	KASSERT(sv->sv_i.sfi_size <= SFS_INLINEMAX(sfs));
+
+	sv->sv_i.sfi_flags &= ~SFS_IFLAG_INLINE;
+	result = sfs_bmap(sv, 0, true, &fresh, &diskblock);
+	if (result) {
+		sv->sv_i.sfi_flags |= SFS_IFLAG_INLINE;
+		return result;
+	}
+	KASSERT(fresh);
+
+	result = buffer_get(sfs->sfs_device, diskblock, &buf);
+	if (result) {
+		/* Put things back the way they were */
+		sv->sv_i.sfi_direct[0] = 0;
+		sfs_bfree(sfs, diskblock);
+		sv->sv_i.sfi_flags |= SFS_IFLAG_INLINE;
+		return result;
+	}
+	memcpy(buffer_map(buf), sv->sv_i.sfi_inline, sv->sv_i.sfi_size);
+	bzero((char *)buffer_map(buf) + sv->sv_i.sfi_size,
+	      sfs->sfs_blocksize - sv->sv_i.sfi_size);
+	buffer_mark_dirty(buf);
+	buffer_release(buf);
+
+	bzero(sv->sv_i.sfi_inline, sizeof(sv->sv_i.sfi_inline));
+	sfs_dirty_inode(sv);
 	return 0;
 }
 
 /*
- * Called for ftruncate() and from sfs_reclaim.
+ * Blocks sfs_itrunc is freeing, gathered into runs of consecutive
+ * blocks (which is how sfs_balloc tends to hand them out) so each run
+ * can be taken out of the freemap at once.
+ */
+struct sfs_freerun {
+	daddr_t fr_start;		/* first block of the run */
+	uint32_t fr_len;		/* number of blocks; 0 if none */
+};
+
+/*
+ * Free the blocks collected so far.
  */
+static
+void
+sfs_freerun_flush(struct sfs_fs *sfs, struct sfs_freerun *fr)
+{
+	if (fr->fr_len > 0) {
+		sfs_bfreerange(sfs, fr->fr_start, fr->fr_len);
+		fr->fr_len = 0;
+	}
+}
+
+/*
+ * Add a block to be freed.
+ */
+static
+void
+sfs_freerun_add(struct sfs_fs *sfs, struct sfs_freerun *fr, daddr_t block)
+{
+	if (fr->fr_len > 0 && block == fr->fr_start + fr->fr_len) {
+		fr->fr_len++;
+		return;
+	}
+	sfs_freerun_flush(sfs, fr);
+	fr->fr_start = block;
+	fr->fr_len = 1;
+}
+
+/*
+ * Free everything under the indirect block *IDSLOT, at indirection
+ * LEVEL (1 for single indirect), that maps file blocks at or past
+ * BLOCKLEN. BASEBLOCK is the first file block it maps. If nothing is
+ * left under it, free the indirect block itself and clear *IDSLOT.
+ * Blocks to free are added to FR. Each indirect block that survives
+ * is updated once, after all of its entries have been looked at.
+ */
+static
 int
-sfs_itrunc(struct sfs_vnode *sv, off_t len)
+sfs_itrunc_indirect(struct sfs_fs *sfs, struct sfs_freerun *fr,
+		    uint32_t *idslot, unsigned level,
+		    uint32_t baseblock, uint32_t blocklen)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	struct buf *idbuf;
+	uint32_t *iddata;
+	uint32_t span, j, child;
+	unsigned i;
+	bool hasnonzero, iddirty;
+	int result = 0;
+
+	if (*idslot == 0) {
+		return 0;
+	}
 
+	/* Number of file blocks each entry maps */
+	for (span = 1, i = 1; i < level; i++) {
+		span *= SFS_FS_DBPERIDB(sfs);
+	}
+
+	if (blocklen >= baseblock + span * SFS_FS_DBPERIDB(sfs)) {
+		/* All of it is before the proposed EOF */
+		return 0;
+	}
+
+	/* Read the indirect block */
+	result = buffer_read(sfs->sfs_device, *idslot, &idbuf);
+	if (result) {
+		return result;
+	}
+	iddata = buffer_map(idbuf);
+
+	hasnonzero = false;
+	iddirty = false;
+	for (j=0; j<SFS_FS_DBPERIDB(sfs); j++) {
+		if (iddata[j] == 0) {
+			continue;
+		}
+		if (blocklen >= baseblock + (j+1) * span) {
+			/* Entirely before EOF; keep it */
+			hasnonzero = true;
+			continue;
+		}
+
+		/* Discard whatever is past the new EOF */
+		if (level == 1) {
+			sfs_freerun_add(sfs, fr, SFS_BLOCKNUM(iddata[j]));
+			iddata[j] = 0;
+			iddirty = true;
+			continue;
+		}
+		child = iddata[j];
+		result = sfs_itrunc_indirect(sfs, fr, &child, level - 1,
+					     baseblock + j * span, blocklen);
+		if (child != iddata[j]) {
+			iddata[j] = child;
+			iddirty = true;
+		}
+		if (child != 0) {
+			hasnonzero = true;
+		}
+		if (result) {
+			break;
+		}
+	}
+
+	if (!hasnonzero && result == 0) {
+		/* The whole indirect block is empty now; free it */
+		buffer_release(idbuf);
+		sfs_freerun_add(sfs, fr, *idslot);
+		*idslot = 0;
+	}
+	else {
+		/* If the indirect block is dirty, it needs writing */
+		if (iddirty) {
+			sfs_jdirty(sfs, idbuf);
+		}
+		buffer_release(idbuf);
+	}
+	return result;
+}
+
+/*
+ * Called for ftruncate() and from sfs_reclaim, with the vnode locked.
+ */
+int
+sfs_itrunc(struct sfs_vnode *sv, off_t len)
+{
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 
 	/* Length in blocks (divide rounding up) */
-	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
+	uint32_t blocklen = DIVROUNDUP(len, sfs->sfs_blocksize);
 
-	uint32_t i, j;
+	uint32_t i;
 	daddr_t block, idblock;
-	uint32_t baseblock, highblock;
+	uint32_t *idslot;
+	uint32_t baseblock, span;
+	unsigned level;
+	struct sfs_freerun fr;
 	int result;
-	int hasnonzero, iddirty;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	fr.fr_start = 0;
+	fr.fr_len = 0;
 
-	vfs_biglock_acquire();
+	/*
+	 * An inline file that stays small enough just needs the bytes
+	 * past the new EOF cleared, so they read as zero if it grows
+	 * again; otherwise move it out to a block first.
+	 */
+	if (sv->sv_i.sfi_flags & SFS_IFLAG_INLINE) {
+		if (len <= SFS_INLINEMAX(sfs)) {
+			if (len < sv->sv_i.sfi_size) {
+				bzero(sv->sv_i.sfi_inline + len,
+				      sv->sv_i.sfi_size - len);
+			}
+			sv->sv_i.sfi_size = len;
+			sfs_dirty_inode(sv);
+			return 0;
+		}
+		result = sfs_inline_evict(sv);
+		if (result) {
+			return result;
+		}
+	}
 
 	/*
 	 * Go through the direct blocks. Discard any that are
@@ -234,70 +642,172 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 	for (i=0; i<SFS_NDIRECT; i++) {
 		block = sv->sv_i.sfi_direct[i];
 		if (i >= blocklen && block != 0) {
-			sfs_bfree(sfs, block);
+			sfs_freerun_add(sfs, &fr, SFS_BLOCKNUM(block));
 			sv->sv_i.sfi_direct[i] = 0;
-			sv->sv_dirty = true;
+			sfs_dirty_inode(sv);
 		}
 	}
 
-	/* Indirect block number */
-	idblock = sv->sv_i.sfi_indirect;
-
-	/* The lowest block in the indirect block */
+	/*
+	 * Now the indirect blocks. Each maps the file blocks right
+	 * after the ones the previous one covers.
+	 */
 	baseblock = SFS_NDIRECT;
+	span = SFS_FS_DBPERIDB(sfs);
+	for (level = 1; level <= 3; level++) {
+		switch (level) {
+		    case 1: idslot = &sv->sv_i.sfi_indirect; break;
+		    case 2: idslot = &sv->sv_i.sfi_dindirect; break;
+		    default: idslot = &sv->sv_i.sfi_tindirect; break;
+		}
+		idblock = *idslot;
+		result = sfs_itrunc_indirect(sfs, &fr, idslot, level,
+					     baseblock, blocklen);
+		if (*idslot != idblock) {
+			sfs_dirty_inode(sv);
+		}
+		if (result) {
+			sfs_freerun_flush(sfs, &fr);
+			sv->sv_idcacheblock = 0;
+			return result;
+		}
+		baseblock += span;
+		span *= SFS_FS_DBPERIDB(sfs);
+	}
 
-	/* The highest block in the indirect block */
-	highblock = baseblock + SFS_DBPERIDB - 1;
+	sfs_freerun_flush(sfs, &fr);
 
-	if (blocklen < highblock && idblock != 0) {
-		/* We're past the proposed EOF; may need to free stuff */
+	/* The lookup cache may name a block we just freed */
+	sv->sv_idcacheblock = 0;
 
-		/* Read the indirect block */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
+	/* Set the file size */
+	sv->sv_i.sfi_size = len;
+
+	/* An empty file has no blocks left and can go back inline */
+	if (len == 0 && sv->sv_i.sfi_type == SFS_TYPE_FILE &&
+	    SFS_INLINEOK(sfs)) {
+		KASSERT(sv->sv_i.sfi_indirect == 0);
+		KASSERT(sv->sv_i.sfi_dindirect == 0);
+		KASSERT(sv->sv_i.sfi_tindirect == 0);
+		sv->sv_i.sfi_flags |= SFS_IFLAG_INLINE;
+	}
+
+	/* Mark the inode dirty */
+	sfs_dirty_inode(sv);
+
+	return 0;
+}
+
+
+/*
+ * Reserve disk blocks for bytes POS through POS+LEN-1 of a file, as
+ * for fallocate, and grow the file to cover them if it's shorter
+ * (unless KEEPSIZE is set, in which case any blocks past EOF just
+ * wait there until writes reach them, or truncation frees them).
+ * Blocks the file doesn't have yet are taken in as few runs as the
+ * freemap allows and marked SFS_UNWRITTEN: the file reads zeros
+ * there without any I/O, and a later write goes straight to the
+ * reserved block. Call with the vnode locked.
+ */
+int
+sfs_prealloc(struct sfs_vnode *sv, off_t pos, off_t len, bool keepsize)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t fileblock, firstblock, endblock, want, got, i;
+	daddr_t block, start, hint;
+	off_t end = pos + len, reached;
+	int result = 0;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(pos >= 0 && len > 0 && end <= (off_t)SFS_MAXFILESIZE);
+
+	/* An inline file that stays small has its space already */
+	if (sv->sv_i.sfi_flags & SFS_IFLAG_INLINE) {
+		if (end <= SFS_INLINEMAX(sfs)) {
+			if (!keepsize && end > sv->sv_i.sfi_size) {
+				sv->sv_i.sfi_size = end;
+				sfs_dirty_inode(sv);
+			}
+			return 0;
+		}
+		result = sfs_inline_evict(sv);
 		if (result) {
-			vfs_biglock_release();
 			return result;
 		}
+	}
+
+	firstblock = pos / sfs->sfs_blocksize;
+	endblock = DIVROUNDUP(end, sfs->sfs_blocksize);
+
+	/* Try to carry on from the block before the range */
+	hint = 0;
+	fileblock = firstblock;
+	if (fileblock > 0) {
+		result = sfs_bmap_get(sv, fileblock - 1, false, 0, NULL,
+				      &block);
+		if (result) {
+			return result;
+		}
+		if (block != 0) {
+			hint = SFS_BLOCKNUM(block) + 1;
+		}
+	}
+
+	while (fileblock < endblock) {
+		result = sfs_bmap_get(sv, fileblock, false, 0, NULL, &block);
+		if (result) {
+			goto out;
+		}
+		if (block != 0) {
+			/* Already there */
+			hint = SFS_BLOCKNUM(block) + 1;
+			fileblock++;
+			continue;
+		}
 
-		hasnonzero = 0;
-		iddirty = 0;
-		for (j=0; j<SFS_DBPERIDB; j++) {
-			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
-				iddirty = 1;
+		/* Count the missing blocks from here, and reserve them */
+		for (want = 1; fileblock + want < endblock; want++) {
+			result = sfs_bmap_get(sv, fileblock + want, false, 0,
+					      NULL, &block);
+			if (result) {
+				goto out;
 			}
-			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
-				hasnonzero=1;
+			if (block != 0) {
+				break;
 			}
 		}
-
-		if (!hasnonzero) {
-			/* The whole indirect block is empty now; free it */
-			sfs_bfree(sfs, idblock);
-			sv->sv_i.sfi_indirect = 0;
-			sv->sv_dirty = true;
+		result = sfs_ballocrun(sfs, hint, want, &start, &got);
+		if (result) {
+			goto out;
 		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_writeblock(sfs, idblock, idbuf,
-						sizeof(idbuf));
+
+		for (i=0; i<got; i++) {
+			result = sfs_bmap_get(sv, fileblock + i, true,
+					      (start + i) | SFS_UNWRITTEN,
+					      NULL, &block);
 			if (result) {
-				vfs_biglock_release();
-				return result;
+				/* Give back the ones not in the file */
+				sfs_bfreerange(sfs, start + i, got - i);
+				fileblock += i;
+				goto out;
 			}
+			KASSERT(block == ((start + i) | SFS_UNWRITTEN));
 		}
+		hint = start + got;
+		fileblock += got;
 	}
 
-	/* Set the file size */
-	sv->sv_i.sfi_size = len;
-
-	/* Mark the inode dirty */
-	sv->sv_dirty = true;
-
-	vfs_biglock_release();
-	return 0;
+ out:
+	/* Cover whatever was reserved, even if we didn't get it all */
+	if (!keepsize && fileblock > firstblock) {
+		reached = (off_t)fileblock * sfs->sfs_blocksize;
+		if (reached > end) {
+			reached = end;
+		}
+		if (reached > sv->sv_i.sfi_size) {
+			sv->sv_i.sfi_size = reached;
+			sfs_dirty_inode(sv);
+		}
+	}
+	return result;
 }
-
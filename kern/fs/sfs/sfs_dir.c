@@ -35,6 +35,7 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <vfs.h>
 #include <sfs.h>
 #include "sfsprivate.h"
@@ -96,13 +97,288 @@ sfs_dir_nentries(struct sfs_vnode *sv)
 }
 
 /*
- * Search a directory for a particular filename in a directory, and
- * return its inode number, its slot, and/or the slot number of an
- * empty directory slot if one is found.
+ * Read up to MAX consecutive slots, starting at SLOT, into SDS, with
+ * one sfs_metaio; fewer if the directory block SLOT is in ends first.
+ * The number read goes in *COUNT; 0 means SLOT is past the end of the
+ * directory. Call with the directory locked.
  */
 int
-sfs_dir_findname(struct sfs_vnode *sv, const char *name,
-		uint32_t *ino, int *slot, int *emptyslot)
+sfs_dir_readslots(struct sfs_vnode *sv, int slot, struct sfs_direntry *sds,
+		  unsigned max, unsigned *count)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	unsigned perblock, n;
+	int nentries;
+
+	KASSERT(slot >= 0);
+	KASSERT(max > 0);
+
+	nentries = sfs_dir_nentries(sv);
+	if (slot >= nentries) {
+		*count = 0;
+		return 0;
+	}
+
+	perblock = sfs->sfs_blocksize / sizeof(struct sfs_direntry);
+	n = perblock - slot % perblock;
+	if (n > (unsigned)(nentries - slot)) {
+		n = nentries - slot;
+	}
+	if (n > max) {
+		n = max;
+	}
+
+	*count = n;
+	return sfs_metaio(sv, slot * sizeof(struct sfs_direntry), sds,
+			  n * sizeof(struct sfs_direntry), UIO_READ);
+}
+
+////////////////////////////////////////////////////////////
+// Directory index
+//
+// To avoid scanning every slot of a directory on each lookup, we
+// keep an in-memory index for each loaded directory: a hash table
+// from name hash to slot number, and a list of the free slots. It is
+// built by one pass over the directory the first time it's needed
+// and thrown away when the vnode is reclaimed, so nothing about it
+// is on disk and images are unchanged. The hash table only holds the
+// hash of each name; a match is confirmed by reading the slot, which
+// will normally be in the buffer cache.
+//
+// If we can't get memory for the index, we fall back to scanning.
+
+/* Initial number of hash chains; must be a power of 2 */
+#define SFS_DIRHASH_INITSIZE	16
+
+struct sfs_dirhent {
+	struct sfs_dirhent *dh_next;	/* next on hash chain */
+	uint32_t dh_hash;		/* hash of the name */
+	int dh_slot;			/* slot it's in */
+};
+
+struct sfs_dirindex {
+	struct sfs_dirhent **di_hash;	/* hash chains */
+	unsigned di_hashsize;		/* number of chains (power of 2) */
+	unsigned di_count;		/* names in the table */
+	int *di_free;			/* stack of free slots */
+	unsigned di_nfree;		/* number of free slots */
+	unsigned di_maxfree;		/* allocated size of di_free */
+};
+
+static
+uint32_t
+sfs_dir_hashname(const char *name)
+{
+	uint32_t h = 5381;
+
+	for (; *name; name++) {
+		h = h * 33 + (unsigned char)*name;
+	}
+	return h;
+}
+
+/*
+ * Add a name to the hash table.
+ */
+static
+int
+sfs_dirindex_addname(struct sfs_dirindex *di, uint32_t hash, int slot)
+{
+	struct sfs_dirhent *dh, **newhash;
+	unsigned i, newsize, h;
+
+	dh = kmalloc(sizeof(*dh));
+	if (dh == NULL) {
+		return ENOMEM;
+	}
+	dh->dh_hash = hash;
+	dh->dh_slot = slot;
+	h = hash & (di->di_hashsize - 1);
+	dh->dh_next = di->di_hash[h];
+	di->di_hash[h] = dh;
+	di->di_count++;
+
+	/* Keep the chains short; if we can't grow, just carry on. */
+	if (di->di_count > 2 * di->di_hashsize) {
+		newsize = di->di_hashsize * 2;
+		newhash = kmalloc(newsize * sizeof(*newhash));
+		if (newhash == NULL) {
+			return 0;
+		}
+		for (i=0; i<newsize; i++) {
+			newhash[i] = NULL;
+		}
+		for (i=0; i<di->di_hashsize; i++) {
+			while ((dh = di->di_hash[i]) != NULL) {
+				di->di_hash[i] = dh->dh_next;
+				h = dh->dh_hash & (newsize - 1);
+				dh->dh_next = newhash[h];
+				newhash[h] = dh;
+			}
+		}
+		kfree(di->di_hash);
+		di->di_hash = newhash;
+		di->di_hashsize = newsize;
+	}
+	return 0;
+}
+
+/*
+ * Remove a name from the hash table.
+ */
+static
+void
+sfs_dirindex_removename(struct sfs_dirindex *di, uint32_t hash, int slot)
+{
+	struct sfs_dirhent **dhp, *dh;
+
+	for (dhp = &di->di_hash[hash & (di->di_hashsize - 1)];
+	     *dhp != NULL; dhp = &(*dhp)->dh_next) {
+		if ((*dhp)->dh_slot == slot) {
+			dh = *dhp;
+			*dhp = dh->dh_next;
+			kfree(dh);
+			di->di_count--;
+			return;
+		}
+	}
+	panic("sfs: directory index lost slot %d\n", slot);
+}
+
+/*
+ * Add a slot to the free list.
+ */
+static
+int
+sfs_dirindex_addfree(struct sfs_dirindex *di, int slot)
+{
+	int *newfree;
+	unsigned newmax, i;
+
+	if (di->di_nfree == di->di_maxfree) {
+		newmax = di->di_maxfree ? di->di_maxfree * 2 : 8;
+		newfree = kmalloc(newmax * sizeof(int));
+		if (newfree == NULL) {
+			return ENOMEM;
+		}
+		for (i=0; i<di->di_nfree; i++) {
+			newfree[i] = di->di_free[i];
+		}
+		kfree(di->di_free);
+		di->di_free = newfree;
+		di->di_maxfree = newmax;
+	}
+	di->di_free[di->di_nfree++] = slot;
+	return 0;
+}
+
+/*
+ * Remove a slot from the free list. It is normally the last one,
+ * since that's what sfs_dir_findname hands out.
+ */
+static
+void
+sfs_dirindex_removefree(struct sfs_dirindex *di, int slot)
+{
+	unsigned i;
+
+	for (i=di->di_nfree; i-- > 0; ) {
+		if (di->di_free[i] == slot) {
+			di->di_free[i] = di->di_free[--di->di_nfree];
+			return;
+		}
+	}
+}
+
+/*
+ * Throw away a directory's index, if it has one. Also used when the
+ * vnode is reclaimed.
+ */
+void
+sfs_dir_dropindex(struct sfs_vnode *sv)
+{
+	struct sfs_dirindex *di = sv->sv_dirindex;
+	struct sfs_dirhent *dh;
+	unsigned i;
+
+	if (di == NULL) {
+		return;
+	}
+	for (i=0; i<di->di_hashsize; i++) {
+		while ((dh = di->di_hash[i]) != NULL) {
+			di->di_hash[i] = dh->dh_next;
+			kfree(dh);
+		}
+	}
+	kfree(di->di_hash);
+	kfree(di->di_free);
+	kfree(di);
+	sv->sv_dirindex = NULL;
+}
+
+/*
+ * Build the index for a directory by reading every slot.
+ */
+static
+int
+sfs_dir_buildindex(struct sfs_vnode *sv)
+{
+	struct sfs_dirindex *di;
+	struct sfs_direntry tsd;
+	int nentries, i, result;
+	unsigned j;
+
+	KASSERT(sv->sv_dirindex == NULL);
+
+	di = kmalloc(sizeof(*di));
+	if (di == NULL) {
+		return ENOMEM;
+	}
+	di->di_hashsize = SFS_DIRHASH_INITSIZE;
+	di->di_hash = kmalloc(di->di_hashsize * sizeof(*di->di_hash));
+	if (di->di_hash == NULL) {
+		kfree(di);
+		return ENOMEM;
+	}
+	for (j=0; j<di->di_hashsize; j++) {
+		di->di_hash[j] = NULL;
+	}
+	di->di_count = 0;
+	di->di_free = NULL;
+	di->di_nfree = di->di_maxfree = 0;
+	sv->sv_dirindex = di;
+
+	nentries = sfs_dir_nentries(sv);
+	for (i=0; i<nentries; i++) {
+		result = sfs_readdir(sv, i, &tsd);
+		if (result) {
+			sfs_dir_dropindex(sv);
+			return result;
+		}
+		if (tsd.sfd_ino == SFS_NOINO) {
+			result = sfs_dirindex_addfree(di, i);
+		}
+		else {
+			tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
+			result = sfs_dirindex_addname(di,
+					sfs_dir_hashname(tsd.sfd_name), i);
+		}
+		if (result) {
+			sfs_dir_dropindex(sv);
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Search the directory by reading every slot. This is what we do
+ * when there's no index.
+ */
+static
+int
+sfs_dir_scan(struct sfs_vnode *sv, const char *name,
+	     uint32_t *ino, int *slot, int *emptyslot)
 {
 	struct sfs_direntry tsd;
 	int found, nentries, i, result;
@@ -146,6 +422,62 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 	return found ? 0 : ENOENT;
 }
 
+////////////////////////////////////////////////////////////
+// Directory operations
+
+/*
+ * Search a directory for a particular filename in a directory, and
+ * return its inode number, its slot, and/or the slot number of an
+ * empty directory slot if one is found.
+ *
+ * All the sfs_dir functions expect the directory to be locked.
+ */
+int
+sfs_dir_findname(struct sfs_vnode *sv, const char *name,
+		uint32_t *ino, int *slot, int *emptyslot)
+{
+	struct sfs_dirindex *di;
+	struct sfs_dirhent *dh;
+	struct sfs_direntry tsd;
+	uint32_t hash;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (sv->sv_dirindex == NULL && sfs_dir_buildindex(sv) != 0) {
+		return sfs_dir_scan(sv, name, ino, slot, emptyslot);
+	}
+	di = sv->sv_dirindex;
+
+	if (emptyslot != NULL && di->di_nfree > 0) {
+		*emptyslot = di->di_free[di->di_nfree - 1];
+	}
+
+	hash = sfs_dir_hashname(name);
+	for (dh = di->di_hash[hash & (di->di_hashsize - 1)];
+	     dh != NULL; dh = dh->dh_next) {
+		if (dh->dh_hash != hash) {
+			continue;
+		}
+		result = sfs_readdir(sv, dh->dh_slot, &tsd);
+		if (result) {
+			return result;
+		}
+		tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
+		if (tsd.sfd_ino != SFS_NOINO && !strcmp(tsd.sfd_name, name)) {
+			if (slot != NULL) {
+				*slot = dh->dh_slot;
+			}
+			if (ino != NULL) {
+				*ino = tsd.sfd_ino;
+			}
+			return 0;
+		}
+	}
+
+	return ENOENT;
+}
+
 /*
  * Create a link in a directory to the specified inode by number, with
  * the specified name, and optionally hand back the slot.
@@ -157,6 +489,8 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 	int result;
 	struct sfs_direntry sd;
 
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
 	/* Look up the name. We want to make sure it *doesn't* exist. */
 	result = sfs_dir_findname(sv, name, NULL, NULL, &emptyslot);
 	if (result!=0 && result!=ENOENT) {
@@ -185,8 +519,23 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 		*slot = emptyslot;
 	}
 
-	/* Write the entry. */
-	return sfs_writedir(sv, emptyslot, &sd);
+	/* Write the entry. If that fails, we no longer know what's there. */
+	result = sfs_writedir(sv, emptyslot, &sd);
+	if (result) {
+		sfs_dir_dropindex(sv);
+		return result;
+	}
+
+	/* Update the index. */
+	if (sv->sv_dirindex != NULL) {
+		sfs_dirindex_removefree(sv->sv_dirindex, emptyslot);
+		if (sfs_dirindex_addname(sv->sv_dirindex,
+					 sfs_dir_hashname(name),
+					 emptyslot)) {
+			sfs_dir_dropindex(sv);
+		}
+	}
+	return 0;
 }
 
 /*
@@ -196,13 +545,41 @@ int
 sfs_dir_unlink(struct sfs_vnode *sv, int slot)
 {
 	struct sfs_direntry sd;
+	uint32_t hash = 0;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	/* Find out what the index has the slot under. */
+	if (sv->sv_dirindex != NULL) {
+		result = sfs_readdir(sv, slot, &sd);
+		if (result) {
+			return result;
+		}
+		KASSERT(sd.sfd_ino != SFS_NOINO);
+		sd.sfd_name[sizeof(sd.sfd_name)-1] = 0;
+		hash = sfs_dir_hashname(sd.sfd_name);
+	}
 
 	/* Initialize a suitable directory entry... */
 	bzero(&sd, sizeof(sd));
 	sd.sfd_ino = SFS_NOINO;
 
 	/* ... and write it */
-	return sfs_writedir(sv, slot, &sd);
+	result = sfs_writedir(sv, slot, &sd);
+	if (result) {
+		sfs_dir_dropindex(sv);
+		return result;
+	}
+
+	/* Update the index. */
+	if (sv->sv_dirindex != NULL) {
+		sfs_dirindex_removename(sv->sv_dirindex, hash, slot);
+		if (sfs_dirindex_addfree(sv->sv_dirindex, slot)) {
+			sfs_dir_dropindex(sv);
+		}
+	}
+	return 0;
 }
 
 /*
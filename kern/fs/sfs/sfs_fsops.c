@@ -39,26 +39,33 @@
 #include <array.h>
 #include <bitmap.h>
 #include <uio.h>
+#include <synch.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
 
 /* Shortcuts for the size macros in kern/sfs.h */
 #define SFS_FS_NBLOCKS(sfs)        ((sfs)->sfs_sb.sb_nblocks)
-#define SFS_FS_FREEMAPBITS(sfs)    SFS_FREEMAPBITS(SFS_FS_NBLOCKS(sfs))
-#define SFS_FS_FREEMAPBLOCKS(sfs)  SFS_FREEMAPBLOCKS(SFS_FS_NBLOCKS(sfs))
+#define SFS_FS_FREEMAPBITS(sfs) \
+	SFS_FREEMAPBITS(SFS_FS_NBLOCKS(sfs), (sfs)->sfs_blocksize)
+#define SFS_FS_FREEMAPBLOCKS(sfs) \
+	SFS_FREEMAPBLOCKS(SFS_FS_NBLOCKS(sfs), (sfs)->sfs_blocksize)
 
 /*
  * Routine for doing I/O (reads or writes) on the free block bitmap.
- * We always do the whole bitmap at once; writing individual sectors
- * might or might not be a worthwhile optimization.
+ * Reads do the whole bitmap at once. Writes do only the blocks marked
+ * in DIRTYMAP (one bit per bitmap block), and unmark them; on a big
+ * volume one allocation would otherwise rewrite the whole freemap,
+ * and with a journal, log it too.
  *
- * The free block bitmap consists of SFS_FREEMAPBLOCKS 512-byte
- * sectors of bits, one bit for each sector on the filesystem. The
- * number of blocks in the bitmap is thus rounded up to the nearest
- * multiple of 512*8 = 4096. (This rounded number is SFS_FREEMAPBITS.)
+ * The free block bitmap consists of SFS_FREEMAPBLOCKS blocks of bits,
+ * one bit for each block on the filesystem. The number of blocks in
+ * the bitmap is thus rounded up to the nearest multiple of the bits
+ * in a block (4096 for 512-byte blocks). (This rounded number is
+ * SFS_FREEMAPBITS.)
  * This means that the bitmap will (in general) contain space for some
  * number of invalid sectors that are actually beyond the end of the
  * disk device. This is ok. These sectors are supposed to be marked
@@ -66,35 +73,44 @@
  *
  * The sectors used by the superblock and the bitmap itself are
  * likewise marked in use by mksfs.
+ *
+ * The inode bitmap of a dense-format volume is laid out the same way
+ * (one bit per inode) and is read and written with the same code.
  */
 static
 int
-sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
+sfs_mapio(struct sfs_fs *sfs, struct bitmap *map, struct bitmap *dirtymap,
+	  daddr_t start, uint32_t mapblocks, enum uio_rw rw)
 {
-	uint32_t j, freemapblocks;
-	char *freemapdata;
+	uint32_t j;
+	char *mapdata;
 	int result;
 
-	/* Number of blocks in the free block bitmap. */
-	freemapblocks = SFS_FS_FREEMAPBLOCKS(sfs);
-
-	/* Pointer to our freemap data in memory. */
-	freemapdata = bitmap_getdata(sfs->sfs_freemap);
+	/* Pointer to our bitmap data in memory. */
+	mapdata = bitmap_getdata(map);
 
-	/* For each block in the free block bitmap... */
-	for (j=0; j<freemapblocks; j++) {
+	/* For each block in the bitmap... */
+	for (j=0; j<mapblocks; j++) {
 
 		/* Get a pointer to its data */
-		void *ptr = freemapdata + j*SFS_BLOCKSIZE;
+		void *ptr = mapdata + j*sfs->sfs_blocksize;
 
-		/* and read or write it. The freemap starts at sector 2. */
+		/* and read or write it. */
 		if (rw == UIO_READ) {
-			result = sfs_readblock(sfs, SFS_FREEMAP_START+j, ptr,
-					       SFS_BLOCKSIZE);
+			result = sfs_readblock(sfs, start+j, ptr,
+					       sfs->sfs_blocksize);
+		}
+		else if (bitmap_isset(dirtymap, j)) {
+			result = sfs_writeblock(sfs, start+j, ptr,
+						sfs->sfs_blocksize);
+			if (result == 0) {
+				bitmap_unmark(dirtymap, j);
+				KASSERT(sfs->sfs_mapdirtycount > 0);
+				sfs->sfs_mapdirtycount--;
+			}
 		}
 		else {
-			result = sfs_writeblock(sfs, SFS_FREEMAP_START+j, ptr,
-						SFS_BLOCKSIZE);
+			result = 0;
 		}
 
 		/* If we failed, stop. */
@@ -105,26 +121,86 @@ sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
 	return 0;
 }
 
+static
+int
+sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
+{
+	/* The freemap starts at sector 2. */
+	return sfs_mapio(sfs, sfs->sfs_freemap, sfs->sfs_freemapdirty,
+			 SFS_FREEMAP_START, SFS_FS_FREEMAPBLOCKS(sfs), rw);
+}
+
+static
+int
+sfs_inomapio(struct sfs_fs *sfs, enum uio_rw rw)
+{
+	KASSERT(SFS_DENSE(sfs));
+	return sfs_mapio(sfs, sfs->sfs_inomap, sfs->sfs_inomapdirty,
+			 sfs->sfs_sb.sb_inomapstart,
+			 SFS_INOMAPBLOCKS(sfs->sfs_sb.sb_ninodes,
+					  sfs->sfs_blocksize), rw);
+}
+
 /*
  * Sync routine for the vnode table.
+ *
+ * This only pushes the inodes into the buffer cache; sfs_sync
+ * writes the buffers out once at the end, rather than going
+ * through VOP_FSYNC and flushing the cache once per vnode. Only the
+ * vnodes on the dirty list are looked at.
+ *
+ * Each vnode has to be locked to sync it, and sv_lock comes before
+ * sfs_vnlock, so we first take a reference to every dirty vnode
+ * while holding sfs_vnlock (which keeps sfs_reclaim from freeing
+ * them under us), then sync them with it released.
  */
 static
 int
 sfs_sync_vnodes(struct sfs_fs *sfs)
 {
+	struct vnodearray *vnodes;
+	struct sfs_vnode *sv;
 	unsigned i, num;
+	int result;
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
-	num = vnodearray_num(sfs->sfs_vnodes);
+	vnodes = vnodearray_create();
+	if (vnodes == NULL) {
+		return ENOMEM;
+	}
+
+	lock_acquire(sfs->sfs_vnlock);
+	lock_acquire(sfs->sfs_dirtylock);
+	result = 0;
+	for (sv = sfs->sfs_dirtyvn; sv != NULL; sv = sv->sv_dirtynext) {
+		result = vnodearray_add(vnodes, &sv->sv_absvn, NULL);
+		if (result) {
+			break;
+		}
+		VOP_INCREF(&sv->sv_absvn);
+	}
+	lock_release(sfs->sfs_dirtylock);
+	lock_release(sfs->sfs_vnlock);
+
+	/* Go over the array of vnodes, syncing as we go. */
+	num = vnodearray_num(vnodes);
 	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
+		sv = vnodearray_get(vnodes, i)->vn_data;
+		if (result == 0) {
+			lock_acquire(sv->sv_lock);
+			result = sfs_sync_inode(sv);
+			lock_release(sv->sv_lock);
+		}
+		VOP_DECREF(&sv->sv_absvn);
 	}
-	return 0;
+
+	vnodearray_setsize(vnodes, 0);
+	vnodearray_destroy(vnodes);
+	return result;
 }
 
 /*
- * Sync routine for the freemap.
+ * Sync routine for the freemap, and the inode bitmap if there is
+ * one. Call with sfs_freemaplock held.
  */
 static
 int
@@ -132,19 +208,30 @@ sfs_sync_freemap(struct sfs_fs *sfs)
 {
 	int result;
 
-	if (sfs->sfs_freemapdirty) {
-		result = sfs_freemapio(sfs, UIO_WRITE);
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
+	if (sfs->sfs_mapdirtycount == 0) {
+		return 0;
+	}
+
+	result = sfs_freemapio(sfs, UIO_WRITE);
+	if (result) {
+		return result;
+	}
+
+	if (SFS_DENSE(sfs)) {
+		result = sfs_inomapio(sfs, UIO_WRITE);
 		if (result) {
 			return result;
 		}
-		sfs->sfs_freemapdirty = false;
 	}
 
+	KASSERT(sfs->sfs_mapdirtycount == 0);
 	return 0;
 }
 
 /*
- * Sync routine for the superblock.
+ * Sync routine for the superblock. Call with sfs_freemaplock held.
  */
 static
 int
@@ -152,6 +239,8 @@ sfs_sync_superblock(struct sfs_fs *sfs)
 {
 	int result;
 
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
 	if (sfs->sfs_superdirty) {
 		result = sfs_writeblock(sfs, SFS_SUPER_BLOCK, &sfs->sfs_sb,
 					sizeof(sfs->sfs_sb));
@@ -163,6 +252,65 @@ sfs_sync_superblock(struct sfs_fs *sfs)
 	return 0;
 }
 
+/*
+ * Get the freemap, inode bitmap, and superblock into the buffer
+ * cache, first applying any frees that were waiting for this.
+ */
+int
+sfs_sync_maps(struct sfs_fs *sfs)
+{
+	int result;
+
+	lock_acquire(sfs->sfs_freemaplock);
+
+	sfs_bfree_deferred(sfs);
+
+	/* If the free block map needs to be written, write it. */
+	result = sfs_sync_freemap(sfs);
+	if (result) {
+		lock_release(sfs->sfs_freemaplock);
+		return result;
+	}
+
+	/* If the superblock needs to be written, write it. */
+	result = sfs_sync_superblock(sfs);
+	if (result) {
+		lock_release(sfs->sfs_freemaplock);
+		return result;
+	}
+
+	lock_release(sfs->sfs_freemaplock);
+	return 0;
+}
+
+/*
+ * Writeback routine: get the inodes, freemap, and superblock into
+ * the buffer cache. This is what gets invoked if you do
+ * FSOP_WRITEBACK; it is also the first half of sync.
+ *
+ * With a journal, this commits the running transaction instead,
+ * which also writes everything back.
+ */
+static
+int
+sfs_writeback(struct fs *fs)
+{
+	struct sfs_fs *sfs = fs->fs_data;
+	int result;
+
+	if (SFS_JOURNALED(sfs)) {
+		return sfs_jcommit(sfs);
+	}
+
+	/* If any vnodes need to be written, write them. */
+	result = sfs_sync_vnodes(sfs);
+	if (result) {
+		return result;
+	}
+
+	return sfs_sync_maps(sfs);
+}
+
 /*
  * Sync routine. This is what gets invoked if you do FS_SYNC on the
  * sfs filesystem structure.
@@ -174,8 +322,6 @@ sfs_sync(struct fs *fs)
 	struct sfs_fs *sfs;
 	int result;
 
-	vfs_biglock_acquire();
-
 	/*
 	 * Get the sfs_fs from the generic abstract fs.
 	 *
@@ -208,28 +354,18 @@ sfs_sync(struct fs *fs)
 
 	sfs = fs->fs_data;
 
-	/* If any vnodes need to be written, write them. */
-	result = sfs_sync_vnodes(sfs);
+	/* Get all the metadata into the buffer cache. */
+	result = sfs_writeback(fs);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
-	/* If the free block map needs to be written, write it. */
-	result = sfs_sync_freemap(sfs);
-	if (result) {
-		vfs_biglock_release();
-		return result;
-	}
-
-	/* If the superblock needs to be written, write it. */
-	result = sfs_sync_superblock(sfs);
+	/* Now push everything in the buffer cache out to disk. */
+	result = buffer_sync(sfs->sfs_device);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -243,13 +379,77 @@ const char *
 sfs_getvolname(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
-	const char *ret;
 
-	vfs_biglock_acquire();
-	ret = sfs->sfs_sb.sb_volname;
-	vfs_biglock_release();
+	/* The volume name doesn't change while we're mounted. */
+	return sfs->sfs_sb.sb_volname;
+}
+
+/*
+ * Check that the superblock of a dense-format volume describes a
+ * sensible layout: freemap, then inode bitmap, then inode table,
+ * all inside the volume.
+ */
+static
+bool
+sfs_checkdense(const struct sfs_superblock *sb)
+{
+	uint32_t ninodes = sb->sb_ninodes;
+	uint32_t bs = SFS_SB_BLOCKSIZE(sb);
 
-	return ret;
+	if (sb->sb_version != SFS_VERSION_DENSE) {
+		return false;
+	}
+	if (ninodes <= SFS_ROOTDIR_INO ||
+	    ninodes % SFS_INOPERBLOCK(bs) != 0) {
+		return false;
+	}
+	if (sb->sb_inomapstart !=
+	    SFS_FREEMAP_START + SFS_FREEMAPBLOCKS(sb->sb_nblocks, bs)) {
+		return false;
+	}
+	if (sb->sb_itablestart !=
+	    sb->sb_inomapstart + SFS_INOMAPBLOCKS(ninodes, bs)) {
+		return false;
+	}
+	if (sb->sb_itablestart + SFS_ITABLEBLOCKS(ninodes, bs) >
+	    sb->sb_nblocks) {
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Check that the journal, if there is one, is big enough and lies
+ * after the bitmaps (and inode table) and inside the volume.
+ */
+static
+bool
+sfs_checkjournal(const struct sfs_superblock *sb)
+{
+	uint32_t bs = SFS_SB_BLOCKSIZE(sb);
+	uint32_t metaend;
+
+	if (sb->sb_journalblocks == 0) {
+		return sb->sb_journalstart == 0;
+	}
+	if (sb->sb_journalblocks < SFS_JMINBLOCKS) {
+		return false;
+	}
+
+	if (sb->sb_version == SFS_VERSION_DENSE) {
+		metaend = sb->sb_itablestart +
+			SFS_ITABLEBLOCKS(sb->sb_ninodes, bs);
+	}
+	else {
+		metaend = SFS_FREEMAP_START +
+			SFS_FREEMAPBLOCKS(sb->sb_nblocks, bs);
+	}
+	if (sb->sb_journalstart < metaend ||
+	    sb->sb_journalstart >= sb->sb_nblocks ||
+	    sb->sb_journalblocks > sb->sb_nblocks - sb->sb_journalstart) {
+		return false;
+	}
+	return true;
 }
 
 /*
@@ -262,6 +462,30 @@ sfs_fs_destroy(struct sfs_fs *sfs)
 	if (sfs->sfs_freemap != NULL) {
 		bitmap_destroy(sfs->sfs_freemap);
 	}
+	if (sfs->sfs_freemapdirty != NULL) {
+		bitmap_destroy(sfs->sfs_freemapdirty);
+	}
+	if (sfs->sfs_inomap != NULL) {
+		bitmap_destroy(sfs->sfs_inomap);
+	}
+	if (sfs->sfs_inomapdirty != NULL) {
+		bitmap_destroy(sfs->sfs_inomapdirty);
+	}
+	KASSERT(sfs->sfs_nfreed == 0);
+	kfree(sfs->sfs_freed);
+	kfree(sfs->sfs_jhead);
+	KASSERT(sfs->sfs_orphans == NULL);
+	KASSERT(!sfs->sfs_orphanbusy);
+	cv_destroy(sfs->sfs_orphancv);
+	lock_destroy(sfs->sfs_orphanlock);
+	KASSERT(sfs->sfs_jactive == 0);
+	cv_destroy(sfs->sfs_jcv);
+	lock_destroy(sfs->sfs_jlock);
+	lock_destroy(sfs->sfs_freemaplock);
+	KASSERT(sfs->sfs_dirtyvn == NULL);
+	lock_destroy(sfs->sfs_dirtylock);
+	lock_destroy(sfs->sfs_vnlock);
+	kfree(sfs->sfs_vnhash);
 	vnodearray_destroy(sfs->sfs_vnodes);
 	KASSERT(sfs->sfs_device == NULL);
 	kfree(sfs);
@@ -277,18 +501,41 @@ int
 sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
+	int result;
 
-	vfs_biglock_acquire();
+	/*
+	 * Finish freeing removed files first; the thread doing it holds
+	 * a vnode. That dirties the freemap again, so sync once more.
+	 */
+	sfs_orphan_drain(sfs);
+	result = sfs_sync(fs);
+	if (result) {
+		return result;
+	}
 
 	/* Do we have any files open? If so, can't unmount. */
+	lock_acquire(sfs->sfs_vnlock);
 	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
-		vfs_biglock_release();
+		lock_release(sfs->sfs_vnlock);
 		return EBUSY;
 	}
+	lock_release(sfs->sfs_vnlock);
+
+	/*
+	 * The VFS layer holds vfs_biglock across unmount, so no new
+	 * lookups can reach us from here on.
+	 */
 
-	/* We should have just had sfs_sync called. */
+	/* We should have just had sfs_sync called (and called it again). */
 	KASSERT(sfs->sfs_superdirty == false);
-	KASSERT(sfs->sfs_freemapdirty == false);
+	KASSERT(sfs->sfs_mapdirtycount == 0);
+	KASSERT(sfs->sfs_nfreed == 0);
+
+	/* Get rid of our blocks in the buffer cache. */
+	result = buffer_invalidate(sfs->sfs_device);
+	if (result) {
+		return result;
+	}
 
 	/* The vfs layer takes care of the device for us */
 	sfs->sfs_device = NULL;
@@ -297,7 +544,6 @@ sfs_unmount(struct fs *fs)
 	sfs_fs_destroy(sfs);
 
 	/* nothing else to do */
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -306,6 +552,7 @@ sfs_unmount(struct fs *fs)
  */
 static const struct fs_ops sfs_fsops = {
 	.fsop_sync = sfs_sync,
+	.fsop_writeback = sfs_writeback,
 	.fsop_getvolname = sfs_getvolname,
 	.fsop_getroot = sfs_getroot,
 	.fsop_unmount = sfs_unmount,
@@ -321,6 +568,7 @@ struct sfs_fs *
 sfs_fs_create(void)
 {
 	struct sfs_fs *sfs;
+	unsigned i;
 
 	/*
 	 * Make sure our on-disk structures aren't messed up
@@ -328,6 +576,8 @@ sfs_fs_create(void)
 	COMPILE_ASSERT(sizeof(struct sfs_superblock)==SFS_BLOCKSIZE);
 	COMPILE_ASSERT(sizeof(struct sfs_dinode)==SFS_BLOCKSIZE);
 	COMPILE_ASSERT(SFS_BLOCKSIZE % sizeof(struct sfs_direntry) == 0);
+	COMPILE_ASSERT(SFS_BLOCKSIZE == BUFFER_SIZE);
+	COMPILE_ASSERT(SFS_MAXBLOCKSIZE <= BUFFER_MAXSIZE);
 
 	/* Allocate object */
 	sfs = kmalloc(sizeof(struct sfs_fs));
@@ -346,6 +596,7 @@ sfs_fs_create(void)
 	/* superblock */
 	/* (ignore sfs_super, we'll read in over it shortly) */
 	sfs->sfs_superdirty = false;
+	sfs->sfs_blocksize = SFS_BLOCKSIZE;
 
 	/* device we mount on */
 	sfs->sfs_device = NULL;
@@ -355,13 +606,88 @@ sfs_fs_create(void)
 	if (sfs->sfs_vnodes == NULL) {
 		goto cleanup_object;
 	}
+	sfs->sfs_vnhashsize = SFS_VNHASH_INITSIZE;
+	sfs->sfs_vnhash = kmalloc(sfs->sfs_vnhashsize *
+				  sizeof(struct sfs_vnode *));
+	if (sfs->sfs_vnhash == NULL) {
+		goto cleanup_vnodes;
+	}
+	for (i=0; i<sfs->sfs_vnhashsize; i++) {
+		sfs->sfs_vnhash[i] = NULL;
+	}
+	sfs->sfs_vnlock = lock_create("sfs_vnlock");
+	if (sfs->sfs_vnlock == NULL) {
+		goto cleanup_vnhash;
+	}
+	sfs->sfs_dirtyvn = NULL;
+	sfs->sfs_ndirtyvn = 0;
+	sfs->sfs_dirtylock = lock_create("sfs_dirtylock");
+	if (sfs->sfs_dirtylock == NULL) {
+		goto cleanup_vnlock;
+	}
 
 	/* freemap */
 	sfs->sfs_freemap = NULL;
-	sfs->sfs_freemapdirty = false;
+	sfs->sfs_freemapdirty = NULL;
+	sfs->sfs_inomap = NULL;
+	sfs->sfs_inomapdirty = NULL;
+	sfs->sfs_mapdirtycount = 0;
+	sfs->sfs_freed = NULL;
+	sfs->sfs_nfreed = 0;
+	sfs->sfs_maxfreed = 0;
+	sfs->sfs_allocnext = 0;
+	sfs->sfs_freemaplock = lock_create("sfs_freemaplock");
+	if (sfs->sfs_freemaplock == NULL) {
+		goto cleanup_dirtylock;
+	}
+
+	/* journal */
+	sfs->sfs_jphase = SFS_JIDLE;
+	sfs->sfs_jactive = 0;
+	sfs->sfs_jseq = 0;
+	sfs->sfs_jresult = 0;
+	sfs->sfs_junsafe = false;
+	sfs->sfs_jhead = NULL;
+	sfs->sfs_jlock = lock_create("sfs_jlock");
+	if (sfs->sfs_jlock == NULL) {
+		goto cleanup_freemaplock;
+	}
+	sfs->sfs_jcv = cv_create("sfs_jcv");
+	if (sfs->sfs_jcv == NULL) {
+		goto cleanup_jlock;
+	}
+
+	/* background freeing of removed files */
+	sfs->sfs_orphans = NULL;
+	sfs->sfs_orphanbusy = false;
+	sfs->sfs_orphanthread = NULL;
+	sfs->sfs_orphanlock = lock_create("sfs_orphanlock");
+	if (sfs->sfs_orphanlock == NULL) {
+		goto cleanup_jcv;
+	}
+	sfs->sfs_orphancv = cv_create("sfs_orphancv");
+	if (sfs->sfs_orphancv == NULL) {
+		goto cleanup_orphanlock;
+	}
 
 	return sfs;
 
+cleanup_orphanlock:
+	lock_destroy(sfs->sfs_orphanlock);
+cleanup_jcv:
+	cv_destroy(sfs->sfs_jcv);
+cleanup_jlock:
+	lock_destroy(sfs->sfs_jlock);
+cleanup_freemaplock:
+	lock_destroy(sfs->sfs_freemaplock);
+cleanup_dirtylock:
+	lock_destroy(sfs->sfs_dirtylock);
+cleanup_vnlock:
+	lock_destroy(sfs->sfs_vnlock);
+cleanup_vnhash:
+	kfree(sfs->sfs_vnhash);
+cleanup_vnodes:
+	vnodearray_destroy(sfs->sfs_vnodes);
 cleanup_object:
 	kfree(sfs);
 fail:
@@ -388,21 +714,17 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	int result;
 	struct sfs_fs *sfs;
 
-	vfs_biglock_acquire();
-
 	/* We don't pass any options through mount */
 	(void)options;
 
 	/*
 	 * We can't mount on devices with the wrong sector size.
 	 *
-	 * (Note: for all intents and purposes here, "sector" and
-	 * "block" are interchangeable terms. Technically a filesystem
-	 * block may be composed of several hardware sectors, but we
-	 * don't do that in sfs.)
+	 * (A filesystem block is one or more sectors, depending on
+	 * the block size in the superblock. The superblock itself is
+	 * in the first sector.)
 	 */
 	if (dev->d_blocksize != SFS_BLOCKSIZE) {
-		vfs_biglock_release();
 		kprintf("sfs: Cannot mount on device with blocksize %zu\n",
 			dev->d_blocksize);
 		return ENXIO;
@@ -410,7 +732,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 
 	sfs = sfs_fs_create();
 	if (sfs == NULL) {
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 
@@ -421,9 +742,9 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	result = sfs_readblock(sfs, SFS_SUPER_BLOCK, &sfs->sfs_sb,
 			       sizeof(sfs->sfs_sb));
 	if (result) {
+		buffer_invalidate(dev);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -434,40 +755,125 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 			"(0x%x, should be 0x%x)\n",
 			sfs->sfs_sb.sb_magic,
 			SFS_MAGIC);
+		buffer_invalidate(dev);
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
+		return EINVAL;
+	}
+
+	/* From here on, use the volume's own block size */
+	sfs->sfs_blocksize = SFS_SB_BLOCKSIZE(&sfs->sfs_sb);
+	if (sfs->sfs_blocksize < SFS_BLOCKSIZE ||
+	    sfs->sfs_blocksize > SFS_MAXBLOCKSIZE ||
+	    (sfs->sfs_blocksize & (sfs->sfs_blocksize - 1)) != 0) {
+		kprintf("sfs: Unsupported block size %u\n",
+			sfs->sfs_blocksize);
+		buffer_invalidate(dev);
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
+		return EINVAL;
+	}
+	result = buffer_setblocksize(dev, sfs->sfs_blocksize);
+	if (result) {
+		buffer_invalidate(dev);
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
+		return result;
+	}
+
+	if (sfs->sfs_sb.sb_nblocks >
+	    dev->d_blocks / (sfs->sfs_blocksize / SFS_BLOCKSIZE)) {
+		kprintf("sfs: warning - fs has %u blocks of %u bytes, "
+			"device has %u sectors\n",
+			sfs->sfs_sb.sb_nblocks, sfs->sfs_blocksize,
+			dev->d_blocks);
+	}
+
+	if (sfs->sfs_sb.sb_version != SFS_VERSION_ORIG &&
+	    !sfs_checkdense(&sfs->sfs_sb)) {
+		kprintf("sfs: Unsupported or bad format revision %u\n",
+			sfs->sfs_sb.sb_version);
+		buffer_invalidate(dev);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return EINVAL;
 	}
 
-	if (sfs->sfs_sb.sb_nblocks > dev->d_blocks) {
-		kprintf("sfs: warning - fs has %u blocks, device has %u\n",
-			sfs->sfs_sb.sb_nblocks, dev->d_blocks);
+	/* Block numbers must leave the SFS_UNWRITTEN bit free. */
+	if (sfs->sfs_sb.sb_nblocks > SFS_UNWRITTEN) {
+		kprintf("sfs: Volume too large (%u blocks)\n",
+			sfs->sfs_sb.sb_nblocks);
+		buffer_invalidate(dev);
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
+		return EINVAL;
+	}
+
+	if (!sfs_checkjournal(&sfs->sfs_sb)) {
+		kprintf("sfs: Bad journal location\n");
+		buffer_invalidate(dev);
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
+		return EINVAL;
 	}
 
 	/* Ensure null termination of the volume name */
 	sfs->sfs_sb.sb_volname[sizeof(sfs->sfs_sb.sb_volname)-1] = 0;
 
+	/* Recover from the journal before reading anything else */
+	if (SFS_JOURNALED(sfs)) {
+		result = sfs_jmount(sfs);
+		if (result) {
+			buffer_invalidate(dev);
+			sfs->sfs_device = NULL;
+			sfs_fs_destroy(sfs);
+			return result;
+		}
+	}
+
 	/* Load free block bitmap */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_FREEMAPBITS(sfs));
-	if (sfs->sfs_freemap == NULL) {
+	sfs->sfs_freemapdirty = bitmap_create(SFS_FS_FREEMAPBLOCKS(sfs));
+	if (sfs->sfs_freemap == NULL || sfs->sfs_freemapdirty == NULL) {
+		buffer_invalidate(dev);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 	result = sfs_freemapio(sfs, UIO_READ);
 	if (result) {
+		buffer_invalidate(dev);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return result;
 	}
 
+	/* Load the inode bitmap, if it has one */
+	if (SFS_DENSE(sfs)) {
+		sfs->sfs_inomap = bitmap_create(
+			SFS_FREEMAPBITS(sfs->sfs_sb.sb_ninodes,
+					sfs->sfs_blocksize));
+		sfs->sfs_inomapdirty = bitmap_create(
+			SFS_INOMAPBLOCKS(sfs->sfs_sb.sb_ninodes,
+					 sfs->sfs_blocksize));
+		if (sfs->sfs_inomap == NULL || sfs->sfs_inomapdirty == NULL) {
+			buffer_invalidate(dev);
+			sfs->sfs_device = NULL;
+			sfs_fs_destroy(sfs);
+			return ENOMEM;
+		}
+		result = sfs_inomapio(sfs, UIO_READ);
+		if (result) {
+			buffer_invalidate(dev);
+			sfs->sfs_device = NULL;
+			sfs_fs_destroy(sfs);
+			return result;
+		}
+	}
+
 	/* Hand back the abstract fs */
 	*ret = &sfs->sfs_absfs;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -35,13 +35,112 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
+#include <thread.h>
+#include <current.h>
 #include <vfs.h>
+#include <buf.h>
+#include <namecache.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
 
+/*
+ * Return the disk block inode INO lives in. In the original format
+ * that's the inode number itself; in the dense format it's a block of
+ * the inode table.
+ */
+daddr_t
+sfs_inoblock(struct sfs_fs *sfs, uint32_t ino)
+{
+	if (SFS_DENSE(sfs)) {
+		return sfs->sfs_sb.sb_itablestart + ino / SFS_FS_INOPERBLOCK(sfs);
+	}
+	return ino;
+}
+
+/*
+ * Read an inode. A dense inode is the first SFS_DINODE_DENSESIZE
+ * bytes of struct sfs_dinode; the rest comes back zeroed.
+ */
+int
+sfs_readinode(struct sfs_fs *sfs, uint32_t ino, struct sfs_dinode *sfi)
+{
+	struct buf *buf;
+	int result;
+
+	if (!SFS_DENSE(sfs)) {
+		return sfs_readblock(sfs, ino, sfi, sizeof(*sfi));
+	}
+
+	result = buffer_read(sfs->sfs_device, sfs_inoblock(sfs, ino), &buf);
+	if (result) {
+		return result;
+	}
+	bzero(sfi, sizeof(*sfi));
+	memcpy(sfi, (char *)buffer_map(buf) +
+	       (ino % SFS_FS_INOPERBLOCK(sfs)) * SFS_DINODE_DENSESIZE,
+	       SFS_DINODE_DENSESIZE);
+	buffer_release(buf);
+	return 0;
+}
+
+/*
+ * Write an inode. In the dense format this updates the inode's slot
+ * in its table block and leaves the neighbors alone.
+ */
+static
+int
+sfs_writeinode(struct sfs_fs *sfs, uint32_t ino, struct sfs_dinode *sfi)
+{
+	struct buf *buf;
+	int result;
+
+	if (!SFS_DENSE(sfs)) {
+		return sfs_writeblock(sfs, ino, sfi, sizeof(*sfi));
+	}
+
+	result = buffer_read(sfs->sfs_device, sfs_inoblock(sfs, ino), &buf);
+	if (result) {
+		return result;
+	}
+	memcpy((char *)buffer_map(buf) +
+	       (ino % SFS_FS_INOPERBLOCK(sfs)) * SFS_DINODE_DENSESIZE,
+	       sfi, SFS_DINODE_DENSESIZE);
+	sfs_jdirty(sfs, buf);
+	buffer_release(buf);
+	return 0;
+}
+
+/*
+ * Take a vnode off the dirty list. Call with sfs_dirtylock held.
+ */
+static
+void
+sfs_undirty_inode(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_dirtylock));
+	KASSERT(sv->sv_dirty);
+
+	if (sv->sv_dirtyprev != NULL) {
+		sv->sv_dirtyprev->sv_dirtynext = sv->sv_dirtynext;
+	}
+	else {
+		KASSERT(sfs->sfs_dirtyvn == sv);
+		sfs->sfs_dirtyvn = sv->sv_dirtynext;
+	}
+	if (sv->sv_dirtynext != NULL) {
+		sv->sv_dirtynext->sv_dirtyprev = sv->sv_dirtyprev;
+	}
+	sv->sv_dirtynext = sv->sv_dirtyprev = NULL;
+	sv->sv_dirty = false;
+	KASSERT(sfs->sfs_ndirtyvn > 0);
+	sfs->sfs_ndirtyvn--;
+}
+
 /*
  * Write an on-disk inode structure back out to disk.
+ * Call with the vnode locked.
  */
 int
 sfs_sync_inode(struct sfs_vnode *sv)
@@ -49,19 +148,377 @@ sfs_sync_inode(struct sfs_vnode *sv)
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 	int result;
 
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
 	if (sv->sv_dirty) {
-		result = sfs_writeblock(sfs, sv->sv_ino, &sv->sv_i,
-					sizeof(sv->sv_i));
+		result = sfs_writeinode(sfs, sv->sv_ino, &sv->sv_i);
 		if (result) {
 			return result;
 		}
-		sv->sv_dirty = false;
+
+		lock_acquire(sfs->sfs_dirtylock);
+		sfs_undirty_inode(sfs, sv);
+		lock_release(sfs->sfs_dirtylock);
 	}
 	return 0;
 }
 
+/*
+ * Write every inode on the dirty list, without locking the vnodes.
+ * This is only safe while a journal commit is holding off every
+ * operation that could change them (see sfs_journal.c).
+ */
+int
+sfs_sync_dirtylist(struct sfs_fs *sfs)
+{
+	struct sfs_vnode *sv;
+	int result = 0;
+
+	lock_acquire(sfs->sfs_dirtylock);
+	while (sfs->sfs_dirtyvn != NULL) {
+		sv = sfs->sfs_dirtyvn;
+		result = sfs_writeinode(sfs, sv->sv_ino, &sv->sv_i);
+		if (result) {
+			break;
+		}
+		sfs_undirty_inode(sfs, sv);
+	}
+	lock_release(sfs->sfs_dirtylock);
+	return result;
+}
+
+/*
+ * Note that the in-memory inode has been changed, and put the vnode
+ * on the filesystem's dirty list if it isn't already. Call with the
+ * vnode locked.
+ */
+void
+sfs_dirty_inode(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+
+	if (sv->sv_dirty) {
+		return;
+	}
+
+	lock_acquire(sfs->sfs_dirtylock);
+	sv->sv_dirty = true;
+	sv->sv_dirtyprev = NULL;
+	sv->sv_dirtynext = sfs->sfs_dirtyvn;
+	if (sfs->sfs_dirtyvn != NULL) {
+		sfs->sfs_dirtyvn->sv_dirtyprev = sv;
+	}
+	sfs->sfs_dirtyvn = sv;
+	sfs->sfs_ndirtyvn++;
+	lock_release(sfs->sfs_dirtylock);
+}
+
+////////////////////////////////////////////////////////////
+// Vnode table
+//
+// Loaded vnodes live in sfs_vnodes, which sfs_sync_vnodes iterates
+// over, and are also hashed by inode number in sfs_vnhash for
+// lookup. Each vnode remembers its index in sfs_vnodes so it can be
+// removed by moving the last entry into its place. All of this is
+// protected by sfs_vnlock.
+
+static
+unsigned
+sfs_vnhash_chain(struct sfs_fs *sfs, uint32_t ino)
+{
+	return ino & (sfs->sfs_vnhashsize - 1);
+}
+
+/*
+ * Find a loaded vnode by inode number.
+ */
+static
+struct sfs_vnode *
+sfs_vntable_find(struct sfs_fs *sfs, uint32_t ino)
+{
+	struct sfs_vnode *sv;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	for (sv = sfs->sfs_vnhash[sfs_vnhash_chain(sfs, ino)];
+	     sv != NULL; sv = sv->sv_hashnext) {
+		if (sv->sv_ino == ino) {
+			return sv;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Double the number of hash chains. If we can't get the memory, keep
+ * the old table; lookups just get a bit slower.
+ */
+static
+void
+sfs_vnhash_grow(struct sfs_fs *sfs)
+{
+	struct sfs_vnode **newhash;
+	struct sfs_vnode *sv;
+	unsigned newsize, i, num;
+
+	newsize = sfs->sfs_vnhashsize * 2;
+	newhash = kmalloc(newsize * sizeof(struct sfs_vnode *));
+	if (newhash == NULL) {
+		return;
+	}
+	for (i=0; i<newsize; i++) {
+		newhash[i] = NULL;
+	}
+
+	kfree(sfs->sfs_vnhash);
+	sfs->sfs_vnhash = newhash;
+	sfs->sfs_vnhashsize = newsize;
+
+	num = vnodearray_num(sfs->sfs_vnodes);
+	for (i=0; i<num; i++) {
+		sv = vnodearray_get(sfs->sfs_vnodes, i)->vn_data;
+		sv->sv_hashnext = newhash[sfs_vnhash_chain(sfs, sv->sv_ino)];
+		newhash[sfs_vnhash_chain(sfs, sv->sv_ino)] = sv;
+	}
+}
+
+/*
+ * Add a vnode to the table.
+ */
+static
+int
+sfs_vntable_add(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	unsigned h;
+	int result;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_absvn,
+				&sv->sv_tableindex);
+	if (result) {
+		return result;
+	}
+
+	h = sfs_vnhash_chain(sfs, sv->sv_ino);
+	sv->sv_hashnext = sfs->sfs_vnhash[h];
+	sfs->sfs_vnhash[h] = sv;
+
+	/* Keep the chains short. */
+	if (vnodearray_num(sfs->sfs_vnodes) > 2 * sfs->sfs_vnhashsize) {
+		sfs_vnhash_grow(sfs);
+	}
+	return 0;
+}
+
+/*
+ * Remove a vnode from the table.
+ */
+static
+void
+sfs_vntable_remove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_vnode **svp;
+	struct vnode *last;
+	unsigned num;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	for (svp = &sfs->sfs_vnhash[sfs_vnhash_chain(sfs, sv->sv_ino)];
+	     *svp != NULL; svp = &(*svp)->sv_hashnext) {
+		if (*svp == sv) {
+			break;
+		}
+	}
+	num = vnodearray_num(sfs->sfs_vnodes);
+	if (*svp == NULL || sv->sv_tableindex >= num ||
+	    vnodearray_get(sfs->sfs_vnodes, sv->sv_tableindex) !=
+	    &sv->sv_absvn) {
+		panic("sfs: %s: reclaim vnode %u not in vnode pool\n",
+		      sfs->sfs_sb.sb_volname, sv->sv_ino);
+	}
+	*svp = sv->sv_hashnext;
+	sv->sv_hashnext = NULL;
+
+	/* Fill the hole with the last entry. */
+	last = vnodearray_get(sfs->sfs_vnodes, num - 1);
+	vnodearray_set(sfs->sfs_vnodes, sv->sv_tableindex, last);
+	((struct sfs_vnode *)last->vn_data)->sv_tableindex =
+		sv->sv_tableindex;
+	vnodearray_setsize(sfs->sfs_vnodes, num - 1);
+}
+
+////////////////////////////////////////////////////////////
+// Background freeing of removed files
+
+/*
+ * Freeing every block of a big file takes a while, and used to happen
+ * in sfs_reclaim, i.e. in the last close or the remove() of the file.
+ * Instead, when a removed file is bigger than SFS_TRUNCCHUNK blocks,
+ * sfs_reclaim writes its inode out with link count 0 and queues its
+ * inode number here; a thread then loads it again and cuts it down
+ * SFS_TRUNCCHUNK blocks at a time, each in its own transaction, and
+ * drops it, whereupon sfs_reclaim frees what's left. If the system
+ * goes down first, sfsck finds the inode unreferenced and frees it.
+ */
+struct sfs_orphan {
+	uint32_t so_ino;
+	struct sfs_orphan *so_next;
+};
+
+/*
+ * Should reclaiming SV (which has no links left) leave freeing its
+ * blocks to the background thread?
+ */
+static
+bool
+sfs_orphan_wanted(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	if (sv->sv_i.sfi_type != SFS_TYPE_FILE ||
+	    (sv->sv_i.sfi_flags & SFS_IFLAG_INLINE)) {
+		return false;
+	}
+	if (sv->sv_i.sfi_size <=
+	    (uint64_t)SFS_TRUNCCHUNK * sfs->sfs_blocksize) {
+		return false;
+	}
+	/* Not the thread doing the freeing, or it would never finish. */
+	return curthread != sfs->sfs_orphanthread;
+}
+
+/*
+ * Free the blocks of removed file INO, a chunk at a time, then drop
+ * it so sfs_reclaim discards the inode.
+ */
+static
+void
+sfs_orphan_free(struct sfs_fs *sfs, uint32_t ino)
+{
+	struct sfs_vnode *sv;
+	off_t chunk, size;
+	int result;
+
+	result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, &sv);
+	if (result) {
+		kprintf("sfs: %s: inode %u: cannot free blocks: %s\n",
+			sfs->sfs_sb.sb_volname, ino, strerror(result));
+		return;
+	}
+	KASSERT(sv->sv_i.sfi_linkcount == 0);
+
+	chunk = (off_t)SFS_TRUNCCHUNK * sfs->sfs_blocksize;
+	do {
+		sfs_jbegin(sfs);
+		lock_acquire(sv->sv_lock);
+		size = sv->sv_i.sfi_size;
+		size = size > chunk ? size - chunk : 0;
+		result = sfs_itrunc(sv, size);
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
+	} while (result == 0 && size > 0);
+
+	if (result) {
+		kprintf("sfs: %s: inode %u: freeing blocks: %s\n",
+			sfs->sfs_sb.sb_volname, ino, strerror(result));
+	}
+	VOP_DECREF(&sv->sv_absvn);
+}
+
+/*
+ * Free everything on the queue. Called with sfs_orphanlock held,
+ * after setting sfs_orphanbusy.
+ */
+static
+void
+sfs_orphan_run(struct sfs_fs *sfs)
+{
+	struct sfs_orphan *so;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_orphanlock));
+	KASSERT(sfs->sfs_orphanbusy);
+
+	sfs->sfs_orphanthread = curthread;
+	while (sfs->sfs_orphans != NULL) {
+		so = sfs->sfs_orphans;
+		sfs->sfs_orphans = so->so_next;
+		lock_release(sfs->sfs_orphanlock);
+
+		sfs_orphan_free(sfs, so->so_ino);
+		kfree(so);
+
+		lock_acquire(sfs->sfs_orphanlock);
+	}
+	sfs->sfs_orphanthread = NULL;
+	sfs->sfs_orphanbusy = false;
+	cv_broadcast(sfs->sfs_orphancv, sfs->sfs_orphanlock);
+}
+
+/*
+ * Thread that frees queued files. Exits when the queue is empty.
+ */
+static
+void
+sfs_orphan_thread(void *data, unsigned long junk)
+{
+	struct sfs_fs *sfs = data;
+
+	(void)junk;
+
+	lock_acquire(sfs->sfs_orphanlock);
+	sfs_orphan_run(sfs);
+	lock_release(sfs->sfs_orphanlock);
+}
+
+/*
+ * Queue a removed file, whose inode is on disk with link count 0, and
+ * start a thread to free it if one isn't running. If we can't start
+ * one, the file stays queued until the next try or sfs_orphan_drain.
+ */
+static
+void
+sfs_orphan_queue(struct sfs_fs *sfs, struct sfs_orphan *so)
+{
+	int result;
+
+	lock_acquire(sfs->sfs_orphanlock);
+	so->so_next = sfs->sfs_orphans;
+	sfs->sfs_orphans = so;
+	if (!sfs->sfs_orphanbusy) {
+		sfs->sfs_orphanbusy = true;
+		result = thread_fork("sfs_orphan", NULL, sfs_orphan_thread,
+				     sfs, 0);
+		if (result) {
+			sfs->sfs_orphanbusy = false;
+		}
+	}
+	lock_release(sfs->sfs_orphanlock);
+}
+
+/*
+ * Wait until every queued file has been freed, freeing any left over
+ * ourselves. Used at unmount.
+ */
+void
+sfs_orphan_drain(struct sfs_fs *sfs)
+{
+	lock_acquire(sfs->sfs_orphanlock);
+	while (sfs->sfs_orphanbusy) {
+		cv_wait(sfs->sfs_orphancv, sfs->sfs_orphanlock);
+	}
+	if (sfs->sfs_orphans != NULL) {
+		sfs->sfs_orphanbusy = true;
+		sfs_orphan_run(sfs);
+	}
+	lock_release(sfs->sfs_orphanlock);
+}
+
+////////////////////////////////////////////////////////////
+// Vnode lifecycle
+
 /*
  * Called when the vnode refcount (in-memory usage count) hits zero.
+ * Call with no SFS locks held, other than (from the name cache) a
+ * directory's sv_lock; that's why this uses sfs_jjoin.
  *
  * This function should try to avoid returning errors other than EBUSY.
  */
@@ -70,15 +527,19 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
+	struct sfs_orphan *so;
+	uint32_t ino;
 	int result;
 
-	vfs_biglock_acquire();
+	sfs_jjoin(sfs);
+	lock_acquire(sv->sv_lock);
+	lock_acquire(sfs->sfs_vnlock);
 
 	/*
 	 * Make sure someone else hasn't picked up the vnode since the
-	 * decision was made to reclaim it. (You must also synchronize
-	 * this with sfs_loadvnode.)
+	 * decision was made to reclaim it. Holding sfs_vnlock keeps
+	 * sfs_loadvnode from handing out new references while we
+	 * look, and while we take the vnode out of the table.
 	 */
 	spinlock_acquire(&v->vn_countlock);
 	if (v->vn_refcount != 1) {
@@ -88,122 +549,155 @@ sfs_reclaim(struct vnode *v)
 		v->vn_refcount--;
 
 		spinlock_release(&v->vn_countlock);
-		vfs_biglock_release();
+		lock_release(sfs->sfs_vnlock);
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return EBUSY;
 	}
 	spinlock_release(&v->vn_countlock);
 
-	/* If there are no on-disk references to the file either, erase it. */
+	/*
+	 * If there are no on-disk references to the file either, erase
+	 * it: now, or if it's big, in the background once it's gone
+	 * from the table (see above).
+	 */
+	so = NULL;
 	if (sv->sv_i.sfi_linkcount == 0) {
-		result = sfs_itrunc(sv, 0);
-		if (result) {
-			vfs_biglock_release();
-			return result;
+		if (sfs_orphan_wanted(sfs, sv)) {
+			so = kmalloc(sizeof(*so));
+		}
+		if (so == NULL) {
+			result = sfs_itrunc(sv, 0);
+			if (result) {
+				lock_release(sfs->sfs_vnlock);
+				lock_release(sv->sv_lock);
+				sfs_jend(sfs);
+				return result;
+			}
 		}
 	}
 
 	/* Sync the inode to disk */
 	result = sfs_sync_inode(sv);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sfs->sfs_vnlock);
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
+		kfree(so);
 		return result;
 	}
 
 	/* If there are no on-disk references, discard the inode */
-	if (sv->sv_i.sfi_linkcount==0) {
-		sfs_bfree(sfs, sv->sv_ino);
+	if (sv->sv_i.sfi_linkcount==0 && so == NULL) {
+		sfs_ifree(sfs, sv->sv_ino);
 	}
 
 	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
-		}
-	}
-	if (ix == num) {
-		panic("sfs: %s: reclaim vnode %u not in vnode pool\n",
-		      sfs->sfs_sb.sb_volname, sv->sv_ino);
+	KASSERT(!sv->sv_dirty);
+	sfs_vntable_remove(sfs, sv);
+
+	lock_release(sfs->sfs_vnlock);
+
+	/* Nobody else can find it now. */
+	lock_release(sv->sv_lock);
+	lock_destroy(sv->sv_lock);
+
+	/*
+	 * Forget any names cached in it, now that no more can be
+	 * entered, before the memory is reused.
+	 */
+	if (sv->sv_i.sfi_type == SFS_TYPE_DIR) {
+		namecache_purgedir(v);
 	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
+	sfs_dir_dropindex(sv);
 
 	vnode_cleanup(&sv->sv_absvn);
 
-	vfs_biglock_release();
-
 	/* Release the storage for the vnode structure itself. */
+	ino = sv->sv_ino;
 	kfree(sv);
 
+	sfs_jend(sfs);
+
+	if (so != NULL) {
+		so->so_ino = ino;
+		sfs_orphan_queue(sfs, so);
+	}
+
 	/* Done */
 	return 0;
 }
 
 /*
  * Function to load a inode into memory as a vnode, or dig up one
- * that's already resident.
+ * that's already resident. Takes sfs_vnlock, so the caller may hold
+ * a directory's sv_lock but not that of any file.
  */
 int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
 	struct sfs_vnode *sv;
 	const struct vnode_ops *ops;
-	unsigned i, num;
 	int result;
 
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
-
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
+	lock_acquire(sfs->sfs_vnlock);
 
-		/* Every inode in memory must be in an allocated block */
-		if (!sfs_bused(sfs, sv->sv_ino)) {
-			panic("sfs: %s: Found inode %u in unallocated block\n",
+	/* Look in the vnodes table */
+	sv = sfs_vntable_find(sfs, ino);
+	if (sv != NULL) {
+		/* Every inode in memory must be allocated */
+		if (!sfs_iused(sfs, sv->sv_ino)) {
+			panic("sfs: %s: Found unallocated inode %u\n",
 			      sfs->sfs_sb.sb_volname, sv->sv_ino);
 		}
 
-		if (sv->sv_ino==ino) {
-			/* Found */
-
-			/* forcetype is only allowed when creating objects */
-			KASSERT(forcetype==SFS_TYPE_INVAL);
+		/* forcetype is only allowed when creating objects */
+		KASSERT(forcetype==SFS_TYPE_INVAL);
 
-			VOP_INCREF(&sv->sv_absvn);
-			*ret = sv;
-			return 0;
-		}
+		VOP_INCREF(&sv->sv_absvn);
+		lock_release(sfs->sfs_vnlock);
+		*ret = sv;
+		return 0;
 	}
 
 	/* Didn't have it loaded; load it */
 
 	sv = kmalloc(sizeof(struct sfs_vnode));
 	if (sv==NULL) {
+		lock_release(sfs->sfs_vnlock);
 		return ENOMEM;
 	}
 
-	/* Must be in an allocated block */
-	if (!sfs_bused(sfs, ino)) {
-		panic("sfs: %s: Tried to load inode %u from "
-		      "unallocated block\n", sfs->sfs_sb.sb_volname, ino);
+	/* Must be allocated */
+	if (!sfs_iused(sfs, ino)) {
+		panic("sfs: %s: Tried to load unallocated inode %u\n",
+		      sfs->sfs_sb.sb_volname, ino);
 	}
 
-	/* Read the block the inode is in */
-	result = sfs_readblock(sfs, ino, &sv->sv_i, sizeof(sv->sv_i));
+	/* Read the inode */
+	result = sfs_readinode(sfs, ino, &sv->sv_i);
 	if (result) {
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
 	/* Not dirty yet */
 	sv->sv_dirty = false;
+	sv->sv_dirtynext = sv->sv_dirtyprev = NULL;
+
+	/* No reads yet */
+	sv->sv_ranext = 0;
+	sv->sv_rawindow = 0;
+	sv->sv_raend = 0;
+
+	/* No indirect lookups yet */
+	sv->sv_idcachebase = 0;
+	sv->sv_idcacheblock = 0;
+
+	/* No directory index yet */
+	sv->sv_dirindex = NULL;
 
 	/*
 	 * FORCETYPE is set if we're creating a new file, because the
@@ -213,7 +707,11 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	if (forcetype != SFS_TYPE_INVAL) {
 		KASSERT(sv->sv_i.sfi_type == SFS_TYPE_INVAL);
 		sv->sv_i.sfi_type = forcetype;
-		sv->sv_dirty = true;
+		/* new files start out with their (no) data inline */
+		if (forcetype == SFS_TYPE_FILE && SFS_INLINEOK(sfs)) {
+			sv->sv_i.sfi_flags = SFS_IFLAG_INLINE;
+		}
+		/* marked dirty below, once it's a proper vnode */
 	}
 
 	/*
@@ -232,10 +730,19 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		      ino, sv->sv_i.sfi_type);
 	}
 
+	sv->sv_lock = lock_create("sfs_vnode");
+	if (sv->sv_lock == NULL) {
+		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
+		return ENOMEM;
+	}
+
 	/* Call the common vnode initializer */
 	result = vnode_init(&sv->sv_absvn, ops, &sfs->sfs_absfs, sv);
 	if (result) {
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
@@ -243,13 +750,21 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	sv->sv_ino = ino;
 
 	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_absvn, NULL);
+	result = sfs_vntable_add(sfs, sv);
 	if (result) {
 		vnode_cleanup(&sv->sv_absvn);
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
+	if (forcetype != SFS_TYPE_INVAL) {
+		sfs_dirty_inode(sv);
+	}
+
+	lock_release(sfs->sfs_vnlock);
+
 	/* Hand it back */
 	*ret = sv;
 	return 0;
@@ -265,11 +780,12 @@ sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
 	int result;
 
 	/*
-	 * First, get an inode. (Each inode is a block, and the inode
-	 * number is the block number, so just get a block.)
+	 * First, get an inode. (In the original format each inode is
+	 * a block, and the inode number is the block number; in the
+	 * dense format it's a slot in the inode table.)
 	 */
 
-	result = sfs_balloc(sfs, &ino);
+	result = sfs_ialloc(sfs, &ino);
 	if (result) {
 		return result;
 	}
@@ -280,14 +796,14 @@ sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
 
 	result = sfs_loadvnode(sfs, ino, type, ret);
 	if (result) {
-		sfs_bfree(sfs, ino);
+		sfs_ifree(sfs, ino);
 	}
 	return result;
 }
 
 /*
  * Get vnode for the root of the filesystem.
- * The root vnode is always found in block 1 (SFS_ROOTDIR_INO).
+ * The root vnode is always inode 1 (SFS_ROOTDIR_INO).
  */
 int
 sfs_getroot(struct fs *fs, struct vnode **ret)
@@ -296,25 +812,20 @@ sfs_getroot(struct fs *fs, struct vnode **ret)
 	struct sfs_vnode *sv;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = sfs_loadvnode(sfs, SFS_ROOTDIR_INO, SFS_TYPE_INVAL, &sv);
 	if (result) {
 		kprintf("sfs: %s: getroot: Cannot load root vnode\n",
 			sfs->sfs_sb.sb_volname);
-		vfs_biglock_release();
 		return result;
 	}
 
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
 		kprintf("sfs: %s: getroot: not directory (type %u)\n",
 			sfs->sfs_sb.sb_volname, sv->sv_i.sfi_type);
-		vfs_biglock_release();
+		VOP_DECREF(&sv->sv_absvn);
 		return EINVAL;
 	}
 
-	vfs_biglock_release();
-
 	*ret = &sv->sv_absvn;
 	return 0;
 }
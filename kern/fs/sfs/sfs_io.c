@@ -37,7 +37,7 @@
 #include <lib.h>
 #include <uio.h>
 #include <vfs.h>
-#include <device.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -46,6 +46,11 @@
 // Basic block-level I/O routines
 
 /*
+ * These copy the first LEN bytes of a block (normally the whole block)
+ * in and out of the buffer cache. Code that only needs some other
+ * part of a block, or that wants to modify a block in place, should
+ * use buffer_read/buffer_get directly instead.
+ *
  * Note: sfs_readblock is used to read the superblock
  * early in mount, before sfs is fully (or even mostly)
  * initialized, and so may not use anything from sfs
@@ -53,82 +58,56 @@
  */
 
 /*
- * Read or write a block, retrying I/O errors.
+ * Read a block.
  */
-static
 int
-sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
+sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 {
+	struct buf *buf;
 	int result;
-	int tries=0;
 
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(len >= SFS_BLOCKSIZE && len <= SFS_MAXBLOCKSIZE);
 
-	DEBUG(DB_SFS, "sfs: %s %llu\n",
-	      uio->uio_rw == UIO_READ ? "read" : "write",
-	      uio->uio_offset / SFS_BLOCKSIZE);
+	DEBUG(DB_SFS, "sfs: read %u\n", block);
 
- retry:
-	result = DEVOP_IO(sfs->sfs_device, uio);
-	if (result == EINVAL) {
-		/*
-		 * This means the sector we requested was out of range,
-		 * or the seek address we gave wasn't sector-aligned,
-		 * or a couple of other things that are our fault.
-		 */
-		panic("sfs: %s: DEVOP_IO returned EINVAL\n",
-		      sfs->sfs_sb.sb_volname);
-	}
-	if (result == EIO) {
-		if (tries == 0) {
-			tries++;
-			kprintf("sfs: %s: block %llu I/O error, retrying\n",
-				sfs->sfs_sb.sb_volname,
-				uio->uio_offset / SFS_BLOCKSIZE);
-			goto retry;
-		}
-		else if (tries < 10) {
-			tries++;
-			goto retry;
-		}
-		else {
-			kprintf("sfs: %s: block %llu I/O error, giving up "
-				"after %d retries\n",
-				sfs->sfs_sb.sb_volname,
-				uio->uio_offset / SFS_BLOCKSIZE, tries);
-		}
+	result = buffer_read(sfs->sfs_device, block, &buf);
+	if (result) {
+		return result;
 	}
-	return result;
-}
-
-/*
- * Read a block.
- */
-int
-sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
-{
-	struct iovec iov;
-	struct uio ku;
-
-	KASSERT(len == SFS_BLOCKSIZE);
-
-	SFSUIO(&iov, &ku, data, block, UIO_READ);
-	return sfs_rwblock(sfs, &ku);
+	memcpy(data, buffer_map(buf), len);
+	buffer_release(buf);
+	return 0;
 }
 
 /*
- * Write a block.
+ * Write a block. This only updates the buffer cache; the block goes
+ * to disk when the buffer is evicted or the filesystem is synced. If
+ * LEN is less than the block size the rest of the block is kept.
+ * Only used for metadata, so with a journal the buffer is pinned.
  */
 int
 sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 {
-	struct iovec iov;
-	struct uio ku;
+	struct buf *buf;
+	int result;
 
-	KASSERT(len == SFS_BLOCKSIZE);
+	KASSERT(len >= SFS_BLOCKSIZE && len <= sfs->sfs_blocksize);
 
-	SFSUIO(&iov, &ku, data, block, UIO_WRITE);
-	return sfs_rwblock(sfs, &ku);
+	DEBUG(DB_SFS, "sfs: write %u\n", block);
+
+	if (len < sfs->sfs_blocksize) {
+		result = buffer_read(sfs->sfs_device, block, &buf);
+	}
+	else {
+		result = buffer_get(sfs->sfs_device, block, &buf);
+	}
+	if (result) {
+		return result;
+	}
+	memcpy(buffer_map(buf), data, len);
+	sfs_jdirty(sfs, buf);
+	buffer_release(buf);
+	return 0;
 }
 
 ////////////////////////////////////////////////////////////
@@ -150,16 +129,8 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *iobuf;
 	daddr_t diskblock;
 	uint32_t fileblock;
 	int result;
@@ -167,16 +138,13 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	/* Allocate missing blocks if and only if we're writing */
 	bool doalloc = (uio->uio_rw==UIO_WRITE);
 
-	KASSERT(skipstart + len <= SFS_BLOCKSIZE);
-
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(skipstart + len <= sfs->sfs_blocksize);
 
 	/* Compute the block offset of this block in the file */
-	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
+	fileblock = uio->uio_offset / sfs->sfs_blocksize;
 
 	/* Get the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+	result = sfs_bmap(sv, fileblock, doalloc, NULL, &diskblock);
 	if (result) {
 		return result;
 	}
@@ -184,64 +152,75 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * Read zeros.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
+		return uiomovezeros(len, uio);
 	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_readblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
-		}
+
+	/*
+	 * Get the block from the buffer cache.
+	 */
+	result = buffer_read(sfs->sfs_device, diskblock, &iobuf);
+	if (result) {
+		return result;
 	}
 
 	/*
 	 * Now perform the requested operation into/out of the buffer.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
+	result = uiomove((char *)buffer_map(iobuf)+skipstart, len, uio);
 	if (result) {
+		buffer_release(iobuf);
 		return result;
 	}
 
 	/*
-	 * If it was a write, write back the modified block.
+	 * If it was a write, the buffer now needs writing back.
 	 */
 	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_writeblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
-		}
+		buffer_mark_dirty(iobuf);
 	}
 
+	buffer_release(iobuf);
 	return 0;
 }
 
 /*
- * Do I/O (either read or write) of a single whole block.
+ * Do I/O of whole blocks, at most MAXBLOCKS of them, and return the
+ * number done in *DONE.
+ *
+ * A read takes as many of the blocks as lie in one contiguous run on
+ * disk and gets them from the buffer cache together, so any that
+ * aren't cached are read in one device request. A write does one
+ * block; dirty blocks that end up adjacent on disk are clustered by
+ * the buffer cache when they are written back.
  */
 static
 int
-sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
+sfs_blockio(struct sfs_vnode *sv, struct uio *uio, uint32_t maxblocks,
+	    uint32_t *done)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
-	daddr_t diskblock;
-	uint32_t fileblock;
+	struct buf *iobufs[BUFFER_MAXCLUSTER];
+	daddr_t diskblock, nextblock;
+	uint32_t fileblock, n, i;
 	int result;
 	bool doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
+	bool fresh;
+
+	KASSERT(maxblocks > 0);
+	*done = 0;
 
 	/* Get the block number within the file */
-	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
+	fileblock = uio->uio_offset / sfs->sfs_blocksize;
 
-	/* Look up the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+	/*
+	 * Look up the disk block number. When writing, we overwrite
+	 * the whole block, so a new block needn't be zeroed first.
+	 */
+	result = sfs_bmap(sv, fileblock, doalloc, doalloc ? &fresh : NULL,
+			  &diskblock);
 	if (result) {
 		return result;
 	}
@@ -254,49 +233,166 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 		 * allocated a block for us.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		return uiomovezeros(SFS_BLOCKSIZE, uio);
+		result = uiomovezeros(sfs->sfs_blocksize, uio);
+		if (result == 0) {
+			*done = 1;
+		}
+		return result;
 	}
 
-	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
-	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
-
-	/*
-	 * Temporarily set the residue to be one block size.
-	 */
-	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
+	if (uio->uio_rw == UIO_WRITE) {
+		/*
+		 * The whole block is about to be overwritten, so
+		 * don't bother reading it first.
+		 */
+		result = buffer_get(sfs->sfs_device, diskblock, &iobufs[0]);
+		if (result) {
+			return result;
+		}
+		result = uiomove(buffer_map(iobufs[0]), sfs->sfs_blocksize,
+				 uio);
+		if (result == 0) {
+			buffer_mark_dirty(iobufs[0]);
+			*done = 1;
+		}
+		else if (fresh) {
+			/* Don't leave whatever was on disk there. */
+			bzero(buffer_map(iobufs[0]), sfs->sfs_blocksize);
+			buffer_mark_dirty(iobufs[0]);
+		}
+		else {
+			/*
+			 * The buffer may now hold neither the old
+			 * contents nor the new; don't let reads see it.
+			 */
+			buffer_release_failed(iobufs[0]);
+			return result;
+		}
+		buffer_release(iobufs[0]);
+		return result;
+	}
 
-	result = sfs_rwblock(sfs, uio);
+	/* Find how far the run of disk blocks goes. */
+	if (maxblocks > BUFFER_MAXCLUSTER) {
+		maxblocks = BUFFER_MAXCLUSTER;
+	}
+	for (n=1; n<maxblocks; n++) {
+		result = sfs_bmap(sv, fileblock + n, false, NULL, &nextblock);
+		if (result) {
+			return result;
+		}
+		if (nextblock != diskblock + n) {
+			break;
+		}
+	}
 
-	/*
-	 * Now, restore the original uio_offset and uio_resid and update
-	 * them by the amount of I/O done.
-	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
+	result = buffer_readcluster(sfs->sfs_device, diskblock, n, iobufs, &n);
+	if (result) {
+		return result;
+	}
 
+	for (i=0; i<n && result == 0; i++) {
+		result = uiomove(buffer_map(iobufs[i]), sfs->sfs_blocksize,
+				 uio);
+	}
+	for (i=0; i<n; i++) {
+		buffer_release(iobufs[i]);
+	}
+	if (result == 0) {
+		*done = n;
+	}
 	return result;
 }
 
+/*
+ * Readahead. Called after a successful read of file blocks FIRSTBLOCK
+ * through LASTBLOCK.
+ *
+ * A read is sequential if it starts where the last one left off, or
+ * in the block the last one ended in. Each sequential read doubles
+ * the readahead window (up to SFS_RAMAX); anything else shuts
+ * readahead off until the reads become sequential again. We then
+ * ask the buffer cache to fetch, in the background, whatever part of
+ * the window past LASTBLOCK hasn't been asked for already.
+ */
+static
+void
+sfs_readahead(struct sfs_vnode *sv, uint32_t firstblock, uint32_t lastblock)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t fileblocks, block, endblock;
+	daddr_t diskblock, runstart;
+	uint32_t runlen;
+
+	if (firstblock == sv->sv_ranext || firstblock + 1 == sv->sv_ranext) {
+		if (sv->sv_rawindow == 0) {
+			sv->sv_rawindow = SFS_RAMIN;
+		}
+		else if (sv->sv_rawindow < SFS_RAMAX) {
+			sv->sv_rawindow *= 2;
+		}
+	}
+	else {
+		sv->sv_rawindow = 0;
+		sv->sv_raend = 0;
+	}
+	sv->sv_ranext = lastblock + 1;
+
+	if (sv->sv_rawindow == 0) {
+		return;
+	}
+
+	/* Don't go past EOF. */
+	fileblocks = DIVROUNDUP((off_t)sv->sv_i.sfi_size, sfs->sfs_blocksize);
+	endblock = lastblock + 1 + sv->sv_rawindow;
+	if (endblock > fileblocks) {
+		endblock = fileblocks;
+	}
+
+	/* Collect the blocks into runs that are contiguous on disk. */
+	runstart = 0;
+	runlen = 0;
+	block = sv->sv_raend > lastblock ? sv->sv_raend : lastblock + 1;
+	for (; block < endblock; block++) {
+		if (sfs_bmap(sv, block, false, NULL, &diskblock)) {
+			break;
+		}
+		if (runlen > 0 &&
+		    (diskblock != runstart + runlen ||
+		     runlen == BUFFER_MAXCLUSTER)) {
+			buffer_prefetch(sfs->sfs_device, runstart, runlen);
+			runlen = 0;
+		}
+		if (diskblock != 0) {
+			if (runlen == 0) {
+				runstart = diskblock;
+			}
+			runlen++;
+		}
+	}
+	if (runlen > 0) {
+		buffer_prefetch(sfs->sfs_device, runstart, runlen);
+	}
+	if (block > sv->sv_raend) {
+		sv->sv_raend = block;
+	}
+}
+
 /*
  * Do I/O of a whole region of data, whether or not it's block-aligned.
  */
 int
 sfs_io(struct sfs_vnode *sv, struct uio *uio)
 {
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 	uint32_t blkoff;
-	uint32_t nblocks, i;
+	uint32_t nblocks, done;
 	int result = 0;
 	uint32_t origresid, extraresid = 0;
+	off_t origoffset;
 
 	origresid = uio->uio_resid;
+	origoffset = uio->uio_offset;
 
 	/*
 	 * If reading, check for EOF. If we can read a partial area,
@@ -319,16 +415,48 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 		}
 	}
 
+	/*
+	 * The size field is 32 bits. With big blocks the indirect
+	 * blocks can map more than that, so check here rather than
+	 * counting on sfs_bmap to fail.
+	 */
+	if (uio->uio_rw == UIO_WRITE &&
+	    uio->uio_offset + uio->uio_resid > (off_t)SFS_MAXFILESIZE) {
+		return EFBIG;
+	}
+
+	/*
+	 * A small file's contents are in the inode. A write that would
+	 * take it past what fits there moves the data out to a block
+	 * first, and then proceeds as usual.
+	 */
+	if (sv->sv_i.sfi_flags & SFS_IFLAG_INLINE) {
+		if (uio->uio_rw == UIO_READ ||
+		    uio->uio_offset + uio->uio_resid <= SFS_INLINEMAX(sfs)) {
+			result = uiomove(sv->sv_i.sfi_inline + uio->uio_offset,
+					 uio->uio_resid, uio);
+			if (uio->uio_rw == UIO_WRITE &&
+			    uio->uio_resid != origresid) {
+				sfs_dirty_inode(sv);
+			}
+			goto out;
+		}
+		result = sfs_inline_evict(sv);
+		if (result) {
+			goto out;
+		}
+	}
+
 	/*
 	 * First, do any leading partial block.
 	 */
-	blkoff = uio->uio_offset % SFS_BLOCKSIZE;
+	blkoff = uio->uio_offset % sfs->sfs_blocksize;
 	if (blkoff != 0) {
 		/* Number of bytes at beginning of block to skip */
 		uint32_t skip = blkoff;
 
 		/* Number of bytes to read/write after that point */
-		uint32_t len = SFS_BLOCKSIZE - blkoff;
+		uint32_t len = sfs->sfs_blocksize - blkoff;
 
 		/* ...which might be less than the rest of the block */
 		if (len > uio->uio_resid) {
@@ -350,19 +478,24 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	/*
 	 * Now we should be block-aligned. Do the remaining whole blocks.
 	 */
-	KASSERT(uio->uio_offset % SFS_BLOCKSIZE == 0);
-	nblocks = uio->uio_resid / SFS_BLOCKSIZE;
-	for (i=0; i<nblocks; i++) {
-		result = sfs_blockio(sv, uio);
+	KASSERT(uio->uio_offset % sfs->sfs_blocksize == 0);
+	nblocks = uio->uio_resid / sfs->sfs_blocksize;
+	while (nblocks > 0) {
+		if (uio->uio_rw == UIO_WRITE) {
+			/* Don't let one big write fill the cache. */
+			buffer_throttle();
+		}
+		result = sfs_blockio(sv, uio, nblocks, &done);
 		if (result) {
 			goto out;
 		}
+		nblocks -= done;
 	}
 
 	/*
 	 * Now do any remaining partial block at the end.
 	 */
-	KASSERT(uio->uio_resid < SFS_BLOCKSIZE);
+	KASSERT(uio->uio_resid < sfs->sfs_blocksize);
 
 	if (uio->uio_resid > 0) {
 		result = sfs_partialio(sv, uio, 0, uio->uio_resid);
@@ -378,7 +511,16 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	    uio->uio_rw == UIO_WRITE &&
 	    uio->uio_offset > (off_t)sv->sv_i.sfi_size) {
 		sv->sv_i.sfi_size = uio->uio_offset;
-		sv->sv_dirty = true;
+		sfs_dirty_inode(sv);
+	}
+
+	/* If reading and we did anything, consider reading ahead */
+	if (uio->uio_resid != origresid &&
+	    uio->uio_rw == UIO_READ &&
+	    (sv->sv_i.sfi_flags & SFS_IFLAG_INLINE) == 0 &&
+	    result == 0) {
+		sfs_readahead(sv, origoffset / sfs->sfs_blocksize,
+			      (uio->uio_offset - 1) / sfs->sfs_blocksize);
 	}
 
 	/* Add in any extra amount we couldn't read because of EOF */
@@ -397,16 +539,17 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
  * handled are smaller than whole blocks, do not cross block
  * boundaries, and originate in the kernel.
  *
- * It is separate from sfs_partialio because, although there is no
- * such code in this version of SFS, it is often desirable when doing
- * more advanced things to handle metadata and user data I/O
- * differently.
+ * It is separate from sfs_partialio because metadata and user data
+ * are handled differently: with a journal, blocks written here are
+ * pinned until the next commit, while file data is written in place.
  */
 int
 sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	   enum uio_rw rw)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *iobuf;
+	char *ioptr;
 	off_t endpos;
 	uint32_t vnblock;
 	uint32_t blockoffset;
@@ -414,25 +557,13 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	bool doalloc;
 	int result;
 
-	/*
-	 * I/O buffer for metadata ops.
-	 *
-	 * Note: in real life (and when you've done the fs assignment) you
-	 * would get space from the disk buffer cache for this, not use a
-	 * static area.
-	 */
-	static char metaiobuf[SFS_BLOCKSIZE];
-
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
-
 	/* Figure out which block of the vnode (directory, whatever) this is */
-	vnblock = actualpos / SFS_BLOCKSIZE;
-	blockoffset = actualpos % SFS_BLOCKSIZE;
+	vnblock = actualpos / sfs->sfs_blocksize;
+	blockoffset = actualpos % sfs->sfs_blocksize;
 
 	/* Get the disk block number */
 	doalloc = (rw == UIO_WRITE);
-	result = sfs_bmap(sv, vnblock, doalloc, &diskblock);
+	result = sfs_bmap(sv, vnblock, doalloc, NULL, &diskblock);
 	if (result) {
 		return result;
 	}
@@ -446,35 +577,32 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 		return 0;
 	}
 
-	/* Read the block */
-	result = sfs_readblock(sfs, diskblock, metaiobuf, sizeof(metaiobuf));
+	/* Get the block */
+	result = buffer_read(sfs->sfs_device, diskblock, &iobuf);
 	if (result) {
 		return result;
 	}
+	ioptr = buffer_map(iobuf);
 
 	if (rw == UIO_READ) {
 		/* Copy out the selected region */
-		memcpy(data, metaiobuf + blockoffset, len);
+		memcpy(data, ioptr + blockoffset, len);
 	}
 	else {
 		/* Update the selected region */
-		memcpy(metaiobuf + blockoffset, data, len);
-
-		/* Write the block back */
-		result = sfs_writeblock(sfs, diskblock,
-					metaiobuf, sizeof(metaiobuf));
-		if (result) {
-			return result;
-		}
+		memcpy(ioptr + blockoffset, data, len);
+		sfs_jdirty(sfs, iobuf);
 
 		/* Update the vnode size if needed */
 		endpos = actualpos + len;
 		if (endpos > (off_t)sv->sv_i.sfi_size) {
 			sv->sv_i.sfi_size = endpos;
-			sv->sv_dirty = true;
+			sfs_dirty_inode(sv);
 		}
 	}
 
+	buffer_release(iobuf);
+
 	/* Done */
 	return 0;
 }
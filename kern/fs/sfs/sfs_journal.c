@@ -0,0 +1,556 @@
+/*
+ * SFS filesystem
+ *
+ * Metadata journal.
+ *
+ * On a volume with a journal (see kern/sfs.h for the layout), changes
+ * to metadata - inodes, directories, indirect blocks, the bitmaps,
+ * and the superblock - are made in pinned buffers (sfs_jdirty), which
+ * the buffer cache won't write back on its own. Every so often (from
+ * the syncer, on fsync or sync, or when the running transaction has
+ * grown past SFS_JTARGET blocks) everything changed since the last
+ * time is committed at once:
+ *
+ *   1. Wait for operations in progress to finish, and hold off new
+ *      ones.
+ *   2. Write back file data, so committed metadata never points at
+ *      blocks that haven't been written yet.
+ *   3. Put the dirty inodes, bitmap blocks, and superblock in the
+ *      buffer cache (pinned).
+ *   4. Copy each pinned block into the log and write the log out.
+ *   5. Write the header, listing where the log blocks belong. Once
+ *      it's on disk the transaction is committed.
+ *   6. Unpin the buffers and write them back in place.
+ *   7. Mark the header clean.
+ *
+ * So at most one transaction is ever waiting to be recovered, and
+ * mount (sfs_jmount) only has to copy the blocks listed in the header
+ * into place. Because one commit covers every operation since the
+ * last, an fsync that comes along while a commit is going on just
+ * waits for it.
+ *
+ * Operations that change metadata run between sfs_jbegin and
+ * sfs_jend, so a commit never sees one half done. sfs_jbegin is
+ * called before taking any SFS locks, and may wait for a commit or
+ * start one. sfs_reclaim can be called with a directory locked (when
+ * the name cache lets go of a vnode), so it uses sfs_jjoin, which
+ * never starts a commit and only waits once the commit has stopped
+ * waiting for operations; after that point the commit doesn't need
+ * any vnode locks.
+ *
+ * A transaction too big for the journal is written in place instead,
+ * with the header marked unsafe until it's done, so that sfsck knows
+ * to do a full check if we crash in the middle.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <buf.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+/* Journal header block, and the first log block */
+#define SFS_JHEADER(sfs) ((sfs)->sfs_sb.sb_journalstart)
+#define SFS_JLOG(sfs)    ((sfs)->sfs_sb.sb_journalstart + 1)
+
+/*
+ * Return the most blocks a transaction can have.
+ */
+static
+unsigned
+sfs_jcapacity(struct sfs_fs *sfs)
+{
+	if (sfs->sfs_sb.sb_journalblocks - 1 < SFS_JMAXBLOCKS) {
+		return sfs->sfs_sb.sb_journalblocks - 1;
+	}
+	return SFS_JMAXBLOCKS;
+}
+
+/*
+ * Return roughly how many blocks the running transaction has changed
+ * so far. Zero means nothing at all.
+ */
+static
+unsigned
+sfs_jpending(struct sfs_fs *sfs)
+{
+	unsigned pending;
+
+	pending = buffer_getpinned(sfs->sfs_device, NULL, 0);
+	lock_acquire(sfs->sfs_dirtylock);
+	pending += sfs->sfs_ndirtyvn;
+	lock_release(sfs->sfs_dirtylock);
+	lock_acquire(sfs->sfs_freemaplock);
+	pending += sfs->sfs_mapdirtycount + sfs->sfs_nfreed;
+	if (sfs->sfs_superdirty) {
+		pending++;
+	}
+	lock_release(sfs->sfs_freemaplock);
+	return pending;
+}
+
+/*
+ * Add a block to a checksum (see kern/sfs.h).
+ */
+static
+uint32_t
+sfs_jsum(uint32_t sum, const void *block, size_t len)
+{
+	const uint32_t *words = block;
+	size_t i;
+
+	for (i=0; i<len/sizeof(uint32_t); i++) {
+		sum = ((sum << 1) | (sum >> 31)) ^ words[i];
+	}
+	return sum;
+}
+
+/*
+ * Write the header in sfs_jhead to disk, and wait for it.
+ */
+static
+int
+sfs_jwriteheader(struct sfs_fs *sfs)
+{
+	struct buf *buf;
+	int result;
+
+	result = buffer_get(sfs->sfs_device, SFS_JHEADER(sfs), &buf);
+	if (result) {
+		return result;
+	}
+	bzero(buffer_map(buf), sfs->sfs_blocksize);
+	memcpy(buffer_map(buf), sfs->sfs_jhead, sizeof(*sfs->sfs_jhead));
+	buffer_mark_dirty(buf);
+	buffer_release(buf);
+
+	return buffer_syncblock(sfs->sfs_device, SFS_JHEADER(sfs));
+}
+
+/*
+ * Write a header with no transaction in it: clean, unless the volume
+ * is already known to need checking, in which case leave it that way.
+ * SEQ is the number for the next transaction.
+ */
+static
+int
+sfs_jclean(struct sfs_fs *sfs, uint32_t seq)
+{
+	struct sfs_jheader *jh = sfs->sfs_jhead;
+
+	bzero(jh, sizeof(*jh));
+	jh->jh_magic = SFS_JMAGIC;
+	jh->jh_state = sfs->sfs_junsafe ? SFS_JSTATE_UNSAFE : SFS_JSTATE_CLEAN;
+	jh->jh_seq = seq;
+	return sfs_jwriteheader(sfs);
+}
+
+/*
+ * Copy block FROM to block TO through the buffer cache, adding it to
+ * *SUM if SUM isn't NULL. The copy is dirty but not pinned.
+ */
+static
+int
+sfs_jcopy(struct sfs_fs *sfs, daddr_t from, daddr_t to, uint32_t *sum)
+{
+	struct buf *frombuf, *tobuf;
+	int result;
+
+	result = buffer_read(sfs->sfs_device, from, &frombuf);
+	if (result) {
+		return result;
+	}
+	result = buffer_get(sfs->sfs_device, to, &tobuf);
+	if (result) {
+		buffer_release(frombuf);
+		return result;
+	}
+	memcpy(buffer_map(tobuf), buffer_map(frombuf), sfs->sfs_blocksize);
+	if (sum != NULL) {
+		*sum = sfs_jsum(*sum, buffer_map(tobuf), sfs->sfs_blocksize);
+	}
+	buffer_mark_dirty(tobuf);
+	buffer_release(tobuf);
+	buffer_release(frombuf);
+	return 0;
+}
+
+/*
+ * Write a transaction that's too big for the journal in place.
+ */
+static
+int
+sfs_jbypass(struct sfs_fs *sfs, uint32_t seq)
+{
+	struct sfs_jheader *jh = sfs->sfs_jhead;
+	int result;
+
+	bzero(jh, sizeof(*jh));
+	jh->jh_magic = SFS_JMAGIC;
+	jh->jh_state = SFS_JSTATE_UNSAFE;
+	jh->jh_seq = seq;
+	result = sfs_jwriteheader(sfs);
+	if (result) {
+		return result;
+	}
+
+	buffer_unpin(sfs->sfs_device);
+	result = buffer_sync(sfs->sfs_device);
+	if (result) {
+		/* The header stays unsafe. */
+		return result;
+	}
+
+	return sfs_jclean(sfs, seq + 1);
+}
+
+/*
+ * Write out transaction SEQ (steps 2-7 above). Called with the commit
+ * in the SFS_JWRITING phase and no locks held.
+ *
+ * If this fails before the header is written, the blocks stay pinned
+ * and go with the next commit. If it fails after, the header still
+ * describes this transaction, which is fine: the next commit writes
+ * everything in place (step 2) before it touches the log.
+ */
+static
+int
+sfs_jwrite(struct sfs_fs *sfs, uint32_t seq)
+{
+	struct sfs_jheader *jh = sfs->sfs_jhead;
+	unsigned n, i;
+	uint32_t sum;
+	int result;
+
+	if (sfs_jpending(sfs) == 0) {
+		/* Nothing changed; leave the data to the syncer. */
+		return 0;
+	}
+
+	/* File data first. */
+	result = buffer_sync(sfs->sfs_device);
+	if (result) {
+		return result;
+	}
+
+	/* Now the metadata that isn't in the buffer cache yet. */
+	result = sfs_sync_dirtylist(sfs);
+	if (result) {
+		return result;
+	}
+	result = sfs_sync_maps(sfs);
+	if (result) {
+		return result;
+	}
+
+	bzero(jh, sizeof(*jh));
+	n = buffer_getpinned(sfs->sfs_device, jh->jh_blocks, SFS_JMAXBLOCKS);
+	if (n == 0) {
+		/* Nothing changed. */
+		return 0;
+	}
+	if (n > sfs_jcapacity(sfs)) {
+		return sfs_jbypass(sfs, seq);
+	}
+
+	/* Log the blocks... */
+	sum = seq;
+	for (i=0; i<n; i++) {
+		result = sfs_jcopy(sfs, jh->jh_blocks[i], SFS_JLOG(sfs) + i,
+				   &sum);
+		if (result) {
+			return result;
+		}
+	}
+	result = buffer_sync(sfs->sfs_device);
+	if (result) {
+		return result;
+	}
+
+	/* ...commit... */
+	jh->jh_magic = SFS_JMAGIC;
+	jh->jh_state = SFS_JSTATE_COMMITTED;
+	jh->jh_seq = seq;
+	jh->jh_nblocks = n;
+	jh->jh_sum = sum;
+	result = sfs_jwriteheader(sfs);
+	if (result) {
+		return result;
+	}
+
+	/* ...and write them in place. */
+	buffer_unpin(sfs->sfs_device);
+	result = buffer_sync(sfs->sfs_device);
+	if (result) {
+		return result;
+	}
+
+	return sfs_jclean(sfs, seq + 1);
+}
+
+////////////////////////////////////////////////////////////
+// Interface
+
+/*
+ * Mark a buffer holding metadata dirty. With a journal, it's pinned
+ * until the next commit.
+ */
+void
+sfs_jdirty(struct sfs_fs *sfs, struct buf *buf)
+{
+	if (SFS_JOURNALED(sfs)) {
+		buffer_mark_pinned(buf);
+	}
+	else {
+		buffer_mark_dirty(buf);
+	}
+}
+
+/*
+ * Start an operation that changes metadata. Call with no SFS locks
+ * held. If the running transaction is already big, commit it first.
+ */
+void
+sfs_jbegin(struct sfs_fs *sfs)
+{
+	unsigned target;
+
+	if (!SFS_JOURNALED(sfs)) {
+		return;
+	}
+
+	target = sfs_jcapacity(sfs) / 2;
+	if (target > SFS_JTARGET) {
+		target = SFS_JTARGET;
+	}
+	if (sfs_jpending(sfs) >= target) {
+		/* If this fails, the next commit will try again. */
+		(void)sfs_jcommit(sfs);
+	}
+
+	lock_acquire(sfs->sfs_jlock);
+	while (sfs->sfs_jphase != SFS_JIDLE) {
+		cv_wait(sfs->sfs_jcv, sfs->sfs_jlock);
+	}
+	sfs->sfs_jactive++;
+	lock_release(sfs->sfs_jlock);
+}
+
+/*
+ * Start an operation that changes metadata, possibly while holding
+ * SFS locks.
+ */
+void
+sfs_jjoin(struct sfs_fs *sfs)
+{
+	if (!SFS_JOURNALED(sfs)) {
+		return;
+	}
+
+	lock_acquire(sfs->sfs_jlock);
+	while (sfs->sfs_jphase == SFS_JWRITING) {
+		cv_wait(sfs->sfs_jcv, sfs->sfs_jlock);
+	}
+	sfs->sfs_jactive++;
+	lock_release(sfs->sfs_jlock);
+}
+
+/*
+ * Finish an operation started with sfs_jbegin or sfs_jjoin.
+ */
+void
+sfs_jend(struct sfs_fs *sfs)
+{
+	if (!SFS_JOURNALED(sfs)) {
+		return;
+	}
+
+	lock_acquire(sfs->sfs_jlock);
+	KASSERT(sfs->sfs_jactive > 0);
+	sfs->sfs_jactive--;
+	if (sfs->sfs_jactive == 0) {
+		cv_broadcast(sfs->sfs_jcv, sfs->sfs_jlock);
+	}
+	lock_release(sfs->sfs_jlock);
+}
+
+/*
+ * Commit the running transaction, and wait until it's on disk. Call
+ * with no SFS locks held and not between sfs_jbegin and sfs_jend.
+ */
+int
+sfs_jcommit(struct sfs_fs *sfs)
+{
+	uint32_t seq;
+	int result;
+
+	KASSERT(SFS_JOURNALED(sfs));
+
+	lock_acquire(sfs->sfs_jlock);
+	seq = sfs->sfs_jseq;
+	if (sfs->sfs_jphase != SFS_JIDLE) {
+		/*
+		 * A commit is already under way, and it will include
+		 * everything we've done; wait for it.
+		 */
+		while (sfs->sfs_jseq == seq) {
+			cv_wait(sfs->sfs_jcv, sfs->sfs_jlock);
+		}
+		result = sfs->sfs_jresult;
+		lock_release(sfs->sfs_jlock);
+		return result;
+	}
+
+	sfs->sfs_jphase = SFS_JDRAINING;
+	while (sfs->sfs_jactive > 0) {
+		cv_wait(sfs->sfs_jcv, sfs->sfs_jlock);
+	}
+	sfs->sfs_jphase = SFS_JWRITING;
+	lock_release(sfs->sfs_jlock);
+
+	result = sfs_jwrite(sfs, seq);
+
+	lock_acquire(sfs->sfs_jlock);
+	sfs->sfs_jresult = result;
+	sfs->sfs_jseq++;
+	sfs->sfs_jphase = SFS_JIDLE;
+	cv_broadcast(sfs->sfs_jcv, sfs->sfs_jlock);
+	lock_release(sfs->sfs_jlock);
+
+	return result;
+}
+
+/*
+ * Replay the committed transaction described by sfs_jhead.
+ */
+static
+int
+sfs_jreplay(struct sfs_fs *sfs)
+{
+	struct sfs_jheader *jh = sfs->sfs_jhead;
+	struct buf *buf;
+	uint32_t sum, start, end;
+	unsigned i;
+	bool superblock = false;
+	int result;
+
+	start = sfs->sfs_sb.sb_journalstart;
+	end = start + sfs->sfs_sb.sb_journalblocks;
+	if (jh->jh_nblocks == 0 || jh->jh_nblocks > sfs_jcapacity(sfs)) {
+		kprintf("sfs: %s: Bad journal transaction size %u\n",
+			sfs->sfs_sb.sb_volname, jh->jh_nblocks);
+		return EINVAL;
+	}
+	for (i=0; i<jh->jh_nblocks; i++) {
+		if (jh->jh_blocks[i] >= sfs->sfs_sb.sb_nblocks ||
+		    (jh->jh_blocks[i] >= start && jh->jh_blocks[i] < end)) {
+			kprintf("sfs: %s: Bad block %u in journal\n",
+				sfs->sfs_sb.sb_volname, jh->jh_blocks[i]);
+			return EINVAL;
+		}
+	}
+
+	/*
+	 * The header is written after the log, so the log should be
+	 * intact; but check.
+	 */
+	sum = jh->jh_seq;
+	for (i=0; i<jh->jh_nblocks; i++) {
+		result = buffer_read(sfs->sfs_device, SFS_JLOG(sfs) + i, &buf);
+		if (result) {
+			return result;
+		}
+		sum = sfs_jsum(sum, buffer_map(buf), sfs->sfs_blocksize);
+		buffer_release(buf);
+	}
+	if (sum != jh->jh_sum) {
+		kprintf("sfs: %s: Journal transaction %u is incomplete; "
+			"discarding it\n", sfs->sfs_sb.sb_volname,
+			jh->jh_seq);
+		return sfs_jclean(sfs, jh->jh_seq + 1);
+	}
+
+	for (i=0; i<jh->jh_nblocks; i++) {
+		result = sfs_jcopy(sfs, SFS_JLOG(sfs) + i, jh->jh_blocks[i],
+				   NULL);
+		if (result) {
+			return result;
+		}
+		if (jh->jh_blocks[i] == SFS_SUPER_BLOCK) {
+			superblock = true;
+		}
+	}
+	result = buffer_sync(sfs->sfs_device);
+	if (result) {
+		return result;
+	}
+	kprintf("sfs: %s: Replayed journal transaction %u (%u blocks)\n",
+		sfs->sfs_sb.sb_volname, jh->jh_seq, jh->jh_nblocks);
+
+	if (superblock) {
+		result = sfs_readblock(sfs, SFS_SUPER_BLOCK, &sfs->sfs_sb,
+				       sizeof(sfs->sfs_sb));
+		if (result) {
+			return result;
+		}
+	}
+
+	return sfs_jclean(sfs, jh->jh_seq + 1);
+}
+
+/*
+ * Set up the journal at mount time, recovering the last transaction
+ * if it was committed but perhaps not written in place. Call after
+ * the superblock has been loaded and checked, and before anything
+ * else is read.
+ */
+int
+sfs_jmount(struct sfs_fs *sfs)
+{
+	struct sfs_jheader *jh;
+	int result;
+
+	KASSERT(SFS_JOURNALED(sfs));
+
+	jh = kmalloc(sizeof(*jh));
+	if (jh == NULL) {
+		return ENOMEM;
+	}
+	sfs->sfs_jhead = jh;
+
+	result = sfs_readblock(sfs, SFS_JHEADER(sfs), jh, sizeof(*jh));
+	if (result) {
+		return result;
+	}
+	if (jh->jh_magic != SFS_JMAGIC) {
+		kprintf("sfs: %s: Wrong magic number in journal header\n",
+			sfs->sfs_sb.sb_volname);
+		return EINVAL;
+	}
+
+	switch (jh->jh_state) {
+	    case SFS_JSTATE_CLEAN:
+		sfs->sfs_jseq = jh->jh_seq;
+		break;
+	    case SFS_JSTATE_COMMITTED:
+		result = sfs_jreplay(sfs);
+		if (result) {
+			return result;
+		}
+		sfs->sfs_jseq = sfs->sfs_jhead->jh_seq;
+		break;
+	    case SFS_JSTATE_UNSAFE:
+		kprintf("sfs: %s: Volume may be inconsistent; "
+			"run sfsck\n", sfs->sfs_sb.sb_volname);
+		sfs->sfs_junsafe = true;
+		sfs->sfs_jseq = jh->jh_seq;
+		break;
+	    default:
+		kprintf("sfs: %s: Bad journal state %u\n",
+			sfs->sfs_sb.sb_volname, jh->jh_state);
+		return EINVAL;
+	}
+
+	return 0;
+}
@@ -35,10 +35,17 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <kern/fcntl.h>
+#include <kern/ioctl.h>
+#include <limits.h>
 #include <stat.h>
+#include <kern/dirent.h>
 #include <lib.h>
 #include <uio.h>
+#include <copyinout.h>
+#include <synch.h>
 #include <vfs.h>
+#include <buf.h>
+#include <namecache.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -102,28 +109,104 @@ sfs_read(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 
 	return result;
 }
 
 /*
  * Called for write(). sfs_io() does the work.
+ *
+ * With a journal, a big write is done SFS_JWRITECHUNK blocks at a
+ * time, each piece a separate operation, so one write can't hold off
+ * a commit indefinitely or run up a transaction the journal can't
+ * hold.
  */
 static
 int
 sfs_write(struct vnode *v, struct uio *uio)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	size_t chunk, extraresid, before;
 	int result;
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
-	vfs_biglock_acquire();
-	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	buffer_throttle();
+
+	if (!SFS_JOURNALED(sfs)) {
+		lock_acquire(sv->sv_lock);
+		result = sfs_io(sv, uio);
+		lock_release(sv->sv_lock);
+		return result;
+	}
+
+	chunk = SFS_JWRITECHUNK * sfs->sfs_blocksize;
+	do {
+		before = uio->uio_resid;
+		extraresid = 0;
+		if (uio->uio_resid > chunk) {
+			extraresid = uio->uio_resid - chunk;
+			uio->uio_resid = chunk;
+		}
+
+		sfs_jbegin(sfs);
+		lock_acquire(sv->sv_lock);
+		result = sfs_io(sv, uio);
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
+
+		uio->uio_resid += extraresid;
+		if (extraresid > 0) {
+			buffer_throttle();
+		}
+	} while (result == 0 && extraresid > 0 && uio->uio_resid < before);
+
+	return result;
+}
+
+/*
+ * Reserve space for bytes POS through POS+LEN-1 of a file
+ * (IOCTL_PREALLOC), with PREALLOC_* FLAGS. Like a big write, this is
+ * done a piece at a time, SFS_PREALLOCCHUNK blocks per operation.
+ */
+static
+int
+sfs_preallocate(struct vnode *v, off_t pos, off_t len, int flags)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	off_t chunk, n;
+	int result;
+
+	if (sv->sv_i.sfi_type != SFS_TYPE_FILE) {
+		return EISDIR;
+	}
+	if (pos < 0 || len <= 0 || (flags & ~PREALLOC_KEEPSIZE) != 0) {
+		return EINVAL;
+	}
+	if (pos > (off_t)SFS_MAXFILESIZE ||
+	    len > (off_t)SFS_MAXFILESIZE - pos) {
+		return EFBIG;
+	}
+
+	chunk = (off_t)SFS_PREALLOCCHUNK * sfs->sfs_blocksize;
+	do {
+		n = len > chunk ? chunk : len;
+
+		sfs_jbegin(sfs);
+		lock_acquire(sv->sv_lock);
+		result = sfs_prealloc(sv, pos, n,
+				      (flags & PREALLOC_KEEPSIZE) != 0);
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
+
+		pos += n;
+		len -= n;
+	} while (result == 0 && len > 0);
 
 	return result;
 }
@@ -135,15 +218,40 @@ static
 int
 sfs_ioctl(struct vnode *v, int op, userptr_t data)
 {
-	/*
-	 * No ioctls.
-	 */
+	struct ioctl_prealloc ip;
+	int result;
 
-	(void)v;
-	(void)op;
-	(void)data;
+	switch (op) {
+	    case IOCTL_PREALLOC:
+		result = copyin(data, &ip, sizeof(ip));
+		if (result) {
+			return result;
+		}
+		return sfs_preallocate(v, ip.ip_offset, ip.ip_length,
+				       ip.ip_flags);
+	}
 
-	return EINVAL;
+	return EIOCTL;
+}
+
+/*
+ * Fill in the parts of a stat structure that come from the inode,
+ * other than the type. Call with the vnode locked.
+ */
+static
+void
+sfs_fillstat(struct sfs_vnode *sv, struct stat *statbuf)
+{
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	statbuf->st_size = sv->sv_i.sfi_size;
+	statbuf->st_nlink = sv->sv_i.sfi_linkcount;
+	statbuf->st_ino = sv->sv_ino;
+
+	/* We don't support this yet */
+	statbuf->st_blocks = 0;
+
+	/* Fill in other fields as desired/possible... */
 }
 
 /*
@@ -164,13 +272,9 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 		return result;
 	}
 
-	statbuf->st_size = sv->sv_i.sfi_size;
-	statbuf->st_nlink = sv->sv_i.sfi_linkcount;
-
-	/* We don't support this yet */
-	statbuf->st_blocks = 0;
-
-	/* Fill in other fields as desired/possible... */
+	lock_acquire(sv->sv_lock);
+	sfs_fillstat(sv, statbuf);
+	lock_release(sv->sv_lock);
 
 	return 0;
 }
@@ -185,16 +289,13 @@ sfs_gettype(struct vnode *v, uint32_t *ret)
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
 
-	vfs_biglock_acquire();
-
+	/* The type never changes, so no locking is needed. */
 	switch (sv->sv_i.sfi_type) {
 	case SFS_TYPE_FILE:
 		*ret = S_IFREG;
-		vfs_biglock_release();
 		return 0;
 	case SFS_TYPE_DIR:
 		*ret = S_IFDIR;
-		vfs_biglock_release();
 		return 0;
 	}
 	panic("sfs: %s: gettype: Invalid inode type (inode %u, type %u)\n",
@@ -202,6 +303,182 @@ sfs_gettype(struct vnode *v, uint32_t *ret)
 	return EINVAL;
 }
 
+/*
+ * Called for getdirentry(). The offset counts directory slots; hand
+ * back the name in the first one in use at or after it.
+ */
+static
+int
+sfs_getdirentry(struct vnode *v, struct uio *uio)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_direntry sd;
+	unsigned n;
+	int slot, result;
+
+	if (uio->uio_offset < 0 || uio->uio_offset != (int)uio->uio_offset) {
+		return EINVAL;
+	}
+
+	lock_acquire(sv->sv_lock);
+	slot = uio->uio_offset;
+	while ((result = sfs_dir_readslots(sv, slot, &sd, 1, &n)) == 0 &&
+	       n > 0) {
+		slot++;
+		if (sd.sfd_ino != SFS_NOINO) {
+			sd.sfd_name[sizeof(sd.sfd_name) - 1] = 0;
+			result = uiomove(sd.sfd_name, strlen(sd.sfd_name),
+					 uio);
+			break;
+		}
+	}
+	if (result == 0) {
+		uio->uio_offset = slot;
+	}
+	lock_release(sv->sv_lock);
+
+	return result;
+}
+
+/*
+ * Fill in the getdirentries() record for directory entry SD of
+ * directory SV: a struct dirent, with the file's stat information in
+ * front if PLUS is set. The file is loaded to get its type (and
+ * stat information), since in the dense format the inode on disk may
+ * not have been written yet. Call with the directory locked.
+ */
+static
+int
+sfs_getdirentries_fill(struct sfs_vnode *sv, const struct sfs_direntry *sd,
+		       bool plus, struct direntplus *rec)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_vnode *file;
+	mode_t type;
+	size_t namlen;
+	int result;
+
+	result = sfs_loadvnode(sfs, sd->sfd_ino, SFS_TYPE_INVAL, &file);
+	if (result) {
+		return result;
+	}
+
+	bzero(rec, sizeof(*rec));
+	result = sfs_gettype(&file->sv_absvn, &type);
+	if (result) {
+		VOP_DECREF(&file->sv_absvn);
+		return result;
+	}
+	if (plus) {
+		rec->dp_stat.st_mode = type;
+		/* "." is the directory itself, which we have locked */
+		if (file != sv) {
+			lock_acquire(file->sv_lock);
+		}
+		sfs_fillstat(file, &rec->dp_stat);
+		if (file != sv) {
+			lock_release(file->sv_lock);
+		}
+	}
+	VOP_DECREF(&file->sv_absvn);
+
+	namlen = strlen(sd->sfd_name);
+	rec->dp_dirent.d_ino = sd->sfd_ino;
+	rec->dp_dirent.d_reclen = plus ? _DIRENTPLUS_RECLEN(namlen) :
+		_DIRENT_RECLEN(namlen);
+	rec->dp_dirent.d_type = (type & _S_IFMT) >> 12;
+	rec->dp_dirent.d_namlen = namlen;
+	strcpy(rec->dp_dirent.d_name, sd->sfd_name);
+	return 0;
+}
+
+/*
+ * Called for getdirentries(). The offset counts directory slots, as
+ * with getdirentry; we read a directory block's worth of slots at a
+ * time and pack a record for each one in use into the uio until the
+ * next won't fit.
+ */
+static
+int
+sfs_getdirentries(struct vnode *v, struct uio *uio, int flags)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	struct sfs_direntry *sds;
+	struct direntplus *rec;
+	unsigned perblock, n, i;
+	size_t reclen;
+	bool plus, any;
+	int slot, result;
+
+	if (uio->uio_offset < 0 || uio->uio_offset != (int)uio->uio_offset) {
+		return EINVAL;
+	}
+	plus = (flags & GETDIRENTRIES_PLUS) != 0;
+
+	perblock = sfs->sfs_blocksize / sizeof(struct sfs_direntry);
+	sds = kmalloc(perblock * sizeof(*sds));
+	if (sds == NULL) {
+		return ENOMEM;
+	}
+	rec = kmalloc(sizeof(*rec));
+	if (rec == NULL) {
+		kfree(sds);
+		return ENOMEM;
+	}
+
+	lock_acquire(sv->sv_lock);
+	slot = uio->uio_offset;
+	any = false;
+	while ((result = sfs_dir_readslots(sv, slot, sds, perblock, &n)) == 0
+	       && n > 0) {
+		for (i=0; i<n; i++) {
+			if (sds[i].sfd_ino == SFS_NOINO) {
+				slot++;
+				continue;
+			}
+			sds[i].sfd_name[sizeof(sds[i].sfd_name) - 1] = 0;
+
+			reclen = strlen(sds[i].sfd_name);
+			reclen = plus ? _DIRENTPLUS_RECLEN(reclen) :
+				_DIRENT_RECLEN(reclen);
+			if (reclen > uio->uio_resid) {
+				/* Full; this one is next time's first */
+				if (!any) {
+					result = EINVAL;
+				}
+				goto out;
+			}
+
+			result = sfs_getdirentries_fill(sv, &sds[i], plus,
+							rec);
+			if (result) {
+				goto out;
+			}
+			result = uiomove(plus ? (void *)rec :
+					 (void *)&rec->dp_dirent,
+					 reclen, uio);
+			if (result) {
+				goto out;
+			}
+			any = true;
+			slot++;
+		}
+	}
+
+ out:
+	/* Anything handed back counts, even if we then hit an error */
+	if (any) {
+		result = 0;
+	}
+	uio->uio_offset = slot;
+	lock_release(sv->sv_lock);
+
+	kfree(rec);
+	kfree(sds);
+	return result;
+}
+
 /*
  * Check if seeking is allowed. The answer is "yes".
  */
@@ -216,18 +493,66 @@ sfs_isseekable(struct vnode *v)
 /*
  * Called for fsync(), and also on filesystem unmount, global sync(),
  * and some other cases.
+ *
+ * Writes back only this file's blocks: its data, then its indirect
+ * blocks, then its inode, so that a crash part way through never
+ * leaves a pointer on disk to a block that doesn't hold the file's
+ * data yet. With a journal, the file's metadata can only reach the
+ * disk by way of a commit, so after the data we commit everything;
+ * if someone else is already committing, that just means waiting for
+ * them.
  */
 static
 int
 sfs_fsync(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
-	int result;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	uint32_t fileblock, nblocks;
+	daddr_t diskblock;
+	int result = 0;
 
-	vfs_biglock_acquire();
-	result = sfs_sync_inode(sv);
-	vfs_biglock_release();
+	lock_acquire(sv->sv_lock);
 
+	/* An inline file's data went with the inode */
+	if (sv->sv_i.sfi_flags & SFS_IFLAG_INLINE) {
+		nblocks = 0;
+	}
+	else {
+		nblocks = DIVROUNDUP((off_t)sv->sv_i.sfi_size,
+				     sfs->sfs_blocksize);
+	}
+	for (fileblock = 0; fileblock < nblocks; fileblock++) {
+		result = sfs_bmap(sv, fileblock, false, NULL, &diskblock);
+		if (result) {
+			goto out;
+		}
+		if (diskblock != 0) {
+			result = buffer_syncblock(sfs->sfs_device, diskblock);
+			if (result) {
+				goto out;
+			}
+		}
+	}
+
+	if (!SFS_JOURNALED(sfs)) {
+		result = sfs_sync_indirect(sv);
+		if (result) {
+			goto out;
+		}
+		result = sfs_sync_inode(sv);
+		if (result) {
+			goto out;
+		}
+		result = buffer_syncblock(sfs->sfs_device,
+					  sfs_inoblock(sfs, sv->sv_ino));
+	}
+
+ out:
+	lock_release(sv->sv_lock);
+	if (result == 0 && SFS_JOURNALED(sfs)) {
+		result = sfs_jcommit(sfs);
+	}
 	return result;
 }
 
@@ -250,8 +575,20 @@ int
 sfs_truncate(struct vnode *v, off_t len)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	int result;
+
+	if (len > (off_t)SFS_MAXFILESIZE) {
+		return EFBIG;
+	}
+
+	sfs_jbegin(sfs);
+	lock_acquire(sv->sv_lock);
+	result = sfs_itrunc(sv, len);
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
 
-	return sfs_itrunc(sv, len);
+	return result;
 }
 
 /*
@@ -289,60 +626,76 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	uint32_t ino;
 	int result;
 
-	vfs_biglock_acquire();
+	sfs_jbegin(sfs);
+	lock_acquire(sv->sv_lock);
 
 	/* Look up the name */
 	result = sfs_dir_findname(sv, name, &ino, NULL, NULL);
 	if (result!=0 && result!=ENOENT) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return result;
 	}
 
 	/* If it exists and we didn't want it to, fail */
 	if (result==0 && excl) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return EEXIST;
 	}
 
 	if (result==0) {
 		/* We got something; load its vnode and return */
 		result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, &newguy);
+		lock_release(sv->sv_lock);
 		if (result) {
-			vfs_biglock_release();
+			sfs_jend(sfs);
 			return result;
 		}
 		*ret = &newguy->sv_absvn;
-		vfs_biglock_release();
+		sfs_jend(sfs);
 		return 0;
 	}
 
 	/* Didn't exist - create it */
 	result = sfs_makeobj(sfs, SFS_TYPE_FILE, &newguy);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return result;
 	}
 
 	/* We don't currently support file permissions; ignore MODE */
 	(void)mode;
 
+	/*
+	 * Lock the new file before it becomes visible, so nobody who
+	 * finds it through the directory sees it with linkcount 0.
+	 */
+	lock_acquire(newguy->sv_lock);
+
 	/* Link it into the directory */
 	result = sfs_dir_link(sv, name, newguy->sv_ino, NULL);
 	if (result) {
+		lock_release(newguy->sv_lock);
+		lock_release(sv->sv_lock);
 		VOP_DECREF(&newguy->sv_absvn);
-		vfs_biglock_release();
+		sfs_jend(sfs);
 		return result;
 	}
+	namecache_purge(&sv->sv_absvn, name);
 
 	/* Update the linkcount of the new file */
 	newguy->sv_i.sfi_linkcount++;
 
 	/* and consequently mark it dirty. */
-	newguy->sv_dirty = true;
+	sfs_dirty_inode(newguy);
 
-	*ret = &newguy->sv_absvn;
+	lock_release(newguy->sv_lock);
+	lock_release(sv->sv_lock);
 
-	vfs_biglock_release();
+	*ret = &newguy->sv_absvn;
+	sfs_jend(sfs);
 	return 0;
 }
 
@@ -357,30 +710,37 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 {
 	struct sfs_vnode *sv = dir->vn_data;
 	struct sfs_vnode *f = file->vn_data;
+	struct sfs_fs *sfs = dir->vn_fs->fs_data;
 	int result;
 
 	KASSERT(file->vn_fs == dir->vn_fs);
 
-	vfs_biglock_acquire();
-
 	/* Hard links to directories aren't allowed. */
 	if (f->sv_i.sfi_type == SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return EINVAL;
 	}
 
+	sfs_jbegin(sfs);
+	lock_acquire(sv->sv_lock);
+	lock_acquire(f->sv_lock);
+
 	/* Create the link */
 	result = sfs_dir_link(sv, name, f->sv_ino, NULL);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(f->sv_lock);
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return result;
 	}
+	namecache_purge(&sv->sv_absvn, name);
 
 	/* and update the link count, marking the inode dirty */
 	f->sv_i.sfi_linkcount++;
-	f->sv_dirty = true;
+	sfs_dirty_inode(f);
 
-	vfs_biglock_release();
+	lock_release(f->sv_lock);
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
 	return 0;
 }
 
@@ -392,32 +752,42 @@ int
 sfs_remove(struct vnode *dir, const char *name)
 {
 	struct sfs_vnode *sv = dir->vn_data;
+	struct sfs_fs *sfs = dir->vn_fs->fs_data;
 	struct sfs_vnode *victim;
 	int slot;
 	int result;
 
-	vfs_biglock_acquire();
+	sfs_jbegin(sfs);
+	lock_acquire(sv->sv_lock);
 
 	/* Look for the file and fetch a vnode for it. */
 	result = sfs_lookonce(sv, name, &victim, &slot);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return result;
 	}
 
+	lock_acquire(victim->sv_lock);
+
 	/* Erase its directory entry. */
 	result = sfs_dir_unlink(sv, slot);
 	if (result==0) {
+		namecache_purge(&sv->sv_absvn, name);
+
 		/* If we succeeded, decrement the link count. */
 		KASSERT(victim->sv_i.sfi_linkcount > 0);
 		victim->sv_i.sfi_linkcount--;
-		victim->sv_dirty = true;
+		sfs_dirty_inode(victim);
 	}
 
+	lock_release(victim->sv_lock);
+	lock_release(sv->sv_lock);
+
 	/* Discard the reference that sfs_lookonce got us */
 	VOP_DECREF(&victim->sv_absvn);
 
-	vfs_biglock_release();
+	sfs_jend(sfs);
 	return result;
 }
 
@@ -438,18 +808,22 @@ sfs_rename(struct vnode *d1, const char *n1,
 	int slot1, slot2;
 	int result, result2;
 
-	vfs_biglock_acquire();
-
 	KASSERT(d1==d2);
 	KASSERT(sv->sv_ino == SFS_ROOTDIR_INO);
 
+	sfs_jbegin(sfs);
+	lock_acquire(sv->sv_lock);
+
 	/* Look up the old name of the file and get its inode and slot number*/
 	result = sfs_lookonce(sv, n1, &g1, &slot1);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return result;
 	}
 
+	lock_acquire(g1->sv_lock);
+
 	/* We don't support subdirectories */
 	KASSERT(g1->sv_i.sfi_type == SFS_TYPE_FILE);
 
@@ -465,16 +839,18 @@ sfs_rename(struct vnode *d1, const char *n1,
 	if (result) {
 		goto puke;
 	}
+	namecache_purge(&sv->sv_absvn, n2);
 
 	/* Increment the link count, and mark inode dirty */
 	g1->sv_i.sfi_linkcount++;
-	g1->sv_dirty = true;
+	sfs_dirty_inode(g1);
 
 	/* Unlink the old slot */
 	result = sfs_dir_unlink(sv, slot1);
 	if (result) {
 		goto puke_harder;
 	}
+	namecache_purge(&sv->sv_absvn, n1);
 
 	/*
 	 * Decrement the link count again, and mark the inode dirty again,
@@ -482,12 +858,15 @@ sfs_rename(struct vnode *d1, const char *n1,
 	 */
 	KASSERT(g1->sv_i.sfi_linkcount>0);
 	g1->sv_i.sfi_linkcount--;
-	g1->sv_dirty = true;
+	sfs_dirty_inode(g1);
+
+	lock_release(g1->sv_lock);
+	lock_release(sv->sv_lock);
 
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_absvn);
 
-	vfs_biglock_release();
+	sfs_jend(sfs);
 	return 0;
 
  puke_harder:
@@ -505,9 +884,12 @@ sfs_rename(struct vnode *d1, const char *n1,
 	}
 	g1->sv_i.sfi_linkcount--;
  puke:
+	lock_release(g1->sv_lock);
+	lock_release(sv->sv_lock);
+
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_absvn);
-	vfs_biglock_release();
+	sfs_jend(sfs);
 	return result;
 }
 
@@ -525,15 +907,11 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 
 	if (strlen(path)+1 > buflen) {
-		vfs_biglock_release();
 		return ENAMETOOLONG;
 	}
 	strcpy(buf, path);
@@ -541,7 +919,6 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 	VOP_INCREF(&sv->sv_absvn);
 	*ret = &sv->sv_absvn;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -549,7 +926,11 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
  * Lookup gets a vnode for a pathname.
  *
  * Since we don't support subdirectories, it's easy - just look up the
- * name.
+ * name. Check the name cache first, and remember what we find
+ * (including if it isn't there) for next time. Everything that
+ * changes the directory purges the names it touches while holding
+ * the directory locked, so doing the same here keeps the cache
+ * consistent.
  */
 static
 int
@@ -559,22 +940,31 @@ sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
 	struct sfs_vnode *final;
 	int result;
 
-	vfs_biglock_acquire();
-
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 
+	lock_acquire(sv->sv_lock);
+
+	if (namecache_lookup(v, path, ret)) {
+		lock_release(sv->sv_lock);
+		return *ret == NULL ? ENOENT : 0;
+	}
+
 	result = sfs_lookonce(sv, path, &final, NULL);
+	if (result == ENOENT) {
+		namecache_enter(v, path, NULL);
+	}
+	else if (result == 0) {
+		namecache_enter(v, path, &final->sv_absvn);
+	}
+	lock_release(sv->sv_lock);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	*ret = &final->sv_absvn;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -593,6 +983,7 @@ const struct vnode_ops sfs_fileops = {
 	.vop_read = sfs_read,
 	.vop_readlink = vopfail_uio_notdir,
 	.vop_getdirentry = vopfail_uio_notdir,
+	.vop_getdirentries = vopfail_getdirentries_notdir,
 	.vop_write = sfs_write,
 	.vop_ioctl = sfs_ioctl,
 	.vop_stat = sfs_stat,
@@ -626,7 +1017,8 @@ const struct vnode_ops sfs_dirops = {
 
 	.vop_read = vopfail_uio_isdir,
 	.vop_readlink = vopfail_uio_inval,
-	.vop_getdirentry = vopfail_uio_nosys,
+	.vop_getdirentry = sfs_getdirentry,
+	.vop_getdirentries = sfs_getdirentries,
 	.vop_write = vopfail_uio_isdir,
 	.vop_ioctl = sfs_ioctl,
 	.vop_stat = sfs_stat,
@@ -32,25 +32,85 @@
 
 #include <uio.h> /* for uio_rw */
 
+struct buf; /* in buf.h */
+
+
+/* Readahead window limits, in blocks */
+#define SFS_RAMIN 2
+#define SFS_RAMAX 16
+
+/* Initial number of vnode hash chains; must be a power of 2 */
+#define SFS_VNHASH_INITSIZE 32
+
+/* Free run sfs_balloc looks for when it can't extend a file in place */
+#define SFS_ALLOCRUN 8
+
+/* True if the volume uses the dense inode table format */
+#define SFS_DENSE(sfs) ((sfs)->sfs_sb.sb_version == SFS_VERSION_DENSE)
+
+/* True if the volume has a metadata journal */
+#define SFS_JOURNALED(sfs) ((sfs)->sfs_sb.sb_journalblocks != 0)
+
+/* Journal commit phases (sfs_jphase) */
+#define SFS_JIDLE     0         /* no commit going on */
+#define SFS_JDRAINING 1         /* waiting for operations to finish */
+#define SFS_JWRITING  2         /* writing the transaction */
+
+/* Size of the running transaction (blocks) that makes sfs_jbegin commit */
+#define SFS_JTARGET 32
+
+/* Most blocks one journaled write operation covers */
+#define SFS_JWRITECHUNK 32
+
+/*
+ * Removed files bigger than this many blocks are freed in the
+ * background, this many blocks at a time
+ */
+#define SFS_TRUNCCHUNK 512
+
+/* Most blocks one preallocation operation reserves */
+#define SFS_PREALLOCCHUNK 512
+
+/* Largest file size sfi_size can hold */
+#define SFS_MAXFILESIZE 0xffffffffU
+
+/* Shortcuts for the block size macros in kern/sfs.h */
+#define SFS_FS_DBPERIDB(sfs)    SFS_DBPERIDB((sfs)->sfs_blocksize)
+#define SFS_FS_INOPERBLOCK(sfs) SFS_INOPERBLOCK((sfs)->sfs_blocksize)
+
+/* Largest file that can be kept in the inode */
+#define SFS_INLINEMAX(sfs) \
+	(SFS_DENSE(sfs) ? SFS_INLINESIZE_DENSE : SFS_INLINESIZE)
+
+/* Whether files may be moved inline (see kern/sfs.h) */
+#define SFS_INLINEOK(sfs) SFS_DENSE(sfs)
 
 /* ops tables (in sfs_vnops.c) */
 extern const struct vnode_ops sfs_fileops;
 extern const struct vnode_ops sfs_dirops;
 
-/* Macro for initializing a uio structure */
-#define SFSUIO(iov, uio, ptr, block, rw) \
-    uio_kinit(iov, uio, ptr, SFS_BLOCKSIZE, ((off_t)(block))*SFS_BLOCKSIZE, rw)
-
 
 /* Functions in sfs_balloc.c */
-int sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock);
+int sfs_balloc(struct sfs_fs *sfs, daddr_t hint, bool zero,
+		daddr_t *diskblock);
+int sfs_ballocrun(struct sfs_fs *sfs, daddr_t hint, uint32_t want,
+		daddr_t *start, uint32_t *got);
+int sfs_clearblock(struct sfs_fs *sfs, daddr_t block);
 void sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock);
+void sfs_bfreerange(struct sfs_fs *sfs, daddr_t start, uint32_t len);
+void sfs_bfree_deferred(struct sfs_fs *sfs);
 int sfs_bused(struct sfs_fs *sfs, daddr_t diskblock);
+int sfs_ialloc(struct sfs_fs *sfs, uint32_t *ino);
+void sfs_ifree(struct sfs_fs *sfs, uint32_t ino);
+int sfs_iused(struct sfs_fs *sfs, uint32_t ino);
 
 /* Functions in sfs_bmap.c */
 int sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
-		daddr_t *diskblock);
+		bool *fresh, daddr_t *diskblock);
+int sfs_sync_indirect(struct sfs_vnode *sv);
+int sfs_inline_evict(struct sfs_vnode *sv);
 int sfs_itrunc(struct sfs_vnode *sv, off_t len);
+int sfs_prealloc(struct sfs_vnode *sv, off_t pos, off_t len, bool keepsize);
 
 /* Functions in sfs_dir.c */
 int sfs_dir_findname(struct sfs_vnode *sv, const char *name,
@@ -58,18 +118,37 @@ int sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 int sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino,
 		int *slot);
 int sfs_dir_unlink(struct sfs_vnode *sv, int slot);
+void sfs_dir_dropindex(struct sfs_vnode *sv);
+int sfs_dir_readslots(struct sfs_vnode *sv, int slot, struct sfs_direntry *sds,
+		unsigned max, unsigned *count);
 int sfs_lookonce(struct sfs_vnode *sv, const char *name,
 		struct sfs_vnode **ret,
 		int *slot);
 
+/* Functions in sfs_fsops.c */
+int sfs_sync_maps(struct sfs_fs *sfs);
+
 /* Functions in sfs_inode.c */
+daddr_t sfs_inoblock(struct sfs_fs *sfs, uint32_t ino);
+int sfs_readinode(struct sfs_fs *sfs, uint32_t ino, struct sfs_dinode *sfi);
+void sfs_dirty_inode(struct sfs_vnode *sv);
 int sfs_sync_inode(struct sfs_vnode *sv);
+int sfs_sync_dirtylist(struct sfs_fs *sfs);
+void sfs_orphan_drain(struct sfs_fs *sfs);
 int sfs_reclaim(struct vnode *v);
 int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		struct sfs_vnode **ret);
 int sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret);
 int sfs_getroot(struct fs *fs, struct vnode **ret);
 
+/* Functions in sfs_journal.c */
+void sfs_jdirty(struct sfs_fs *sfs, struct buf *buf);
+void sfs_jbegin(struct sfs_fs *sfs);
+void sfs_jjoin(struct sfs_fs *sfs);
+void sfs_jend(struct sfs_fs *sfs);
+int sfs_jcommit(struct sfs_fs *sfs);
+int sfs_jmount(struct sfs_fs *sfs);
+
 /* Functions in sfs_io.c */
 int sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len);
 int sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len);
@@ -39,13 +39,35 @@
 #include "opt-dumbvm.h"
 
 struct vnode;
+struct lock;
+struct pagetable;
 
 
+#if !OPT_DUMBVM
+/*
+ * A region of the address space defined by the executable. The heap
+ * (which starts out empty right after the highest region and is
+ * moved with sbrk) and the stack (VM_STACKPAGES long, at the top of
+ * user space) are kept separately.
+ */
+struct region {
+	vaddr_t rg_vbase;		/* first address */
+	size_t rg_npages;		/* length in pages */
+	bool rg_writeable;		/* whether user code may write */
+	struct region *rg_next;
+};
+
+#define VM_STACKPAGES	1024
+#endif
+
 /*
  * Address space - data structure associated with the virtual memory
  * space of a process.
  *
- * You write this.
+ * Without dumbvm, pages are allocated and zeroed the first time they
+ * are touched, and are found through the page table. as_lock
+ * protects the page table and the heap bounds; the regions don't
+ * change once the executable is loaded.
  */
 
 struct addrspace {
@@ -58,7 +80,13 @@ struct addrspace {
         size_t as_npages2;
         paddr_t as_stackpbase;
 #else
-        /* Put stuff here for your VM system */
+        struct region *as_regions;	/* from the executable */
+        vaddr_t as_heapbase;		/* start of heap */
+        vaddr_t as_heaptop;		/* end of heap (the "break") */
+        vaddr_t as_stackbase;		/* bottom of stack */
+        struct pagetable *as_pt;	/* page table */
+        struct lock *as_lock;		/* protects the above */
+        bool as_loading;		/* executable being loaded */
 #endif
 };
 
@@ -117,6 +145,12 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+int               as_sbrk(struct addrspace *as, intptr_t amount,
+                          vaddr_t *oldbreak);
+#if !OPT_DUMBVM
+int               as_fault(struct addrspace *as, vaddr_t vaddr,
+                           int faulttype);
+#endif
 
 
 /*
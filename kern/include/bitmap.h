@@ -38,8 +38,16 @@
  *                      Returns NULL on error.
  *     bitmap_getdata - return pointer to raw bit data (for I/O).
  *     bitmap_alloc   - locate a cleared bit, set it, and return its index.
+ *     bitmap_alloc_near - like bitmap_alloc, but take the first cleared
+ *                      bit at or after a starting index, wrapping around
+ *                      to the beginning if necessary.
+ *     bitmap_findrun - find a run of cleared bits of a given length at or
+ *                      after a starting index (wrapping around). Does
+ *                      not set them.
  *     bitmap_mark    - set a clear bit by its index.
  *     bitmap_unmark  - clear a set bit by its index.
+ *     bitmap_unmarkrange - clear a run of set bits, a byte at a time
+ *                      where possible.
  *     bitmap_isset   - return whether a particular bit is set or not.
  *     bitmap_destroy - destroy bitmap.
  */
@@ -50,8 +58,14 @@ struct bitmap;  /* Opaque. */
 struct bitmap *bitmap_create(unsigned nbits);
 void          *bitmap_getdata(struct bitmap *);
 int            bitmap_alloc(struct bitmap *, unsigned *index);
+int            bitmap_alloc_near(struct bitmap *, unsigned start,
+                                 unsigned *index);
+int            bitmap_findrun(struct bitmap *, unsigned start, unsigned len,
+                              unsigned *index);
 void           bitmap_mark(struct bitmap *, unsigned index);
 void           bitmap_unmark(struct bitmap *, unsigned index);
+void           bitmap_unmarkrange(struct bitmap *, unsigned start,
+                                  unsigned len);
 int            bitmap_isset(struct bitmap *, unsigned index);
 void           bitmap_destroy(struct bitmap *);
 
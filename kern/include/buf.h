@@ -0,0 +1,143 @@
+#ifndef _BUF_H_
+#define _BUF_H_
+
+/*
+ * Block buffer cache.
+ *
+ * A fixed pool of block-sized buffers shared by every mounted
+ * filesystem. Buffers are named by (device, block number), found
+ * through a hash table, and recycled in LRU order. Blocks are
+ * BUFFER_SIZE bytes unless the filesystem on a device has asked for
+ * larger ones (buffer_setblocksize); a buffer's space is resized when
+ * it is reused for a device with a different block size. Writes are
+ * write-back: marking a buffer dirty does no I/O; the data reaches
+ * the device when the buffer is evicted or when buffer_sync is
+ * called for the device.
+ *
+ * A "syncer" thread wakes up every BUFFER_SYNCINTERVAL seconds, has
+ * each filesystem put its dirty metadata in the cache (vfs_writeback),
+ * and then writes back buffers that have been dirty for more than
+ * BUFFER_SYNCAGE seconds. Writers that find more than BUFFER_DIRTYHIGH
+ * buffers dirty (buffer_throttle) write back until there are no more
+ * than BUFFER_DIRTYLOW, so a burst of writes can't fill the cache.
+ *
+ * A filesystem that journals its metadata can pin dirty buffers
+ * (buffer_mark_pinned). A pinned buffer is never written back or
+ * evicted, so its contents can't reach the disk before the journal
+ * entry for them does; the filesystem unpins its buffers
+ * (buffer_unpin) once that has been written.
+ *
+ * A buffer handed back by buffer_read or buffer_get is held
+ * exclusively by the caller until buffer_release. Do not try to
+ * get the same block twice from one thread; that deadlocks.
+ *
+ * Functions:
+ *     buffer_bootstrap  - allocate the buffer pool. Panics on failure.
+ *     buffer_read       - get a buffer holding the contents of a block,
+ *                         reading it from the device if not cached.
+ *     buffer_readcluster - like buffer_read, but for a run of up to
+ *                         BUFFER_MAXCLUSTER consecutive blocks. The
+ *                         uncached ones are read in as few device
+ *                         requests as possible. Blocks are got in
+ *                         ascending order. Only the first is waited
+ *                         for; the run stops short before any block
+ *                         that is busy or would need a buffer written
+ *                         back, and the number got is handed back.
+ *     buffer_get        - get a buffer for a block without reading it.
+ *                         Use when the whole block is about to be
+ *                         overwritten; the contents are undefined
+ *                         unless the block was already cached.
+ *     buffer_map        - return a pointer to the buffer's data.
+ *     buffer_mark_dirty - note that the buffer's data has been changed.
+ *     buffer_mark_pinned - like buffer_mark_dirty, but also pin the
+ *                         buffer until buffer_unpin.
+ *     buffer_release    - give up a buffer.
+ *     buffer_release_failed - give up a buffer from buffer_get that
+ *                         the caller failed to fill in. If it didn't
+ *                         hold the block before, it is discarded;
+ *                         otherwise it is kept, and marked dirty in
+ *                         case it was partly overwritten.
+ *     buffer_prefetch   - start reading a run of blocks into the cache
+ *                         in the background, skipping any already
+ *                         there. Does not wait and does not report
+ *                         errors.
+ *     buffer_drop       - discard any cached copy of a block without
+ *                         writing it back (e.g. the block was freed).
+ *     buffer_syncblock  - write back one block if it is cached, dirty,
+ *                         and not pinned (along with any such
+ *                         neighbors).
+ *     buffer_sync       - write back every dirty buffer for a device,
+ *                         except pinned ones.
+ *     buffer_getpinned  - return the number of pinned buffers for a
+ *                         device, and put (up to MAX of) their block
+ *                         numbers in BLOCKS, which may be NULL if MAX
+ *                         is 0.
+ *     buffer_unpin      - unpin every buffer for a device. They stay
+ *                         dirty.
+ *     buffer_invalidate - write back, then discard, every buffer for a
+ *                         device (none may be pinned), and go back to
+ *                         BUFFER_SIZE blocks for it. Used at unmount.
+ *     buffer_setblocksize - write back and discard every buffer for a
+ *                         device, then use blocks of the given size for
+ *                         it from now on. Block numbers passed in for
+ *                         the device are then in units of that size.
+ *     buffer_throttle   - if too much of the cache is dirty, write some
+ *                         back. Call before dirtying buffers, while not
+ *                         holding any.
+ *     buffer_printstats - print hit/miss/eviction/readahead/writeback
+ *                         counters.
+ */
+
+struct device;	/* in device.h */
+struct buf;	/* Opaque. */
+
+/* Default (and smallest) block size, and the largest allowed. */
+#define BUFFER_SIZE	512
+#define BUFFER_MAXSIZE	4096
+
+/* Most devices that can use a block size other than BUFFER_SIZE. */
+#define BUFFER_MAXDEVS	8
+
+/* Number of buffers in the pool. */
+#define BUFFER_COUNT	128
+
+/* Most blocks moved to or from the device in one request. */
+#define BUFFER_MAXCLUSTER	16
+
+/* How often the syncer runs, and how long data may stay dirty (seconds). */
+#define BUFFER_SYNCINTERVAL	1
+#define BUFFER_SYNCAGE		5
+
+/* Dirty buffer count at which writers are throttled, and down to where. */
+#define BUFFER_DIRTYHIGH	(BUFFER_COUNT / 2)
+#define BUFFER_DIRTYLOW		(BUFFER_COUNT / 4)
+
+/* Buffers the syncer writes back before letting others run. */
+#define BUFFER_SYNCBATCH	16
+
+void buffer_bootstrap(void);
+
+int buffer_read(struct device *dev, daddr_t block, struct buf **ret);
+int buffer_readcluster(struct device *dev, daddr_t block, unsigned nblocks,
+		       struct buf **bufs, unsigned *got);
+int buffer_get(struct device *dev, daddr_t block, struct buf **ret);
+void *buffer_map(struct buf *b);
+void buffer_mark_dirty(struct buf *b);
+void buffer_mark_pinned(struct buf *b);
+void buffer_release(struct buf *b);
+void buffer_release_failed(struct buf *b);
+void buffer_prefetch(struct device *dev, daddr_t block, unsigned nblocks);
+
+void buffer_drop(struct device *dev, daddr_t block);
+int buffer_syncblock(struct device *dev, daddr_t block);
+int buffer_sync(struct device *dev);
+unsigned buffer_getpinned(struct device *dev, daddr_t *blocks, unsigned max);
+void buffer_unpin(struct device *dev);
+int buffer_invalidate(struct device *dev);
+int buffer_setblocksize(struct device *dev, size_t size);
+void buffer_throttle(void);
+
+void buffer_printstats(void);
+
+
+#endif /* _BUF_H_ */
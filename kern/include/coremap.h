@@ -0,0 +1,56 @@
+#ifndef _COREMAP_H_
+#define _COREMAP_H_
+
+/*
+ * The coremap: physical page frame allocation.
+ *
+ * There is one entry per physical page, recording what state it is
+ * in and who owns it. Allocations are runs of one or more contiguous
+ * pages; a run is freed by passing the address of its first page.
+ * Single pages come off a free list; longer runs are found by
+ * scanning.
+ *
+ * coremap_alloc may be called before coremap_bootstrap, in which
+ * case it steals memory with ram_stealmem. Pages got that way are
+ * never freed; passing them to coremap_free does nothing.
+ *
+ * coremap_alloc returns 0 if there is no run of free pages long
+ * enough. If there is swap, it first tries paging user pages out to
+ * make room, which means waiting for the disk; it only does that if
+ * the caller could have slept anyway.
+ *
+ * Single user pages may be shared copy-on-write: coremap_share adds a
+ * reference, coremap_free drops one, and the page is only freed when
+ * none are left.
+ */
+
+struct addrspace;		/* from <addrspace.h> */
+
+void coremap_bootstrap(void);
+
+/* Allocate NPAGES contiguous pages for AS (NULL for the kernel) at VADDR */
+paddr_t coremap_alloc(unsigned npages, struct addrspace *as, vaddr_t vaddr);
+
+/* Free the run starting at PADDR (or drop one reference to it) */
+void coremap_free(paddr_t paddr);
+
+/* Share a user page; take ownership of it if no longer shared */
+void coremap_share(paddr_t paddr);
+bool coremap_claim(paddr_t paddr, struct addrspace *as, vaddr_t vaddr);
+
+/* Note that a user page has been used; false if it needs claiming */
+bool coremap_touch(paddr_t paddr);
+
+/* A page picked to be paged out */
+struct coremap_victim {
+	paddr_t cv_paddr;
+	vaddr_t cv_vaddr;
+};
+
+/* Pick up to MAX pages of one address space to page out (for swap.c) */
+unsigned coremap_pickvictims(struct coremap_victim *victims, unsigned max,
+			     struct addrspace **ret, bool *locked);
+
+/* coremap_used_bytes is in <vm.h> */
+
+#endif /* _COREMAP_H_ */
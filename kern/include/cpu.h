@@ -35,6 +35,8 @@
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
+struct addrspace;
+
 extern unsigned num_cpus;
 
 /*
@@ -78,7 +80,10 @@ struct cpu {
 	 * TLB shootdown requests made to this CPU are queued in
 	 * c_shootdown[], with c_numshootdown holding the number of
 	 * requests. TLBSHOOTDOWN_MAX is the maximum number that can
-	 * be queued at once, which is machine-dependent.
+	 * be queued at once, which is machine-dependent. If more
+	 * arrive, c_numshootdown is set past TLBSHOOTDOWN_MAX and the
+	 * whole TLB is flushed instead. c_shootdowns_done counts the
+	 * batches handled, so senders can tell when theirs is done.
 	 *
 	 * The contents of struct tlbshootdown are also machine-
 	 * dependent and might reasonably be either an address space
@@ -87,8 +92,17 @@ struct cpu {
 	uint32_t c_ipi_pending;		/* One bit for each IPI number */
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	unsigned c_numshootdown;
+	unsigned c_shootdowns_done;
 	struct spinlock c_ipi_lock;
 
+	/*
+	 * Written only by this cpu; read by others deciding whether
+	 * to send it TLB shootdowns.
+	 */
+	struct addrspace *c_tlbas;	/* Address space loaded in the TLB */
+	unsigned c_tlbfaults;		/* TLB misses taken */
+	unsigned c_tlbslowfaults;	/* ...that were real page faults */
+
 	/*
 	 * Accessed by other cpus. Protected inside hangman.c.
 	 */
@@ -118,6 +132,12 @@ void cpu_hatch(unsigned software_number);
  */
 void cpu_identify(char *buf, size_t max);
 
+/*
+ * Print each CPU's TLB miss counts, for sizing workloads against what
+ * the TLB can map.
+ */
+void cpu_printtlbstats(void);
+
 /*
  * Hardware-level interrupt on/off, for the current CPU.
  *
@@ -156,6 +176,10 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_as sends it to all other CPUs that may have entries
+ * for the address space AS in their TLB (those whose c_tlbas is AS),
+ * and waits until they have done it. It must be called with
+ * interrupts enabled and no spinlocks held.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -170,6 +194,8 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+void ipi_tlbshootdown_as(struct addrspace *as,
+			 const struct tlbshootdown *mapping);
 
 void interprocessor_interrupt(void);
 
@@ -36,6 +36,7 @@
 
 
 struct uio;  /* in <uio.h> */
+struct devreq;
 
 /*
  * Filesystem-namespace-accessible device.
@@ -56,11 +57,39 @@ struct device {
  *      devop_eachopen - called on each open call to allow denying the open
  *      devop_io - for both reads and writes (the uio indicates the direction)
  *      devop_ioctl - miscellaneous control operations
+ *      devop_submit - start an asynchronous read or write (optional; may
+ *                     be NULL if the device only does synchronous I/O)
  */
 struct device_ops {
 	int (*devop_eachopen)(struct device *, int flags_from_open);
 	int (*devop_io)(struct device *, struct uio *);
 	int (*devop_ioctl)(struct device *, int op, userptr_t data);
+	int (*devop_submit)(struct device *, struct devreq *);
+};
+
+/*
+ * Asynchronous I/O request.
+ *
+ * The submitter fills in dr_uio, dr_done, and (if it likes) dr_data,
+ * and passes the request to dev_submit. If dev_submit returns 0, the
+ * request is queued and dr_done will be called exactly once, with
+ * the result, when it finishes. dr_done may be called from an
+ * interrupt handler, so it must not sleep. The uio must be
+ * UIO_SYSSPACE for the same reason, and it and the request must stay
+ * put until dr_done is called.
+ *
+ * The remaining fields belong to the driver while the request is
+ * queued.
+ */
+struct devreq {
+	struct uio *dr_uio;		/* what to transfer */
+	void (*dr_done)(struct devreq *, int result);
+	void *dr_data;			/* for the submitter's use */
+
+	struct devreq *dr_next;		/* driver queue linkage */
+	uint32_t dr_block;		/* first block */
+	uint32_t dr_nblocks;		/* number of blocks */
+	uint32_t dr_blocksdone;		/* number finished so far */
 };
 
 /*
@@ -77,6 +106,9 @@ struct vnode *dev_create_vnode(struct device *dev);
 /* Undo dev_create_vnode. */
 void dev_uncreate_vnode(struct vnode *vn);
 
+/* Start an asynchronous request, falling back to devop_io if need be. */
+int dev_submit(struct device *dev, struct devreq *req);
+
 /* Initialization functions for builtin vfs-level devices. */
 void devnull_create(void);
 
@@ -0,0 +1,46 @@
+#ifndef _KERN_DIRENT_H_
+#define _KERN_DIRENT_H_
+
+/*
+ * Directory entries as returned by getdirentries().
+ *
+ * The call fills the buffer with as many whole records as fit. Each
+ * is a struct dirent cut off after the NUL that ends d_name, padded
+ * to a multiple of _DIRENT_ALIGN bytes; d_reclen gives the length,
+ * so the next record starts d_reclen bytes on. d_type is the file's
+ * type from kern/stattypes.h shifted right by 12 bits.
+ *
+ * With GETDIRENTRIES_PLUS each record is a struct direntplus
+ * instead: the file's stat information, then the struct dirent,
+ * shortened the same way. Its d_reclen is the length of the whole
+ * record.
+ *
+ * Uses struct stat (kern/stat.h) and __NAME_MAX (kern/limits.h).
+ */
+
+/* Flag for getdirentries() */
+#define GETDIRENTRIES_PLUS	1	/* include stat information */
+
+struct dirent {
+	__ino_t d_ino;			/* inode number */
+	__u16 d_reclen;			/* length of this record */
+	__u8 d_type;			/* type of file */
+	__u8 d_namlen;			/* length of d_name, less the NUL */
+	char d_name[__NAME_MAX + 1];	/* name, NUL-terminated */
+};
+
+struct direntplus {
+	struct stat dp_stat;		/* as from fstat() */
+	struct dirent dp_dirent;	/* the entry itself */
+};
+
+/* Record lengths for a name NAMLEN characters long */
+#define _DIRENT_ALIGN		8
+#define _DIRENT_HEADSIZE	8	/* bytes before d_name */
+#define _DIRENT_RECLEN(namlen) \
+	((_DIRENT_HEADSIZE + (namlen) + 1 + _DIRENT_ALIGN - 1) & \
+	 ~(_DIRENT_ALIGN - 1))
+#define _DIRENTPLUS_RECLEN(namlen) \
+	(sizeof(struct stat) + _DIRENT_RECLEN(namlen))
+
+#endif /* _KERN_DIRENT_H_ */
@@ -34,6 +34,24 @@
  * ioctl operation codes
  */
 
-/* (none yet) */
+/*
+ * IOCTL_PREALLOC: reserve disk space for a range of a file up front,
+ * like posix_fallocate, so later writes to it go to contiguous blocks
+ * and can't run out of space. The file grows to cover the range if
+ * it is shorter, unless PREALLOC_KEEPSIZE is given; then the size is
+ * left alone and only later writes extend it. Space not written yet
+ * reads as zeros. The argument is a struct ioctl_prealloc. The file
+ * must be open for writing.
+ */
+#define IOCTL_PREALLOC	1
+
+struct ioctl_prealloc {
+	off_t ip_offset;	/* start of the range (bytes) */
+	off_t ip_length;	/* length of the range (bytes) */
+	int ip_flags;		/* PREALLOC_* */
+};
+
+/* Flags for ip_flags */
+#define PREALLOC_KEEPSIZE	1	/* don't change the file size */
 
 #endif /* _KERN_IOCTL_H_*/
@@ -37,30 +37,94 @@
  */
 
 #define SFS_MAGIC         0xabadf001    /* magic number identifying us */
-#define SFS_BLOCKSIZE     512           /* size of our blocks */
+#define SFS_BLOCKSIZE     512           /* smallest (and default) blk size */
+#define SFS_MAXBLOCKSIZE  4096          /* largest block size */
 #define SFS_VOLNAME_SIZE  32            /* max length of volume name */
 #define SFS_NDIRECT       15            /* # of direct blocks in inode */
 #define SFS_NINDIRECT     1             /* # of indirect blocks in inode */
-#define SFS_NDINDIRECT    0             /* # of 2x indirect blocks in inode */
-#define SFS_NTINDIRECT    0             /* # of 3x indirect blocks in inode */
-#define SFS_DBPERIDB      128           /* # direct blks per indirect blk */
+#define SFS_NDINDIRECT    1             /* # of 2x indirect blocks in inode */
+#define SFS_NTINDIRECT    1             /* # of 3x indirect blocks in inode */
 #define SFS_NAMELEN       60            /* max length of filename */
 #define SFS_SUPER_BLOCK   0             /* block the superblock lives in */
 #define SFS_FREEMAP_START 2             /* 1st block of the freemap */
 #define SFS_NOINO         0             /* inode # for free dir entry */
 #define SFS_ROOTDIR_INO   1             /* loc'n of the root dir inode */
 
+/*
+ * Format revisions (sb_version).
+ *
+ * In the original format each inode takes a whole block and the inode
+ * number is the block number. In the dense format inodes are
+ * SFS_DINODE_DENSESIZE bytes, packed SFS_INOPERBLOCK to a block in an
+ * inode table that follows the freemap and an inode bitmap; the inode
+ * number is the index into the table. A dense inode is the first
+ * SFS_DINODE_DENSESIZE bytes of struct sfs_dinode (the rest of
+ * sfi_inline is not stored). Inode 0 is never used.
+ */
+#define SFS_VERSION_ORIG  0             /* one inode per block */
+#define SFS_VERSION_DENSE 1             /* inode table */
+#define SFS_DINODE_DENSESIZE 128        /* bytes per inode in the table */
+
+/*
+ * Block size. The volume's block size (BS below) is sb_blocksize, a
+ * power of 2 from SFS_BLOCKSIZE to SFS_MAXBLOCKSIZE; 0 in volumes
+ * made before the field existed means SFS_BLOCKSIZE. All block
+ * numbers are in units of it. The superblock and (in the original
+ * format) each inode occupy the first SFS_BLOCKSIZE bytes of their
+ * blocks; the rest of those blocks is unused.
+ */
+#define SFS_SB_BLOCKSIZE(sb) \
+	((sb)->sb_blocksize == 0 ? SFS_BLOCKSIZE : (sb)->sb_blocksize)
+
+/* # direct blks per indirect blk */
+#define SFS_DBPERIDB(bs)      ((bs) / sizeof(uint32_t))
+
+/* # inodes per inode table block (dense) */
+#define SFS_INOPERBLOCK(bs)   ((bs) / SFS_DINODE_DENSESIZE)
+
 /* Number of bits in a block */
-#define SFS_BITSPERBLOCK (SFS_BLOCKSIZE * CHAR_BIT)
+#define SFS_BITSPERBLOCK(bs)  ((bs) * CHAR_BIT)
 
 /* Utility macro */
-#define SFS_ROUNDUP(a,b)       ((((a)+(b)-1)/(b))*b)
+#define SFS_ROUNDUP(a,b)       ((((a)+(b)-1)/(b))*(b))
 
 /* Size of free block bitmap (in bits) */
-#define SFS_FREEMAPBITS(nblocks) SFS_ROUNDUP(nblocks, SFS_BITSPERBLOCK)
+#define SFS_FREEMAPBITS(nblocks, bs) \
+	SFS_ROUNDUP(nblocks, SFS_BITSPERBLOCK(bs))
 
 /* Size of free block bitmap (in blocks) */
-#define SFS_FREEMAPBLOCKS(nblocks)  (SFS_FREEMAPBITS(nblocks)/SFS_BITSPERBLOCK)
+#define SFS_FREEMAPBLOCKS(nblocks, bs) \
+	(SFS_FREEMAPBITS(nblocks, bs)/SFS_BITSPERBLOCK(bs))
+
+/* Size of the dense-format inode bitmap and inode table (in blocks) */
+#define SFS_INOMAPBLOCKS(ninodes, bs) SFS_FREEMAPBLOCKS(ninodes, bs)
+#define SFS_ITABLEBLOCKS(ninodes, bs) ((ninodes) / SFS_INOPERBLOCK(bs))
+
+/*
+ * Inode flags (sfi_flags). An SFS_IFLAG_INLINE file has no blocks;
+ * its contents are kept in sfi_inline, which holds SFS_INLINESIZE
+ * bytes (SFS_INLINESIZE_DENSE in the dense format). Otherwise
+ * sfi_inline is unused and set to 0.
+ *
+ * Files are only made inline in the dense format. In the original
+ * format sfi_inline is where sfi_waste used to be, and tools from
+ * before inline files existed would zero it; such volumes can still
+ * be read if they have inline files, but won't get any new ones.
+ */
+#define SFS_IFLAG_INLINE  0x1
+#define SFS_DINODE_HEADSIZE  (4*(6+SFS_NDIRECT))  /* bytes before sfi_inline */
+#define SFS_INLINESIZE       (SFS_BLOCKSIZE - SFS_DINODE_HEADSIZE)
+#define SFS_INLINESIZE_DENSE (SFS_DINODE_DENSESIZE - SFS_DINODE_HEADSIZE)
+
+/*
+ * A data block pointer (in sfi_direct or a bottom-level indirect
+ * block at any depth) with SFS_UNWRITTEN set names a block that was
+ * reserved for the file ahead of time and hasn't been written since:
+ * it is allocated, but the file reads zeros there. SFS_BLOCKNUM gets
+ * the block number.
+ */
+#define SFS_UNWRITTEN     0x80000000
+#define SFS_BLOCKNUM(ptr) ((ptr) & ~(uint32_t)SFS_UNWRITTEN)
 
 /* File types for sfi_type */
 #define SFS_TYPE_INVAL    0       /* Should not appear on disk */
@@ -74,7 +138,56 @@ struct sfs_superblock {
 	uint32_t sb_magic;		/* Magic number; should be SFS_MAGIC */
 	uint32_t sb_nblocks;			/* Number of blocks in fs */
 	char sb_volname[SFS_VOLNAME_SIZE];	/* Name of this volume */
-	uint32_t reserved[118];			/* unused, set to 0 */
+	uint32_t sb_version;			/* SFS_VERSION_* */
+	uint32_t sb_ninodes;			/* Inodes in table (dense) */
+	uint32_t sb_inomapstart;		/* 1st inode bitmap blk (dense) */
+	uint32_t sb_itablestart;		/* 1st inode table blk (dense) */
+	uint32_t sb_blocksize;			/* Block size (bytes) */
+	uint32_t sb_journalstart;		/* 1st journal blk (if any) */
+	uint32_t sb_journalblocks;		/* Journal size; 0 if none */
+	uint32_t reserved[111];			/* unused, set to 0 */
+};
+
+/*
+ * Metadata journal. A volume with sb_journalblocks nonzero has a
+ * journal of that many blocks at sb_journalstart, after the inode
+ * table (dense format) or the freemap (original format). The first
+ * block holds the journal header (at its start, like the superblock)
+ * and the rest is the log.
+ *
+ * A transaction is written by copying the new contents of each
+ * metadata block it changes into the log, in order from the first
+ * log block, and then writing a header with jh_state set to
+ * SFS_JSTATE_COMMITTED that lists, in jh_blocks, where each log block
+ * belongs. Once the blocks have been written in place, the header is
+ * set back to SFS_JSTATE_CLEAN with jh_seq advanced. To recover from
+ * a crash, copy the log blocks of a committed transaction into place.
+ *
+ * jh_sum is a checksum of the log blocks of a committed transaction:
+ * starting from jh_seq, for each 32-bit word of each block (in disk
+ * byte order), rotate the sum left one bit and xor in the word.
+ *
+ * SFS_JSTATE_UNSAFE means metadata may have been written in place
+ * without going through the journal (a transaction too big for it)
+ * and the volume should be fully checked.
+ */
+#define SFS_JMAGIC        0x4a524e4c    /* "JRNL" */
+#define SFS_JSTATE_CLEAN     0          /* nothing to recover */
+#define SFS_JSTATE_COMMITTED 1          /* log holds a transaction */
+#define SFS_JSTATE_UNSAFE    2          /* needs a full check */
+#define SFS_JMINBLOCKS    2             /* header and one log block */
+#define SFS_JMAXBLOCKS    123           /* most blocks in a transaction */
+
+/*
+ * On-disk journal header
+ */
+struct sfs_jheader {
+	uint32_t jh_magic;			/* Should be SFS_JMAGIC */
+	uint32_t jh_state;			/* One of SFS_JSTATE_* above */
+	uint32_t jh_seq;			/* Transaction sequence number */
+	uint32_t jh_nblocks;			/* Blocks in the log */
+	uint32_t jh_sum;			/* Checksum of the log blocks */
+	uint32_t jh_blocks[SFS_JMAXBLOCKS];	/* Home of each log block */
 };
 
 /*
@@ -86,7 +199,10 @@ struct sfs_dinode {
 	uint16_t sfi_linkcount;			/* # hard links to this file */
 	uint32_t sfi_direct[SFS_NDIRECT];	/* Direct blocks */
 	uint32_t sfi_indirect;			/* Indirect block */
-	uint32_t sfi_waste[128-3-SFS_NDIRECT];	/* unused space, set to 0 */
+	uint32_t sfi_dindirect;			/* Double indirect block */
+	uint32_t sfi_tindirect;			/* Triple indirect block */
+	uint32_t sfi_flags;			/* SFS_IFLAG_* above */
+	char sfi_inline[SFS_INLINESIZE];	/* Inline data, or set to 0 */
 };
 
 /*
@@ -0,0 +1,59 @@
+#ifndef _NAMECACHE_H_
+#define _NAMECACHE_H_
+
+/*
+ * Directory name lookup cache.
+ *
+ * Remembers the results of looking up a name in a directory: either
+ * the vnode the name refers to, or the fact that there is no such
+ * name (a negative entry). Filesystems consult it in their lookup
+ * routines and must purge a name whenever they create, remove, or
+ * rename it, while still holding the directory locked. Only
+ * filesystems that do this may enter names.
+ *
+ * The cache holds a reference to each vnode it maps a name to, but
+ * not to the directories; a filesystem must call namecache_purgedir
+ * before it frees a directory vnode.
+ *
+ * Functions:
+ *     namecache_bootstrap  - set up the cache. Panics on failure.
+ *     namecache_lookup     - look up NAME in DIR. Returns true on a hit,
+ *                            with *RET holding a new reference to the
+ *                            vnode, or NULL if the name is known not to
+ *                            exist. Returns false if not cached.
+ *     namecache_enter      - remember that NAME in DIR is VN (which may
+ *                            be NULL for "doesn't exist").
+ *     namecache_purge      - forget NAME in DIR.
+ *     namecache_purgedir   - forget every name in DIR.
+ *     namecache_purgefs    - forget every name in directories on FS.
+ *                            Called at unmount.
+ *     namecache_printstats - print hit/miss counters.
+ *
+ * The purge functions drop the cache's references, which may cause
+ * vnodes to be reclaimed, so the caller must not hold any lock that
+ * the filesystem's reclaim routine would need. The cache's own lock is
+ * never held across calls into the filesystem.
+ */
+
+struct fs;	/* in fs.h */
+struct vnode;	/* in vnode.h */
+
+/* Longest name that will be cached; longer ones always miss. */
+#define NAMECACHE_NAMELEN	31
+
+/* Number of entries. */
+#define NAMECACHE_SIZE		128
+
+void namecache_bootstrap(void);
+
+bool namecache_lookup(struct vnode *dir, const char *name,
+		      struct vnode **ret);
+void namecache_enter(struct vnode *dir, const char *name, struct vnode *vn);
+void namecache_purge(struct vnode *dir, const char *name);
+void namecache_purgedir(struct vnode *dir);
+void namecache_purgefs(struct fs *fs);
+
+void namecache_printstats(void);
+
+
+#endif /* _NAMECACHE_H_ */
@@ -0,0 +1,60 @@
+#ifndef _PAGETABLE_H_
+#define _PAGETABLE_H_
+
+/*
+ * Two-level page table.
+ *
+ * The top 10 bits of a virtual address select an entry in the first
+ * level, which points to a second-level table (or is NULL if nothing
+ * in that 4M of the address space has been touched); the next 10
+ * bits select the page table entry within it. Both levels are one
+ * page in size.
+ *
+ * A page table entry holds the physical frame in the same bits as a
+ * physical address, and flags in the low bits. An entry of 0 means
+ * the page has never been touched. A page that has been paged out
+ * has PTE_SWAPPED set instead of PTE_VALID, and its swap slot number
+ * where the frame number would be.
+ *
+ * PTE_WRITE is set when as_fault last found that the page may be
+ * mapped writeable, so that TLB misses can be refilled straight from
+ * the table without asking again (see vm_fault). Anything that takes
+ * the right away must clear it before shooting down the TLB entries.
+ *
+ * The page table does no locking of its own; it belongs to an
+ * address space and is protected by the address space's lock.
+ */
+
+#include <vm.h>
+
+typedef uint32_t pte_t;
+
+#define PTE_FRAME	PAGE_FRAME	/* physical frame */
+#define PTE_VALID	0x00000001	/* frame is in memory */
+#define PTE_SWAPPED	0x00000002	/* page is in swap */
+#define PTE_WRITE	0x00000004	/* may be mapped writeable */
+
+#define PTE_SLOT(pte)		((pte) >> 12)	/* swap slot, if swapped */
+#define PTE_MKSWAPPED(slot)	(((pte_t)(slot) << 12) | PTE_SWAPPED)
+#define PTE_MAXSLOTS		(1U << 20)	/* slots an entry can name */
+
+#define PT_L1_ENTRIES	1024
+#define PT_L2_ENTRIES	1024
+#define PT_L1_INDEX(va)	((va) >> 22)
+#define PT_L2_INDEX(va)	(((va) >> 12) & (PT_L2_ENTRIES - 1))
+#define PT_VADDR(l1, l2) (((vaddr_t)(l1) << 22) | ((vaddr_t)(l2) << 12))
+
+struct pagetable {
+	pte_t *pt_l2[PT_L1_ENTRIES];	/* second-level tables */
+};
+
+struct pagetable *pt_create(void);
+void pt_destroy(struct pagetable *pt);
+
+/* Return the entry for VA, or NULL if its second-level table doesn't exist */
+pte_t *pt_get(struct pagetable *pt, vaddr_t va);
+
+/* Same, but create the second-level table if necessary */
+int pt_getcreate(struct pagetable *pt, vaddr_t va, pte_t **ret);
+
+#endif /* _PAGETABLE_H_ */
@@ -48,6 +48,31 @@
  */
 #include <kern/sfs.h>
 
+/*
+ * Locking.
+ *
+ * sv_lock protects a vnode's inode (sv_i, sv_dirty), its data and
+ * block map, and its readahead state; for a directory it also covers
+ * the directory entries. sfs_vnlock protects the table of loaded
+ * vnodes and its hash index. sfs_dirtylock protects the list of vnodes
+ * with dirty inodes (a vnode is on it exactly when sv_dirty is set).
+ * sfs_freemaplock protects the freemap, the inode bitmap, their
+ * dirty-block maps, the list of deferred frees, the superblock, and
+ * the allocation hint. sfs_jlock protects the journal state; nothing
+ * else is taken while holding it. sfs_orphanlock protects the queue
+ * of removed files waiting to be freed; nothing else is taken while
+ * holding it either. The inode type and number never change once a
+ * vnode is loaded and may be read without locking.
+ *
+ * Lock ordering: a directory's sv_lock before the sv_lock of a file
+ * in it, then sfs_vnlock, then sfs_dirtylock or sfs_freemaplock
+ * (neither is held while taking the other). (The buffer cache's
+ * internal lock comes after all of these.)
+ */
+
+struct sfs_dirindex;	/* private to sfs_dir.c */
+struct sfs_orphan;	/* private to sfs_inode.c */
+
 /*
  * In-memory inode
  */
@@ -56,6 +81,27 @@ struct sfs_vnode {
 	struct sfs_dinode sv_i;		/* copy of on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+	struct sfs_vnode *sv_dirtynext; /* sfs_dirtyvn list linkage */
+	struct sfs_vnode *sv_dirtyprev;
+	struct lock *sv_lock;           /* lock for this vnode */
+	struct sfs_vnode *sv_hashnext;  /* next in sfs_vnhash chain */
+	unsigned sv_tableindex;         /* position in sfs_vnodes */
+
+	/* Sequential read detection and readahead state */
+	uint32_t sv_ranext;             /* file block a sequential read hits */
+	uint32_t sv_rawindow;           /* readahead window, in blocks */
+	uint32_t sv_raend;              /* blocks before this already queued */
+
+	/*
+	 * Last bottom-level indirect block sfs_bmap went through under
+	 * the double or triple indirect block, so lookups nearby can
+	 * skip the levels above it. Cleared by sfs_itrunc.
+	 */
+	uint32_t sv_idcachebase;        /* first file block it maps */
+	daddr_t sv_idcacheblock;        /* its disk block, or 0 if none */
+
+	/* Directories only: lookup index, built when first needed */
+	struct sfs_dirindex *sv_dirindex;
 };
 
 /*
@@ -64,11 +110,43 @@ struct sfs_vnode {
 struct sfs_fs {
 	struct fs sfs_absfs;            /* abstract filesystem structure */
 	struct sfs_superblock sfs_sb;	/* copy of on-disk superblock */
+	uint32_t sfs_blocksize;         /* block size (bytes) */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
 	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct sfs_vnode **sfs_vnhash;  /* sfs_vnodes hashed by inode number */
+	unsigned sfs_vnhashsize;        /* number of chains (power of 2) */
+	struct lock *sfs_vnlock;        /* lock for sfs_vnodes/sfs_vnhash */
+	struct sfs_vnode *sfs_dirtyvn;  /* vnodes with sv_dirty set */
+	unsigned sfs_ndirtyvn;          /* number of them */
+	struct lock *sfs_dirtylock;     /* lock for sfs_dirtyvn */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
-	bool sfs_freemapdirty;          /* true if freemap modified */
+	struct bitmap *sfs_freemapdirty; /* freemap blocks modified */
+	struct bitmap *sfs_inomap;      /* inodes in use (dense format) */
+	struct bitmap *sfs_inomapdirty; /* inomap blocks modified */
+	unsigned sfs_mapdirtycount;     /* blocks marked in those two */
+	uint32_t *sfs_freed;            /* frees waiting for a commit */
+	unsigned sfs_nfreed;            /* number of them */
+	unsigned sfs_maxfreed;          /* room in sfs_freed */
+	struct lock *sfs_freemaplock;   /* lock for freemap and superblock */
+	daddr_t sfs_allocnext;          /* where to look when no better hint */
+
+	/* Journal, if sb_journalblocks is nonzero (see sfs_journal.c) */
+	struct lock *sfs_jlock;         /* lock for the journal state */
+	struct cv *sfs_jcv;             /* for waiting on it */
+	int sfs_jphase;                 /* SFS_JIDLE, etc. */
+	unsigned sfs_jactive;           /* operations in progress */
+	uint32_t sfs_jseq;              /* sequence # of running transaction */
+	int sfs_jresult;                /* result of the last commit */
+	bool sfs_junsafe;               /* volume may be inconsistent */
+	struct sfs_jheader *sfs_jhead;  /* header, built during commit */
+
+	/* Removed files whose blocks are freed in the background */
+	struct sfs_orphan *sfs_orphans; /* waiting to be freed */
+	bool sfs_orphanbusy;            /* someone is freeing them */
+	struct thread *sfs_orphanthread; /* that thread */
+	struct lock *sfs_orphanlock;    /* lock for the above */
+	struct cv *sfs_orphancv;        /* for waiting until they're freed */
 };
 
 /*
@@ -0,0 +1,27 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swap: paging user pages out to disk when memory runs short.
+ *
+ * Pages are kept in page-sized slots on a raw disk, which has to be
+ * attached with swap_attach (DEVNAME without the colon) before
+ * anything can be paged out. swap_evict is called by the coremap
+ * when it has no free pages; it pages some out and returns true, or
+ * returns false if it couldn't (no swap disk, swap full, or nothing
+ * that can be paged out).
+ *
+ * swap_read fills the page at PADDR from SLOT; swap_free gives the
+ * slot back.
+ */
+
+/* Largest number of pages written out at once */
+#define SWAP_CLUSTER	8
+
+int swap_attach(const char *devname);
+bool swap_evict(void);
+int swap_read(unsigned slot, paddr_t paddr);
+void swap_free(unsigned slot);
+void swap_printstats(void);
+
+#endif /* _SWAP_H_ */
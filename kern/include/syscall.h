@@ -66,9 +66,14 @@ int sys_dup2(int oldfd, int newfd, int *retval);
 int sys___getcwd(userptr_t buf, size_t nbytes, int *retval);
 int sys_chdir(userptr_t pathname);
 int sys_fstat(int fd, userptr_t statbuf);
+int sys_ioctl(int fd, int code, userptr_t data);
+int sys_getdirentry(int fd, userptr_t buf, size_t buflen, int *retval);
+int sys_getdirentries(int fd, userptr_t buf, size_t buflen, int flags,
+		      int *retval);
 
 int sys_fork(struct trapframe *tf, int *retval);
 int sys_getpid(int *retval);
+int sys_sbrk(intptr_t amount, int *retval);
 int sys_waitpid(pid_t pid, userptr_t status, int options, int *retval);
 int sys__exit(int exitcode);
 int sys_execv(userptr_t progname, userptr_t args);
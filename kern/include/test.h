@@ -105,6 +105,7 @@ int writestress(int, char **);
 int writestress2(int, char **);
 int longstress(int, char **);
 int createstress(int, char **);
+int fsbench(int, char **);
 int printfile(int, char **);
 
 /* HMAC/hash tests */
@@ -39,6 +39,8 @@
 
 #include <machine/vm.h>
 
+struct addrspace;
+
 /* Fault-type arguments to vm_fault() */
 #define VM_FAULT_READ        0    /* A read was attempted */
 #define VM_FAULT_WRITE       1    /* A write was attempted */
@@ -65,5 +67,18 @@ unsigned int coremap_used_bytes(void);
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown(const struct tlbshootdown *);
 
+/* Invalidate all of this CPU's TLB entries */
+void vm_tlbflush(void);
+
+/* Map VADDR to PADDR in this CPU's TLB (not used by dumbvm) */
+void vm_tlbload(vaddr_t vaddr, paddr_t paddr, bool writeable);
+
+/*
+ * Invalidate the TLB entry for VADDR in AS, or all of AS's entries
+ * for VM_TLB_ALL, here and on other CPUs (not used by dumbvm).
+ */
+#define VM_TLB_ALL ((vaddr_t)-1)
+void vm_tlbinvalidate(struct addrspace *as, vaddr_t vaddr);
+
 
 #endif /* _VM_H_ */
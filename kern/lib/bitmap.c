@@ -120,6 +120,91 @@ bitmap_alloc(struct bitmap *b, unsigned *index)
         return ENOSPC;
 }
 
+/*
+ * Return the first clear bit in [start, end), or end if there is none.
+ */
+static
+unsigned
+bitmap_scanclear(struct bitmap *b, unsigned start, unsigned end)
+{
+        unsigned bit = start;
+
+        while (bit < end) {
+                if (bit % BITS_PER_WORD == 0 &&
+                    b->v[bit / BITS_PER_WORD] == WORD_ALLBITS) {
+                        bit += BITS_PER_WORD;
+                        continue;
+                }
+                if ((b->v[bit / BITS_PER_WORD] &
+                     ((WORD_TYPE)1 << (bit % BITS_PER_WORD))) == 0) {
+                        return bit;
+                }
+                bit++;
+        }
+        return end;
+}
+
+int
+bitmap_alloc_near(struct bitmap *b, unsigned start, unsigned *index)
+{
+        unsigned bit;
+
+        if (start >= b->nbits) {
+                start = 0;
+        }
+        bit = bitmap_scanclear(b, start, b->nbits);
+        if (bit >= b->nbits) {
+                bit = bitmap_scanclear(b, 0, start);
+                if (bit >= start) {
+                        return ENOSPC;
+                }
+        }
+        b->v[bit / BITS_PER_WORD] |= (WORD_TYPE)1 << (bit % BITS_PER_WORD);
+        *index = bit;
+        return 0;
+}
+
+/*
+ * Look for LEN clear bits in a row within [start, end).
+ */
+static
+int
+bitmap_findrun_range(struct bitmap *b, unsigned start, unsigned end,
+                     unsigned len, unsigned *index)
+{
+        unsigned bit, runstart;
+
+        bit = bitmap_scanclear(b, start, end);
+        while (bit < end) {
+                runstart = bit;
+                while (bit < end && bit - runstart < len &&
+                       !bitmap_isset(b, bit)) {
+                        bit++;
+                }
+                if (bit - runstart == len) {
+                        *index = runstart;
+                        return 0;
+                }
+                bit = bitmap_scanclear(b, bit, end);
+        }
+        return ENOSPC;
+}
+
+int
+bitmap_findrun(struct bitmap *b, unsigned start, unsigned len,
+               unsigned *index)
+{
+        KASSERT(len > 0);
+
+        if (start >= b->nbits) {
+                start = 0;
+        }
+        if (bitmap_findrun_range(b, start, b->nbits, len, index) == 0) {
+                return 0;
+        }
+        return bitmap_findrun_range(b, 0, start, len, index);
+}
+
 static
 inline
 void
@@ -157,6 +242,25 @@ bitmap_unmark(struct bitmap *b, unsigned index)
         b->v[ix] &= ~mask;
 }
 
+void
+bitmap_unmarkrange(struct bitmap *b, unsigned start, unsigned len)
+{
+        unsigned bit = start, end = start + len;
+
+        KASSERT(end >= start && end <= b->nbits);
+
+        while (bit < end) {
+                if (bit % BITS_PER_WORD == 0 && end - bit >= BITS_PER_WORD) {
+                        KASSERT(b->v[bit / BITS_PER_WORD] == WORD_ALLBITS);
+                        b->v[bit / BITS_PER_WORD] = 0;
+                        bit += BITS_PER_WORD;
+                        continue;
+                }
+                bitmap_unmark(b, bit);
+                bit++;
+        }
+}
+
 
 int
 bitmap_isset(struct bitmap *b, unsigned index)
@@ -36,15 +36,20 @@
 #include <uio.h>
 #include <clock.h>
 #include <mainbus.h>
+#include <cpu.h>
 #include <synch.h>
 #include <thread.h>
 #include <proc.h>
 #include <proctable.h>
 #include <vfs.h>
+#include <buf.h>
+#include <namecache.h>
 #include <sfs.h>
+#include <swap.h>
 #include <syscall.h>
 #include <test.h>
 #include <prompt.h>
+#include "opt-dumbvm.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
 #include "opt-synchprobs.h"
@@ -507,6 +512,81 @@ cmd_kheapgeneration(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_bufstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	buffer_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_namecachestats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	namecache_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_tlbstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	cpu_printtlbstats();
+
+	return 0;
+}
+
+#if !OPT_DUMBVM
+/*
+ * Command for attaching swap. Nothing is paged out until this has
+ * been done.
+ */
+static
+int
+cmd_swapon(int nargs, char **args)
+{
+	char *device;
+
+	if (nargs != 2) {
+		kprintf("Usage: swapon device\n");
+		return EINVAL;
+	}
+
+	device = args[1];
+
+	/* Allow (but do not require) colon after device name */
+	if (device[strlen(device)-1]==':') {
+		device[strlen(device)-1] = 0;
+	}
+
+	return swap_attach(device);
+}
+
+static
+int
+cmd_swapstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	swap_printstats();
+
+	return 0;
+}
+#endif
+
 static
 int
 cmd_kheapdump(int nargs, char **args)
@@ -559,6 +639,9 @@ static const char *opsmenu[] = {
 	"[mount]   Mount a filesystem        ",
 	"[unmount] Unmount a filesystem      ",
 	"[bootfs]  Set \"boot\" filesystem     ",
+#if !OPT_DUMBVM
+	"[swapon]  Attach swap disk          ",
+#endif
 	"[pf]      Print a file              ",
 	"[cd]      Change directory          ",
 	"[pwd]     Print current directory   ",
@@ -624,6 +707,7 @@ static const char *testmenu[] = {
 	"[fs4] FS write stress 2             ",
 	"[fs5] FS long stress                ",
 	"[fs6] FS create stress              ",
+	"[fs7] FS concurrency benchmark      ",
 	"[hm1] HMAC unit test                ",
 	NULL
 };
@@ -675,6 +759,12 @@ static const char *mainmenu[] = {
 	"[khu] Kernel heap usage             ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[bc] Buffer cache stats             ",
+	"[nc] Name cache stats               ",
+	"[tlb] TLB miss stats                ",
+#if !OPT_DUMBVM
+	"[sw] Swap stats                     ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -714,6 +804,9 @@ static struct {
 	{ "mount",	cmd_mount },
 	{ "unmount",	cmd_unmount },
 	{ "bootfs",	cmd_bootfs },
+#if !OPT_DUMBVM
+	{ "swapon",	cmd_swapon },
+#endif
 	{ "pf",		printfile },
 	{ "cd",		cmd_chdir },
 	{ "pwd",	cmd_pwd },
@@ -730,6 +823,12 @@ static struct {
 	{ "khu",        cmd_kheapused },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "bc",         cmd_bufstats },
+	{ "nc",         cmd_namecachestats },
+	{ "tlb",        cmd_tlbstats },
+#if !OPT_DUMBVM
+	{ "sw",         cmd_swapstats },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -801,6 +900,7 @@ static struct {
 	{ "fs4",	writestress2 },
 	{ "fs5",	longstress },
 	{ "fs6",	createstress },
+	{ "fs7",	fsbench },
 
 	/* HMAC unit tests */
 	{ "hm1",	hmacu1 },
@@ -915,6 +1015,9 @@ menu_execute(char *line, int isargs)
  * the kernel command line
  *
  *      "mount sfs lhd0; bootfs lhd0; s"
+ *
+ * With the VM system (not dumbvm), "swapon lhd1" would also page to
+ * lhd1.
  */
 
 void
@@ -10,9 +10,11 @@
 #include <vfs.h>
 #include <vnode.h>
 #include <kern/fcntl.h>
+#include <kern/ioctl.h>
 #include <kern/errno.h>
 #include <kern/seek.h>		/* Contains the codes for lseek whence */
 #include <kern/stat.h>
+#include <kern/dirent.h>
 
 #define UINT_BIT_MASK	0xFFFFFFFF
 
@@ -384,3 +386,102 @@ int sys_fstat(int fd, userptr_t statbuf)
 
 	return 0;
 }
+
+int sys_ioctl(int fd, int code, userptr_t data)
+{
+	KASSERT(curproc->p_filetable != NULL);
+
+	int err;
+	struct filehandle *fh;
+
+	if (fd < 0 || fd >= OPEN_MAX)
+		return EBADF;
+
+	lock_acquire(curproc->p_filetable->lk);
+	fh = filetable_lookup(fd, curproc->p_filetable);
+	lock_release(curproc->p_filetable->lk);
+
+	if (fh == NULL)
+		return EBADF;
+
+	lock_acquire(fh->fh_lk);
+
+	/* Reserving space changes the file, so it must be open for writing */
+	if (code == IOCTL_PREALLOC && (fh->flag & O_ACCMODE) == O_RDONLY) {
+		lock_release(fh->fh_lk);
+		return EBADF;
+	}
+
+	err = VOP_IOCTL(fh->vn, code, data);
+	lock_release(fh->fh_lk);
+
+	return err;
+}
+
+/*
+ * Read directory entries. The file offset is the filesystem's cookie
+ * for where the next entry is, not a byte position, so it is taken
+ * from whatever the call leaves in the uio rather than advanced by
+ * the amount transferred.
+ */
+static int getdirentries_common(int fd, userptr_t buf, size_t buflen,
+				bool batched, int flags, int *retval)
+{
+	KASSERT(curproc->p_filetable != NULL);
+
+	int res;
+	struct filehandle *fh;
+	struct uio block;
+	struct iovec vec;
+
+	res = readwrite_check(fd, buf);
+	if (res)
+		return res;
+
+	lock_acquire(curproc->p_filetable->lk);
+	fh = filetable_lookup(fd, curproc->p_filetable);
+	lock_release(curproc->p_filetable->lk);
+
+	if (fh == NULL)
+		return EBADF;
+
+	lock_acquire(fh->fh_lk);
+
+	if ((fh->flag & O_ACCMODE) == O_WRONLY) {
+		lock_release(fh->fh_lk);
+		return EBADF;
+	}
+
+	uio_uinit(&vec, &block, buf, buflen, curproc->p_addrspace,
+		  fh->offset, UIO_READ);
+
+	if (batched)
+		res = VOP_GETDIRENTRIES(fh->vn, &block, flags);
+	else
+		res = VOP_GETDIRENTRY(fh->vn, &block);
+	if (res) {
+		lock_release(fh->fh_lk);
+		return res;
+	}
+
+	*retval = buflen - block.uio_resid;
+	fh->offset = block.uio_offset;
+
+	lock_release(fh->fh_lk);
+
+	return 0;
+}
+
+int sys_getdirentry(int fd, userptr_t buf, size_t buflen, int *retval)
+{
+	return getdirentries_common(fd, buf, buflen, false, 0, retval);
+}
+
+int sys_getdirentries(int fd, userptr_t buf, size_t buflen, int flags,
+		      int *retval)
+{
+	if (flags & ~GETDIRENTRIES_PLUS)
+		return EINVAL;
+
+	return getdirentries_common(fd, buf, buflen, true, flags, retval);
+}
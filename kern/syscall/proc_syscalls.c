@@ -70,6 +70,29 @@ int sys_getpid(int *retval)
 	return 0;
 }
 
+int sys_sbrk(intptr_t amount, int *retval)
+{
+	struct addrspace *as;
+	vaddr_t oldbreak;
+	int err;
+
+	KASSERT(curproc != NULL);
+
+	as = proc_getas();
+	if (as == NULL) {
+		return ENOMEM;
+	}
+
+	err = as_sbrk(as, amount, &oldbreak);
+	if (err) {
+		return err;
+	}
+
+	*retval = (int)oldbreak;
+
+	return 0;
+}
+
 int sys_waitpid(pid_t pid, userptr_t status, int options, int *retval)
 {
 	struct ptablenode *childnode;
@@ -101,6 +101,22 @@ bitmaptest(int nargs, char **args)
 		KASSERT(data[i]==0);
 	}
 
+	/* Clear a run that starts and ends partway through a byte */
+	bitmap_unmarkrange(b, 13, 100);
+	for (i=0; i<TESTSIZE; i++) {
+		if (i >= 13 && i < 113) {
+			KASSERT(bitmap_isset(b, i)==0);
+		}
+		else {
+			KASSERT(bitmap_isset(b, i));
+		}
+	}
+	KASSERT(bitmap_findrun(b, 0, 100, &x)==0);
+	KASSERT(x == 13);
+	KASSERT(bitmap_findrun(b, 0, 101, &x)!=0);
+
+	bitmap_destroy(b);
+
 	kprintf("Bitmap test complete\n");
 	return 0;
 }
@@ -42,6 +42,8 @@
 #include <kern/errno.h>
 #include <kern/fcntl.h>
 #include <lib.h>
+#include <clock.h>
+#include <cpu.h>
 #include <uio.h>
 #include <thread.h>
 #include <synch.h>
@@ -57,6 +59,12 @@
 #define NLONG    32
 #define NCREATE  24
 
+/* For the concurrency benchmark */
+#define NBENCHTHREADS	8
+#define NBENCHBLOCKS	8
+#define NBENCHPASSES	64
+#define BENCHBLOCKSIZE	512
+
 static struct semaphore *threadsem = NULL;
 
 static
@@ -674,6 +682,128 @@ docreatestress(const char *filesys)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Concurrency benchmark. Each thread repeatedly overwrites and reads
+ * back its own small file; with the data staying in the buffer
+ * cache, this measures how well the filesystem code itself scales
+ * with the number of CPUs. Run it with 1, 2, 4, ... threads and
+ * report the aggregate throughput for each.
+ */
+
+static
+void
+fsbench_thread(void *fs, unsigned long num)
+{
+	const char *filesys = fs;
+	char name[32];
+	struct vnode *vn;
+	struct iovec iov;
+	struct uio ku;
+	char *block;
+	int err, pass, i;
+
+	snprintf(name, sizeof(name), "%s:%sb%lu", filesys, FILENAME, num);
+
+	block = kmalloc(BENCHBLOCKSIZE);
+	if (block == NULL) {
+		kprintf("*** Thread %lu: Out of memory\n", num);
+		V(threadsem);
+		return;
+	}
+
+	err = vfs_open(name, O_RDWR|O_CREAT|O_TRUNC, 0664, &vn);
+	if (err) {
+		kprintf("*** Thread %lu: open: %s\n", num, strerror(err));
+		kfree(block);
+		V(threadsem);
+		return;
+	}
+
+	for (pass=0; pass<NBENCHPASSES; pass++) {
+		for (i=0; i<NBENCHBLOCKS; i++) {
+			memset(block, 'a' + (pass + i) % 26, BENCHBLOCKSIZE);
+			uio_kinit(&iov, &ku, block, BENCHBLOCKSIZE,
+				  (off_t)i * BENCHBLOCKSIZE, UIO_WRITE);
+			err = VOP_WRITE(vn, &ku);
+			if (err || ku.uio_resid > 0) {
+				kprintf("*** Thread %lu: write failed\n",
+					num);
+				goto out;
+			}
+		}
+		for (i=0; i<NBENCHBLOCKS; i++) {
+			uio_kinit(&iov, &ku, block, BENCHBLOCKSIZE,
+				  (off_t)i * BENCHBLOCKSIZE, UIO_READ);
+			err = VOP_READ(vn, &ku);
+			if (err || ku.uio_resid > 0) {
+				kprintf("*** Thread %lu: read failed\n",
+					num);
+				goto out;
+			}
+			if (block[BENCHBLOCKSIZE-1] != 'a' + (pass + i) % 26) {
+				kprintf("*** Thread %lu: data mismatch\n",
+					num);
+				goto out;
+			}
+		}
+	}
+
+ out:
+	vfs_close(vn);
+	snprintf(name, sizeof(name), "%s:%sb%lu", filesys, FILENAME, num);
+	vfs_remove(name);
+	kfree(block);
+	V(threadsem);
+}
+
+static
+void
+dofsbench(const char *filesys)
+{
+	struct timespec before, after;
+	uint64_t bytes, usecs;
+	unsigned nthreads, i;
+	int err;
+
+	init_threadsem();
+
+	kprintf("*** Starting fs concurrency benchmark on %s (%u cpus):\n",
+		filesys, num_cpus);
+
+	for (nthreads=1; nthreads<=NBENCHTHREADS; nthreads*=2) {
+		gettime(&before);
+		for (i=0; i<nthreads; i++) {
+			err = thread_fork("fsbench", NULL,
+					  fsbench_thread, (char *)filesys, i);
+			if (err) {
+				panic("fsbench: thread_fork failed %s\n",
+				      strerror(err));
+			}
+		}
+		for (i=0; i<nthreads; i++) {
+			P(threadsem);
+		}
+		gettime(&after);
+		timespec_sub(&after, &before, &after);
+
+		bytes = (uint64_t)nthreads * NBENCHPASSES * NBENCHBLOCKS *
+			BENCHBLOCKSIZE * 2;
+		usecs = (uint64_t)after.tv_sec * 1000000 +
+			after.tv_nsec / 1000;
+		if (usecs == 0) {
+			usecs = 1;
+		}
+		kprintf("%2u threads: %llu KB in %llu.%06llu sec, "
+			"%llu KB/sec\n", nthreads,
+			bytes / 1024, usecs / 1000000, usecs % 1000000,
+			bytes * 1000000 / 1024 / usecs);
+	}
+
+	kprintf("*** fs concurrency benchmark done\n");
+}
+
+////////////////////////////////////////////////////////////
+
 static
 int
 checkfilesystem(int nargs, char **args)
@@ -681,7 +811,7 @@ checkfilesystem(int nargs, char **args)
 	char *device;
 
 	if (nargs != 2) {
-		kprintf("Usage: fs[123456] filesystem:\n");
+		kprintf("Usage: fs[1234567] filesystem:\n");
 		return EINVAL;
 	}
 
@@ -714,6 +844,7 @@ DEFTEST(writestress);
 DEFTEST(writestress2);
 DEFTEST(longstress);
 DEFTEST(createstress);
+DEFTEST(fsbench);
 
 ////////////////////////////////////////////////////////////
 
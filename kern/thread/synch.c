@@ -210,6 +210,27 @@ void lock_acquire(struct lock *lock)
 	spinlock_release(spinlk);
 }
 
+bool lock_tryacquire(struct lock *lock)
+{
+	KASSERT(lock != NULL);
+
+	spinlock_acquire(&lock->lk_spinlk);
+
+	if (lock->lk_owner != NULL) {
+		spinlock_release(&lock->lk_spinlk);
+		return false;
+	}
+
+	lock->lk_owner = curthread;
+
+	/* Free, so the wait is over as soon as it starts */
+	HANGMAN_WAIT(&curthread->t_hangman, &lock->lk_hangman);
+	HANGMAN_ACQUIRE(&curthread->t_hangman, &lock->lk_hangman);
+
+	spinlock_release(&lock->lk_spinlk);
+	return true;
+}
+
 void lock_release(struct lock *lock)
 {
 	KASSERT(lock != NULL);
@@ -40,6 +40,7 @@
 #include <cpu.h>
 #include <spl.h>
 #include <spinlock.h>
+#include <membar.h>
 #include <wchan.h>
 #include <thread.h>
 #include <threadlist.h>
@@ -191,6 +192,10 @@ cpu_create(unsigned hardware_number)
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
+	c->c_shootdowns_done = 0;
+	c->c_tlbas = NULL;
+	c->c_tlbfaults = 0;
+	c->c_tlbslowfaults = 0;
 	spinlock_init(&c->c_ipi_lock);
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
@@ -420,6 +425,25 @@ cpu_hatch(unsigned software_number)
 	thread_exit();
 }
 
+/*
+ * Print the TLB miss counts. They're only read here, so there's no
+ * need to stop anyone updating them.
+ */
+void
+cpu_printtlbstats(void)
+{
+	unsigned i, faults, slow;
+	struct cpu *c;
+
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		faults = c->c_tlbfaults;
+		slow = c->c_tlbslowfaults;
+		kprintf("cpu%u: %u TLB misses, %u of them page faults\n",
+			c->c_number, faults, slow);
+	}
+}
+
 /*
  * Start up secondary cpus. Called from boot().
  */
@@ -1162,37 +1186,88 @@ ipi_broadcast(int code)
 }
 
 /*
- * Send a TLB shootdown IPI to the specified CPU.
+ * Queue a TLB shootdown for the specified CPU and poke it. Returns
+ * how many batches of shootdowns it had done beforehand; once the
+ * count moves past that, this one has been done too.
  */
-void
-ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
+static
+unsigned
+ipi_queueshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 {
-	unsigned n;
+	unsigned n, done;
 
 	spinlock_acquire(&target->c_ipi_lock);
 
 	n = target->c_numshootdown;
-	if (n == TLBSHOOTDOWN_MAX) {
+	if (n >= TLBSHOOTDOWN_MAX) {
 		/*
-		 * If you have problems with this panic going off,
-		 * consider: (1) increasing the maximum, (2) putting
-		 * logic here to sleep until space appears (may
-		 * interact awkwardly with VM system locking), (3)
-		 * putting logic here to coalesce requests together,
-		 * and/or (4) improving VM system state tracking to
-		 * reduce the number of unnecessary shootdowns.
+		 * Too many to keep track of; the target will flush
+		 * its whole TLB instead.
 		 */
-		panic("ipi_tlbshootdown: Too many shootdowns queued\n");
+		target->c_numshootdown = TLBSHOOTDOWN_MAX + 1;
 	}
 	else {
 		target->c_shootdown[n] = *mapping;
 		target->c_numshootdown = n+1;
 	}
+	done = target->c_shootdowns_done;
 
 	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
 	mainbus_send_ipi(target);
 
 	spinlock_release(&target->c_ipi_lock);
+
+	return done;
+}
+
+/*
+ * Send a TLB shootdown IPI to the specified CPU.
+ */
+void
+ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
+{
+	(void)ipi_queueshootdown(target, mapping);
+}
+
+/*
+ * Send a TLB shootdown IPI to all other CPUs that may have entries
+ * for AS loaded, and wait for each to finish. A CPU that loads AS
+ * after we look flushes its TLB on the way in, so it doesn't need
+ * one.
+ *
+ * We wait with interrupts on, so that two CPUs shooting at each
+ * other both get their requests handled.
+ */
+void
+ipi_tlbshootdown_as(struct addrspace *as, const struct tlbshootdown *mapping)
+{
+	unsigned i, done, now;
+	struct cpu *c;
+	int spl;
+
+	KASSERT(curcpu->c_spinlocks == 0);
+	KASSERT(curthread->t_iplhigh_count == 0);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	membar_any_any();
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+
+		/* Don't move to C between checking and sending */
+		spl = splhigh();
+		if (c == curcpu->c_self || c->c_tlbas != as) {
+			splx(spl);
+			continue;
+		}
+		done = ipi_queueshootdown(c, mapping);
+		splx(spl);
+
+		do {
+			spinlock_acquire(&c->c_ipi_lock);
+			now = c->c_shootdowns_done;
+			spinlock_release(&c->c_ipi_lock);
+		} while (now == done);
+	}
 }
 
 /*
@@ -1235,10 +1310,16 @@ interprocessor_interrupt(void)
 		 * need to release the ipi lock while calling
 		 * vm_tlbshootdown.
 		 */
-		for (i=0; i<curcpu->c_numshootdown; i++) {
-			vm_tlbshootdown(&curcpu->c_shootdown[i]);
+		if (curcpu->c_numshootdown > TLBSHOOTDOWN_MAX) {
+			vm_tlbflush();
+		}
+		else {
+			for (i=0; i<curcpu->c_numshootdown; i++) {
+				vm_tlbshootdown(&curcpu->c_shootdown[i]);
+			}
 		}
 		curcpu->c_numshootdown = 0;
+		curcpu->c_shootdowns_done++;
 	}
 
 	curcpu->c_ipi_pending = 0;
@@ -0,0 +1,1586 @@
+/*
+ * Block buffer cache.
+ *
+ * The pool is a fixed array of buffers allocated at boot. Each buffer
+ * is either unused (b_dev == NULL) or names one block of one device,
+ * in which case it is on the hash chain for that (device, block).
+ * Every buffer is also on the LRU list; the head of the list is the
+ * next eviction candidate and the tail is the most recently used.
+ *
+ * buffer_lock protects all of the list and hash linkage, the buffer
+ * identities and flags, the readahead queue, and the statistics. It
+ * is not held across device I/O: a buffer is marked busy instead, and
+ * anyone else who wants it sleeps on buffer_cv until it is released.
+ *
+ * Readahead requests (buffer_prefetch) go on a small queue that is
+ * drained by the "readahead" kernel thread, so the caller doesn't
+ * wait for the disk. If the queue is full, requests are dropped.
+ *
+ * Readahead, and the syncer's background writeback, don't wait for
+ * the disk either: they are handed to the device with dev_submit, up
+ * to BUFFER_MAXASYNC transfers at a time, so that a driver that
+ * schedules its queue (lhd) sees them all at once. The buffers stay
+ * busy until the transfer completes. Completions may come in
+ * interrupt context, so they go on the buffer_iodone list, and the
+ * readahead thread finishes them off. Unlike synchronous I/O these
+ * aren't retried: failed readahead is just forgotten, and failed
+ * writeback leaves the data dirty for the next sync to try again.
+ *
+ * Consecutive blocks are moved to and from the device in clusters of
+ * up to BUFFER_MAXCLUSTER blocks per request: buffer_readcluster and
+ * readahead read each run of uncached blocks at once, and writeback
+ * of a dirty buffer takes along any idle dirty neighbors.
+ *
+ * Each buffer remembers when it was last made dirty from clean; the
+ * "syncer" thread uses that to write back dirty data once it is
+ * BUFFER_SYNCAGE seconds old, a batch at a time.
+ *
+ * A pinned buffer (b_pinned) is dirty but must not be written until
+ * the filesystem says so; eviction, writeback clustering, and all the
+ * flushing paths pass over it.
+ *
+ * Devices whose filesystem uses blocks bigger than BUFFER_SIZE are
+ * listed in buffer_devsizes. A buffer's data is allocated at the
+ * block size of the device it was last used for, and reallocated
+ * when it's taken for a device with a different one.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <synch.h>
+#include <thread.h>
+#include <clock.h>
+#include <device.h>
+#include <vfs.h>
+#include <buf.h>
+
+/* Number of hash chains. */
+#define BUFFER_HASHSIZE		67
+
+/* Maximum number of queued readahead requests. */
+#define BUFFER_RAQUEUESIZE	32
+
+/* Maximum number of asynchronous transfers in progress. */
+#define BUFFER_MAXASYNC		8
+
+struct buf {
+	struct buf *b_hashnext;		/* next on hash chain */
+	struct buf *b_lruprev;		/* LRU list linkage */
+	struct buf *b_lrunext;
+	struct device *b_dev;		/* device, or NULL if unused */
+	daddr_t b_block;		/* block number on b_dev */
+	bool b_valid;			/* b_data holds the block contents */
+	bool b_dirty;			/* b_data differs from the disk */
+	bool b_busy;			/* held by a caller or doing I/O */
+	bool b_prefetched;		/* read ahead and not yet used */
+	bool b_pinned;			/* dirty, and not to be written yet */
+	bool b_unfilled;		/* from buffer_get; not filled in yet */
+	time_t b_dirtysince;		/* when b_dirty was last set */
+	void *b_data;			/* b_size bytes */
+	size_t b_size;			/* block size of b_dev */
+};
+
+/* A device whose block size isn't BUFFER_SIZE. */
+struct bufdevsize {
+	struct device *ds_dev;		/* device, or NULL if unused */
+	size_t ds_size;			/* its block size */
+};
+
+/* A pending readahead request. */
+struct bufra {
+	struct device *ra_dev;
+	daddr_t ra_block;
+	unsigned ra_nblocks;
+};
+
+/* An asynchronous transfer of consecutive blocks. */
+struct bufio {
+	struct devreq bio_req;
+	struct uio bio_uio;
+	struct iovec bio_iov[BUFFER_MAXCLUSTER];
+	struct buf *bio_bufs[BUFFER_MAXCLUSTER];
+	unsigned bio_nbufs;
+	int bio_result;
+	struct bufio *bio_next;		/* on free or done list */
+};
+
+static struct buf *buffers;
+static struct buf *buffer_hash[BUFFER_HASHSIZE];
+static struct buf *buffer_lruhead;	/* least recently used */
+static struct buf *buffer_lrutail;	/* most recently used */
+static struct lock *buffer_lock;
+static struct cv *buffer_cv;
+static struct bufdevsize buffer_devsizes[BUFFER_MAXDEVS];
+
+/* Readahead queue (circular). */
+static struct bufra buffer_raqueue[BUFFER_RAQUEUESIZE];
+static unsigned buffer_rahead, buffer_racount;
+
+/*
+ * Asynchronous transfers. The free list is protected by buffer_lock;
+ * the done list, which completion callbacks add to, by its spinlock.
+ * buffer_iosem is V'd for each completion and each readahead request,
+ * to wake the readahead thread.
+ */
+static struct bufio buffer_ios[BUFFER_MAXASYNC];
+static struct bufio *buffer_iofree;
+static struct bufio *buffer_iodone;
+static struct spinlock buffer_iodonelock;
+static struct semaphore *buffer_iosem;
+
+/* Statistics. */
+static struct {
+	unsigned hits;			/* found in the cache */
+	unsigned misses;		/* had to take a new buffer */
+	unsigned reads;			/* blocks read from disk */
+	unsigned readreqs;		/* ...in this many device requests */
+	unsigned writes;		/* blocks written to disk */
+	unsigned writereqs;		/* ...in this many device requests */
+	unsigned evictions;		/* buffers recycled */
+	unsigned evictwrites;		/* writes forced by eviction */
+	unsigned rareads;		/* blocks read ahead */
+	unsigned rauseful;		/* ...that were later used */
+	unsigned rawasted;		/* ...that were thrown away unused */
+	unsigned radropped;		/* requests dropped, queue full */
+	unsigned syncwrites;		/* blocks written by the syncer */
+	unsigned throttles;		/* times a writer was throttled */
+	unsigned throttlewrites;	/* blocks written by throttled writers */
+} buffer_stats;
+
+////////////////////////////////////////////////////////////
+// List and hash plumbing (call with buffer_lock held)
+
+static
+unsigned
+buffer_hashfunc(struct device *dev, daddr_t block)
+{
+	return ((uintptr_t)dev / sizeof(struct device) + block)
+		% BUFFER_HASHSIZE;
+}
+
+static
+struct buf *
+buffer_hash_find(struct device *dev, daddr_t block)
+{
+	struct buf *b;
+
+	for (b = buffer_hash[buffer_hashfunc(dev, block)];
+	     b != NULL; b = b->b_hashnext) {
+		if (b->b_dev == dev && b->b_block == block) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+buffer_hash_insert(struct buf *b)
+{
+	unsigned h;
+
+	KASSERT(b->b_dev != NULL);
+	h = buffer_hashfunc(b->b_dev, b->b_block);
+	b->b_hashnext = buffer_hash[h];
+	buffer_hash[h] = b;
+}
+
+static
+void
+buffer_hash_remove(struct buf *b)
+{
+	struct buf **bp;
+
+	KASSERT(b->b_dev != NULL);
+	for (bp = &buffer_hash[buffer_hashfunc(b->b_dev, b->b_block)];
+	     *bp != NULL; bp = &(*bp)->b_hashnext) {
+		if (*bp == b) {
+			*bp = b->b_hashnext;
+			b->b_hashnext = NULL;
+			return;
+		}
+	}
+	panic("buffer: block %u not on its hash chain\n", b->b_block);
+}
+
+static
+void
+buffer_lru_remove(struct buf *b)
+{
+	if (b->b_lruprev != NULL) {
+		b->b_lruprev->b_lrunext = b->b_lrunext;
+	}
+	else {
+		buffer_lruhead = b->b_lrunext;
+	}
+	if (b->b_lrunext != NULL) {
+		b->b_lrunext->b_lruprev = b->b_lruprev;
+	}
+	else {
+		buffer_lrutail = b->b_lruprev;
+	}
+	b->b_lruprev = b->b_lrunext = NULL;
+}
+
+/* Put B, which is not on the LRU list, at the most-recently-used end. */
+static
+void
+buffer_lru_append(struct buf *b)
+{
+	b->b_lruprev = buffer_lrutail;
+	b->b_lrunext = NULL;
+	if (buffer_lrutail != NULL) {
+		buffer_lrutail->b_lrunext = b;
+	}
+	else {
+		buffer_lruhead = b;
+	}
+	buffer_lrutail = b;
+}
+
+/* Move B to the most-recently-used end. */
+static
+void
+buffer_lru_touch(struct buf *b)
+{
+	buffer_lru_remove(b);
+	buffer_lru_append(b);
+}
+
+/* Put B at the least-recently-used end, so it gets reused first. */
+static
+void
+buffer_lru_demote(struct buf *b)
+{
+	buffer_lru_remove(b);
+	b->b_lrunext = buffer_lruhead;
+	if (buffer_lruhead != NULL) {
+		buffer_lruhead->b_lruprev = b;
+	}
+	else {
+		buffer_lrutail = b;
+	}
+	buffer_lruhead = b;
+}
+
+/* Return the block size in use for DEV. */
+static
+size_t
+buffer_blocksize(struct device *dev)
+{
+	unsigned i;
+
+	for (i=0; i<BUFFER_MAXDEVS; i++) {
+		if (buffer_devsizes[i].ds_dev == dev) {
+			return buffer_devsizes[i].ds_size;
+		}
+	}
+	return BUFFER_SIZE;
+}
+
+/* Forget what block B holds. */
+static
+void
+buffer_disown(struct buf *b)
+{
+	if (b->b_dev != NULL) {
+		buffer_hash_remove(b);
+	}
+	if (b->b_prefetched) {
+		buffer_stats.rawasted++;
+	}
+	b->b_dev = NULL;
+	b->b_block = 0;
+	b->b_valid = false;
+	b->b_dirty = false;
+	b->b_prefetched = false;
+	b->b_pinned = false;
+	b->b_unfilled = false;
+}
+
+////////////////////////////////////////////////////////////
+// Device I/O
+
+/*
+ * Read or write the blocks of NBUFS buffers, which must hold
+ * consecutive blocks of one device, as a single device request,
+ * retrying I/O errors. Call with the buffers busy and buffer_lock
+ * not held.
+ */
+static
+int
+buffer_devio(struct buf **bufs, unsigned nbufs, enum uio_rw rw)
+{
+	struct iovec iov[BUFFER_MAXCLUSTER];
+	struct uio ku;
+	struct device *dev;
+	daddr_t block;
+	size_t size;
+	unsigned i;
+	int result;
+	int tries = 0;
+
+	KASSERT(nbufs > 0 && nbufs <= BUFFER_MAXCLUSTER);
+	dev = bufs[0]->b_dev;
+	block = bufs[0]->b_block;
+	size = bufs[0]->b_size;
+	for (i=0; i<nbufs; i++) {
+		KASSERT(bufs[i]->b_busy);
+		KASSERT(bufs[i]->b_dev == dev);
+		KASSERT(bufs[i]->b_block == block + i);
+		KASSERT(bufs[i]->b_size == size);
+	}
+
+ retry:
+	for (i=0; i<nbufs; i++) {
+		iov[i].iov_kbase = bufs[i]->b_data;
+		iov[i].iov_len = size;
+	}
+	ku.uio_iov = iov;
+	ku.uio_iovcnt = nbufs;
+	ku.uio_offset = ((off_t)block) * size;
+	ku.uio_resid = nbufs * size;
+	ku.uio_segflg = UIO_SYSSPACE;
+	ku.uio_rw = rw;
+	ku.uio_space = NULL;
+
+	result = DEVOP_IO(dev, &ku);
+	if (result == EINVAL) {
+		/*
+		 * The blocks were out of range or misaligned; that's the
+		 * filesystem's fault, not the disk's.
+		 */
+		panic("buffer: device %u: DEVOP_IO returned EINVAL "
+		      "(blocks %u-%u)\n", dev->d_devnumber,
+		      block, block + nbufs - 1);
+	}
+	if (result == EIO) {
+		if (tries == 0) {
+			tries++;
+			kprintf("buffer: device %u: blocks %u-%u I/O error, "
+				"retrying\n", dev->d_devnumber,
+				block, block + nbufs - 1);
+			goto retry;
+		}
+		else if (tries < 10) {
+			tries++;
+			goto retry;
+		}
+		else {
+			kprintf("buffer: device %u: blocks %u-%u I/O error, "
+				"giving up after %d retries\n",
+				dev->d_devnumber, block, block + nbufs - 1,
+				tries);
+		}
+	}
+	return result;
+}
+
+/*
+ * Read NBUFS busy, not-yet-valid buffers holding consecutive blocks.
+ * Call with buffer_lock held; it is dropped during the I/O. On
+ * failure the buffers are thrown away and are no longer held.
+ */
+static
+int
+buffer_readin(struct buf **bufs, unsigned nbufs)
+{
+	unsigned i;
+	int result;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+
+	lock_release(buffer_lock);
+	result = buffer_devio(bufs, nbufs, UIO_READ);
+	lock_acquire(buffer_lock);
+
+	if (result) {
+		for (i=0; i<nbufs; i++) {
+			buffer_disown(bufs[i]);
+			buffer_lru_demote(bufs[i]);
+			bufs[i]->b_busy = false;
+		}
+		cv_broadcast(buffer_cv, buffer_lock);
+		return result;
+	}
+
+	for (i=0; i<nbufs; i++) {
+		bufs[i]->b_valid = true;
+		bufs[i]->b_prefetched = false;
+	}
+	buffer_stats.reads += nbufs;
+	buffer_stats.readreqs++;
+	return 0;
+}
+
+/*
+ * Collect a cluster to write back: a dirty buffer, together with any
+ * idle dirty buffers for the blocks on either side of it. Call with
+ * buffer_lock held and B busy; the others are made busy too. Returns
+ * the number of buffers put in CLUSTER.
+ */
+static
+unsigned
+buffer_writecluster(struct buf *b, struct buf **cluster)
+{
+	struct buf *nb;
+	daddr_t first;
+	unsigned n;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+	KASSERT(b->b_busy);
+	KASSERT(b->b_dirty);
+	KASSERT(!b->b_pinned);
+
+	/* Look backwards for the start of the run... */
+	first = b->b_block;
+	while (first > 0 && b->b_block - first < BUFFER_MAXCLUSTER - 1) {
+		nb = buffer_hash_find(b->b_dev, first - 1);
+		if (nb == NULL || nb->b_busy || !nb->b_dirty ||
+		    nb->b_pinned) {
+			break;
+		}
+		first--;
+	}
+
+	/* ...then collect forwards from there. */
+	n = 0;
+	while (n < BUFFER_MAXCLUSTER) {
+		if (first + n == b->b_block) {
+			nb = b;
+		}
+		else {
+			nb = buffer_hash_find(b->b_dev, first + n);
+			if (nb == NULL || nb->b_busy || !nb->b_dirty ||
+			    nb->b_pinned) {
+				break;
+			}
+			nb->b_busy = true;
+		}
+		cluster[n++] = nb;
+	}
+	KASSERT(n > b->b_block - first);
+	return n;
+}
+
+/*
+ * Write back a dirty buffer, together with any idle dirty buffers
+ * for the blocks on either side of it, as one cluster. Call with
+ * buffer_lock held and B busy; the lock is dropped during the I/O.
+ */
+static
+int
+buffer_writeback(struct buf *b)
+{
+	struct buf *cluster[BUFFER_MAXCLUSTER];
+	unsigned i, n;
+	int result;
+
+	n = buffer_writecluster(b, cluster);
+
+	lock_release(buffer_lock);
+	result = buffer_devio(cluster, n, UIO_WRITE);
+	lock_acquire(buffer_lock);
+
+	for (i=0; i<n; i++) {
+		if (result == 0) {
+			cluster[i]->b_dirty = false;
+		}
+		if (cluster[i] != b) {
+			cluster[i]->b_busy = false;
+		}
+	}
+	if (n > 1) {
+		cv_broadcast(buffer_cv, buffer_lock);
+	}
+	if (result == 0) {
+		buffer_stats.writes += n;
+		buffer_stats.writereqs++;
+	}
+	return result;
+}
+
+/*
+ * Completion callback for asynchronous transfers. This may be called
+ * in an interrupt handler, so it can't take buffer_lock; it leaves
+ * the transfer for the readahead thread to finish.
+ */
+static
+void
+buffer_asyncdone(struct devreq *req, int result)
+{
+	struct bufio *bio = req->dr_data;
+
+	bio->bio_result = result;
+
+	spinlock_acquire(&buffer_iodonelock);
+	bio->bio_next = buffer_iodone;
+	buffer_iodone = bio;
+	spinlock_release(&buffer_iodonelock);
+
+	V(buffer_iosem);
+}
+
+/*
+ * Start reading or writing the blocks of NBUFS buffers, which must
+ * hold consecutive blocks of one device, without waiting for it to
+ * finish. Call with buffer_lock held, the buffers busy, and a free
+ * transfer on buffer_iofree; the lock is dropped while the request
+ * is submitted. The buffers are let go by buffer_asyncfinish.
+ */
+static
+void
+buffer_asyncstart(struct buf **bufs, unsigned nbufs, enum uio_rw rw)
+{
+	struct bufio *bio;
+	struct device *dev;
+	daddr_t block;
+	size_t size;
+	unsigned i;
+	int result;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+	KASSERT(nbufs > 0 && nbufs <= BUFFER_MAXCLUSTER);
+	KASSERT(buffer_iofree != NULL);
+
+	bio = buffer_iofree;
+	buffer_iofree = bio->bio_next;
+
+	dev = bufs[0]->b_dev;
+	block = bufs[0]->b_block;
+	size = bufs[0]->b_size;
+	for (i=0; i<nbufs; i++) {
+		KASSERT(bufs[i]->b_busy);
+		KASSERT(bufs[i]->b_dev == dev);
+		KASSERT(bufs[i]->b_block == block + i);
+		KASSERT(bufs[i]->b_size == size);
+		bio->bio_bufs[i] = bufs[i];
+		bio->bio_iov[i].iov_kbase = bufs[i]->b_data;
+		bio->bio_iov[i].iov_len = size;
+	}
+	bio->bio_nbufs = nbufs;
+	bio->bio_uio.uio_iov = bio->bio_iov;
+	bio->bio_uio.uio_iovcnt = nbufs;
+	bio->bio_uio.uio_offset = ((off_t)block) * size;
+	bio->bio_uio.uio_resid = nbufs * size;
+	bio->bio_uio.uio_segflg = UIO_SYSSPACE;
+	bio->bio_uio.uio_rw = rw;
+	bio->bio_uio.uio_space = NULL;
+	bio->bio_req.dr_uio = &bio->bio_uio;
+	bio->bio_req.dr_done = buffer_asyncdone;
+	bio->bio_req.dr_data = bio;
+
+	lock_release(buffer_lock);
+	result = dev_submit(dev, &bio->bio_req);
+	if (result) {
+		/* Never got started; finish it like any other failure. */
+		buffer_asyncdone(&bio->bio_req, result);
+	}
+	lock_acquire(buffer_lock);
+}
+
+/*
+ * Finish off the asynchronous transfers that have completed: mark
+ * what was read valid and what was written clean, throw away what
+ * couldn't be read, and let the buffers go. Call with buffer_lock
+ * held.
+ */
+static
+void
+buffer_asyncfinish(void)
+{
+	struct bufio *bio, *next;
+	struct buf *b;
+	bool reading;
+	unsigned i;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+
+	spinlock_acquire(&buffer_iodonelock);
+	bio = buffer_iodone;
+	buffer_iodone = NULL;
+	spinlock_release(&buffer_iodonelock);
+
+	if (bio == NULL) {
+		return;
+	}
+
+	for (; bio != NULL; bio = next) {
+		next = bio->bio_next;
+		reading = bio->bio_uio.uio_rw == UIO_READ;
+
+		if (bio->bio_result && !reading) {
+			b = bio->bio_bufs[0];
+			kprintf("buffer: device %u: blocks %u-%u: "
+				"background write failed: %s\n",
+				b->b_dev->d_devnumber, b->b_block,
+				b->b_block + bio->bio_nbufs - 1,
+				strerror(bio->bio_result));
+		}
+
+		for (i=0; i<bio->bio_nbufs; i++) {
+			b = bio->bio_bufs[i];
+			KASSERT(b->b_busy);
+			if (reading && bio->bio_result == 0) {
+				b->b_valid = true;
+				b->b_prefetched = true;
+			}
+			else if (reading) {
+				buffer_disown(b);
+				buffer_lru_demote(b);
+			}
+			else if (bio->bio_result == 0) {
+				b->b_dirty = false;
+			}
+			b->b_busy = false;
+		}
+
+		if (bio->bio_result == 0 && reading) {
+			buffer_stats.reads += bio->bio_nbufs;
+			buffer_stats.readreqs++;
+			buffer_stats.rareads += bio->bio_nbufs;
+		}
+		else if (bio->bio_result == 0) {
+			buffer_stats.writes += bio->bio_nbufs;
+			buffer_stats.writereqs++;
+		}
+
+		bio->bio_next = buffer_iofree;
+		buffer_iofree = bio;
+	}
+	cv_broadcast(buffer_cv, buffer_lock);
+}
+
+////////////////////////////////////////////////////////////
+// Lookup and replacement
+
+/*
+ * Find a buffer to reuse. On success hands back either a buffer that
+ * is now busy and disowned, or NULL if we had to sleep (waiting for
+ * a buffer, or writing one back), in which case the caller must
+ * start over because the cache may have changed.
+ *
+ * If WAIT is false we never sleep: only a clean buffer will do, and
+ * if there isn't one we fail with EAGAIN.
+ */
+static
+int
+buffer_evict(bool wait, struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+
+	for (b = buffer_lruhead; b != NULL; b = b->b_lrunext) {
+		if (!b->b_busy && !b->b_pinned && (wait || !b->b_dirty)) {
+			break;
+		}
+	}
+	if (b == NULL && !wait) {
+		return EAGAIN;
+	}
+	if (b == NULL) {
+		/* Everything is in use; wait for something to come free. */
+		cv_wait(buffer_cv, buffer_lock);
+		*ret = NULL;
+		return 0;
+	}
+
+	b->b_busy = true;
+	if (b->b_dirty) {
+		buffer_stats.evictwrites++;
+		result = buffer_writeback(b);
+		b->b_busy = false;
+		cv_broadcast(buffer_cv, buffer_lock);
+		if (result) {
+			return result;
+		}
+		/* We slept; start over. */
+		*ret = NULL;
+		return 0;
+	}
+
+	if (b->b_dev != NULL) {
+		buffer_stats.evictions++;
+	}
+	buffer_disown(b);
+	*ret = b;
+	return 0;
+}
+
+/*
+ * Find the buffer for a block, or take a new one for it, and mark it
+ * busy. No I/O is done for the block itself; a newly taken buffer is
+ * not valid. Call with buffer_lock held.
+ *
+ * If PREFETCH is set we're reading ahead: if the block is already
+ * cached (or on its way in) there's nothing to do, and we hand back
+ * NULL.
+ *
+ * If WAIT is false we never sleep, and fail with EAGAIN if the block
+ * is busy or no buffer can be had for it without waiting. Anyone
+ * already holding buffers must do this, or they can end up waiting
+ * for each other with the whole pool tied up.
+ */
+static
+int
+buffer_find(struct device *dev, daddr_t block, bool prefetch, bool wait,
+	    struct buf **ret)
+{
+	struct buf *b;
+	size_t size;
+	void *data;
+	int result;
+
+	KASSERT(dev != NULL);
+	KASSERT(lock_do_i_hold(buffer_lock));
+
+	while (1) {
+		b = buffer_hash_find(dev, block);
+		if (b != NULL && prefetch) {
+			*ret = NULL;
+			return 0;
+		}
+		if (b != NULL) {
+			if (b->b_busy && !wait) {
+				return EAGAIN;
+			}
+			if (b->b_busy) {
+				cv_wait(buffer_cv, buffer_lock);
+				continue;
+			}
+			buffer_stats.hits++;
+			if (b->b_prefetched) {
+				buffer_stats.rauseful++;
+				b->b_prefetched = false;
+			}
+			b->b_busy = true;
+			break;
+		}
+
+		result = buffer_evict(wait, &b);
+		if (result) {
+			return result;
+		}
+		size = buffer_blocksize(dev);
+		if (b != NULL && b->b_size != size) {
+			/* Last used for a different block size. */
+			data = kmalloc(size);
+			if (data == NULL) {
+				buffer_lru_demote(b);
+				b->b_busy = false;
+				cv_broadcast(buffer_cv, buffer_lock);
+				return ENOMEM;
+			}
+			kfree(b->b_data);
+			b->b_data = data;
+			b->b_size = size;
+		}
+		if (b != NULL) {
+			if (!prefetch) {
+				buffer_stats.misses++;
+			}
+			b->b_dev = dev;
+			b->b_block = block;
+			buffer_hash_insert(b);
+			break;
+		}
+	}
+
+	buffer_lru_touch(b);
+	*ret = b;
+	return 0;
+}
+
+/*
+ * Get up to NBLOCKS consecutive blocks starting at BLOCK, reading
+ * whichever of them aren't cached using as few device requests as
+ * possible. Hands back the buffers, all busy, in BUFS, and how many
+ * there are in *GOT.
+ *
+ * Only the first block is waited for. The cluster stops short at the
+ * first block after that which isn't to be had at once, since waiting
+ * while holding the others could deadlock against another cluster
+ * doing the same. At least one block is always got.
+ */
+static
+int
+buffer_getcluster(struct device *dev, daddr_t block, unsigned nblocks,
+		  struct buf **bufs, unsigned *got)
+{
+	unsigned i, j, k, held;
+	int result;
+
+	KASSERT(nblocks > 0 && nblocks <= BUFFER_MAXCLUSTER);
+
+	*got = 0;
+	lock_acquire(buffer_lock);
+
+	for (held=0; held<nblocks; held++) {
+		result = buffer_find(dev, block + held, false, held == 0,
+				     &bufs[held]);
+		if (result == EAGAIN) {
+			/* Make do with what we have. */
+			KASSERT(held > 0);
+			break;
+		}
+		if (result) {
+			goto fail;
+		}
+	}
+	nblocks = held;
+
+	/* Read each run of buffers that need it. */
+	i = 0;
+	while (i < nblocks) {
+		if (bufs[i]->b_valid) {
+			i++;
+			continue;
+		}
+		for (j=i; j<nblocks; j++) {
+			if (bufs[j]->b_valid) {
+				break;
+			}
+		}
+		result = buffer_readin(&bufs[i], j - i);
+		if (result) {
+			/* buffer_readin let go of those. */
+			for (k=i; k<j; k++) {
+				bufs[k] = NULL;
+			}
+			goto fail;
+		}
+		i = j;
+	}
+
+	lock_release(buffer_lock);
+	*got = nblocks;
+	return 0;
+
+ fail:
+	for (k=0; k<held; k++) {
+		if (bufs[k] != NULL) {
+			if (!bufs[k]->b_valid) {
+				buffer_disown(bufs[k]);
+				buffer_lru_demote(bufs[k]);
+			}
+			bufs[k]->b_busy = false;
+		}
+	}
+	for (k=0; k<nblocks; k++) {
+		bufs[k] = NULL;
+	}
+	cv_broadcast(buffer_cv, buffer_lock);
+	lock_release(buffer_lock);
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+// Readahead
+
+/*
+ * Start reading one readahead request. Blocks that are already cached
+ * are skipped, and each run of the rest is read in one transfer. Call
+ * with buffer_lock held and a free transfer on buffer_iofree.
+ *
+ * All the buffers are found before the lock is first dropped, so by
+ * the time buffer_ra_cancel can run they are all busy, and whoever
+ * called it will wait for them like any others.
+ */
+static
+void
+buffer_rastart(const struct bufra *ra)
+{
+	struct buf *bufs[BUFFER_MAXCLUSTER];
+	unsigned i, j, n;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+
+	for (n=0; n<ra->ra_nblocks; n++) {
+		if (buffer_find(ra->ra_dev, ra->ra_block + n, true, false,
+				&bufs[n])) {
+			/* Whatever didn't fit in is just not read ahead. */
+			break;
+		}
+	}
+
+	i = 0;
+	while (i < n) {
+		if (bufs[i] == NULL) {
+			i++;
+			continue;
+		}
+		for (j=i; j<n; j++) {
+			if (bufs[j] == NULL) {
+				break;
+			}
+		}
+		if (buffer_iofree == NULL) {
+			/* No transfers left; give up on the rest. */
+			for (; i<n; i++) {
+				if (bufs[i] != NULL) {
+					buffer_disown(bufs[i]);
+					buffer_lru_demote(bufs[i]);
+					bufs[i]->b_busy = false;
+				}
+			}
+			cv_broadcast(buffer_cv, buffer_lock);
+			break;
+		}
+		buffer_asyncstart(&bufs[i], j - i, UIO_READ);
+		i = j;
+	}
+}
+
+/*
+ * Readahead thread. Takes requests off the queue and starts reading
+ * them into the cache, and finishes off completed asynchronous
+ * transfers. Never exits.
+ */
+static
+void
+buffer_rathread(void *unused1, unsigned long unused2)
+{
+	struct bufra ra;
+
+	(void)unused1;
+	(void)unused2;
+
+	lock_acquire(buffer_lock);
+	while (1) {
+		buffer_asyncfinish();
+
+		if (buffer_racount > 0 && buffer_iofree != NULL) {
+			ra = buffer_raqueue[buffer_rahead];
+			buffer_rahead = (buffer_rahead + 1) % BUFFER_RAQUEUESIZE;
+			buffer_racount--;
+			buffer_rastart(&ra);
+			continue;
+		}
+
+		lock_release(buffer_lock);
+		P(buffer_iosem);
+		lock_acquire(buffer_lock);
+	}
+}
+
+/*
+ * Remove all queued readahead for DEV. Readahead that has already
+ * been started holds its buffers busy until it's done.
+ */
+static
+void
+buffer_ra_cancel(struct device *dev)
+{
+	unsigned i, n, from, to;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+
+	n = buffer_racount;
+	to = buffer_rahead;
+	for (i=0; i<n; i++) {
+		from = (buffer_rahead + i) % BUFFER_RAQUEUESIZE;
+		if (buffer_raqueue[from].ra_dev == dev) {
+			buffer_racount--;
+			continue;
+		}
+		buffer_raqueue[to] = buffer_raqueue[from];
+		to = (to + 1) % BUFFER_RAQUEUESIZE;
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Interface
+
+int
+buffer_read(struct device *dev, daddr_t block, struct buf **ret)
+{
+	unsigned got;
+	int result;
+
+	result = buffer_getcluster(dev, block, 1, ret, &got);
+	KASSERT(result != 0 || got == 1);
+	return result;
+}
+
+int
+buffer_readcluster(struct device *dev, daddr_t block, unsigned nblocks,
+		   struct buf **bufs, unsigned *got)
+{
+	return buffer_getcluster(dev, block, nblocks, bufs, got);
+}
+
+int
+buffer_get(struct device *dev, daddr_t block, struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	lock_acquire(buffer_lock);
+	result = buffer_find(dev, block, false, true, &b);
+	if (result) {
+		lock_release(buffer_lock);
+		return result;
+	}
+	if (!b->b_valid) {
+		/* The caller is about to fill it in. */
+		b->b_valid = true;
+		b->b_prefetched = false;
+		b->b_unfilled = true;
+	}
+	lock_release(buffer_lock);
+
+	*ret = b;
+	return 0;
+}
+
+void *
+buffer_map(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	return b->b_data;
+}
+
+void
+buffer_mark_dirty(struct buf *b)
+{
+	struct timespec now;
+
+	KASSERT(b->b_busy);
+	KASSERT(b->b_valid);
+	b->b_unfilled = false;
+	if (!b->b_dirty) {
+		/* We hold the buffer, so nobody else touches these. */
+		gettime(&now);
+		b->b_dirtysince = now.tv_sec;
+		b->b_dirty = true;
+	}
+}
+
+void
+buffer_mark_pinned(struct buf *b)
+{
+	buffer_mark_dirty(b);
+	b->b_pinned = true;
+}
+
+void
+buffer_release(struct buf *b)
+{
+	lock_acquire(buffer_lock);
+	KASSERT(b->b_busy);
+	b->b_busy = false;
+	b->b_unfilled = false;
+	cv_broadcast(buffer_cv, buffer_lock);
+	lock_release(buffer_lock);
+}
+
+void
+buffer_release_failed(struct buf *b)
+{
+	lock_acquire(buffer_lock);
+	KASSERT(b->b_busy);
+	if (b->b_unfilled) {
+		/* It never held the block; don't let anyone read it. */
+		buffer_disown(b);
+		buffer_lru_demote(b);
+	}
+	else {
+		/*
+		 * It held the block, and part of it may have been
+		 * overwritten; make sure the disk ends up the same.
+		 */
+		buffer_mark_dirty(b);
+	}
+	b->b_busy = false;
+	cv_broadcast(buffer_cv, buffer_lock);
+	lock_release(buffer_lock);
+}
+
+void
+buffer_prefetch(struct device *dev, daddr_t block, unsigned nblocks)
+{
+	unsigned i, slot;
+
+	KASSERT(nblocks > 0 && nblocks <= BUFFER_MAXCLUSTER);
+
+	lock_acquire(buffer_lock);
+
+	/* Trim off blocks at either end that are already here. */
+	while (nblocks > 0 && buffer_hash_find(dev, block) != NULL) {
+		block++;
+		nblocks--;
+	}
+	while (nblocks > 0 &&
+	       buffer_hash_find(dev, block + nblocks - 1) != NULL) {
+		nblocks--;
+	}
+	if (nblocks == 0) {
+		lock_release(buffer_lock);
+		return;
+	}
+
+	for (i=0; i<buffer_racount; i++) {
+		slot = (buffer_rahead + i) % BUFFER_RAQUEUESIZE;
+		if (buffer_raqueue[slot].ra_dev == dev &&
+		    buffer_raqueue[slot].ra_block <= block &&
+		    buffer_raqueue[slot].ra_block +
+		    buffer_raqueue[slot].ra_nblocks >= block + nblocks) {
+			/* Already asked for. */
+			lock_release(buffer_lock);
+			return;
+		}
+	}
+	if (buffer_racount == BUFFER_RAQUEUESIZE) {
+		buffer_stats.radropped++;
+		lock_release(buffer_lock);
+		return;
+	}
+	slot = (buffer_rahead + buffer_racount) % BUFFER_RAQUEUESIZE;
+	buffer_raqueue[slot].ra_dev = dev;
+	buffer_raqueue[slot].ra_block = block;
+	buffer_raqueue[slot].ra_nblocks = nblocks;
+	buffer_racount++;
+	V(buffer_iosem);
+	lock_release(buffer_lock);
+}
+
+void
+buffer_drop(struct device *dev, daddr_t block)
+{
+	struct buf *b;
+
+	lock_acquire(buffer_lock);
+	while (1) {
+		b = buffer_hash_find(dev, block);
+		if (b == NULL || !b->b_busy) {
+			break;
+		}
+		cv_wait(buffer_cv, buffer_lock);
+	}
+	if (b != NULL) {
+		buffer_disown(b);
+		buffer_lru_demote(b);
+	}
+	lock_release(buffer_lock);
+}
+
+int
+buffer_syncblock(struct device *dev, daddr_t block)
+{
+	struct buf *b;
+	int result = 0;
+
+	lock_acquire(buffer_lock);
+	while (1) {
+		b = buffer_hash_find(dev, block);
+		if (b == NULL || !b->b_busy) {
+			break;
+		}
+		cv_wait(buffer_cv, buffer_lock);
+	}
+	if (b != NULL && b->b_dirty && !b->b_pinned) {
+		b->b_busy = true;
+		result = buffer_writeback(b);
+		b->b_busy = false;
+		cv_broadcast(buffer_cv, buffer_lock);
+	}
+	lock_release(buffer_lock);
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+// Background writeback
+
+/* Count the dirty buffers. Call with buffer_lock held. */
+static
+unsigned
+buffer_countdirty(void)
+{
+	unsigned i, n = 0;
+
+	for (i=0; i<BUFFER_COUNT; i++) {
+		if (buffers[i].b_dirty) {
+			n++;
+		}
+	}
+	return n;
+}
+
+/*
+ * Write back idle dirty buffers that were dirtied at or before
+ * OLDEST, least recently used first, until no more than MAXDIRTY
+ * buffers are dirty. Hands back the number of blocks written in
+ * *WRITTEN. Call with buffer_lock held; it is dropped during I/O, and
+ * after every BUFFER_SYNCBATCH blocks to let others in.
+ *
+ * If ASYNC is set the writes are only started, and *WRITTEN counts
+ * the blocks sent; buffers being written are busy, so they aren't
+ * picked again, and we stop when nothing else qualifies.
+ */
+static
+int
+buffer_flushold(unsigned maxdirty, time_t oldest, bool async,
+		unsigned *written)
+{
+	struct buf *cluster[BUFFER_MAXCLUSTER];
+	struct buf *b;
+	unsigned before, batch, n;
+	int result;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+
+	*written = 0;
+	batch = 0;
+	while (buffer_countdirty() > maxdirty) {
+		if (async && buffer_iofree == NULL) {
+			cv_wait(buffer_cv, buffer_lock);
+			continue;
+		}
+
+		for (b = buffer_lruhead; b != NULL; b = b->b_lrunext) {
+			if (b->b_dirty && !b->b_busy && !b->b_pinned &&
+			    b->b_dirtysince <= oldest) {
+				break;
+			}
+		}
+		if (b == NULL) {
+			break;
+		}
+
+		b->b_busy = true;
+		if (async) {
+			n = buffer_writecluster(b, cluster);
+			buffer_asyncstart(cluster, n, UIO_WRITE);
+		}
+		else {
+			before = buffer_stats.writes;
+			result = buffer_writeback(b);
+			b->b_busy = false;
+			cv_broadcast(buffer_cv, buffer_lock);
+			if (result) {
+				return result;
+			}
+			n = buffer_stats.writes - before;
+		}
+		*written += n;
+		batch += n;
+
+		if (batch >= BUFFER_SYNCBATCH) {
+			batch = 0;
+			lock_release(buffer_lock);
+			thread_yield();
+			lock_acquire(buffer_lock);
+		}
+	}
+	return 0;
+}
+
+/*
+ * Syncer thread. Never exits. Errors are left for the next sync to
+ * find; the data stays dirty in the meantime.
+ */
+static
+void
+buffer_syncthread(void *unused1, unsigned long unused2)
+{
+	struct timespec now;
+	unsigned written;
+
+	(void)unused1;
+	(void)unused2;
+
+	while (1) {
+		clocksleep(BUFFER_SYNCINTERVAL);
+
+		vfs_writeback();
+
+		gettime(&now);
+		lock_acquire(buffer_lock);
+		buffer_flushold(0, now.tv_sec - BUFFER_SYNCAGE, true,
+				&written);
+		buffer_stats.syncwrites += written;
+		lock_release(buffer_lock);
+	}
+}
+
+void
+buffer_throttle(void)
+{
+	struct timespec now;
+	unsigned written;
+
+	lock_acquire(buffer_lock);
+	if (buffer_countdirty() > BUFFER_DIRTYHIGH) {
+		gettime(&now);
+		buffer_stats.throttles++;
+		buffer_flushold(BUFFER_DIRTYLOW, now.tv_sec, false,
+				&written);
+		buffer_stats.throttlewrites += written;
+	}
+	lock_release(buffer_lock);
+}
+
+/*
+ * Write back (and, if DISCARD is set, disown) every buffer belonging
+ * to DEV. The caller must not be holding any buffers. Pinned buffers
+ * are skipped, and there must not be any if DISCARD is set.
+ */
+static
+int
+buffer_flushdev(struct device *dev, bool discard)
+{
+	struct buf *b;
+	unsigned i;
+	int result;
+
+	lock_acquire(buffer_lock);
+	if (discard) {
+		buffer_ra_cancel(dev);
+	}
+	for (i=0; i<BUFFER_COUNT; i++) {
+		b = &buffers[i];
+		while (b->b_dev == dev &&
+		       (b->b_busy || (b->b_dirty && !b->b_pinned))) {
+			if (b->b_busy) {
+				cv_wait(buffer_cv, buffer_lock);
+				continue;
+			}
+			b->b_busy = true;
+			result = buffer_writeback(b);
+			b->b_busy = false;
+			cv_broadcast(buffer_cv, buffer_lock);
+			if (result) {
+				lock_release(buffer_lock);
+				return result;
+			}
+		}
+		if (discard && b->b_dev == dev) {
+			KASSERT(!b->b_pinned);
+			buffer_disown(b);
+			buffer_lru_demote(b);
+		}
+	}
+	lock_release(buffer_lock);
+	return 0;
+}
+
+int
+buffer_sync(struct device *dev)
+{
+	return buffer_flushdev(dev, false);
+}
+
+unsigned
+buffer_getpinned(struct device *dev, daddr_t *blocks, unsigned max)
+{
+	unsigned i, n;
+
+	n = 0;
+	lock_acquire(buffer_lock);
+	for (i=0; i<BUFFER_COUNT; i++) {
+		if (buffers[i].b_dev == dev && buffers[i].b_pinned) {
+			if (n < max) {
+				blocks[n] = buffers[i].b_block;
+			}
+			n++;
+		}
+	}
+	lock_release(buffer_lock);
+	return n;
+}
+
+void
+buffer_unpin(struct device *dev)
+{
+	unsigned i;
+
+	lock_acquire(buffer_lock);
+	for (i=0; i<BUFFER_COUNT; i++) {
+		if (buffers[i].b_dev == dev) {
+			buffers[i].b_pinned = false;
+		}
+	}
+	/* Eviction may have been waiting for these. */
+	cv_broadcast(buffer_cv, buffer_lock);
+	lock_release(buffer_lock);
+}
+
+int
+buffer_invalidate(struct device *dev)
+{
+	return buffer_setblocksize(dev, BUFFER_SIZE);
+}
+
+int
+buffer_setblocksize(struct device *dev, size_t size)
+{
+	unsigned i, slot;
+	int result;
+
+	KASSERT(size >= BUFFER_SIZE && size <= BUFFER_MAXSIZE);
+	KASSERT((size & (size - 1)) == 0);
+	KASSERT(size % dev->d_blocksize == 0);
+
+	result = buffer_flushdev(dev, true);
+	if (result) {
+		return result;
+	}
+
+	lock_acquire(buffer_lock);
+	slot = BUFFER_MAXDEVS;
+	for (i=0; i<BUFFER_MAXDEVS; i++) {
+		if (buffer_devsizes[i].ds_dev == dev) {
+			slot = i;
+			break;
+		}
+		if (buffer_devsizes[i].ds_dev == NULL && slot == BUFFER_MAXDEVS) {
+			slot = i;
+		}
+	}
+	if (size == BUFFER_SIZE) {
+		/* The default; no entry needed. */
+		if (slot < BUFFER_MAXDEVS &&
+		    buffer_devsizes[slot].ds_dev == dev) {
+			buffer_devsizes[slot].ds_dev = NULL;
+		}
+	}
+	else if (slot == BUFFER_MAXDEVS) {
+		lock_release(buffer_lock);
+		return ENOSPC;
+	}
+	else {
+		buffer_devsizes[slot].ds_dev = dev;
+		buffer_devsizes[slot].ds_size = size;
+	}
+	lock_release(buffer_lock);
+	return 0;
+}
+
+void
+buffer_printstats(void)
+{
+	unsigned i, used, dirty, busy, pinned;
+	size_t space;
+
+	used = dirty = busy = pinned = 0;
+	space = 0;
+
+	lock_acquire(buffer_lock);
+	for (i=0; i<BUFFER_COUNT; i++) {
+		space += buffers[i].b_size;
+		if (buffers[i].b_dev != NULL) {
+			used++;
+		}
+		if (buffers[i].b_dirty) {
+			dirty++;
+		}
+		if (buffers[i].b_busy) {
+			busy++;
+		}
+		if (buffers[i].b_pinned) {
+			pinned++;
+		}
+	}
+
+	kprintf("Buffer cache: %u buffers, %zu bytes; "
+		"%u in use, %u dirty, %u busy, %u pinned\n",
+		BUFFER_COUNT, space, used, dirty, busy, pinned);
+	kprintf("    %u hits, %u misses\n",
+		buffer_stats.hits, buffer_stats.misses);
+	kprintf("    %u blocks read in %u requests, "
+		"%u blocks written in %u requests\n",
+		buffer_stats.reads, buffer_stats.readreqs,
+		buffer_stats.writes, buffer_stats.writereqs);
+	kprintf("    %u evictions, %u writes forced by eviction\n",
+		buffer_stats.evictions, buffer_stats.evictwrites);
+	kprintf("    readahead: %u blocks read, %u useful, %u wasted, "
+		"%u dropped\n",
+		buffer_stats.rareads, buffer_stats.rauseful,
+		buffer_stats.rawasted, buffer_stats.radropped);
+	kprintf("    writeback: %u blocks by syncer; "
+		"%u writers throttled, %u blocks written by them\n",
+		buffer_stats.syncwrites, buffer_stats.throttles,
+		buffer_stats.throttlewrites);
+	lock_release(buffer_lock);
+}
+
+/*
+ * Setup function.
+ */
+void
+buffer_bootstrap(void)
+{
+	struct buf *b;
+	unsigned i;
+	int result;
+
+	buffer_lock = lock_create("buffer cache");
+	if (buffer_lock == NULL) {
+		panic("buffer: Could not create lock\n");
+	}
+	buffer_cv = cv_create("buffer cache");
+	if (buffer_cv == NULL) {
+		panic("buffer: Could not create cv\n");
+	}
+	buffer_iosem = sem_create("readahead", 0);
+	if (buffer_iosem == NULL) {
+		panic("buffer: Could not create readahead semaphore\n");
+	}
+	spinlock_init(&buffer_iodonelock);
+	buffer_rahead = buffer_racount = 0;
+	buffer_iofree = buffer_iodone = NULL;
+	for (i=0; i<BUFFER_MAXASYNC; i++) {
+		buffer_ios[i].bio_next = buffer_iofree;
+		buffer_iofree = &buffer_ios[i];
+	}
+	for (i=0; i<BUFFER_MAXDEVS; i++) {
+		buffer_devsizes[i].ds_dev = NULL;
+		buffer_devsizes[i].ds_size = 0;
+	}
+
+	buffers = kmalloc(BUFFER_COUNT * sizeof(struct buf));
+	if (buffers == NULL) {
+		panic("buffer: Could not allocate buffer headers\n");
+	}
+	for (i=0; i<BUFFER_HASHSIZE; i++) {
+		buffer_hash[i] = NULL;
+	}
+	buffer_lruhead = buffer_lrutail = NULL;
+
+	for (i=0; i<BUFFER_COUNT; i++) {
+		b = &buffers[i];
+		b->b_hashnext = NULL;
+		b->b_lruprev = b->b_lrunext = NULL;
+		b->b_dev = NULL;
+		b->b_block = 0;
+		b->b_valid = false;
+		b->b_dirty = false;
+		b->b_busy = false;
+		b->b_prefetched = false;
+		b->b_pinned = false;
+		b->b_unfilled = false;
+		b->b_dirtysince = 0;
+		b->b_data = kmalloc(BUFFER_SIZE);
+		if (b->b_data == NULL) {
+			panic("buffer: Could not allocate buffer space\n");
+		}
+		b->b_size = BUFFER_SIZE;
+		buffer_lru_append(b);
+	}
+
+	bzero(&buffer_stats, sizeof(buffer_stats));
+
+	result = thread_fork("readahead", NULL, buffer_rathread, NULL, 0);
+	if (result) {
+		panic("buffer: Could not start readahead thread: %s\n",
+		      strerror(result));
+	}
+	result = thread_fork("syncer", NULL, buffer_syncthread, NULL, 0);
+	if (result) {
+		panic("buffer: Could not start syncer thread: %s\n",
+		      strerror(result));
+	}
+}
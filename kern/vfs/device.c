@@ -330,6 +330,7 @@ static const struct vnode_ops dev_vnode_ops = {
 	.vop_read = dev_read,
 	.vop_readlink = vopfail_uio_inval,
 	.vop_getdirentry = vopfail_uio_notdir,
+	.vop_getdirentries = vopfail_getdirentries_notdir,
 	.vop_write = dev_write,
 	.vop_ioctl = dev_ioctl,
 	.vop_stat = dev_stat,
@@ -386,3 +387,26 @@ dev_uncreate_vnode(struct vnode *vn)
 	vnode_cleanup(vn);
 	kfree(vn);
 }
+
+/*
+ * Start an asynchronous request on a device.
+ *
+ * Devices that don't have a devop_submit get the request done
+ * synchronously here, with dr_done called before we return.
+ */
+int
+dev_submit(struct device *dev, struct devreq *req)
+{
+	int result;
+
+	KASSERT(req->dr_uio->uio_segflg == UIO_SYSSPACE);
+	KASSERT(req->dr_done != NULL);
+
+	if (dev->d_ops->devop_submit != NULL) {
+		return dev->d_ops->devop_submit(dev, req);
+	}
+
+	result = DEVOP_IO(dev, req->dr_uio);
+	req->dr_done(req, result);
+	return 0;
+}
@@ -0,0 +1,360 @@
+/*
+ * Directory name lookup cache.
+ *
+ * A fixed pool of entries, each mapping (directory vnode, name) to a
+ * vnode or to NULL for a name that doesn't exist. Entries are found
+ * through a hash table and recycled in LRU order; every entry is on
+ * the LRU list, and the ones in use are also on a hash chain.
+ *
+ * namecache_lock protects everything here. It is a leaf lock: we
+ * never call into a filesystem while holding it, and in particular
+ * we drop it before releasing a reference (VOP_DECREF), since that
+ * may call VOP_RECLAIM.
+ */
+#include <types.h>
+#include <lib.h>
+#include <synch.h>
+#include <fs.h>
+#include <vnode.h>
+#include <namecache.h>
+
+/* Number of hash chains. */
+#define NAMECACHE_HASHSIZE	61
+
+struct ncentry {
+	struct ncentry *nc_hashnext;	/* next on hash chain */
+	struct ncentry *nc_lruprev;	/* LRU list linkage */
+	struct ncentry *nc_lrunext;
+	struct vnode *nc_dir;		/* directory, or NULL if unused */
+	struct vnode *nc_vn;		/* what the name is; NULL if none */
+	char nc_name[NAMECACHE_NAMELEN+1];
+};
+
+static struct ncentry namecache[NAMECACHE_SIZE];
+static struct ncentry *namecache_hash[NAMECACHE_HASHSIZE];
+static struct ncentry *namecache_lruhead;	/* least recently used */
+static struct ncentry *namecache_lrutail;	/* most recently used */
+static struct lock *namecache_lock;
+
+/* Statistics. */
+static struct {
+	unsigned hits;			/* found a vnode */
+	unsigned neghits;		/* found that the name doesn't exist */
+	unsigned misses;		/* not cached */
+	unsigned enters;		/* entries made */
+	unsigned purges;		/* entries invalidated */
+} namecache_stats;
+
+////////////////////////////////////////////////////////////
+// List and hash plumbing (call with namecache_lock held)
+
+static
+unsigned
+namecache_hashfunc(struct vnode *dir, const char *name)
+{
+	unsigned h;
+
+	h = (uintptr_t)dir / sizeof(struct vnode);
+	for (; *name; name++) {
+		h = h * 33 + (unsigned char)*name;
+	}
+	return h % NAMECACHE_HASHSIZE;
+}
+
+static
+struct ncentry *
+namecache_find(struct vnode *dir, const char *name)
+{
+	struct ncentry *nc;
+
+	for (nc = namecache_hash[namecache_hashfunc(dir, name)];
+	     nc != NULL; nc = nc->nc_hashnext) {
+		if (nc->nc_dir == dir && !strcmp(nc->nc_name, name)) {
+			return nc;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+namecache_lru_remove(struct ncentry *nc)
+{
+	if (nc->nc_lruprev != NULL) {
+		nc->nc_lruprev->nc_lrunext = nc->nc_lrunext;
+	}
+	else {
+		namecache_lruhead = nc->nc_lrunext;
+	}
+	if (nc->nc_lrunext != NULL) {
+		nc->nc_lrunext->nc_lruprev = nc->nc_lruprev;
+	}
+	else {
+		namecache_lrutail = nc->nc_lruprev;
+	}
+	nc->nc_lruprev = nc->nc_lrunext = NULL;
+}
+
+/* Put NC, which is not on the LRU list, at the most-recently-used end. */
+static
+void
+namecache_lru_append(struct ncentry *nc)
+{
+	nc->nc_lruprev = namecache_lrutail;
+	nc->nc_lrunext = NULL;
+	if (namecache_lrutail != NULL) {
+		namecache_lrutail->nc_lrunext = nc;
+	}
+	else {
+		namecache_lruhead = nc;
+	}
+	namecache_lrutail = nc;
+}
+
+/* Put NC at the least-recently-used end, so it gets reused first. */
+static
+void
+namecache_lru_demote(struct ncentry *nc)
+{
+	namecache_lru_remove(nc);
+	nc->nc_lrunext = namecache_lruhead;
+	if (namecache_lruhead != NULL) {
+		namecache_lruhead->nc_lruprev = nc;
+	}
+	else {
+		namecache_lrutail = nc;
+	}
+	namecache_lruhead = nc;
+}
+
+/*
+ * Take an entry off its hash chain and mark it unused. Hands back the
+ * vnode reference it held (if any); the caller must VOP_DECREF it
+ * after dropping namecache_lock.
+ */
+static
+struct vnode *
+namecache_clear(struct ncentry *nc)
+{
+	struct ncentry **ncp;
+	struct vnode *vn;
+
+	KASSERT(nc->nc_dir != NULL);
+
+	for (ncp = &namecache_hash[namecache_hashfunc(nc->nc_dir,
+						      nc->nc_name)];
+	     *ncp != NULL; ncp = &(*ncp)->nc_hashnext) {
+		if (*ncp == nc) {
+			*ncp = nc->nc_hashnext;
+			break;
+		}
+	}
+	nc->nc_hashnext = NULL;
+
+	vn = nc->nc_vn;
+	nc->nc_dir = NULL;
+	nc->nc_vn = NULL;
+	nc->nc_name[0] = 0;
+	namecache_lru_demote(nc);
+
+	return vn;
+}
+
+////////////////////////////////////////////////////////////
+// Interface
+
+bool
+namecache_lookup(struct vnode *dir, const char *name, struct vnode **ret)
+{
+	struct ncentry *nc;
+
+	if (strlen(name) > NAMECACHE_NAMELEN) {
+		return false;
+	}
+
+	lock_acquire(namecache_lock);
+	nc = namecache_find(dir, name);
+	if (nc == NULL) {
+		namecache_stats.misses++;
+		lock_release(namecache_lock);
+		return false;
+	}
+
+	namecache_lru_remove(nc);
+	namecache_lru_append(nc);
+
+	if (nc->nc_vn != NULL) {
+		VOP_INCREF(nc->nc_vn);
+		namecache_stats.hits++;
+	}
+	else {
+		namecache_stats.neghits++;
+	}
+	*ret = nc->nc_vn;
+	lock_release(namecache_lock);
+	return true;
+}
+
+void
+namecache_enter(struct vnode *dir, const char *name, struct vnode *vn)
+{
+	struct ncentry *nc;
+	struct vnode *oldvn;
+	unsigned h;
+
+	KASSERT(dir != NULL);
+
+	if (strlen(name) > NAMECACHE_NAMELEN) {
+		return;
+	}
+
+	lock_acquire(namecache_lock);
+
+	nc = namecache_find(dir, name);
+	if (nc == NULL) {
+		/* Take the least recently used entry. */
+		nc = namecache_lruhead;
+		KASSERT(nc != NULL);
+		oldvn = nc->nc_dir != NULL ? namecache_clear(nc) : NULL;
+
+		nc->nc_dir = dir;
+		strcpy(nc->nc_name, name);
+		h = namecache_hashfunc(dir, name);
+		nc->nc_hashnext = namecache_hash[h];
+		namecache_hash[h] = nc;
+	}
+	else {
+		oldvn = nc->nc_vn;
+	}
+
+	if (vn != NULL) {
+		VOP_INCREF(vn);
+	}
+	nc->nc_vn = vn;
+	namecache_lru_remove(nc);
+	namecache_lru_append(nc);
+	namecache_stats.enters++;
+
+	lock_release(namecache_lock);
+
+	if (oldvn != NULL) {
+		VOP_DECREF(oldvn);
+	}
+}
+
+void
+namecache_purge(struct vnode *dir, const char *name)
+{
+	struct ncentry *nc;
+	struct vnode *vn = NULL;
+
+	if (strlen(name) > NAMECACHE_NAMELEN) {
+		return;
+	}
+
+	lock_acquire(namecache_lock);
+	nc = namecache_find(dir, name);
+	if (nc != NULL) {
+		vn = namecache_clear(nc);
+		namecache_stats.purges++;
+	}
+	lock_release(namecache_lock);
+
+	if (vn != NULL) {
+		VOP_DECREF(vn);
+	}
+}
+
+/*
+ * Common code for namecache_purgedir and namecache_purgefs: clear
+ * every entry whose directory is DIR, or (if DIR is NULL) is on FS.
+ */
+static
+void
+namecache_purgematching(struct vnode *dir, struct fs *fs)
+{
+	struct vnode *vn;
+	unsigned i;
+
+	lock_acquire(namecache_lock);
+	for (i=0; i<NAMECACHE_SIZE; i++) {
+		if (namecache[i].nc_dir == NULL) {
+			continue;
+		}
+		if (dir != NULL ? namecache[i].nc_dir != dir :
+		    namecache[i].nc_dir->vn_fs != fs) {
+			continue;
+		}
+		vn = namecache_clear(&namecache[i]);
+		namecache_stats.purges++;
+		if (vn != NULL) {
+			lock_release(namecache_lock);
+			VOP_DECREF(vn);
+			lock_acquire(namecache_lock);
+		}
+	}
+	lock_release(namecache_lock);
+}
+
+void
+namecache_purgedir(struct vnode *dir)
+{
+	namecache_purgematching(dir, NULL);
+}
+
+void
+namecache_purgefs(struct fs *fs)
+{
+	KASSERT(fs != NULL);
+	namecache_purgematching(NULL, fs);
+}
+
+void
+namecache_printstats(void)
+{
+	unsigned i, used, negative;
+
+	used = negative = 0;
+
+	lock_acquire(namecache_lock);
+	for (i=0; i<NAMECACHE_SIZE; i++) {
+		if (namecache[i].nc_dir != NULL) {
+			used++;
+			if (namecache[i].nc_vn == NULL) {
+				negative++;
+			}
+		}
+	}
+
+	kprintf("Name cache: %u entries; %u in use, %u negative\n",
+		NAMECACHE_SIZE, used, negative);
+	kprintf("    %u hits, %u negative hits, %u misses\n",
+		namecache_stats.hits, namecache_stats.neghits,
+		namecache_stats.misses);
+	kprintf("    %u entered, %u purged\n",
+		namecache_stats.enters, namecache_stats.purges);
+	lock_release(namecache_lock);
+}
+
+void
+namecache_bootstrap(void)
+{
+	unsigned i;
+
+	namecache_lock = lock_create("namecache");
+	if (namecache_lock == NULL) {
+		panic("namecache: Could not create lock\n");
+	}
+
+	for (i=0; i<NAMECACHE_HASHSIZE; i++) {
+		namecache_hash[i] = NULL;
+	}
+	namecache_lruhead = namecache_lrutail = NULL;
+	for (i=0; i<NAMECACHE_SIZE; i++) {
+		namecache[i].nc_hashnext = NULL;
+		namecache[i].nc_dir = NULL;
+		namecache[i].nc_vn = NULL;
+		namecache[i].nc_name[0] = 0;
+		namecache_lru_append(&namecache[i]);
+	}
+}
@@ -79,6 +79,27 @@ vopfail_uio_nosys(struct vnode *vn, struct uio *uio)
 	return ENOSYS;
 }
 
+////////////////////////////////////////////////////////////
+// getdirentries
+
+int
+vopfail_getdirentries_notdir(struct vnode *vn, struct uio *uio, int flags)
+{
+	(void)vn;
+	(void)uio;
+	(void)flags;
+	return ENOTDIR;
+}
+
+int
+vopfail_getdirentries_nosys(struct vnode *vn, struct uio *uio, int flags)
+{
+	(void)vn;
+	(void)uio;
+	(void)flags;
+	return ENOSYS;
+}
+
 ////////////////////////////////////////////////////////////
 // mmap
 
@@ -43,6 +43,8 @@
 #include <fs.h>
 #include <vnode.h>
 #include <device.h>
+#include <buf.h>
+#include <namecache.h>
 
 /*
  * Structure for a single named device.
@@ -112,6 +114,9 @@ vfs_bootstrap(void)
 	}
 	vfs_biglock_depth = 0;
 
+	buffer_bootstrap();
+	namecache_bootstrap();
+
 	devnull_create();
 	semfs_bootstrap();
 }
@@ -190,6 +195,30 @@ vfs_sync(void)
 	return 0;
 }
 
+/*
+ * Call FSOP_WRITEBACK on all devices. Used by the syncer.
+ */
+int
+vfs_writeback(void)
+{
+	struct knowndev *dev;
+	unsigned i, num;
+
+	vfs_biglock_acquire();
+
+	num = knowndevarray_num(knowndevs);
+	for (i=0; i<num; i++) {
+		dev = knowndevarray_get(knowndevs, i);
+		if (dev->kd_fs != NULL && dev->kd_fs != SWAP_FS) {
+			/*result =*/ FSOP_WRITEBACK(dev->kd_fs);
+		}
+	}
+
+	vfs_biglock_release();
+
+	return 0;
+}
+
 /*
  * Given a device name (lhd0, emu0, somevolname, null, etc.), hand
  * back an appropriate vnode.
@@ -654,6 +683,9 @@ vfs_unmount(const char *devname)
 	KASSERT(kd->kd_rawname != NULL);
 	KASSERT(kd->kd_device != NULL);
 
+	/* drop cached names, which hold vnodes open */
+	namecache_purgefs(kd->kd_fs);
+
 	/* sync the fs */
 	result = FSOP_SYNC(kd->kd_fs);
 	if (result) {
@@ -745,6 +777,8 @@ vfs_unmountall(void)
 
 		kprintf("vfs: Unmounting %s:\n", dev->kd_name);
 
+		namecache_purgefs(dev->kd_fs);
+
 		result = FSOP_SYNC(dev->kd_fs);
 		if (result) {
 			kprintf("vfs: Warning: sync failed for %s: %s, trying "
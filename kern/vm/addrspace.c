@@ -30,7 +30,14 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <synch.h>
 #include <addrspace.h>
+#include <pagetable.h>
+#include <coremap.h>
+#include <swap.h>
 #include <vm.h>
 #include <proc.h>
 
@@ -40,6 +47,53 @@
  * used. The cheesy hack versions in dumbvm.c are used instead.
  */
 
+/*
+ * Free the pages in [START, END) that have been touched, and clear
+ * their page table entries. Call with the address space locked, or
+ * when nobody else can see it.
+ *
+ * The entries are made invalid and the TLBs shot down before any
+ * page is freed, so that nobody can still reach a page once it has
+ * been handed to someone else (see pagetable.h). In between, an entry
+ * holds a frame with neither PTE_VALID nor PTE_SWAPPED set.
+ */
+static
+void
+as_freerange(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+	vaddr_t va;
+	pte_t *pte;
+
+	KASSERT((start & PAGE_FRAME) == start);
+
+	for (va = start; va < end; va += PAGE_SIZE) {
+		pte = pt_get(as->as_pt, va);
+		if (pte == NULL) {
+			/* Nothing in this second-level table; skip it */
+			va = PT_VADDR(PT_L1_INDEX(va) + 1, 0) - PAGE_SIZE;
+			continue;
+		}
+		*pte &= ~(pte_t)(PTE_VALID | PTE_WRITE);
+	}
+
+	vm_tlbinvalidate(as, VM_TLB_ALL);
+
+	for (va = start; va < end; va += PAGE_SIZE) {
+		pte = pt_get(as->as_pt, va);
+		if (pte == NULL) {
+			va = PT_VADDR(PT_L1_INDEX(va) + 1, 0) - PAGE_SIZE;
+			continue;
+		}
+		if (*pte & PTE_SWAPPED) {
+			swap_free(PTE_SLOT(*pte));
+		}
+		else if (*pte != 0) {
+			coremap_free(*pte & PTE_FRAME);
+		}
+		*pte = 0;
+	}
+}
+
 struct addrspace *
 as_create(void)
 {
@@ -50,28 +104,143 @@ as_create(void)
 		return NULL;
 	}
 
-	/*
-	 * Initialize as needed.
-	 */
+	as->as_pt = pt_create();
+	if (as->as_pt == NULL) {
+		kfree(as);
+		return NULL;
+	}
+	as->as_lock = lock_create("addrspace");
+	if (as->as_lock == NULL) {
+		pt_destroy(as->as_pt);
+		kfree(as);
+		return NULL;
+	}
+
+	as->as_regions = NULL;
+	as->as_heapbase = 0;
+	as->as_heaptop = 0;
+	as->as_stackbase = USERSTACK - VM_STACKPAGES * PAGE_SIZE;
+	as->as_loading = false;
 
 	return as;
 }
 
+/*
+ * Read the page at VA of AS, which is in swap slot SLOT, into a new
+ * page and point PTE at it. The slot is left for the caller to free.
+ * Call with AS locked.
+ */
+static
+int
+as_pagein(struct addrspace *as, vaddr_t va, unsigned slot, pte_t *pte)
+{
+	paddr_t pa;
+	int result;
+
+	KASSERT(lock_do_i_hold(as->as_lock));
+
+	pa = coremap_alloc(1, as, va);
+	if (pa == 0) {
+		return ENOMEM;
+	}
+	result = swap_read(slot, pa);
+	if (result) {
+		coremap_free(pa);
+		return result;
+	}
+	*pte = pa | PTE_VALID;
+	return 0;
+}
+
+/*
+ * Give NEW the touched pages of OLD. Call with both locked.
+ *
+ * Pages in memory are shared copy-on-write. Nothing is marked; a page
+ * is writeable only while its address space is the only one using it
+ * (see as_fault). The caller needs to get rid of any writeable TLB
+ * entries OLD has. Pages in swap are read into pages of NEW's own,
+ * since swap slots aren't shared.
+ */
+static
+int
+as_copypages(struct addrspace *old, struct addrspace *new)
+{
+	unsigned l1, l2;
+	pte_t *oldl2, *newpte;
+	vaddr_t va;
+	int result;
+
+	for (l1 = 0; l1 < PT_L1_ENTRIES; l1++) {
+		oldl2 = old->as_pt->pt_l2[l1];
+		if (oldl2 == NULL) {
+			continue;
+		}
+		for (l2 = 0; l2 < PT_L2_ENTRIES; l2++) {
+			if (oldl2[l2] == 0) {
+				continue;
+			}
+			va = PT_VADDR(l1, l2);
+			result = pt_getcreate(new->as_pt, va, &newpte);
+			if (result) {
+				return result;
+			}
+			/* That may have paged the page out; look now */
+			if (oldl2[l2] & PTE_VALID) {
+				coremap_share(oldl2[l2] & PTE_FRAME);
+				oldl2[l2] &= ~(pte_t)PTE_WRITE;
+				*newpte = oldl2[l2];
+			}
+			else {
+				KASSERT(oldl2[l2] & PTE_SWAPPED);
+				result = as_pagein(new, va,
+						   PTE_SLOT(oldl2[l2]), newpte);
+				if (result) {
+					return result;
+				}
+			}
+		}
+	}
+	return 0;
+}
+
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
 	struct addrspace *newas;
+	struct region *rg, *newrg, **tail;
+	int result;
 
 	newas = as_create();
 	if (newas==NULL) {
 		return ENOMEM;
 	}
 
-	/*
-	 * Write this.
-	 */
+	tail = &newas->as_regions;
+	for (rg = old->as_regions; rg != NULL; rg = rg->rg_next) {
+		newrg = kmalloc(sizeof(*newrg));
+		if (newrg == NULL) {
+			as_destroy(newas);
+			return ENOMEM;
+		}
+		*newrg = *rg;
+		newrg->rg_next = NULL;
+		*tail = newrg;
+		tail = &newrg->rg_next;
+	}
 
-	(void)old;
+	lock_acquire(old->as_lock);
+	lock_acquire(newas->as_lock);
+	newas->as_heapbase = old->as_heapbase;
+	newas->as_heaptop = old->as_heaptop;
+	newas->as_stackbase = old->as_stackbase;
+	result = as_copypages(old, newas);
+	vm_tlbinvalidate(old, VM_TLB_ALL);
+	lock_release(newas->as_lock);
+	lock_release(old->as_lock);
+	if (result) {
+		as_destroy(newas);
+		return result;
+	}
 
 	*ret = newas;
 	return 0;
@@ -80,10 +249,21 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 void
 as_destroy(struct addrspace *as)
 {
-	/*
-	 * Clean up as needed.
-	 */
+	struct region *rg;
+
+	/* Keep the pager off the pages while they're being freed */
+	lock_acquire(as->as_lock);
+	as_freerange(as, 0, USERSPACETOP);
+	lock_release(as->as_lock);
+	pt_destroy(as->as_pt);
+
+	while (as->as_regions != NULL) {
+		rg = as->as_regions;
+		as->as_regions = rg->rg_next;
+		kfree(rg);
+	}
 
+	lock_destroy(as->as_lock);
 	kfree(as);
 }
 
@@ -91,6 +271,7 @@ void
 as_activate(void)
 {
 	struct addrspace *as;
+	int spl;
 
 	as = proc_getas();
 	if (as == NULL) {
@@ -101,18 +282,19 @@ as_activate(void)
 		return;
 	}
 
-	/*
-	 * Write this.
-	 */
+	/* We don't use address space IDs, so flush the TLB. */
+	spl = splhigh();
+	vm_tlbflush();
+	curcpu->c_tlbas = as;
+	splx(spl);
 }
 
 void
 as_deactivate(void)
 {
 	/*
-	 * Write this. For many designs it won't need to actually do
-	 * anything. See proc.c for an explanation of why it (might)
-	 * be needed.
+	 * Nothing to do; the TLB is flushed when the next address
+	 * space is activated.
 	 */
 }
 
@@ -122,57 +304,92 @@ as_deactivate(void)
  * VADDR+MEMSIZE.
  *
  * The READABLE, WRITEABLE, and EXECUTABLE flags are set if read,
- * write, or execute permission should be set on the segment. At the
- * moment, these are ignored. When you write the VM system, you may
- * want to implement them.
+ * write, or execute permission should be set on the segment. The
+ * hardware can't prevent reading or executing a mapped page, so only
+ * WRITEABLE is enforced.
+ *
+ * Nothing is allocated here; pages are allocated when touched.
  */
 int
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
 		 int readable, int writeable, int executable)
 {
-	/*
-	 * Write this.
-	 */
+	struct region *rg;
+	vaddr_t top;
 
-	(void)as;
-	(void)vaddr;
-	(void)memsize;
 	(void)readable;
-	(void)writeable;
 	(void)executable;
-	return ENOSYS;
+
+	/* Align the region. First, the base... */
+	memsize += vaddr & ~(vaddr_t)PAGE_FRAME;
+	vaddr &= PAGE_FRAME;
+
+	/* ...and now the length. */
+	memsize = (memsize + PAGE_SIZE - 1) & PAGE_FRAME;
+
+	top = vaddr + memsize;
+	if (top < vaddr || top > as->as_stackbase) {
+		return ENOMEM;
+	}
+
+	rg = kmalloc(sizeof(*rg));
+	if (rg == NULL) {
+		return ENOMEM;
+	}
+	rg->rg_vbase = vaddr;
+	rg->rg_npages = memsize / PAGE_SIZE;
+	rg->rg_writeable = writeable != 0;
+	rg->rg_next = as->as_regions;
+	as->as_regions = rg;
+
+	/* The heap starts out empty, above the highest region */
+	if (top > as->as_heapbase) {
+		as->as_heapbase = as->as_heaptop = top;
+	}
+
+	return 0;
 }
 
 int
 as_prepare_load(struct addrspace *as)
 {
-	/*
-	 * Write this.
-	 */
-
-	(void)as;
+	/* Let load_elf write to read-only segments */
+	as->as_loading = true;
 	return 0;
 }
 
 int
 as_complete_load(struct addrspace *as)
 {
+	unsigned l1, l2;
+	pte_t *l2table;
+
+	lock_acquire(as->as_lock);
+	as->as_loading = false;
+
 	/*
-	 * Write this.
+	 * Get rid of writeable mappings for read-only segments. The
+	 * writeable parts get theirs back on their next fault.
 	 */
-
-	(void)as;
+	for (l1 = 0; l1 < PT_L1_ENTRIES; l1++) {
+		l2table = as->as_pt->pt_l2[l1];
+		if (l2table == NULL) {
+			continue;
+		}
+		for (l2 = 0; l2 < PT_L2_ENTRIES; l2++) {
+			l2table[l2] &= ~(pte_t)PTE_WRITE;
+		}
+	}
+	vm_tlbinvalidate(as, VM_TLB_ALL);
+	lock_release(as->as_lock);
 	return 0;
 }
 
 int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
-	/*
-	 * Write this.
-	 */
-
-	(void)as;
+	/* The stack is always there; its pages come when touched. */
+	KASSERT(as->as_stackbase == USERSTACK - VM_STACKPAGES * PAGE_SIZE);
 
 	/* Initial user-level stack pointer */
 	*stackptr = USERSTACK;
@@ -180,3 +397,183 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+/*
+ * Move the break by AMOUNT, which must be a multiple of the page
+ * size, and hand back the old break. Shrinking frees the pages.
+ */
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak)
+{
+	vaddr_t newtop;
+
+	if (amount % PAGE_SIZE != 0) {
+		return EINVAL;
+	}
+
+	lock_acquire(as->as_lock);
+	if (amount < 0) {
+		if ((vaddr_t)-amount > as->as_heaptop - as->as_heapbase) {
+			lock_release(as->as_lock);
+			return EINVAL;
+		}
+		newtop = as->as_heaptop - (vaddr_t)-amount;
+		as_freerange(as, newtop, as->as_heaptop);
+	}
+	else {
+		if ((vaddr_t)amount > as->as_stackbase - as->as_heaptop) {
+			lock_release(as->as_lock);
+			return ENOMEM;
+		}
+		newtop = as->as_heaptop + amount;
+	}
+	*oldbreak = as->as_heaptop;
+	as->as_heaptop = newtop;
+	lock_release(as->as_lock);
+
+	return 0;
+}
+
+/*
+ * Check if VA is in the address space, and whether user code may
+ * write to it. Call with the address space locked.
+ */
+static
+bool
+as_findaddr(struct addrspace *as, vaddr_t va, bool *writeable)
+{
+	struct region *rg;
+
+	KASSERT(lock_do_i_hold(as->as_lock));
+
+	if (va >= as->as_stackbase && va < USERSTACK) {
+		*writeable = true;
+		return true;
+	}
+	if (va >= as->as_heapbase && va < as->as_heaptop) {
+		*writeable = true;
+		return true;
+	}
+	for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+		if (va >= rg->rg_vbase &&
+		    va < rg->rg_vbase + rg->rg_npages * PAGE_SIZE) {
+			*writeable = rg->rg_writeable;
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Give AS its own copy of the shared page at VA, whose page table
+ * entry is PTE. Call with the address space locked.
+ */
+static
+int
+as_copyonwrite(struct addrspace *as, vaddr_t va, pte_t *pte)
+{
+	paddr_t oldpa, newpa;
+
+	KASSERT(lock_do_i_hold(as->as_lock));
+
+	oldpa = *pte & PTE_FRAME;
+	newpa = coremap_alloc(1, as, va);
+	if (newpa == 0) {
+		return ENOMEM;
+	}
+	memmove((void *)PADDR_TO_KVADDR(newpa),
+		(const void *)PADDR_TO_KVADDR(oldpa), PAGE_SIZE);
+	*pte = newpa | PTE_VALID;
+	vm_tlbinvalidate(as, va);
+	coremap_free(oldpa);
+
+	return 0;
+}
+
+/*
+ * Handle a fault on the page VA. If the access is allowed, make sure
+ * the page is in memory, allocating a zeroed page if it's never been
+ * touched and reading it back if it has been paged out, and load it
+ * into the TLB. That is done with the address space still locked, so
+ * the page can't be paged out again before it's mapped. Most TLB
+ * misses never get here; vm_fault refills them from the page table.
+ *
+ * A page shared with another address space after fork is mapped
+ * read-only, and copied on the first write. Once the other sharers
+ * have let go, it is ours again and becomes writeable.
+ */
+int
+as_fault(struct addrspace *as, vaddr_t va, int faulttype)
+{
+	pte_t *pte;
+	paddr_t pa;
+	unsigned slot;
+	bool writeable;
+	int result;
+
+	KASSERT((va & PAGE_FRAME) == va);
+
+	lock_acquire(as->as_lock);
+
+	if (!as_findaddr(as, va, &writeable)) {
+		lock_release(as->as_lock);
+		return EFAULT;
+	}
+	if (as->as_loading) {
+		writeable = true;
+	}
+	if (faulttype != VM_FAULT_READ && !writeable) {
+		lock_release(as->as_lock);
+		return EFAULT;
+	}
+
+	result = pt_getcreate(as->as_pt, va, &pte);
+	if (result) {
+		lock_release(as->as_lock);
+		return result;
+	}
+	if (*pte & PTE_VALID) {
+		if (!coremap_claim(*pte & PTE_FRAME, as, va)) {
+			if (faulttype == VM_FAULT_READ) {
+				/* Shared; map it read-only until written */
+				writeable = false;
+			}
+			else {
+				result = as_copyonwrite(as, va, pte);
+				if (result) {
+					lock_release(as->as_lock);
+					return result;
+				}
+			}
+		}
+	}
+	else if (*pte & PTE_SWAPPED) {
+		slot = PTE_SLOT(*pte);
+		result = as_pagein(as, va, slot, pte);
+		if (result) {
+			lock_release(as->as_lock);
+			return result;
+		}
+		swap_free(slot);
+	}
+	else {
+		pa = coremap_alloc(1, as, va);
+		if (pa == 0) {
+			lock_release(as->as_lock);
+			return ENOMEM;
+		}
+		bzero((void *)PADDR_TO_KVADDR(pa), PAGE_SIZE);
+		*pte = pa | PTE_VALID;
+	}
+
+	/* Remember the answer, for refilling the TLB later */
+	if (writeable) {
+		*pte |= PTE_WRITE;
+	}
+	else {
+		*pte &= ~(pte_t)PTE_WRITE;
+	}
+	vm_tlbload(va, *pte & PTE_FRAME, writeable);
+
+	lock_release(as->as_lock);
+	return 0;
+}
@@ -0,0 +1,516 @@
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <vm.h>
+#include <addrspace.h>
+#include <coremap.h>
+#include <swap.h>
+
+/*
+ * Coremap.
+ *
+ * The coremap covers all of physical memory, starting from address
+ * 0. Pages below what ram_getfirstfree returns (the exception
+ * handlers, the kernel image, anything stolen during boot, and the
+ * coremap itself) are marked fixed and never change state.
+ *
+ * Free pages are kept on a doubly linked list threaded through the
+ * entries by page number, so that taking one page off the front is
+ * O(1), as is putting a freed page back or pulling a page out of the
+ * middle when a multi-page run claims it. Runs of more than one page
+ * are found by scanning forward from a hint left where the last such
+ * run was found; the only multi-page allocations are the odd large
+ * kmalloc, so this is rarely done.
+ *
+ * The first page of an allocated run records how long the run is, so
+ * coremap_free only needs the address.
+ *
+ * User pages can be shared between address spaces for copy-on-write;
+ * the reference count says by how many, and the page is freed when
+ * the last one lets go. The owner of a shared page isn't known, since
+ * any of the sharers may turn out to be the last; it is recorded
+ * again by coremap_claim once only one is left. (coremap_touch says
+ * when that's needed, so the TLB refill fast path doesn't keep
+ * skipping it.)
+ *
+ * When memory runs out, user pages are paged out to make room (see
+ * swap.c), chosen by the clock algorithm: a hand sweeps round the
+ * coremap, and a page that has been used since the hand last passed
+ * it gets a second chance instead of being taken. A page counts as
+ * used when it is allocated, faulted on (coremap_claim), or loaded
+ * into the TLB (coremap_touch); the MIPS has no hardware referenced
+ * bit to do better with.
+ */
+
+/* Page states */
+#define CME_FREE	0	/* on the free list */
+#define CME_FIXED	1	/* in use since boot; never freed */
+#define CME_KERNEL	2	/* allocated to the kernel */
+#define CME_USER	3	/* allocated to a user address space */
+
+/* "No page" for free list links */
+#define CM_NONE		((unsigned)-1)
+
+struct coremap_entry {
+	struct addrspace *cme_as;	/* owner, for user pages */
+	vaddr_t cme_vaddr;		/* owner's address for this page */
+	unsigned cme_state:4;		/* CME_* */
+	unsigned cme_referenced:1;	/* used since the clock hand passed */
+	unsigned cme_npages:27;		/* length of run (first page only) */
+	unsigned cme_refcount;		/* references (first page only) */
+	unsigned cme_next;		/* free list links */
+	unsigned cme_prev;
+};
+
+static struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
+
+static struct coremap_entry *coremap;	/* NULL until bootstrapped */
+static unsigned coremap_npages;		/* entries in coremap */
+static unsigned coremap_nfree;		/* entries on the free list */
+static unsigned coremap_freehead;	/* first free page */
+static unsigned coremap_hint;		/* where to start looking for runs */
+static unsigned coremap_clockhand;	/* next page to consider paging out */
+
+////////////////////////////////////////////////////////////
+// Free list
+
+static
+void
+coremap_pushfree(unsigned pn)
+{
+	struct coremap_entry *cme = &coremap[pn];
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	cme->cme_state = CME_FREE;
+	cme->cme_as = NULL;
+	cme->cme_vaddr = 0;
+	cme->cme_referenced = 0;
+	cme->cme_npages = 0;
+	cme->cme_refcount = 0;
+	cme->cme_prev = CM_NONE;
+	cme->cme_next = coremap_freehead;
+	if (coremap_freehead != CM_NONE) {
+		coremap[coremap_freehead].cme_prev = pn;
+	}
+	coremap_freehead = pn;
+	coremap_nfree++;
+}
+
+static
+void
+coremap_unlinkfree(unsigned pn)
+{
+	struct coremap_entry *cme = &coremap[pn];
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	KASSERT(cme->cme_state == CME_FREE);
+
+	if (cme->cme_prev == CM_NONE) {
+		KASSERT(coremap_freehead == pn);
+		coremap_freehead = cme->cme_next;
+	}
+	else {
+		coremap[cme->cme_prev].cme_next = cme->cme_next;
+	}
+	if (cme->cme_next != CM_NONE) {
+		coremap[cme->cme_next].cme_prev = cme->cme_prev;
+	}
+	cme->cme_next = cme->cme_prev = CM_NONE;
+	coremap_nfree--;
+}
+
+////////////////////////////////////////////////////////////
+// Setup
+
+/*
+ * Take over physical memory from ram.c. Called from vm_bootstrap.
+ */
+void
+coremap_bootstrap(void)
+{
+	paddr_t cmpaddr, firstfree;
+	unsigned cmpages, firstpn, pn;
+
+	KASSERT(coremap == NULL);
+
+	coremap_npages = ram_getsize() / PAGE_SIZE;
+	cmpages = DIVROUNDUP(coremap_npages * sizeof(struct coremap_entry),
+			     PAGE_SIZE);
+	cmpaddr = ram_stealmem(cmpages);
+	if (cmpaddr == 0) {
+		panic("coremap: No memory for %u entries\n", coremap_npages);
+	}
+	firstfree = ram_getfirstfree();
+	KASSERT(firstfree % PAGE_SIZE == 0);
+	firstpn = firstfree / PAGE_SIZE;
+
+	spinlock_acquire(&coremap_lock);
+	coremap = (struct coremap_entry *)PADDR_TO_KVADDR(cmpaddr);
+	coremap_nfree = 0;
+	coremap_freehead = CM_NONE;
+	coremap_hint = firstpn;
+	coremap_clockhand = firstpn;
+	for (pn = 0; pn < firstpn; pn++) {
+		coremap[pn].cme_as = NULL;
+		coremap[pn].cme_vaddr = 0;
+		coremap[pn].cme_state = CME_FIXED;
+		coremap[pn].cme_referenced = 0;
+		coremap[pn].cme_npages = 1;
+		coremap[pn].cme_refcount = 1;
+		coremap[pn].cme_next = coremap[pn].cme_prev = CM_NONE;
+	}
+	/* Push in reverse so low addresses are handed out first */
+	for (pn = coremap_npages; pn-- > firstpn; ) {
+		coremap_pushfree(pn);
+	}
+	spinlock_release(&coremap_lock);
+
+	kprintf("coremap: %u pages, %u free\n", coremap_npages,
+		coremap_nfree);
+}
+
+////////////////////////////////////////////////////////////
+// Allocation
+
+/*
+ * Find NPAGES free pages in a row, starting from the hint and
+ * wrapping around once. Returns CM_NONE if there is no such run.
+ */
+static
+unsigned
+coremap_findrun(unsigned npages)
+{
+	unsigned start, pn, run, scanned;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	if (npages > coremap_nfree) {
+		return CM_NONE;
+	}
+
+	pn = coremap_hint;
+	run = 0;
+	for (scanned = 0; scanned < coremap_npages + npages; scanned++) {
+		if (pn >= coremap_npages) {
+			/* Runs can't wrap; start over from the bottom */
+			pn = 0;
+			run = 0;
+		}
+		if (coremap[pn].cme_state == CME_FREE) {
+			run++;
+			if (run == npages) {
+				start = pn + 1 - npages;
+				coremap_hint = pn + 1;
+				return start;
+			}
+		}
+		else {
+			run = 0;
+		}
+		pn++;
+	}
+	return CM_NONE;
+}
+
+paddr_t
+coremap_alloc(unsigned npages, struct addrspace *as, vaddr_t vaddr)
+{
+	paddr_t pa;
+	unsigned start, pn;
+
+	KASSERT(npages > 0);
+
+	spinlock_acquire(&coremap_lock);
+
+	if (coremap == NULL) {
+		/* Too early; there's no way to give these back */
+		pa = ram_stealmem(npages);
+		spinlock_release(&coremap_lock);
+		return pa;
+	}
+
+	while (1) {
+		if (npages == 1) {
+			start = coremap_freehead;
+		}
+		else {
+			start = coremap_findrun(npages);
+		}
+		if (start != CM_NONE) {
+			break;
+		}
+
+		/* Try to make room, and look again if any was made */
+		spinlock_release(&coremap_lock);
+#if OPT_DUMBVM
+		return 0;
+#else
+		if (!swap_evict()) {
+			return 0;
+		}
+#endif
+		spinlock_acquire(&coremap_lock);
+	}
+
+	for (pn = start; pn < start + npages; pn++) {
+		coremap_unlinkfree(pn);
+		coremap[pn].cme_state = as == NULL ? CME_KERNEL : CME_USER;
+		coremap[pn].cme_as = as;
+		coremap[pn].cme_vaddr = vaddr;
+		coremap[pn].cme_referenced = 1;
+		if (vaddr != 0) {
+			vaddr += PAGE_SIZE;
+		}
+	}
+	coremap[start].cme_npages = npages;
+	coremap[start].cme_refcount = 1;
+
+	spinlock_release(&coremap_lock);
+
+	return (paddr_t)start * PAGE_SIZE;
+}
+
+/*
+ * Look up the user page at PADDR. Call with the coremap locked.
+ */
+static
+struct coremap_entry *
+coremap_userpage(paddr_t paddr)
+{
+	struct coremap_entry *cme;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	KASSERT(coremap != NULL);
+	KASSERT(paddr % PAGE_SIZE == 0);
+	KASSERT(paddr / PAGE_SIZE < coremap_npages);
+
+	cme = &coremap[paddr / PAGE_SIZE];
+	KASSERT(cme->cme_state == CME_USER);
+	KASSERT(cme->cme_npages == 1);
+	KASSERT(cme->cme_refcount > 0);
+	return cme;
+}
+
+/*
+ * Add a reference to the user page at PADDR, for another address
+ * space sharing it copy-on-write.
+ */
+void
+coremap_share(paddr_t paddr)
+{
+	struct coremap_entry *cme;
+
+	spinlock_acquire(&coremap_lock);
+	cme = coremap_userpage(paddr);
+	cme->cme_refcount++;
+	cme->cme_as = NULL;
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * If the user page at PADDR isn't shared, make AS (at VADDR) its
+ * owner and return true. If it is shared, return false.
+ */
+bool
+coremap_claim(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+	struct coremap_entry *cme;
+	bool ret;
+
+	spinlock_acquire(&coremap_lock);
+	cme = coremap_userpage(paddr);
+	ret = cme->cme_refcount == 1;
+	if (ret) {
+		cme->cme_as = as;
+		cme->cme_vaddr = vaddr;
+		cme->cme_referenced = 1;
+	}
+	spinlock_release(&coremap_lock);
+
+	return ret;
+}
+
+/*
+ * Mark the user page at PADDR used, so the clock hand passes it over
+ * next time. Returns false if the page was shared and the other
+ * sharers have since let go, so nobody owns it; the caller should go
+ * through coremap_claim, or the page can never be paged out.
+ */
+bool
+coremap_touch(paddr_t paddr)
+{
+	struct coremap_entry *cme;
+	bool ret;
+
+	spinlock_acquire(&coremap_lock);
+	cme = coremap_userpage(paddr);
+	cme->cme_referenced = 1;
+	ret = cme->cme_as != NULL || cme->cme_refcount > 1;
+	spinlock_release(&coremap_lock);
+
+	return ret;
+}
+
+void
+coremap_free(paddr_t paddr)
+{
+	unsigned start, npages, pn;
+
+	KASSERT(paddr % PAGE_SIZE == 0);
+	start = paddr / PAGE_SIZE;
+
+	spinlock_acquire(&coremap_lock);
+
+	if (coremap == NULL) {
+		/* Stolen memory; leak it. */
+		spinlock_release(&coremap_lock);
+		return;
+	}
+
+	KASSERT(start < coremap_npages);
+	switch (coremap[start].cme_state) {
+	    case CME_FIXED:
+		/* Allocated before we were bootstrapped; leak it. */
+		spinlock_release(&coremap_lock);
+		return;
+	    case CME_KERNEL:
+	    case CME_USER:
+		break;
+	    default:
+		panic("coremap: Freeing free page 0x%x\n", paddr);
+	}
+
+	npages = coremap[start].cme_npages;
+	if (npages == 0) {
+		panic("coremap: Freeing 0x%x, which is not the start of "
+		      "a run\n", paddr);
+	}
+	KASSERT(start + npages <= coremap_npages);
+
+	KASSERT(coremap[start].cme_refcount > 0);
+	if (--coremap[start].cme_refcount > 0) {
+		/* Still shared */
+		KASSERT(coremap[start].cme_state == CME_USER);
+		spinlock_release(&coremap_lock);
+		return;
+	}
+
+	for (pn = start; pn < start + npages; pn++) {
+		KASSERT(coremap[pn].cme_state == coremap[start].cme_state);
+		KASSERT(pn == start || coremap[pn].cme_npages == 0);
+		coremap_pushfree(pn);
+	}
+
+	spinlock_release(&coremap_lock);
+}
+
+////////////////////////////////////////////////////////////
+// Page replacement
+
+#if !OPT_DUMBVM
+
+
+/*
+ * Choose up to MAX user pages to page out, all belonging to the same
+ * address space, and hand back that address space locked (or, if we
+ * already held its lock, with *LOCKED set to false so the caller
+ * knows not to release it). Returns the number chosen.
+ *
+ * The first victim is the first page the clock hand finds that hasn't
+ * been used since it last went by. The rest are taken from the pages
+ * that follow, as long as they belong to the same address space, so
+ * that they can be written out together. The hand goes round twice at
+ * most, since by then every page has had its referenced bit cleared.
+ *
+ * Shared pages, pages whose owner isn't known, and pages of address
+ * spaces that are locked by someone else are passed over.
+ */
+unsigned
+coremap_pickvictims(struct coremap_victim *victims, unsigned max,
+		    struct addrspace **ret, bool *locked)
+{
+	struct coremap_entry *cme;
+	struct addrspace *as;
+	unsigned n, pn, scanned;
+
+	KASSERT(max > 0);
+
+	as = NULL;
+	n = 0;
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(coremap != NULL);
+
+	for (scanned = 0; scanned < 2 * coremap_npages; scanned++) {
+		pn = coremap_clockhand;
+		cme = &coremap[pn];
+
+		if (as != NULL && cme->cme_as != as) {
+			/* End of the cluster; start here next time */
+			break;
+		}
+		coremap_clockhand = pn + 1 < coremap_npages ? pn + 1 : 0;
+
+		if (cme->cme_state != CME_USER || cme->cme_refcount != 1 ||
+		    cme->cme_as == NULL) {
+			continue;
+		}
+		if (cme->cme_referenced) {
+			cme->cme_referenced = 0;
+			continue;
+		}
+		if (as == NULL) {
+			/*
+			 * The address space can't go away while it
+			 * owns pages, so its lock is safe to touch.
+			 */
+			if (lock_do_i_hold(cme->cme_as->as_lock)) {
+				*locked = false;
+			}
+			else if (lock_tryacquire(cme->cme_as->as_lock)) {
+				*locked = true;
+			}
+			else {
+				continue;
+			}
+			as = cme->cme_as;
+		}
+
+		victims[n].cv_paddr = (paddr_t)pn * PAGE_SIZE;
+		victims[n].cv_vaddr = cme->cme_vaddr;
+		if (++n == max) {
+			break;
+		}
+	}
+
+	spinlock_release(&coremap_lock);
+
+	*ret = as;
+	return n;
+}
+
+#endif /* !OPT_DUMBVM */
+
+/*
+ * Report the memory in use. This counts everything not free,
+ * including the kernel image and whatever was taken during boot.
+ */
+unsigned
+int
+coremap_used_bytes(void)
+{
+	unsigned used;
+
+	spinlock_acquire(&coremap_lock);
+	if (coremap == NULL) {
+		used = 0;
+	}
+	else {
+		used = (coremap_npages - coremap_nfree) * PAGE_SIZE;
+	}
+	spinlock_release(&coremap_lock);
+
+	return used;
+}
@@ -0,0 +1,68 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <pagetable.h>
+
+/*
+ * Two-level page tables. See pagetable.h.
+ */
+
+struct pagetable *
+pt_create(void)
+{
+	struct pagetable *pt;
+
+	pt = kmalloc(sizeof(*pt));
+	if (pt == NULL) {
+		return NULL;
+	}
+	bzero(pt, sizeof(*pt));
+	return pt;
+}
+
+/*
+ * Free the tables. Whatever the entries referred to must already have
+ * been dealt with.
+ */
+void
+pt_destroy(struct pagetable *pt)
+{
+	unsigned i;
+
+	for (i=0; i<PT_L1_ENTRIES; i++) {
+		if (pt->pt_l2[i] != NULL) {
+			kfree(pt->pt_l2[i]);
+		}
+	}
+	kfree(pt);
+}
+
+pte_t *
+pt_get(struct pagetable *pt, vaddr_t va)
+{
+	pte_t *l2;
+
+	l2 = pt->pt_l2[PT_L1_INDEX(va)];
+	if (l2 == NULL) {
+		return NULL;
+	}
+	return &l2[PT_L2_INDEX(va)];
+}
+
+int
+pt_getcreate(struct pagetable *pt, vaddr_t va, pte_t **ret)
+{
+	pte_t *l2;
+
+	l2 = pt->pt_l2[PT_L1_INDEX(va)];
+	if (l2 == NULL) {
+		l2 = kmalloc(PT_L2_ENTRIES * sizeof(pte_t));
+		if (l2 == NULL) {
+			return ENOMEM;
+		}
+		bzero(l2, PT_L2_ENTRIES * sizeof(pte_t));
+		pt->pt_l2[PT_L1_INDEX(va)] = l2;
+	}
+	*ret = &l2[PT_L2_INDEX(va)];
+	return 0;
+}
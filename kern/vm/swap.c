@@ -0,0 +1,368 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/iovec.h>
+#include <kern/stat.h>
+#include <kern/sfs.h>
+#include <lib.h>
+#include <bitmap.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <thread.h>
+#include <current.h>
+#include <synch.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <addrspace.h>
+#include <pagetable.h>
+#include <coremap.h>
+#include <vm.h>
+#include <swap.h>
+
+/*
+ * Swap.
+ *
+ * User pages are paged out to a raw disk, in page-sized
+ * slots whose use is tracked in a bitmap. The page table entry of a
+ * page that is out holds its slot number where the frame would be,
+ * with PTE_SWAPPED set in place of PTE_VALID (see pagetable.h).
+ *
+ * When the coremap has no free pages it calls swap_evict, which has
+ * the coremap pick victims with the clock algorithm and writes them
+ * out. The victims are up to SWAP_CLUSTER pages of one address space,
+ * and go to consecutive slots in a single write. Pages are read back
+ * one at a time when faulted on (see as_fault), at which point their
+ * slot is freed; no copy is kept on disk, so every page-out is a
+ * write.
+ *
+ * There is no swap until a disk is attached with swap_attach (the
+ * "swapon" menu command); nothing chooses one by default, since that
+ * would write over whatever is on it. Without swap nothing is ever
+ * paged out, and running out of memory fails just as it would if
+ * this file weren't here.
+ */
+
+/* Set once by swap_attach; swap_vnode last, so it says the rest is there */
+static struct vnode *swap_vnode;	/* the disk; NULL if no swap */
+static char *swap_devname;		/* its name */
+static unsigned swap_nslots;		/* size of the disk in pages */
+
+/* Protects everything below */
+static struct spinlock swap_lock = SPINLOCK_INITIALIZER;
+
+static struct bitmap *swap_map;		/* slots in use */
+static unsigned swap_hint;		/* where to look for free slots */
+
+static struct {
+	unsigned pageins;		/* pages read in */
+	unsigned pageouts;		/* pages written out */
+	unsigned writes;		/* ...in this many writes */
+	unsigned fullfails;		/* evictions failed for want of slots */
+} swap_stats;
+
+/*
+ * Check whether VN holds an SFS volume, by looking for its superblock.
+ * Returns EBUSY if it does, so nobody's files get paged over.
+ */
+static
+int
+swap_checkdisk(struct vnode *vn)
+{
+	struct iovec iov;
+	struct uio u;
+	struct sfs_superblock *sb;
+	int result;
+
+	sb = kmalloc(SFS_BLOCKSIZE);
+	if (sb == NULL) {
+		return ENOMEM;
+	}
+	uio_kinit(&iov, &u, sb, SFS_BLOCKSIZE,
+		  (off_t)SFS_SUPER_BLOCK * SFS_BLOCKSIZE, UIO_READ);
+	result = VOP_READ(vn, &u);
+	if (result == 0 && sb->sb_magic == SFS_MAGIC) {
+		result = EBUSY;
+	}
+	kfree(sb);
+	return result;
+}
+
+/*
+ * Attach DEVNAME as the swap disk. Called from the menu. Refuses a
+ * disk that has a filesystem on it, and can only be done once.
+ */
+int
+swap_attach(const char *devname)
+{
+	struct vnode *vn;
+	struct stat st;
+	struct bitmap *map;
+	char *name;
+	unsigned nslots;
+	int result;
+
+	if (swap_vnode != NULL) {
+		kprintf("swap: Already using %s\n", swap_devname);
+		return EBUSY;
+	}
+
+	name = kstrdup(devname);
+	if (name == NULL) {
+		return ENOMEM;
+	}
+
+	result = vfs_swapon(devname, &vn);
+	if (result) {
+		kfree(name);
+		return result;
+	}
+
+	result = swap_checkdisk(vn);
+	if (result == EBUSY) {
+		kprintf("swap: %s has an SFS volume on it; not using it\n",
+			devname);
+	}
+	if (result) {
+		goto fail;
+	}
+
+	result = VOP_STAT(vn, &st);
+	if (result) {
+		goto fail;
+	}
+	nslots = st.st_size / PAGE_SIZE;
+	if (nslots > PTE_MAXSLOTS) {
+		/* Page table entries can't name any more */
+		nslots = PTE_MAXSLOTS;
+	}
+	if (nslots == 0) {
+		kprintf("swap: %s is too small\n", devname);
+		result = ENOSPC;
+		goto fail;
+	}
+
+	map = bitmap_create(nslots);
+	if (map == NULL) {
+		result = ENOMEM;
+		goto fail;
+	}
+
+	spinlock_acquire(&swap_lock);
+	swap_map = map;
+	swap_nslots = nslots;
+	swap_devname = name;
+	swap_vnode = vn;
+	spinlock_release(&swap_lock);
+
+	kprintf("swap: %u pages on %s\n", nslots, devname);
+	return 0;
+
+ fail:
+	VOP_DECREF(vn);
+	vfs_swapoff(devname);
+	kfree(name);
+	return result;
+}
+
+/*
+ * Find NPAGES consecutive free slots and mark them in use. If there
+ * isn't a run that long, settle for the longest shorter one there is.
+ * Returns how many were got (0 if swap is full) and the first in
+ * *SLOT.
+ */
+static
+unsigned
+swap_allocslots(unsigned npages, unsigned *slot)
+{
+	unsigned i;
+
+	spinlock_acquire(&swap_lock);
+	for (; npages > 0; npages--) {
+		if (bitmap_findrun(swap_map, swap_hint, npages, slot) == 0) {
+			break;
+		}
+	}
+	for (i = 0; i < npages; i++) {
+		bitmap_mark(swap_map, *slot + i);
+	}
+	if (npages > 0) {
+		swap_hint = *slot + npages;
+	}
+	else {
+		/* *SLOT wasn't set */
+		swap_stats.fullfails++;
+	}
+	spinlock_release(&swap_lock);
+
+	return npages;
+}
+
+void
+swap_free(unsigned slot)
+{
+	KASSERT(slot < swap_nslots);
+
+	spinlock_acquire(&swap_lock);
+	KASSERT(bitmap_isset(swap_map, slot));
+	bitmap_unmark(swap_map, slot);
+	spinlock_release(&swap_lock);
+}
+
+/*
+ * Page out some user pages. Returns true if any pages were freed.
+ */
+bool
+swap_evict(void)
+{
+	struct coremap_victim victims[SWAP_CLUSTER];
+	struct iovec iov[SWAP_CLUSTER];
+	struct uio u;
+	struct addrspace *as;
+	unsigned n, i, slot;
+	bool locked;
+	pte_t *pte;
+	int result;
+
+	if (swap_vnode == NULL) {
+		return false;
+	}
+	if (curcpu->c_spinlocks > 0 || curthread->t_in_interrupt) {
+		/* Can't wait for the disk from here */
+		return false;
+	}
+
+	n = coremap_pickvictims(victims, SWAP_CLUSTER, &as, &locked);
+	if (n == 0) {
+		return false;
+	}
+	n = swap_allocslots(n, &slot);
+	if (n == 0) {
+		/* Swap is full; the victims just stay where they are */
+		if (locked) {
+			lock_release(as->as_lock);
+		}
+		return false;
+	}
+
+	/*
+	 * Point the page table entries at the slots, and then get the
+	 * pages out of every TLB, so that they can't change while
+	 * they're written. In that order, because vm_fault refills the
+	 * TLB from the page table without the address space lock;
+	 * anyone else who faults on them waits for the lock, which we
+	 * hold.
+	 */
+	for (i = 0; i < n; i++) {
+		pte = pt_get(as->as_pt, victims[i].cv_vaddr);
+		KASSERT(pte != NULL);
+		KASSERT((*pte & (PTE_FRAME | PTE_VALID)) ==
+			(victims[i].cv_paddr | PTE_VALID));
+		*pte = PTE_MKSWAPPED(slot + i);
+	}
+	vm_tlbinvalidate(as, n == 1 ? victims[0].cv_vaddr : VM_TLB_ALL);
+
+	for (i = 0; i < n; i++) {
+		iov[i].iov_kbase = (void *)PADDR_TO_KVADDR(victims[i].cv_paddr);
+		iov[i].iov_len = PAGE_SIZE;
+	}
+	u.uio_iov = iov;
+	u.uio_iovcnt = n;
+	u.uio_offset = (off_t)slot * PAGE_SIZE;
+	u.uio_resid = n * PAGE_SIZE;
+	u.uio_segflg = UIO_SYSSPACE;
+	u.uio_rw = UIO_WRITE;
+	u.uio_space = NULL;
+
+	result = VOP_WRITE(swap_vnode, &u);
+	if (result == 0 && u.uio_resid > 0) {
+		result = EIO;
+	}
+	if (result) {
+		kprintf("swap: Write error: %s\n", strerror(result));
+		for (i = 0; i < n; i++) {
+			pte = pt_get(as->as_pt, victims[i].cv_vaddr);
+			*pte = victims[i].cv_paddr | PTE_VALID;
+			swap_free(slot + i);
+		}
+		if (locked) {
+			lock_release(as->as_lock);
+		}
+		return false;
+	}
+
+	for (i = 0; i < n; i++) {
+		coremap_free(victims[i].cv_paddr);
+	}
+
+	if (locked) {
+		lock_release(as->as_lock);
+	}
+
+	spinlock_acquire(&swap_lock);
+	swap_stats.pageouts += n;
+	swap_stats.writes++;
+	spinlock_release(&swap_lock);
+
+	return true;
+}
+
+/*
+ * Read the page in SLOT into the page at PADDR. The slot is left
+ * allocated; the caller frees it when it's done with it.
+ */
+int
+swap_read(unsigned slot, paddr_t paddr)
+{
+	struct iovec iov;
+	struct uio u;
+	int result;
+
+	KASSERT(swap_vnode != NULL);
+	KASSERT(slot < swap_nslots);
+
+	uio_kinit(&iov, &u, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE,
+		  (off_t)slot * PAGE_SIZE, UIO_READ);
+	result = VOP_READ(swap_vnode, &u);
+	if (result == 0 && u.uio_resid > 0) {
+		result = EIO;
+	}
+	if (result) {
+		return result;
+	}
+
+	spinlock_acquire(&swap_lock);
+	swap_stats.pageins++;
+	spinlock_release(&swap_lock);
+
+	return 0;
+}
+
+void
+swap_printstats(void)
+{
+	unsigned i, used, pageins, pageouts, writes, fullfails;
+
+	if (swap_vnode == NULL) {
+		kprintf("Swap: none\n");
+		return;
+	}
+
+	spinlock_acquire(&swap_lock);
+	used = 0;
+	for (i = 0; i < swap_nslots; i++) {
+		if (bitmap_isset(swap_map, i)) {
+			used++;
+		}
+	}
+	pageins = swap_stats.pageins;
+	pageouts = swap_stats.pageouts;
+	writes = swap_stats.writes;
+	fullfails = swap_stats.fullfails;
+	spinlock_release(&swap_lock);
+
+	kprintf("Swap: %u pages on %s, %u in use\n",
+		swap_nslots, swap_devname, used);
+	kprintf("    %u pages in, %u pages out in %u writes\n",
+		pageins, pageouts, writes);
+	kprintf("    %u evictions failed for lack of space\n", fullfails);
+}
@@ -32,6 +32,7 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <dirent.h>
 #include <errno.h>
 #include <err.h>
 
@@ -127,18 +128,22 @@ printheader(const char *file)
 }
 
 /*
- * Show a single file.
+ * Show a single file. STATP is its stat information, if the caller
+ * already has it, or NULL.
  * We don't do the neat multicolumn listing that Unix ls does.
  */
 static
 void
-print(const char *path)
+print(const char *path, const struct stat *statp)
 {
 	struct stat statbuf;
 	const char *file;
 	int typech;
 
-	if (lopt || sopt) {
+	if (statp != NULL) {
+		statbuf = *statp;
+	}
+	else if (lopt || sopt) {
 		int fd;
 
 		fd = open(path, O_RDONLY);
@@ -186,20 +191,29 @@ print(const char *path)
 }
 
 /*
- * List a directory.
+ * Read the directory PATH, calling FUNC for each entry with its full
+ * name, its name within PATH, its type (DT_UNKNOWN if we can't tell
+ * without asking), and, if WANTSTAT is set and the filesystem
+ * supplied it, its stat information (otherwise NULL).
+ *
+ * Use getdirentries to get many entries per call; if the filesystem
+ * doesn't support it, fall back to getdirentry, one name at a time.
  */
 static
 void
-listdir(const char *path, int showheader)
+readentries(const char *path, int wantstat,
+	    void (*func)(const char *newpath, const char *name,
+			 unsigned type, const struct stat *statp))
 {
-	int fd;
-	char buf[1024];
+	union {
+		struct direntplus dp;	/* for alignment */
+		char bytes[2048];
+	} buf;
 	char newpath[1024];
-	ssize_t len;
-
-	if (showheader) {
-		printheader(path);
-	}
+	const struct direntplus *dp;
+	const struct dirent *d;
+	ssize_t len, pos;
+	int fd;
 
 	/*
 	 * Open it.
@@ -212,75 +226,115 @@ listdir(const char *path, int showheader)
 	/*
 	 * List the directory.
 	 */
-	while ((len = getdirentry(fd, buf, sizeof(buf)-1)) > 0) {
-		buf[len] = 0;
+	while ((len = getdirentries(fd, &buf, sizeof(buf),
+				    wantstat ? GETDIRENTRIES_PLUS : 0)) > 0) {
+		for (pos=0; pos<len; pos += d->d_reclen) {
+			if (wantstat) {
+				dp = (const void *)(buf.bytes + pos);
+				d = &dp->dp_dirent;
+			}
+			else {
+				dp = NULL;
+				d = (const void *)(buf.bytes + pos);
+			}
+
+			/* Assemble the full name of the new item */
+			snprintf(newpath, sizeof(newpath), "%s/%s",
+				 path, d->d_name);
+
+			func(newpath, d->d_name, d->d_type,
+			     dp ? &dp->dp_stat : NULL);
+		}
+	}
+	if (len<0 && errno==ENOSYS) {
+		while ((len = getdirentry(fd, buf.bytes,
+					  sizeof(buf.bytes)-1)) > 0) {
+			buf.bytes[len] = 0;
 
-		/* Assemble the full name of the new item */
-		snprintf(newpath, sizeof(newpath), "%s/%s", path, buf);
+			/* Assemble the full name of the new item */
+			snprintf(newpath, sizeof(newpath), "%s/%s",
+				 path, buf.bytes);
 
-		if (aopt || buf[0]!='.') {
-			/* Print it */
-			print(newpath);
+			func(newpath, buf.bytes, DT_UNKNOWN, NULL);
 		}
 	}
 	if (len<0) {
-		err(1, "%s: getdirentry", path);
+		err(1, "%s: getdirentries", path);
 	}
 
 	/* Done */
 	close(fd);
 }
 
+/*
+ * Show one entry of a directory being listed.
+ */
 static
 void
-recursedir(const char *path)
+listentry(const char *newpath, const char *name, unsigned type,
+	  const struct stat *statp)
 {
-	int fd;
-	char buf[1024];
-	char newpath[1024];
-	int len;
+	(void)type;
 
-	/*
-	 * Open it.
-	 */
-	fd = open(path, O_RDONLY);
-	if (fd<0) {
-		err(1, "%s", path);
+	if (aopt || name[0]!='.') {
+		/* Print it */
+		print(newpath, statp);
 	}
+}
 
-	/*
-	 * List the directory.
-	 */
-	while ((len = getdirentry(fd, buf, sizeof(buf)-1)) > 0) {
-		buf[len] = 0;
+/*
+ * List a directory.
+ */
+static
+void
+listdir(const char *path, int showheader)
+{
+	if (showheader) {
+		printheader(path);
+	}
 
-		/* Assemble the full name of the new item */
-		snprintf(newpath, sizeof(newpath), "%s/%s", path, buf);
+	/* Only ask for stat information if we're going to print it */
+	readentries(path, lopt || sopt, listentry);
+}
 
-		if (!aopt && buf[0]=='.') {
-			/* skip this one */
-			continue;
-		}
+static void recursedir(const char *path);
 
-		if (!strcmp(buf, ".") || !strcmp(buf, "..")) {
-			/* always skip these */
-			continue;
-		}
+/*
+ * Look at one entry of a directory being recursed into; if it's a
+ * subdirectory, list it.
+ */
+static
+void
+recurseentry(const char *newpath, const char *name, unsigned type,
+	     const struct stat *statp)
+{
+	(void)statp;
 
-		if (!isdir(newpath)) {
-			continue;
-		}
+	if (!aopt && name[0]=='.') {
+		/* skip this one */
+		return;
+	}
 
-		listdir(newpath, 1 /*showheader*/);
-		if (Ropt) {
-			recursedir(newpath);
-		}
+	if (!strcmp(name, ".") || !strcmp(name, "..")) {
+		/* always skip these */
+		return;
 	}
-	if (len<0) {
-		err(1, "%s", path);
+
+	if (type == DT_UNKNOWN ? !isdir(newpath) : type != DT_DIR) {
+		return;
 	}
 
-	close(fd);
+	listdir(newpath, 1 /*showheader*/);
+	if (Ropt) {
+		recursedir(newpath);
+	}
+}
+
+static
+void
+recursedir(const char *path)
+{
+	readentries(path, 0, recurseentry);
 }
 
 static
@@ -294,7 +348,7 @@ listitem(const char *path, int showheader)
 		}
 	}
 	else {
-		print(path);
+		print(path, NULL);
 	}
 }
 
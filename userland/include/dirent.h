@@ -0,0 +1,34 @@
+#ifndef _DIRENT_H_
+#define _DIRENT_H_
+
+/*
+ * Get struct dirent, struct direntplus, and the flags from the kernel
+ */
+#include <sys/types.h>
+#include <kern/limits.h>
+#include <kern/stat.h>
+#include <kern/stattypes.h>
+#include <kern/dirent.h>
+
+/*
+ * Values for d_type. DT_UNKNOWN is never returned by OS/161 but is
+ * provided for compatibility.
+ */
+#define DT_UNKNOWN 0
+#define DT_REG   (_S_IFREG >> 12)
+#define DT_DIR   (_S_IFDIR >> 12)
+#define DT_LNK   (_S_IFLNK >> 12)
+#define DT_FIFO  (_S_IFIFO >> 12)
+#define DT_SOCK  (_S_IFSOCK >> 12)
+#define DT_CHR   (_S_IFCHR >> 12)
+#define DT_BLK   (_S_IFBLK >> 12)
+
+/*
+ * getdirentries reads as many directory entries as fit into BUF and
+ * returns the number of bytes used, or 0 at the end of the directory.
+ * Step through the records using d_reclen. (The same file offset is
+ * used by getdirentry; the two can be mixed.)
+ */
+ssize_t getdirentries(int filehandle, void *buf, size_t buflen, int flags);
+
+#endif /* _DIRENT_H_ */
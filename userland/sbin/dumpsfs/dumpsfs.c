@@ -73,6 +73,12 @@ static bool dofiles, dodirs;
 static bool doindirect;
 static bool recurse;
 
+/* Block size of the volume, from the superblock */
+static uint32_t blocksize;
+
+/* Inode table layout (dense format); ninodes is 0 for the original */
+static uint32_t ninodes, inomapstart, itablestart;
+
 ////////////////////////////////////////////////////////////
 // printouts
 
@@ -137,22 +143,116 @@ uint32_t
 readsb(void)
 {
 	struct sfs_superblock sb;
+	char data[SFS_MAXBLOCKSIZE];
 
-	diskread(&sb, SFS_SUPER_BLOCK);
+	diskread(data, SFS_SUPER_BLOCK);
+	memcpy(&sb, data, sizeof(sb));
 	if (SWAP32(sb.sb_magic) != SFS_MAGIC) {
 		errx(1, "Not an sfs filesystem");
 	}
+	blocksize = SWAP32(sb.sb_blocksize);
+	if (blocksize == 0) {
+		blocksize = SFS_BLOCKSIZE;
+	}
+	if (blocksize < SFS_BLOCKSIZE || blocksize > SFS_MAXBLOCKSIZE ||
+	    (blocksize & (blocksize - 1)) != 0) {
+		errx(1, "Unsupported block size %u", blocksize);
+	}
+	disksetblocksize(blocksize);
+	if (SWAP32(sb.sb_version) == SFS_VERSION_DENSE) {
+		ninodes = SWAP32(sb.sb_ninodes);
+		inomapstart = SWAP32(sb.sb_inomapstart);
+		itablestart = SWAP32(sb.sb_itablestart);
+	}
+	else if (SWAP32(sb.sb_version) != SFS_VERSION_ORIG) {
+		errx(1, "Unknown sfs format version %u",
+		     SWAP32(sb.sb_version));
+	}
 	return SWAP32(sb.sb_nblocks);
 }
 
+/*
+ * Read inode INO. In the dense format the part past
+ * SFS_DINODE_DENSESIZE isn't stored and comes back zeroed.
+ */
+static
+void
+readinode(uint32_t ino, struct sfs_dinode *sfi)
+{
+	char data[SFS_MAXBLOCKSIZE];
+	uint32_t inoperblock = SFS_INOPERBLOCK(blocksize);
+
+	if (ninodes == 0) {
+		diskread(data, ino);
+		memcpy(sfi, data, sizeof(*sfi));
+		return;
+	}
+	if (ino >= ninodes) {
+		errx(1, "Inode %u out of range (%u inodes)", ino, ninodes);
+	}
+	diskread(data, itablestart + ino / inoperblock);
+	memset(sfi, 0, sizeof(*sfi));
+	memcpy(sfi, data + (ino % inoperblock) * SFS_DINODE_DENSESIZE,
+	       SFS_DINODE_DENSESIZE);
+}
+
+/*
+ * Print the state of the journal, from its header at block START.
+ */
+static
+void
+dumpjournal(uint32_t start)
+{
+	struct sfs_jheader jh;
+	char data[SFS_MAXBLOCKSIZE];
+	uint32_t i, n;
+
+	diskread(data, start);
+	memcpy(&jh, data, sizeof(jh));
+	if (SWAP32(jh.jh_magic) != SFS_JMAGIC) {
+		dumpvalf("Journal header", "bad magic 0x%8x",
+			 SWAP32(jh.jh_magic));
+		return;
+	}
+	switch (SWAP32(jh.jh_state)) {
+	    case SFS_JSTATE_CLEAN:
+		dumpvalf("Journal state", "clean, next transaction %u",
+			 SWAP32(jh.jh_seq));
+		break;
+	    case SFS_JSTATE_COMMITTED:
+		n = SWAP32(jh.jh_nblocks);
+		dumpvalf("Journal state", "transaction %u committed, "
+			 "%u blocks, checksum 0x%08x", SWAP32(jh.jh_seq),
+			 n, SWAP32(jh.jh_sum));
+		if (n > SFS_JMAXBLOCKS) {
+			n = SFS_JMAXBLOCKS;
+		}
+		for (i=0; i<n; i++) {
+			printf("    Log block %u: block %u\n",
+			       i, SWAP32(jh.jh_blocks[i]));
+		}
+		break;
+	    case SFS_JSTATE_UNSAFE:
+		dumpvalf("Journal state", "unsafe (needs sfsck), "
+			 "next transaction %u", SWAP32(jh.jh_seq));
+		break;
+	    default:
+		dumpvalf("Journal state", "unknown (%u)",
+			 SWAP32(jh.jh_state));
+		break;
+	}
+}
+
 static
 void
 dumpsb(void)
 {
 	struct sfs_superblock sb;
+	char data[SFS_MAXBLOCKSIZE];
 	unsigned i;
 
-	diskread(&sb, SFS_SUPER_BLOCK);
+	diskread(data, SFS_SUPER_BLOCK);
+	memcpy(&sb, data, sizeof(sb));
 	sb.sb_volname[sizeof(sb.sb_volname)-1] = 0;
 
 	printf("Superblock\n");
@@ -160,8 +260,30 @@ dumpsb(void)
 	dumpvalf("Magic", "0x%8x", SWAP32(sb.sb_magic));
 	dumpvalf("Size", "%u blocks", SWAP32(sb.sb_nblocks));
 	dumpvalf("Freemap size", "%u blocks",
-		 SFS_FREEMAPBLOCKS(SWAP32(sb.sb_nblocks)));
-	dumpvalf("Block size", "%u bytes", SFS_BLOCKSIZE);
+		 SFS_FREEMAPBLOCKS(SWAP32(sb.sb_nblocks), blocksize));
+	dumpvalf("Block size", "%u bytes%s", blocksize,
+		 sb.sb_blocksize == 0 ? " (not set)" : "");
+	dumpvalf("Format version", "%u (%s)", SWAP32(sb.sb_version),
+		 SWAP32(sb.sb_version) == SFS_VERSION_DENSE ?
+		 "inode table" : "original");
+	if (SWAP32(sb.sb_version) == SFS_VERSION_DENSE) {
+		dumpvalf("Inodes", "%u", SWAP32(sb.sb_ninodes));
+		dumpvalf("Inode bitmap", "%u blocks at %u",
+			 SFS_INOMAPBLOCKS(SWAP32(sb.sb_ninodes), blocksize),
+			 SWAP32(sb.sb_inomapstart));
+		dumpvalf("Inode table", "%u blocks at %u",
+			 SFS_ITABLEBLOCKS(SWAP32(sb.sb_ninodes), blocksize),
+			 SWAP32(sb.sb_itablestart));
+	}
+	if (SWAP32(sb.sb_journalblocks) != 0) {
+		dumpvalf("Journal", "%u blocks at %u",
+			 SWAP32(sb.sb_journalblocks),
+			 SWAP32(sb.sb_journalstart));
+		dumpjournal(SWAP32(sb.sb_journalstart));
+	}
+	else {
+		dumplval("Journal", "none");
+	}
 	dumplval("Volume name", sb.sb_volname);
 
 	for (i=0; i<ARRAYCOUNT(sb.reserved); i++) {
@@ -173,34 +295,43 @@ dumpsb(void)
 	printf("\n");
 }
 
+/*
+ * Print a bitmap of NBITS bits (blocks or inodes) stored starting at
+ * disk block START.
+ */
 static
 void
-dumpfreemap(uint32_t fsblocks)
+dumpbitmap(const char *title, const char *what, uint32_t start,
+	   uint32_t nbits)
 {
-	uint32_t freemapblocks = SFS_FREEMAPBLOCKS(fsblocks);
+	uint32_t mapblocks = SFS_FREEMAPBLOCKS(nbits, blocksize);
+	uint32_t bitsperblock = SFS_BITSPERBLOCK(blocksize);
 	uint32_t i, j, k, bn;
-	uint8_t data[SFS_BLOCKSIZE], mask;
+	uint8_t data[SFS_MAXBLOCKSIZE], mask;
 	char tmp[16];
 
-	printf("Free block bitmap\n");
-	printf("-----------------\n");
-	for (i=0; i<freemapblocks; i++) {
-		diskread(data, SFS_FREEMAP_START+i);
-		printf("    Freemap block #%u in disk block %u: blocks %u - %u"
+	printf("%s\n", title);
+	for (i=0; title[i]; i++) {
+		putchar('-');
+	}
+	printf("\n");
+	for (i=0; i<mapblocks; i++) {
+		diskread(data, start+i);
+		printf("    Bitmap block #%u in disk block %u: %s %u - %u"
 		       " (0x%x - 0x%x)\n",
-		       i, SFS_FREEMAP_START+i,
-		       i*SFS_BITSPERBLOCK, (i+1)*SFS_BITSPERBLOCK - 1,
-		       i*SFS_BITSPERBLOCK, (i+1)*SFS_BITSPERBLOCK - 1);
-		for (j=0; j<SFS_BLOCKSIZE; j++) {
+		       i, start+i, what,
+		       i*bitsperblock, (i+1)*bitsperblock - 1,
+		       i*bitsperblock, (i+1)*bitsperblock - 1);
+		for (j=0; j<blocksize; j++) {
 			if (j % 8 == 0) {
 				snprintf(tmp, sizeof(tmp), "0x%x",
-					 i*SFS_BITSPERBLOCK + j*8);
+					 i*bitsperblock + j*8);
 				printf("%-7s ", tmp);
 			}
 			for (k=0; k<8; k++) {
-				bn = i*SFS_BITSPERBLOCK + j*8 + k;
+				bn = i*bitsperblock + j*8 + k;
 				mask = 1U << k;
-				if (bn >= fsblocks) {
+				if (bn >= nbits) {
 					if (data[j] & mask) {
 						putchar('x');
 					}
@@ -230,19 +361,35 @@ dumpfreemap(uint32_t fsblocks)
 
 static
 void
-dumpindirect(uint32_t block)
+dumpfreemap(uint32_t fsblocks)
+{
+	dumpbitmap("Free block bitmap", "blocks", SFS_FREEMAP_START, fsblocks);
+	if (ninodes > 0) {
+		dumpbitmap("Inode bitmap", "inodes", inomapstart, ninodes);
+	}
+}
+
+/*
+ * Dump indirect block BLOCK, at indirection LEVEL (1 for a single
+ * indirect block), and then the indirect blocks under it.
+ */
+static
+void
+dumpindirect(uint32_t block, unsigned level)
 {
-	uint32_t ib[SFS_BLOCKSIZE/sizeof(uint32_t)];
+	uint32_t ib[SFS_DBPERIDB(SFS_MAXBLOCKSIZE)];
 	char tmp[128];
 	unsigned i;
 
 	if (block == 0) {
 		return;
 	}
-	printf("Indirect block %u\n", block);
+	printf("%s block %u\n",
+	       level == 3 ? "Triple indirect" :
+	       level == 2 ? "Double indirect" : "Indirect", block);
 
 	diskread(ib, block);
-	for (i=0; i<ARRAYCOUNT(ib); i++) {
+	for (i=0; i<SFS_DBPERIDB(blocksize); i++) {
 		if (i % 4 == 0) {
 			printf("@%-3u   ", i);
 		}
@@ -253,14 +400,25 @@ dumpindirect(uint32_t block)
 			printf("\n");
 		}
 	}
+
+	if (level > 1) {
+		for (i=0; i<SFS_DBPERIDB(blocksize); i++) {
+			dumpindirect(SWAP32(ib[i]), level - 1);
+		}
+	}
 }
 
+/*
+ * Call DOBLOCK for each file block mapped under indirect block BLOCK,
+ * at indirection LEVEL, starting with file block FILEBLOCK and
+ * stopping at NUMBLOCKS. Returns the next file block.
+ */
 static
 uint32_t
 traverse_ib(uint32_t fileblock, uint32_t numblocks, uint32_t block,
-	    void (*doblock)(uint32_t, uint32_t))
+	    unsigned level, void (*doblock)(uint32_t, uint32_t))
 {
-	uint32_t ib[SFS_BLOCKSIZE/sizeof(uint32_t)];
+	uint32_t ib[SFS_DBPERIDB(SFS_MAXBLOCKSIZE)];
 	unsigned i;
 
 	if (block == 0) {
@@ -269,8 +427,15 @@ traverse_ib(uint32_t fileblock, uint32_t numblocks, uint32_t block,
 	else {
 		diskread(ib, block);
 	}
-	for (i=0; i<ARRAYCOUNT(ib) && fileblock < numblocks; i++) {
-		doblock(fileblock++, SWAP32(ib[i]));
+	for (i=0; i<SFS_DBPERIDB(blocksize) && fileblock < numblocks; i++) {
+		if (level > 1) {
+			fileblock = traverse_ib(fileblock, numblocks,
+						SWAP32(ib[i]), level - 1,
+						doblock);
+		}
+		else {
+			doblock(fileblock++, SWAP32(ib[i]));
+		}
 	}
 	return fileblock;
 }
@@ -283,7 +448,10 @@ traverse(const struct sfs_dinode *sfi, void (*doblock)(uint32_t, uint32_t))
 	uint32_t numblocks;
 	unsigned i;
 
-	numblocks = DIVROUNDUP(SWAP32(sfi->sfi_size), SFS_BLOCKSIZE);
+	numblocks = SWAP32(sfi->sfi_size) / blocksize;
+	if (SWAP32(sfi->sfi_size) % blocksize != 0) {
+		numblocks++;
+	}
 
 	fileblock = 0;
 	for (i=0; i<SFS_NDIRECT && fileblock < numblocks; i++) {
@@ -291,7 +459,15 @@ traverse(const struct sfs_dinode *sfi, void (*doblock)(uint32_t, uint32_t))
 	}
 	if (fileblock < numblocks) {
 		fileblock = traverse_ib(fileblock, numblocks,
-					SWAP32(sfi->sfi_indirect), doblock);
+					SWAP32(sfi->sfi_indirect), 1, doblock);
+	}
+	if (fileblock < numblocks) {
+		fileblock = traverse_ib(fileblock, numblocks,
+					SWAP32(sfi->sfi_dindirect), 2, doblock);
+	}
+	if (fileblock < numblocks) {
+		fileblock = traverse_ib(fileblock, numblocks,
+					SWAP32(sfi->sfi_tindirect), 3, doblock);
 	}
 	assert(fileblock == numblocks);
 }
@@ -300,8 +476,8 @@ static
 void
 dumpdirblock(uint32_t fileblock, uint32_t diskblock)
 {
-	struct sfs_direntry sds[SFS_BLOCKSIZE/sizeof(struct sfs_direntry)];
-	int nsds = SFS_BLOCKSIZE/sizeof(struct sfs_direntry);
+	struct sfs_direntry sds[SFS_MAXBLOCKSIZE/sizeof(struct sfs_direntry)];
+	int nsds = blocksize/sizeof(struct sfs_direntry);
 	int i;
 
 	(void)fileblock;
@@ -342,8 +518,8 @@ static
 void
 recursedirblock(uint32_t fileblock, uint32_t diskblock)
 {
-	struct sfs_direntry sds[SFS_BLOCKSIZE/sizeof(struct sfs_direntry)];
-	int nsds = SFS_BLOCKSIZE/sizeof(struct sfs_direntry);
+	struct sfs_direntry sds[SFS_MAXBLOCKSIZE/sizeof(struct sfs_direntry)];
+	int nsds = blocksize/sizeof(struct sfs_direntry);
 	int i;
 
 	(void)fileblock;
@@ -374,23 +550,20 @@ recursedir(uint32_t ino, const struct sfs_dinode *sfi)
 	printf("Done with directory %u\n", ino);
 }
 
+/*
+ * Hex dump LEN bytes (a multiple of 16) of file data starting at file
+ * offset POS.
+ */
 static
-void dumpfileblock(uint32_t fileblock, uint32_t diskblock)
+void
+dumphex(uint32_t pos, const uint8_t *data, unsigned len)
 {
-	uint8_t data[SFS_BLOCKSIZE];
 	unsigned i, j;
 	char tmp[128];
 
-	if (diskblock == 0) {
-		printf("    0x%6x  [sparse]\n", fileblock * SFS_BLOCKSIZE);
-		return;
-	}
-
-	diskread(data, diskblock);
-	for (i=0; i<SFS_BLOCKSIZE; i++) {
+	for (i=0; i<len; i++) {
 		if (i % 16 == 0) {
-			snprintf(tmp, sizeof(tmp), "0x%x",
-				 fileblock * SFS_BLOCKSIZE + i);
+			snprintf(tmp, sizeof(tmp), "0x%x", pos + i);
 			printf("%8s", tmp);
 		}
 		if (i % 8 == 0) {
@@ -415,11 +588,44 @@ void dumpfileblock(uint32_t fileblock, uint32_t diskblock)
 	}
 }
 
+static
+void dumpfileblock(uint32_t fileblock, uint32_t diskblock)
+{
+	uint8_t data[SFS_MAXBLOCKSIZE];
+
+	if (diskblock == 0) {
+		printf("    0x%6x  [sparse]\n", fileblock * blocksize);
+		return;
+	}
+	if (diskblock & SFS_UNWRITTEN) {
+		printf("    0x%6x  [unwritten, block %u]\n",
+		       fileblock * blocksize, SFS_BLOCKNUM(diskblock));
+		return;
+	}
+
+	diskread(data, diskblock);
+	dumphex(fileblock * blocksize, data, blocksize);
+}
+
 static
 void
 dumpfile(uint32_t ino, const struct sfs_dinode *sfi)
 {
+	uint8_t data[SFS_INLINESIZE + 16];
+	uint32_t size;
+
 	printf("File contents for inode %u:\n", ino);
+	if (SWAP32(sfi->sfi_flags) & SFS_IFLAG_INLINE) {
+		size = SWAP32(sfi->sfi_size);
+		if (size > SFS_INLINESIZE) {
+			warnx("Warning: inline file is too large");
+			size = SFS_INLINESIZE;
+		}
+		memset(data, 0, sizeof(data));
+		memcpy(data, sfi->sfi_inline, size);
+		dumphex(0, data, DIVROUNDUP(size, 16) * 16);
+		return;
+	}
 	traverse(sfi, dumpfileblock);
 }
 
@@ -432,7 +638,7 @@ dumpinode(uint32_t ino, const char *name)
 	char tmp[128];
 	unsigned i;
 
-	diskread(&sfi, ino);
+	readinode(ino, &sfi);
 
 	printf("Inode %u", ino);
 	if (name != NULL) {
@@ -476,15 +682,26 @@ dumpinode(uint32_t ino, const char *name)
 	}
 	printf("    Indirect block: %u (0x%x)\n",
 	       SWAP32(sfi.sfi_indirect), SWAP32(sfi.sfi_indirect));
-	for (i=0; i<ARRAYCOUNT(sfi.sfi_waste); i++) {
-		if (sfi.sfi_waste[i] != 0) {
-			printf("    Word %u in waste area: 0x%x\n",
-			       i, SWAP32(sfi.sfi_waste[i]));
+	printf("    Double indirect block: %u (0x%x)\n",
+	       SWAP32(sfi.sfi_dindirect), SWAP32(sfi.sfi_dindirect));
+	printf("    Triple indirect block: %u (0x%x)\n",
+	       SWAP32(sfi.sfi_tindirect), SWAP32(sfi.sfi_tindirect));
+	printf("    Flags: 0x%x%s\n", SWAP32(sfi.sfi_flags),
+	       (SWAP32(sfi.sfi_flags) & SFS_IFLAG_INLINE) ?
+	       " (data inline)" : "");
+	if ((SWAP32(sfi.sfi_flags) & SFS_IFLAG_INLINE) == 0) {
+		for (i=0; i<ARRAYCOUNT(sfi.sfi_inline); i++) {
+			if (sfi.sfi_inline[i] != 0) {
+				printf("    Byte %u in inline area: 0x%x\n",
+				       i, (uint8_t)sfi.sfi_inline[i]);
+			}
 		}
 	}
 
 	if (doindirect) {
-		dumpindirect(SWAP32(sfi.sfi_indirect));
+		dumpindirect(SWAP32(sfi.sfi_indirect), 1);
+		dumpindirect(SWAP32(sfi.sfi_dindirect), 2);
+		dumpindirect(SWAP32(sfi.sfi_tindirect), 3);
 	}
 
 	if (SWAP16(sfi.sfi_type) == SFS_TYPE_DIR && dodirs) {
@@ -498,6 +715,127 @@ dumpinode(uint32_t ino, const char *name)
 	}
 }
 
+////////////////////////////////////////////////////////////
+// fragmentation statistics
+
+/*
+ * An extent is a run of file blocks that are also consecutive on
+ * disk. A file laid out perfectly has one extent.
+ */
+static uint32_t frag_lastblock;		/* previous disk block of the file */
+static uint32_t frag_extents;		/* extents in the current file */
+static uint32_t frag_blocks;		/* blocks in the current file */
+
+static uint32_t frag_nfiles, frag_contigfiles;
+static uint32_t frag_totblocks, frag_totextents;
+
+static
+void
+fragblock(uint32_t fileblock, uint32_t diskblock)
+{
+	(void)fileblock;
+	if (diskblock == 0) {
+		return;
+	}
+	if (frag_blocks == 0 || diskblock != frag_lastblock + 1) {
+		frag_extents++;
+	}
+	frag_lastblock = diskblock;
+	frag_blocks++;
+}
+
+static
+void
+fraginode(uint32_t ino)
+{
+	struct sfs_dinode sfi;
+
+	readinode(ino, &sfi);
+	frag_blocks = frag_extents = 0;
+	traverse(&sfi, fragblock);
+
+	frag_nfiles++;
+	if (frag_extents <= 1) {
+		frag_contigfiles++;
+	}
+	frag_totblocks += frag_blocks;
+	frag_totextents += frag_extents;
+}
+
+static
+void
+fragdirblock(uint32_t fileblock, uint32_t diskblock)
+{
+	struct sfs_direntry sds[SFS_MAXBLOCKSIZE/sizeof(struct sfs_direntry)];
+	int nsds = blocksize/sizeof(struct sfs_direntry);
+	int i;
+
+	(void)fileblock;
+	if (diskblock == 0) {
+		return;
+	}
+	diskread(&sds, diskblock);
+
+	for (i=0; i<nsds; i++) {
+		uint32_t ino = SWAP32(sds[i].sfd_ino);
+		if (ino != SFS_NOINO) {
+			fraginode(ino);
+		}
+	}
+}
+
+static
+void
+dumpfrag(uint32_t fsblocks)
+{
+	struct sfs_dinode root;
+	uint8_t data[SFS_MAXBLOCKSIZE];
+	uint32_t bitsperblock = SFS_BITSPERBLOCK(blocksize);
+	uint32_t bn, run, nfree, freeextents, maxfree;
+
+	/* Files (SFS has only the root directory) */
+	readinode(SFS_ROOTDIR_INO, &root);
+	traverse(&root, fragdirblock);
+	fraginode(SFS_ROOTDIR_INO);
+
+	/* Free space */
+	nfree = freeextents = maxfree = run = 0;
+	for (bn=0; bn<fsblocks; bn++) {
+		if (bn % bitsperblock == 0) {
+			diskread(data, SFS_FREEMAP_START + bn/bitsperblock);
+		}
+		if (data[(bn % bitsperblock) / 8] & (1U << (bn % 8))) {
+			run = 0;
+			continue;
+		}
+		if (run == 0) {
+			freeextents++;
+		}
+		run++;
+		nfree++;
+		if (run > maxfree) {
+			maxfree = run;
+		}
+	}
+
+	printf("Fragmentation\n");
+	printf("-------------\n");
+	dumpvalf("Files", "%u", frag_nfiles);
+	dumpvalf("Contiguous files", "%u", frag_contigfiles);
+	dumpvalf("Blocks in files", "%u", frag_totblocks);
+	dumpvalf("Extents in files", "%u", frag_totextents);
+	if (frag_totextents > 0) {
+		dumpvalf("Blocks per extent", "%u.%02u",
+			 frag_totblocks / frag_totextents,
+			 (frag_totblocks % frag_totextents) * 100 /
+			 frag_totextents);
+	}
+	dumpvalf("Free blocks", "%u", nfree);
+	dumpvalf("Free extents", "%u", freeextents);
+	dumpvalf("Largest free extent", "%u", maxfree);
+	printf("\n");
+}
+
 ////////////////////////////////////////////////////////////
 // main
 
@@ -507,7 +845,8 @@ usage(void)
 {
 	warnx("Usage: dumpsfs [options] device/diskfile");
 	warnx("   -s: dump superblock");
-	warnx("   -b: dump free block bitmap");
+	warnx("   -b: dump free block (and inode) bitmap");
+	warnx("   -F: print fragmentation statistics");
 	warnx("   -i ino: dump specified inode");
 	warnx("   -I: dump indirect blocks");
 	warnx("   -f: dump file contents");
@@ -522,6 +861,7 @@ main(int argc, char **argv)
 {
 	bool dosb = false;
 	bool dofreemap = false;
+	bool dofrag = false;
 	uint32_t dumpino = 0;
 	const char *dumpdisk = NULL;
 
@@ -540,6 +880,7 @@ main(int argc, char **argv)
 				switch (argv[i][j]) {
 				    case 's': dosb = true; break;
 				    case 'b': dofreemap = true; break;
+				    case 'F': dofrag = true; break;
 				    case 'i':
 					if (argv[i][j+1] == 0) {
 						dumpino = atoi(argv[++i]);
@@ -584,7 +925,7 @@ main(int argc, char **argv)
 		usage();
 	}
 
-	if (!dosb && !dofreemap && dumpino == 0) {
+	if (!dosb && !dofreemap && !dofrag && dumpino == 0) {
 		dumpino = SFS_ROOTDIR_INO;
 	}
 
@@ -597,6 +938,9 @@ main(int argc, char **argv)
 	if (dofreemap) {
 		dumpfreemap(nblocks);
 	}
+	if (dofrag) {
+		dumpfrag(nblocks);
+	}
 	if (dumpino != 0) {
 		dumpinode(dumpino, NULL);
 	}
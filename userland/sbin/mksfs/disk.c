@@ -49,6 +49,7 @@
 
 static int fd=-1;
 static uint32_t nblocks;
+static uint32_t iosize = BLOCKSIZE;	/* bytes per diskread/diskwrite */
 
 /*
  * Open a disk. If we're built for the host OS, check that it's a
@@ -111,7 +112,33 @@ uint32_t
 diskblocks(void)
 {
 	assert(fd>=0);
-	return nblocks;
+	return nblocks / (iosize / BLOCKSIZE);
+}
+
+void
+disksetblocksize(uint32_t size)
+{
+	assert(size >= BLOCKSIZE && size % BLOCKSIZE == 0);
+	iosize = size;
+}
+
+/*
+ * Seek to the start of BLOCK (in units of iosize).
+ */
+static
+void
+diskseek(uint32_t block)
+{
+	off_t pos = (off_t)block * iosize;
+
+#ifdef HOST
+	// skip over disk file header
+	pos += BLOCKSIZE;
+#endif
+
+	if (lseek(fd, pos, SEEK_SET)<0) {
+		err(1, "lseek");
+	}
 }
 
 /*
@@ -126,17 +153,10 @@ diskwrite(const void *data, uint32_t block)
 
 	assert(fd>=0);
 
-#ifdef HOST
-	// skip over disk file header
-	block++;
-#endif
-
-	if (lseek(fd, block*BLOCKSIZE, SEEK_SET)<0) {
-		err(1, "lseek");
-	}
+	diskseek(block);
 
-	while (tot < BLOCKSIZE) {
-		len = write(fd, cdata + tot, BLOCKSIZE - tot);
+	while (tot < iosize) {
+		len = write(fd, cdata + tot, iosize - tot);
 		if (len < 0) {
 			if (errno==EINTR || errno==EAGAIN) {
 				continue;
@@ -162,17 +182,10 @@ diskread(void *data, uint32_t block)
 
 	assert(fd>=0);
 
-#ifdef HOST
-	// skip over disk file header
-	block++;
-#endif
-
-	if (lseek(fd, block*BLOCKSIZE, SEEK_SET)<0) {
-		err(1, "lseek");
-	}
+	diskseek(block);
 
-	while (tot < BLOCKSIZE) {
-		len = read(fd, cdata + tot, BLOCKSIZE - tot);
+	while (tot < iosize) {
+		len = read(fd, cdata + tot, iosize - tot);
 		if (len < 0) {
 			if (errno==EINTR || errno==EAGAIN) {
 				continue;
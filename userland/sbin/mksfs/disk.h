@@ -32,6 +32,12 @@ void opendisk(const char *path);
 uint32_t diskblocksize(void);
 uint32_t diskblocks(void);
 
+/*
+ * Make diskread/diskwrite (and diskblocks) work in blocks of SIZE
+ * bytes, a multiple of diskblocksize(), instead of device sectors.
+ */
+void disksetblocksize(uint32_t size);
+
 void diskwrite(const void *data, uint32_t block);
 void diskread(void *data, uint32_t block);
 
@@ -29,6 +29,7 @@
 
 #include <sys/types.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <limits.h>
@@ -57,12 +58,24 @@
 
 #include "disk.h"
 
-/* Maximum size of freemap we support */
+/* Maximum size of freemap we support (in 512-byte blocks) */
 #define MAXFREEMAPBLOCKS 32
 
 /* Free block bitmap */
 static char freemapbuf[MAXFREEMAPBLOCKS * SFS_BLOCKSIZE];
 
+/* Inode bitmap (dense format) */
+static char inomapbuf[MAXFREEMAPBLOCKS * SFS_BLOCKSIZE];
+
+/* Block size of the volume */
+static uint32_t blocksize = SFS_BLOCKSIZE;
+
+/* Dense format layout; ninodes is 0 for the original format */
+static uint32_t ninodes, inomapstart, itablestart;
+
+/* Journal layout; journalblocks is 0 for no journal */
+static uint32_t journalstart, journalblocks;
+
 /*
  * Assert that the on-disk data structures are correctly sized.
  */
@@ -73,6 +86,7 @@ check(void)
 	assert(sizeof(struct sfs_superblock)==SFS_BLOCKSIZE);
 	assert(sizeof(struct sfs_dinode)==SFS_BLOCKSIZE);
 	assert(SFS_BLOCKSIZE % sizeof(struct sfs_direntry) == 0);
+	assert(sizeof(struct sfs_jheader)==SFS_BLOCKSIZE);
 }
 
 /*
@@ -89,6 +103,80 @@ allocblock(uint32_t block)
 	freemapbuf[mapbyte] |= mask;
 }
 
+/*
+ * Mark an inode allocated (dense format).
+ */
+static
+void
+allocino(uint32_t ino)
+{
+	uint32_t mapbyte = ino/CHAR_BIT;
+	unsigned char mask = (1<<(ino % CHAR_BIT));
+
+	assert((inomapbuf[mapbyte] & mask) == 0);
+	inomapbuf[mapbyte] |= mask;
+}
+
+/*
+ * Choose the dense format layout: one inode per four blocks, with
+ * the inode bitmap and then the inode table right after the freemap.
+ */
+static
+void
+setupdense(uint32_t fsblocks)
+{
+	uint32_t inoperblock = SFS_INOPERBLOCK(blocksize);
+	uint32_t i;
+
+	ninodes = fsblocks / 4;
+	ninodes = (ninodes + inoperblock - 1) / inoperblock;
+	if (ninodes == 0) {
+		ninodes = 1;
+	}
+	ninodes *= inoperblock;
+	if (SFS_INOMAPBLOCKS(ninodes, blocksize) * blocksize >
+	    sizeof(inomapbuf)) {
+		errx(1, "Filesystem too large -- "
+		     "increase MAXFREEMAPBLOCKS and recompile");
+	}
+	inomapstart = SFS_FREEMAP_START +
+		SFS_FREEMAPBLOCKS(fsblocks, blocksize);
+	itablestart = inomapstart + SFS_INOMAPBLOCKS(ninodes, blocksize);
+	if (itablestart + SFS_ITABLEBLOCKS(ninodes, blocksize) >= fsblocks) {
+		errx(1, "Filesystem too small for an inode table");
+	}
+
+	/* inode 0 is never used; 1 is the root directory */
+	allocino(0);
+	allocino(SFS_ROOTDIR_INO);
+
+	/* all inodes in the bitmap but past the table end are "in use" */
+	for (i=ninodes; i<SFS_FREEMAPBITS(ninodes, blocksize); i++) {
+		allocino(i);
+	}
+}
+
+/*
+ * Place the journal right after the rest of the metadata.
+ */
+static
+void
+setupjournal(uint32_t fsblocks)
+{
+	if (ninodes > 0) {
+		journalstart = itablestart +
+			SFS_ITABLEBLOCKS(ninodes, blocksize);
+	}
+	else {
+		journalstart = SFS_FREEMAP_START +
+			SFS_FREEMAPBLOCKS(fsblocks, blocksize);
+	}
+	if (journalstart >= fsblocks ||
+	    journalblocks >= fsblocks - journalstart) {
+		errx(1, "Filesystem too small for the journal");
+	}
+}
+
 /*
  * Initialize the free block bitmap.
  */
@@ -96,24 +184,41 @@ static
 void
 initfreemap(uint32_t fsblocks)
 {
-	uint32_t freemapbits = SFS_FREEMAPBITS(fsblocks);
-	uint32_t freemapblocks = SFS_FREEMAPBLOCKS(fsblocks);
+	uint32_t freemapbits = SFS_FREEMAPBITS(fsblocks, blocksize);
+	uint32_t freemapblocks = SFS_FREEMAPBLOCKS(fsblocks, blocksize);
 	uint32_t i;
 
-	if (freemapblocks > MAXFREEMAPBLOCKS) {
+	if (freemapblocks * blocksize > sizeof(freemapbuf)) {
 		errx(1, "Filesystem too large -- "
 		     "increase MAXFREEMAPBLOCKS and recompile");
 	}
 
-	/* mark the superblock and root inode in use */
+	/* mark the superblock in use */
 	allocblock(SFS_SUPER_BLOCK);
-	allocblock(SFS_ROOTDIR_INO);
 
 	/* the freemap blocks must be in use */
 	for (i=0; i<freemapblocks; i++) {
 		allocblock(SFS_FREEMAP_START + i);
 	}
 
+	if (ninodes > 0) {
+		/* so must the inode bitmap and inode table */
+		for (i=inomapstart;
+		     i<itablestart + SFS_ITABLEBLOCKS(ninodes, blocksize);
+		     i++) {
+			allocblock(i);
+		}
+	}
+	else {
+		/* the root inode is in its own block */
+		allocblock(SFS_ROOTDIR_INO);
+	}
+
+	/* and the journal */
+	for (i=0; i<journalblocks; i++) {
+		allocblock(journalstart + i);
+	}
+
 	/* all blocks in the freemap but past the volume end are "in use" */
 	for (i=fsblocks; i<freemapbits; i++) {
 		allocblock(i);
@@ -128,9 +233,11 @@ void
 writesuper(const char *volname, uint32_t nblocks)
 {
 	struct sfs_superblock sb;
+	char block[SFS_MAXBLOCKSIZE];
 
 	/* The cast is required on some outdated host systems. */
 	bzero((void *)&sb, sizeof(sb));
+	bzero((void *)block, sizeof(block));
 
 	if (strlen(volname) >= SFS_VOLNAME_SIZE) {
 		errx(1, "Volume name %s too long", volname);
@@ -139,10 +246,25 @@ writesuper(const char *volname, uint32_t nblocks)
 	/* Initialize the superblock structure */
 	sb.sb_magic = SWAP32(SFS_MAGIC);
 	sb.sb_nblocks = SWAP32(nblocks);
+	sb.sb_blocksize = SWAP32(blocksize);
 	strcpy(sb.sb_volname, volname);
+	if (ninodes > 0) {
+		sb.sb_version = SWAP32(SFS_VERSION_DENSE);
+		sb.sb_ninodes = SWAP32(ninodes);
+		sb.sb_inomapstart = SWAP32(inomapstart);
+		sb.sb_itablestart = SWAP32(itablestart);
+	}
+	else {
+		sb.sb_version = SWAP32(SFS_VERSION_ORIG);
+	}
+	if (journalblocks > 0) {
+		sb.sb_journalstart = SWAP32(journalstart);
+		sb.sb_journalblocks = SWAP32(journalblocks);
+	}
 
-	/* and write it out. */
-	diskwrite(&sb, SFS_SUPER_BLOCK);
+	/* and write it out, at the start of its block. */
+	memcpy(block, &sb, sizeof(sb));
+	diskwrite(block, SFS_SUPER_BLOCK);
 }
 
 /*
@@ -157,13 +279,59 @@ writefreemap(uint32_t fsblocks)
 	uint32_t i;
 
 	/* Write out each of the blocks in the free block bitmap. */
-	freemapblocks = SFS_FREEMAPBLOCKS(fsblocks);
+	freemapblocks = SFS_FREEMAPBLOCKS(fsblocks, blocksize);
 	for (i=0; i<freemapblocks; i++) {
-		ptr = freemapbuf + i*SFS_BLOCKSIZE;
+		ptr = freemapbuf + i*blocksize;
 		diskwrite(ptr, SFS_FREEMAP_START+i);
 	}
 }
 
+/*
+ * Write out the inode bitmap and clear the inode table (dense format).
+ */
+static
+void
+writeinodes(void)
+{
+	char zeros[SFS_MAXBLOCKSIZE];
+	uint32_t i;
+
+	for (i=0; i<SFS_INOMAPBLOCKS(ninodes, blocksize); i++) {
+		diskwrite(inomapbuf + i*blocksize, inomapstart+i);
+	}
+
+	/* The cast is required on some outdated host systems. */
+	bzero((void *)zeros, sizeof(zeros));
+	for (i=0; i<SFS_ITABLEBLOCKS(ninodes, blocksize); i++) {
+		diskwrite(zeros, itablestart+i);
+	}
+}
+
+/*
+ * Clear the journal and write an empty header.
+ */
+static
+void
+writejournal(void)
+{
+	struct sfs_jheader jh;
+	char block[SFS_MAXBLOCKSIZE];
+	uint32_t i;
+
+	/* The cast is required on some outdated host systems. */
+	bzero((void *)block, sizeof(block));
+	for (i=1; i<journalblocks; i++) {
+		diskwrite(block, journalstart+i);
+	}
+
+	bzero((void *)&jh, sizeof(jh));
+	jh.jh_magic = SWAP32(SFS_JMAGIC);
+	jh.jh_state = SWAP32(SFS_JSTATE_CLEAN);
+	jh.jh_seq = SWAP32(0);
+	memcpy(block, &jh, sizeof(jh));
+	diskwrite(block, journalstart);
+}
+
 /*
  * Write out the root directory inode.
  */
@@ -172,6 +340,7 @@ void
 writerootdir(void)
 {
 	struct sfs_dinode sfi;
+	char buf[SFS_MAXBLOCKSIZE];
 
 	/* Initialize the dinode */
 	bzero((void *)&sfi, sizeof(sfi));
@@ -180,7 +349,23 @@ writerootdir(void)
 	sfi.sfi_linkcount = SWAP16(1);
 
 	/* Write it out */
-	diskwrite(&sfi, SFS_ROOTDIR_INO);
+	if (ninodes > 0) {
+		uint32_t block, offset;
+
+		block = itablestart +
+			SFS_ROOTDIR_INO / SFS_INOPERBLOCK(blocksize);
+		offset = (SFS_ROOTDIR_INO % SFS_INOPERBLOCK(blocksize)) *
+			SFS_DINODE_DENSESIZE;
+		diskread(buf, block);
+		memcpy(buf + offset, &sfi, SFS_DINODE_DENSESIZE);
+		diskwrite(buf, block);
+	}
+	else {
+		/* The inode is the start of its block */
+		bzero((void *)buf, sizeof(buf));
+		memcpy(buf, &sfi, sizeof(sfi));
+		diskwrite(buf, SFS_ROOTDIR_INO);
+	}
 }
 
 /*
@@ -189,15 +374,52 @@ writerootdir(void)
 int
 main(int argc, char **argv)
 {
-	uint32_t size, blocksize;
+	uint32_t size, sectorsize;
 	char *volname, *s;
+	int dense = 0;
 
 #ifdef HOST
 	hostcompat_init(argc, argv);
 #endif
 
+	while (argc > 1 && argv[1][0] == '-') {
+		if (!strcmp(argv[1], "-d")) {
+			/* -d: use the dense inode table format */
+			dense = 1;
+			argc--;
+			argv++;
+		}
+		else if (!strcmp(argv[1], "-b") && argc > 2) {
+			/* -b size: use SIZE-byte blocks */
+			blocksize = atoi(argv[2]);
+			if (blocksize < SFS_BLOCKSIZE ||
+			    blocksize > SFS_MAXBLOCKSIZE ||
+			    (blocksize & (blocksize - 1)) != 0) {
+				errx(1, "Block size must be a power of 2 "
+				     "from %u to %u", SFS_BLOCKSIZE,
+				     SFS_MAXBLOCKSIZE);
+			}
+			argc -= 2;
+			argv += 2;
+		}
+		else if (!strcmp(argv[1], "-j") && argc > 2) {
+			/* -j blocks: add a journal of BLOCKS blocks */
+			journalblocks = atoi(argv[2]);
+			if (journalblocks < SFS_JMINBLOCKS) {
+				errx(1, "Journal must be at least %u blocks",
+				     SFS_JMINBLOCKS);
+			}
+			argc -= 2;
+			argv += 2;
+		}
+		else {
+			break;
+		}
+	}
+
 	if (argc!=3) {
-		errx(1, "Usage: mksfs device/diskfile volume-name");
+		errx(1, "Usage: mksfs [-d] [-b blocksize] [-j journalblocks] "
+		     "device/diskfile volume-name");
 	}
 
 	check();
@@ -220,18 +442,31 @@ main(int argc, char **argv)
 	}
 
 	opendisk(argv[1]);
-	blocksize = diskblocksize();
+	sectorsize = diskblocksize();
 
-	if (blocksize!=SFS_BLOCKSIZE) {
+	if (sectorsize!=SFS_BLOCKSIZE) {
 		errx(1, "Device has wrong blocksize %u (should be %u)\n",
-		     blocksize, SFS_BLOCKSIZE);
+		     sectorsize, SFS_BLOCKSIZE);
 	}
+	disksetblocksize(blocksize);
 	size = diskblocks();
 
 	/* Write out the on-disk structures */
+	if (dense) {
+		setupdense(size);
+	}
+	if (journalblocks > 0) {
+		setupjournal(size);
+	}
 	initfreemap(size);
 	writesuper(volname, size);
 	writefreemap(size);
+	if (dense) {
+		writeinodes();
+	}
+	if (journalblocks > 0) {
+		writejournal();
+	}
 	writerootdir();
 
 	closedisk();
@@ -46,6 +46,7 @@
 static unsigned long blocksinuse = 0;
 static uint8_t *freemapdata;
 static uint8_t *tofreedata;
+static uint8_t *inomapdata;	/* dense format only */
 
 /*
  * Allocate space to keep track of the free block bitmap. This is
@@ -60,7 +61,7 @@ freemap_setup(void)
 
 	fsblocks = sb_totalblocks();
 	mapblocks = sb_freemapblocks();
-	mapbytes = mapblocks * SFS_BLOCKSIZE;
+	mapbytes = mapblocks * sb_blocksize();
 
 	freemapdata = domalloc(mapbytes * sizeof(uint8_t));
 	tofreedata = domalloc(mapbytes * sizeof(uint8_t));
@@ -69,7 +70,7 @@ freemap_setup(void)
 	}
 
 	/* Mark off what's in the freemap but past the volume end. */
-	for (i=fsblocks; i < mapblocks*SFS_BITSPERBLOCK; i++) {
+	for (i=fsblocks; i < mapblocks*SFS_BITSPERBLOCK(sb_blocksize()); i++) {
 		freemap_blockinuse(i, B_PASTEND, 0);
 	}
 
@@ -78,6 +79,35 @@ freemap_setup(void)
 	for (i=0; i < mapblocks; i++) {
 		freemap_blockinuse(SFS_FREEMAP_START+i, B_FREEMAPBLOCK, i);
 	}
+
+	/* and the journal, if there is one */
+	for (i=0; i < sb_journalblocks(); i++) {
+		freemap_blockinuse(sb_journalstart()+i, B_JOURNAL, i);
+	}
+
+	if (!sb_dense()) {
+		return;
+	}
+
+	/* Mark the inode bitmap and inode table blocks in use */
+	for (i=0; i < sb_inomapblocks(); i++) {
+		freemap_blockinuse(sb_inomapstart()+i, B_INOMAPBLOCK, i);
+	}
+	for (i=0; i < SFS_ITABLEBLOCKS(sb_ninodes(), sb_blocksize()); i++) {
+		freemap_blockinuse(sb_itablestart()+i, B_ITABLEBLOCK, i);
+	}
+
+	/* Inode 0 and the ones past the table end are always "in use" */
+	mapbytes = sb_inomapblocks() * sb_blocksize();
+	inomapdata = domalloc(mapbytes * sizeof(uint8_t));
+	for (i=0; i<mapbytes; i++) {
+		inomapdata[i] = 0;
+	}
+	inomapdata[0] = 1;
+	for (i=sb_ninodes();
+	     i < sb_inomapblocks()*SFS_BITSPERBLOCK(sb_blocksize()); i++) {
+		inomapdata[i/8] |= ((uint8_t)1)<<(i%8);
+	}
 }
 
 /*
@@ -95,6 +125,18 @@ blockusagestr(blockusage_t how, uint32_t howdesc)
 		snprintf(rv, sizeof(rv), "freemap block %lu",
 			 (unsigned long) howdesc);
 		break;
+	    case B_INOMAPBLOCK:
+		snprintf(rv, sizeof(rv), "inode bitmap block %lu",
+			 (unsigned long) howdesc);
+		break;
+	    case B_ITABLEBLOCK:
+		snprintf(rv, sizeof(rv), "inode table block %lu",
+			 (unsigned long) howdesc);
+		break;
+	    case B_JOURNAL:
+		snprintf(rv, sizeof(rv), "journal block %lu",
+			 (unsigned long) howdesc);
+		break;
 	    case B_INODE:
 		snprintf(rv, sizeof(rv), "inode %lu",
 			 (unsigned long) howdesc);
@@ -147,6 +189,19 @@ freemap_blockinuse(uint32_t block, blockusage_t how, uint32_t howdesc)
 	}
 }
 
+/*
+ * Mark inode INO in use (dense format). Inodes are only reached
+ * through pass1_inode, which weeds out repeats, so there's no need to
+ * check for conflicts here.
+ */
+void
+freemap_inodeinuse(uint32_t ino)
+{
+	assert(sb_dense());
+	assert(ino < sb_ninodes());
+	inomapdata[ino/8] |= ((uint8_t)1)<<(ino%8);
+}
+
 /*
  * Mark a block free. This is specifically for blocks that we are
  * freeing, that might be marked allocated in the on-disk freemap. If
@@ -207,7 +262,7 @@ reportfreemap(uint32_t mapblock, uint32_t byte, uint8_t val, const char *what)
 
 	for (x=1, y=0; x; x<<=1, y++) {
 		if (val & x) {
-			blocknum = mapblock*SFS_BITSPERBLOCK +
+			blocknum = mapblock*SFS_BITSPERBLOCK(sb_blocksize()) +
 				byte*CHAR_BIT + y;
 			warnx("Block %lu erroneously shown %s in freemap",
 			      (unsigned long) blocknum, what);
@@ -224,7 +279,7 @@ reportfreemap(uint32_t mapblock, uint32_t byte, uint8_t val, const char *what)
 void
 freemap_check(void)
 {
-	uint8_t actual[SFS_BLOCKSIZE], *expected, *tofree, tmp;
+	uint8_t actual[SFS_MAXBLOCKSIZE], *expected, *tofree, tmp;
 	uint32_t alloccount=0, freecount=0, i, j;
 	int bchanged;
 	uint32_t bitblocks;
@@ -233,11 +288,11 @@ freemap_check(void)
 
 	for (i=0; i<bitblocks; i++) {
 		sfs_readfreemapblock(i, actual);
-		expected = freemapdata + i*SFS_BLOCKSIZE;
-		tofree = tofreedata + i*SFS_BLOCKSIZE;
+		expected = freemapdata + i*sb_blocksize();
+		tofree = tofreedata + i*sb_blocksize();
 		bchanged = 0;
 
-		for (j=0; j<SFS_BLOCKSIZE; j++) {
+		for (j=0; j<sb_blocksize(); j++) {
 			/* we shouldn't have blocks marked both ways */
 			assert((expected[j] & tofree[j])==0);
 
@@ -299,6 +354,55 @@ freemap_check(void)
 	}
 }
 
+/*
+ * Scan the inode bitmap (dense format). Like freemap_check, this is
+ * called at the end of pass 1; anything not found by then is free.
+ */
+void
+freemap_checkinodes(void)
+{
+	uint8_t actual[SFS_MAXBLOCKSIZE], *expected, tmp;
+	uint32_t alloccount=0, freecount=0, i, j;
+	int bchanged;
+
+	if (!sb_dense()) {
+		return;
+	}
+
+	for (i=0; i<sb_inomapblocks(); i++) {
+		sfs_readinomapblock(i, actual);
+		expected = inomapdata + i*sb_blocksize();
+		bchanged = 0;
+
+		for (j=0; j<sb_blocksize(); j++) {
+			if (actual[j] == expected[j]) {
+				continue;
+			}
+			tmp = expected[j] & ~actual[j];
+			alloccount += countbits(tmp);
+			tmp = actual[j] & ~expected[j];
+			freecount += countbits(tmp);
+			actual[j] = expected[j];
+			bchanged = 1;
+		}
+
+		if (bchanged) {
+			sfs_writeinomapblock(i, actual);
+		}
+	}
+
+	if (alloccount > 0) {
+		warnx("%lu inodes erroneously shown free in inode bitmap "
+		      "(fixed)", (unsigned long) alloccount);
+		setbadness(EXIT_RECOV);
+	}
+	if (freecount > 0) {
+		warnx("%lu inodes erroneously shown used in inode bitmap "
+		      "(fixed)", (unsigned long) freecount);
+		setbadness(EXIT_RECOV);
+	}
+}
+
 /*
  * Return the total number of blocks in use, which we count during
  * pass 1.
@@ -41,6 +41,9 @@
 typedef enum {
 	B_SUPERBLOCK,	/* Block that is the superblock */
 	B_FREEMAPBLOCK,	/* Block used by free-block bitmap */
+	B_INOMAPBLOCK,	/* Block used by inode bitmap (dense format) */
+	B_ITABLEBLOCK,	/* Block of the inode table (dense format) */
+	B_JOURNAL,	/* Block of the journal */
 	B_INODE,	/* Block that is an inode */
 	B_IBLOCK,	/* Indirect (or doubly-indirect etc.) block */
 	B_DIRDATA,	/* Data block of a directory */
@@ -57,9 +60,15 @@ void freemap_blockinuse(uint32_t block, blockusage_t how, uint32_t howdesc);
 /* Note that a block has been found where it should be dropped. */
 void freemap_blockfree(uint32_t block);
 
+/* Call this to note that an inode (dense format) has been found in use. */
+void freemap_inodeinuse(uint32_t ino);
+
 /* Call this after all checks that call freemap_block{inuse,free}. */
 void freemap_check(void);
 
+/* Likewise for the inode bitmap; does nothing for the original format. */
+void freemap_checkinodes(void);
+
 /* Return the number of blocks in use. Valid after freemap_check(). */
 unsigned long freemap_blocksused(void);
 
@@ -71,6 +71,9 @@
  *    RANGE_x	size of the block range mapped with one block of this type
  *    INOMAX_x	maximum block number mapped by using this type in the inode
  *
+ * RANGE_x and INOMAX_x depend on the volume's block size, so they can
+ * only be used after the superblock is loaded.
+ *
  * It is important that the accessor macros (SET_x/GET_x) not refer to
  * a nonexistent field of the inode in the case where there are zero
  * blocks of that type, as that will lead to compile failure. Hence the
@@ -144,16 +147,16 @@
 /* region sizes */
 
 #define RANGE_D		1
-#define RANGE_I		(RANGE_D * SFS_DBPERIDB)
-#define RANGE_II	(RANGE_I * SFS_DBPERIDB)
-#define RANGE_III	(RANGE_II * SFS_DBPERIDB)
+#define RANGE_I		(RANGE_D * SFS_DBPERIDB(sb_blocksize()))
+#define RANGE_II	(RANGE_I * SFS_DBPERIDB(sb_blocksize()))
+#define RANGE_III	(RANGE_II * SFS_DBPERIDB(sb_blocksize()))
 
 /* max blocks */
 
 #define INOMAX_D 	NUM_D
-#define INOMAX_I 	(INOMAX_D + SFS_DBPERIDB * NUM_I)
-#define INOMAX_II	(INOMAX_I + SFS_DBPERIDB * NUM_II)
-#define INOMAX_III	(INOMAX_II + SFS_DBPERIDB * NUM_III)
+#define INOMAX_I 	(INOMAX_D + RANGE_I * NUM_I)
+#define INOMAX_II	(INOMAX_I + RANGE_II * NUM_II)
+#define INOMAX_III	(INOMAX_II + RANGE_III * NUM_III)
 
 
 #endif /* IBMACROS_H */
@@ -0,0 +1,185 @@
+/*
+ * Journal recovery.
+ *
+ * See kern/sfs.h for the journal format. The kernel copies a
+ * committed transaction into place when it mounts the volume; we do
+ * the same here so a volume can be checked first. After that, a
+ * clean journal means the metadata is consistent, and the full check
+ * is only done if asked for (or if the journal says otherwise).
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <err.h>
+
+#include "compat.h"
+#include <kern/sfs.h>
+
+#include "disk.h"
+#include "sfs.h"
+#include "sb.h"
+#include "journal.h"
+#include "main.h"
+
+/* Sequence number for the next transaction */
+static uint32_t nextseq;
+
+/*
+ * Add a block (as read from disk) to a journal checksum.
+ */
+static
+uint32_t
+journal_sum(uint32_t sum, const char *block)
+{
+	uint32_t word;
+	unsigned i;
+
+	for (i=0; i<sb_blocksize(); i+=sizeof(word)) {
+		memcpy(&word, block + i, sizeof(word));
+		sum = ((sum << 1) | (sum >> 31)) ^ SWAP32(word);
+	}
+	return sum;
+}
+
+/*
+ * Write an empty header.
+ */
+static
+void
+journal_writeclean(void)
+{
+	struct sfs_jheader jh;
+
+	memset(&jh, 0, sizeof(jh));
+	jh.jh_magic = SFS_JMAGIC;
+	jh.jh_state = SFS_JSTATE_CLEAN;
+	jh.jh_seq = nextseq;
+	sfs_writejheader(sb_journalstart(), &jh);
+}
+
+/*
+ * Check that a committed transaction's header makes sense.
+ */
+static
+int
+journal_checkheader(const struct sfs_jheader *jh)
+{
+	uint32_t maxblocks, start, end;
+	unsigned i;
+
+	maxblocks = sb_journalblocks() - 1;
+	if (maxblocks > SFS_JMAXBLOCKS) {
+		maxblocks = SFS_JMAXBLOCKS;
+	}
+	if (jh->jh_nblocks == 0 || jh->jh_nblocks > maxblocks) {
+		warnx("Journal transaction has bad size %lu",
+		      (unsigned long) jh->jh_nblocks);
+		return -1;
+	}
+
+	start = sb_journalstart();
+	end = start + sb_journalblocks();
+	for (i=0; i<jh->jh_nblocks; i++) {
+		if (jh->jh_blocks[i] >= sb_totalblocks() ||
+		    (jh->jh_blocks[i] >= start && jh->jh_blocks[i] < end)) {
+			warnx("Journal transaction has bad block %lu",
+			      (unsigned long) jh->jh_blocks[i]);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Replay a committed transaction. Returns nonzero if it was intact.
+ */
+static
+int
+journal_replay(const struct sfs_jheader *jh)
+{
+	char block[SFS_MAXBLOCKSIZE];
+	uint32_t sum;
+	unsigned i;
+	int reloadsb = 0;
+
+	sum = jh->jh_seq;
+	for (i=0; i<jh->jh_nblocks; i++) {
+		diskread(block, sb_journalstart() + 1 + i);
+		sum = journal_sum(sum, block);
+	}
+	if (sum != jh->jh_sum) {
+		warnx("Journal transaction %lu is incomplete (discarded)",
+		      (unsigned long) jh->jh_seq);
+		return 0;
+	}
+
+	for (i=0; i<jh->jh_nblocks; i++) {
+		diskread(block, sb_journalstart() + 1 + i);
+		diskwrite(block, jh->jh_blocks[i]);
+		if (jh->jh_blocks[i] == SFS_SUPER_BLOCK) {
+			reloadsb = 1;
+		}
+	}
+	warnx("Replayed journal transaction %lu (%lu blocks)",
+	      (unsigned long) jh->jh_seq, (unsigned long) jh->jh_nblocks);
+	setbadness(EXIT_RECOV);
+
+	if (reloadsb) {
+		sb_load();
+	}
+	return 1;
+}
+
+int
+journal_recover(void)
+{
+	struct sfs_jheader jh;
+	int ok;
+
+	if (sb_journalblocks() == 0) {
+		return 0;
+	}
+
+	sfs_readjheader(sb_journalstart(), &jh);
+	if (jh.jh_magic != SFS_JMAGIC) {
+		warnx("Journal header has bad magic number");
+		setbadness(EXIT_RECOV);
+		nextseq = 0;
+		return 0;
+	}
+	nextseq = jh.jh_seq + 1;
+
+	switch (jh.jh_state) {
+	    case SFS_JSTATE_CLEAN:
+		nextseq = jh.jh_seq;
+		return 1;
+	    case SFS_JSTATE_COMMITTED:
+		if (journal_checkheader(&jh) < 0) {
+			setbadness(EXIT_RECOV);
+			return 0;
+		}
+		ok = journal_replay(&jh);
+		if (ok) {
+			journal_writeclean();
+		}
+		return ok;
+	    case SFS_JSTATE_UNSAFE:
+		warnx("Journal marked unsafe");
+		return 0;
+	    default:
+		warnx("Journal header has bad state %lu",
+		      (unsigned long) jh.jh_state);
+		setbadness(EXIT_RECOV);
+		return 0;
+	}
+}
+
+void
+journal_markclean(void)
+{
+	if (sb_journalblocks() == 0) {
+		return;
+	}
+	journal_writeclean();
+}
@@ -0,0 +1,19 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+/*
+ * The journal module recovers from the volume's metadata journal, if
+ * it has one, and decides whether the full check can be skipped.
+ */
+
+/*
+ * After the superblock is loaded: replay a committed transaction if
+ * there is one. Returns nonzero if the journal shows the volume is
+ * consistent, so the full check isn't needed.
+ */
+int journal_recover(void);
+
+/* After a full check that fixed everything: mark the journal clean. */
+void journal_markclean(void);
+
+#endif /* JOURNAL_H */
@@ -30,6 +30,7 @@
 #include <assert.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <err.h>
 
 #include "compat.h"
@@ -40,6 +41,7 @@
 #include "freemap.h"
 #include "inode.h"
 #include "passes.h"
+#include "journal.h"
 #include "main.h"
 
 static int badness=0;
@@ -64,25 +66,42 @@ setbadness(int code)
 int
 main(int argc, char **argv)
 {
+	int force = 0;
+
 #ifdef HOST
 	hostcompat_init(argc, argv);
 #endif
 
+	/* -f: check everything even if the journal says it's clean */
+	if (argc > 1 && !strcmp(argv[1], "-f")) {
+		force = 1;
+		argc--;
+		argv++;
+	}
+
 	/* FUTURE: add -n option */
 	if (argc!=2) {
-		errx(EXIT_USAGE, "Usage: sfsck device/diskfile");
+		errx(EXIT_USAGE, "Usage: sfsck [-f] device/diskfile");
 	}
 
 	opendisk(argv[1]);
 
 	sfs_setup();
 	sb_load();
+	if (journal_recover() && !force) {
+		sb_check();
+		closedisk();
+		warnx("Journal is clean; skipping full check "
+		      "(use -f to force one)");
+		return badness;
+	}
 	sb_check();
 	freemap_setup();
 
 	printf("Phase 1 -- check blocks and sizes\n");
 	pass1();
 	freemap_check();
+	freemap_checkinodes();
 
 	printf("Phase 2 -- check directory tree\n");
 	inode_sorttable();
@@ -91,6 +110,10 @@ main(int argc, char **argv)
 	printf("Phase 3 -- check reference counts\n");
 	inode_adjust_filelinks();
 
+	if (badness < EXIT_UNRECOV) {
+		journal_markclean();
+	}
+
 	closedisk();
 
 	warnx("%lu blocks used (of %lu); %lu directories; %lu files",
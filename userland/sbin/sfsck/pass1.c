@@ -61,10 +61,22 @@ struct ibstate {
 	blockusage_t usagetype;	/* how to call freemap_blockinuse() */
 };
 
+/*
+ * Is ENTRY, a data block pointer past EOF, a block reserved ahead of
+ * time (IOCTL_PREALLOC with PREALLOC_KEEPSIZE)? Those belong there;
+ * anything else past EOF is garbage.
+ */
+static
+int
+reserved(blockusage_t usagetype, uint32_t entry)
+{
+	return usagetype == B_DATA && (entry & SFS_UNWRITTEN) != 0;
+}
+
 /*
  * Traverse an indirect block, recording blocks that are in use,
- * dropping any entries that are past EOF, and clearing any entries
- * that point outside the volume.
+ * dropping any entries that are past EOF (except reserved ones), and
+ * clearing any entries that point outside the volume.
  *
  * XXX: this should be extended to be able to recover from crosslinked
  * blocks. Currently it just complains in freemap.c and sets
@@ -81,9 +93,10 @@ void
 check_indirect_block(struct ibstate *ibs, uint32_t *ientry, int *iechangedp,
 		     int indirection)
 {
-	uint32_t entries[SFS_DBPERIDB];
+	uint32_t entries[SFS_DBPERIDB(SFS_MAXBLOCKSIZE)];
+	uint32_t dbperidb = SFS_DBPERIDB(sb_blocksize());
 	uint32_t i, ct;
-	uint32_t coveredblocks;
+	uint32_t coveredblocks, datablock;
 	int localchanged = 0;
 	int j;
 
@@ -105,14 +118,14 @@ check_indirect_block(struct ibstate *ibs, uint32_t *ientry, int *iechangedp,
 		}
 		coveredblocks = 1;
 		for (j=0; j<indirection; j++) {
-			coveredblocks *= SFS_DBPERIDB;
+			coveredblocks *= dbperidb;
 		}
 		ibs->curfileblock += coveredblocks;
 		return;
 	}
 
 	if (indirection > 1) {
-		for (i=0; i<SFS_DBPERIDB; i++) {
+		for (i=0; i<dbperidb; i++) {
 			check_indirect_block(ibs, &entries[i], &localchanged,
 					     indirection-1);
 		}
@@ -120,28 +133,31 @@ check_indirect_block(struct ibstate *ibs, uint32_t *ientry, int *iechangedp,
 	else {
 		assert(indirection==1);
 
-		for (i=0; i<SFS_DBPERIDB; i++) {
-			if (entries[i] >= ibs->volblocks) {
+		for (i=0; i<dbperidb; i++) {
+			/* (a reserved, unwritten block is still in use) */
+			datablock = SFS_BLOCKNUM(entries[i]);
+			if (datablock >= ibs->volblocks) {
 				setbadness(EXIT_RECOV);
 				warnx("Inode %lu: direct block pointer for "
 				      "block %lu outside of volume: %lu "
 				      "(cleared)\n",
 				      (unsigned long)ibs->ino,
 				      (unsigned long)ibs->curfileblock,
-				      (unsigned long)entries[i]);
+				      (unsigned long)datablock);
 				entries[i] = 0;
 				localchanged = 1;
 			}
-			else if (entries[i] != 0) {
-				if (ibs->curfileblock < ibs->fileblocks) {
-					freemap_blockinuse(entries[i],
+			else if (datablock != 0) {
+				if (ibs->curfileblock < ibs->fileblocks ||
+				    reserved(ibs->usagetype, entries[i])) {
+					freemap_blockinuse(datablock,
 							  ibs->usagetype,
 							  ibs->ino);
 				}
 				else {
 					setbadness(EXIT_RECOV);
 					ibs->pasteofcount++;
-					freemap_blockfree(entries[i]);
+					freemap_blockfree(datablock);
 					entries[i] = 0;
 					localchanged = 1;
 				}
@@ -151,7 +167,7 @@ check_indirect_block(struct ibstate *ibs, uint32_t *ientry, int *iechangedp,
 	}
 
 	ct=0;
-	for (i=ct=0; i<SFS_DBPERIDB; i++) {
+	for (i=ct=0; i<dbperidb; i++) {
 		if (entries[i]!=0) ct++;
 	}
 	if (ct==0) {
@@ -185,15 +201,16 @@ int
 check_inode_blocks(uint32_t ino, struct sfs_dinode *sfi, int isdir)
 {
 	struct ibstate ibs;
-	uint32_t size, datablock;
+	uint32_t datablock;
 	int changed;
 	int i;
 
-	size = SFS_ROUNDUP(sfi->sfi_size, SFS_BLOCKSIZE);
-
 	ibs.ino = ino;
 	/*ibs.curfileblock = 0;*/
-	ibs.fileblocks = size/SFS_BLOCKSIZE;
+	ibs.fileblocks = sfi->sfi_size / sb_blocksize();
+	if (sfi->sfi_size % sb_blocksize() != 0) {
+		ibs.fileblocks++;
+	}
 	ibs.volblocks = sb_totalblocks();
 	ibs.pasteofcount = 0;
 	ibs.usagetype = isdir ? B_DIRDATA : B_DATA;
@@ -201,7 +218,7 @@ check_inode_blocks(uint32_t ino, struct sfs_dinode *sfi, int isdir)
 	changed = 0;
 
 	for (ibs.curfileblock=0; ibs.curfileblock<NUM_D; ibs.curfileblock++) {
-		datablock = GET_D(sfi, ibs.curfileblock);
+		datablock = SFS_BLOCKNUM(GET_D(sfi, ibs.curfileblock));
 		if (datablock >= ibs.volblocks) {
 			setbadness(EXIT_RECOV);
 			warnx("Inode %lu: direct block pointer for "
@@ -214,7 +231,9 @@ check_inode_blocks(uint32_t ino, struct sfs_dinode *sfi, int isdir)
 			changed = 1;
 		}
 		else if (datablock > 0) {
-			if (ibs.curfileblock < ibs.fileblocks) {
+			if (ibs.curfileblock < ibs.fileblocks ||
+			    reserved(ibs.usagetype,
+				     GET_D(sfi, ibs.curfileblock))) {
 				freemap_blockinuse(datablock, ibs.usagetype,
 						   ibs.ino);
 			}
@@ -247,6 +266,84 @@ check_inode_blocks(uint32_t ino, struct sfs_dinode *sfi, int isdir)
 	return changed;
 }
 
+/*
+ * Check an inode whose data is inline (SFS_IFLAG_INLINE): it should
+ * be a regular file small enough to fit, with no blocks, and with
+ * nothing past EOF in the inline area.
+ *
+ * Returns nonzero if SFI has been modified and needs to be written
+ * back.
+ */
+static
+int
+check_inode_inline(uint32_t ino, struct sfs_dinode *sfi, int isdir)
+{
+	uint32_t max;
+	int changed = 0, hasblocks = 0;
+	int i;
+
+	if (isdir) {
+		warnx("Inode %lu: directory marked inline (fixed)",
+		      (unsigned long) ino);
+		setbadness(EXIT_RECOV);
+		sfi->sfi_flags &= ~SFS_IFLAG_INLINE;
+		bzero(sfi->sfi_inline, sizeof(sfi->sfi_inline));
+		return 1;
+	}
+
+	max = sb_dense() ? SFS_INLINESIZE_DENSE : SFS_INLINESIZE;
+	if (sfi->sfi_size > max) {
+		warnx("Inode %lu: inline file too large: %lu bytes "
+		      "(truncated to %lu)", (unsigned long) ino,
+		      (unsigned long) sfi->sfi_size, (unsigned long) max);
+		setbadness(EXIT_RECOV);
+		sfi->sfi_size = max;
+		changed = 1;
+	}
+
+	/* Any blocks aren't marked in use, so the freemap check frees them */
+	for (i=0; i<NUM_D; i++) {
+		if (GET_D(sfi, i) != 0) {
+			SET_D(sfi, i) = 0;
+			hasblocks = 1;
+		}
+	}
+	for (i=0; i<NUM_I; i++) {
+		if (GET_I(sfi, i) != 0) {
+			SET_I(sfi, i) = 0;
+			hasblocks = 1;
+		}
+	}
+	for (i=0; i<NUM_II; i++) {
+		if (GET_II(sfi, i) != 0) {
+			SET_II(sfi, i) = 0;
+			hasblocks = 1;
+		}
+	}
+	for (i=0; i<NUM_III; i++) {
+		if (GET_III(sfi, i) != 0) {
+			SET_III(sfi, i) = 0;
+			hasblocks = 1;
+		}
+	}
+	if (hasblocks) {
+		warnx("Inode %lu: inline file has block pointers (cleared)",
+		      (unsigned long) ino);
+		setbadness(EXIT_RECOV);
+		changed = 1;
+	}
+
+	if (checkzeroed(sfi->sfi_inline + sfi->sfi_size,
+			sizeof(sfi->sfi_inline) - sfi->sfi_size)) {
+		warnx("Inode %lu: inline data past EOF not zeroed (fixed)",
+		      (unsigned long) ino);
+		setbadness(EXIT_RECOV);
+		changed = 1;
+	}
+
+	return changed;
+}
+
 /*
  * Do the pass1 inode-level checks on inode INO, which has already
  * been loaded into SFI. Note that sfi_type has already been
@@ -268,17 +365,38 @@ pass1_inode(uint32_t ino, struct sfs_dinode *sfi, int alreadychanged)
 		return 1;
 	}
 
-	freemap_blockinuse(ino, B_INODE, ino);
+	if (sb_dense()) {
+		freemap_inodeinuse(ino);
+	}
+	else {
+		freemap_blockinuse(ino, B_INODE, ino);
+	}
 
-	if (checkzeroed(sfi->sfi_waste, sizeof(sfi->sfi_waste))) {
-		warnx("Inode %lu: sfi_waste section not zeroed (fixed)",
-		      (unsigned long) ino);
+	if (sfi->sfi_flags & ~SFS_IFLAG_INLINE) {
+		warnx("Inode %lu: unknown flags 0x%lx (cleared)",
+		      (unsigned long) ino,
+		      (unsigned long) (sfi->sfi_flags & ~SFS_IFLAG_INLINE));
 		setbadness(EXIT_RECOV);
+		sfi->sfi_flags &= SFS_IFLAG_INLINE;
 		changed = 1;
 	}
 
-	if (check_inode_blocks(ino, sfi, isdir)) {
-		changed = 1;
+	if (sfi->sfi_flags & SFS_IFLAG_INLINE) {
+		if (check_inode_inline(ino, sfi, isdir)) {
+			changed = 1;
+		}
+	}
+	else {
+		if (checkzeroed(sfi->sfi_inline, sizeof(sfi->sfi_inline))) {
+			warnx("Inode %lu: sfi_inline section not zeroed "
+			      "(fixed)", (unsigned long) ino);
+			setbadness(EXIT_RECOV);
+			changed = 1;
+		}
+
+		if (check_inode_blocks(ino, sfi, isdir)) {
+			changed = 1;
+		}
 	}
 
 	if (changed) {
@@ -296,9 +414,9 @@ int
 pass1_direntry(const char *path, uint32_t index, struct sfs_direntry *sfd)
 {
 	int dchanged = 0;
-	uint32_t nblocks;
+	uint32_t ninodes;
 
-	nblocks = sb_totalblocks();
+	ninodes = sb_ninodes();
 
 	if (sfd->sfd_ino == SFS_NOINO) {
 		if (sfd->sfd_name[0] != 0) {
@@ -309,7 +427,7 @@ pass1_direntry(const char *path, uint32_t index, struct sfs_direntry *sfd)
 			dchanged = 1;
 		}
 	}
-	else if (sfd->sfd_ino >= nblocks) {
+	else if (sfd->sfd_ino >= ninodes) {
 		setbadness(EXIT_RECOV);
 		warnx("Directory %s entry %lu has out of range "
 		      "inode (cleared)",
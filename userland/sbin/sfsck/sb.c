@@ -36,6 +36,7 @@
 #include "compat.h"
 #include <kern/sfs.h>
 
+#include "disk.h"
 #include "utils.h"
 #include "sfs.h"
 #include "sb.h"
@@ -43,6 +44,22 @@
 #include "main.h"
 
 static struct sfs_superblock sb;
+static uint32_t blocksize;
+
+/*
+ * Return the first block after the superblock, the bitmaps, and (in
+ * the dense format) the inode table.
+ */
+static
+uint32_t
+sb_metaend(void)
+{
+	if (sb.sb_version == SFS_VERSION_DENSE) {
+		return sb.sb_itablestart +
+			SFS_ITABLEBLOCKS(sb.sb_ninodes, blocksize);
+	}
+	return SFS_FREEMAP_START + SFS_FREEMAPBLOCKS(sb.sb_nblocks, blocksize);
+}
 
 /*
  * Load the superblock.
@@ -55,8 +72,55 @@ sb_load(void)
 		errx(EXIT_FATAL, "Not an sfs filesystem");
 	}
 
+	/* Everything after the superblock is in units of the block size */
+	blocksize = SFS_SB_BLOCKSIZE(&sb);
+	if (blocksize < SFS_BLOCKSIZE || blocksize > SFS_MAXBLOCKSIZE ||
+	    (blocksize & (blocksize - 1)) != 0) {
+		errx(EXIT_FATAL, "Unsupported block size %lu",
+		     (unsigned long) blocksize);
+	}
+	disksetblocksize(blocksize);
+
 	assert(sb.sb_nblocks > 0);
-	assert(SFS_FREEMAPBLOCKS(sb.sb_nblocks) > 0);
+	assert(SFS_FREEMAPBLOCKS(sb.sb_nblocks, blocksize) > 0);
+
+	switch (sb.sb_version) {
+	    case SFS_VERSION_ORIG:
+		break;
+	    case SFS_VERSION_DENSE:
+		if (sb.sb_ninodes <= SFS_ROOTDIR_INO ||
+		    sb.sb_ninodes % SFS_INOPERBLOCK(blocksize) != 0) {
+			errx(EXIT_FATAL, "Bad inode count %lu in superblock",
+			     (unsigned long) sb.sb_ninodes);
+		}
+		if (sb.sb_inomapstart != SFS_FREEMAP_START +
+		    SFS_FREEMAPBLOCKS(sb.sb_nblocks, blocksize) ||
+		    sb.sb_itablestart != sb.sb_inomapstart +
+		    SFS_INOMAPBLOCKS(sb.sb_ninodes, blocksize) ||
+		    sb.sb_itablestart +
+		    SFS_ITABLEBLOCKS(sb.sb_ninodes, blocksize) >
+		    sb.sb_nblocks) {
+			errx(EXIT_FATAL, "Bad inode table layout in "
+			     "superblock");
+		}
+		break;
+	    default:
+		errx(EXIT_FATAL, "Unknown sfs format version %lu",
+		     (unsigned long) sb.sb_version);
+	}
+
+	/* The journal, if any, goes after the rest of the metadata */
+	if (sb.sb_journalblocks == 0) {
+		if (sb.sb_journalstart != 0) {
+			errx(EXIT_FATAL, "Bad journal layout in superblock");
+		}
+	}
+	else if (sb.sb_journalblocks < SFS_JMINBLOCKS ||
+		 sb.sb_journalstart < sb_metaend() ||
+		 sb.sb_journalstart >= sb.sb_nblocks ||
+		 sb.sb_journalblocks > sb.sb_nblocks - sb.sb_journalstart) {
+		errx(EXIT_FATAL, "Bad journal layout in superblock");
+	}
 }
 
 /*
@@ -111,7 +175,80 @@ sb_totalblocks(void)
 uint32_t
 sb_freemapblocks(void)
 {
-	return SFS_FREEMAPBLOCKS(sb.sb_nblocks);
+	return SFS_FREEMAPBLOCKS(sb.sb_nblocks, blocksize);
+}
+
+/*
+ * Return the block size.
+ */
+uint32_t
+sb_blocksize(void)
+{
+	return blocksize;
+}
+
+/*
+ * Return true if the volume uses the dense inode table format.
+ */
+int
+sb_dense(void)
+{
+	return sb.sb_version == SFS_VERSION_DENSE;
+}
+
+/*
+ * Return the number of inode numbers: the size of the inode table
+ * for the dense format, or the volume size for the original one.
+ */
+uint32_t
+sb_ninodes(void)
+{
+	return sb_dense() ? sb.sb_ninodes : sb.sb_nblocks;
+}
+
+/*
+ * Return the number of inode bitmap blocks (dense format).
+ */
+uint32_t
+sb_inomapblocks(void)
+{
+	return sb_dense() ? SFS_INOMAPBLOCKS(sb.sb_ninodes, blocksize) : 0;
+}
+
+/*
+ * Return the first inode bitmap block (dense format).
+ */
+uint32_t
+sb_inomapstart(void)
+{
+	return sb.sb_inomapstart;
+}
+
+/*
+ * Return the first inode table block (dense format).
+ */
+uint32_t
+sb_itablestart(void)
+{
+	return sb.sb_itablestart;
+}
+
+/*
+ * Return the first journal block.
+ */
+uint32_t
+sb_journalstart(void)
+{
+	return sb.sb_journalstart;
+}
+
+/*
+ * Return the number of journal blocks, or 0 if there's no journal.
+ */
+uint32_t
+sb_journalblocks(void)
+{
+	return sb.sb_journalblocks;
 }
 
 /*
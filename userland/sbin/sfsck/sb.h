@@ -46,6 +46,20 @@ uint32_t sb_totalblocks(void);
 /* After the superblock is loaded: return number of freemap blocks. */
 uint32_t sb_freemapblocks(void);
 
+/* After the superblock is loaded: return the block size (bytes). */
+uint32_t sb_blocksize(void);
+
+/* After the superblock is loaded: inode table (dense format) info. */
+int sb_dense(void);
+uint32_t sb_ninodes(void);
+uint32_t sb_inomapblocks(void);
+uint32_t sb_inomapstart(void);
+uint32_t sb_itablestart(void);
+
+/* After the superblock is loaded: journal info (0 blocks if none). */
+uint32_t sb_journalstart(void);
+uint32_t sb_journalblocks(void);
+
 /* After the superblock is loaded: return volume name. */
 const char *sb_volname(void);
 
@@ -40,6 +40,7 @@
 #include "utils.h"
 #include "ibmacros.h"
 #include "sfs.h"
+#include "sb.h"
 #include "main.h"
 
 ////////////////////////////////////////////////////////////
@@ -51,6 +52,7 @@ sfs_setup(void)
 	assert(sizeof(struct sfs_superblock)==SFS_BLOCKSIZE);
 	assert(sizeof(struct sfs_dinode)==SFS_BLOCKSIZE);
 	assert(SFS_BLOCKSIZE % sizeof(struct sfs_direntry) == 0);
+	assert(sizeof(struct sfs_jheader)==SFS_BLOCKSIZE);
 }
 
 ////////////////////////////////////////////////////////////
@@ -62,6 +64,29 @@ swapsb(struct sfs_superblock *sb)
 {
 	sb->sb_magic = SWAP32(sb->sb_magic);
 	sb->sb_nblocks = SWAP32(sb->sb_nblocks);
+	sb->sb_version = SWAP32(sb->sb_version);
+	sb->sb_ninodes = SWAP32(sb->sb_ninodes);
+	sb->sb_inomapstart = SWAP32(sb->sb_inomapstart);
+	sb->sb_itablestart = SWAP32(sb->sb_itablestart);
+	sb->sb_blocksize = SWAP32(sb->sb_blocksize);
+	sb->sb_journalstart = SWAP32(sb->sb_journalstart);
+	sb->sb_journalblocks = SWAP32(sb->sb_journalblocks);
+}
+
+static
+void
+swapjheader(struct sfs_jheader *jh)
+{
+	int i;
+
+	jh->jh_magic = SWAP32(jh->jh_magic);
+	jh->jh_state = SWAP32(jh->jh_state);
+	jh->jh_seq = SWAP32(jh->jh_seq);
+	jh->jh_nblocks = SWAP32(jh->jh_nblocks);
+	jh->jh_sum = SWAP32(jh->jh_sum);
+	for (i=0; i<SFS_JMAXBLOCKS; i++) {
+		jh->jh_blocks[i] = SWAP32(jh->jh_blocks[i]);
+	}
 }
 
 static
@@ -81,6 +106,7 @@ swapinode(struct sfs_dinode *sfi)
 	sfi->sfi_size = SWAP32(sfi->sfi_size);
 	sfi->sfi_type = SWAP16(sfi->sfi_type);
 	sfi->sfi_linkcount = SWAP16(sfi->sfi_linkcount);
+	sfi->sfi_flags = SWAP32(sfi->sfi_flags);
 
 	for (i=0; i<NUM_D; i++) {
 		SET_D(sfi, i) = SWAP32(GET_D(sfi, i));
@@ -110,8 +136,8 @@ static
 void
 swapindir(uint32_t *entries)
 {
-	int i;
-	for (i=0; i<SFS_DBPERIDB; i++) {
+	uint32_t i;
+	for (i=0; i<SFS_DBPERIDB(sb_blocksize()); i++) {
 		entries[i] = SWAP32(entries[i]);
 	}
 }
@@ -132,7 +158,7 @@ static
 uint32_t
 ibmap(uint32_t iblock, uint32_t offset, uint32_t entrysize)
 {
-	uint32_t entries[SFS_DBPERIDB];
+	uint32_t entries[SFS_DBPERIDB(SFS_MAXBLOCKSIZE)];
 
 	if (iblock == 0) {
 		return 0;
@@ -144,10 +170,11 @@ ibmap(uint32_t iblock, uint32_t offset, uint32_t entrysize)
 	if (entrysize > 1) {
 		uint32_t index = offset / entrysize;
 		offset %= entrysize;
-		return ibmap(entries[index], offset, entrysize/SFS_DBPERIDB);
+		return ibmap(entries[index], offset,
+			     entrysize/SFS_DBPERIDB(sb_blocksize()));
 	}
 	else {
-		assert(offset < SFS_DBPERIDB);
+		assert(offset < SFS_DBPERIDB(sb_blocksize()));
 		return entries[offset];
 	}
 }
@@ -188,24 +215,60 @@ bmap(const struct sfs_dinode *sfi, uint32_t fileblock)
 // superblock, free block bitmap, and inode I/O
 
 /*
- *  superblock - blocknum is a disk block number.
+ *  superblock - blocknum is a disk block number. The superblock is
+ *  the start of the block; the rest of a larger block is left alone.
  */
 
 void
 sfs_readsb(uint32_t blocknum, struct sfs_superblock *sb)
 {
-	diskread(sb, blocknum);
+	char block[SFS_MAXBLOCKSIZE];
+
+	diskread(block, blocknum);
+	memcpy(sb, block, sizeof(*sb));
 	swapsb(sb);
 }
 
 void
 sfs_writesb(uint32_t blocknum, struct sfs_superblock *sb)
 {
+	char block[SFS_MAXBLOCKSIZE];
+
+	diskread(block, blocknum);
 	swapsb(sb);
-	diskwrite(sb, blocknum);
+	memcpy(block, sb, sizeof(*sb));
+	diskwrite(block, blocknum);
 	swapsb(sb);
 }
 
+/*
+ * journal header - blocknum is a disk block number. Like the
+ * superblock, the header is the start of its block; writing it
+ * clears the rest.
+ */
+
+void
+sfs_readjheader(uint32_t blocknum, struct sfs_jheader *jh)
+{
+	char block[SFS_MAXBLOCKSIZE];
+
+	diskread(block, blocknum);
+	memcpy(jh, block, sizeof(*jh));
+	swapjheader(jh);
+}
+
+void
+sfs_writejheader(uint32_t blocknum, struct sfs_jheader *jh)
+{
+	char block[SFS_MAXBLOCKSIZE];
+
+	bzero(block, sizeof(block));
+	swapjheader(jh);
+	memcpy(block, jh, sizeof(*jh));
+	diskwrite(block, blocknum);
+	swapjheader(jh);
+}
+
 /*
  * freemap blocks - whichblock is a block number within the free block
  * bitmap.
@@ -227,21 +290,69 @@ sfs_writefreemapblock(uint32_t whichblock, uint8_t *bits)
 }
 
 /*
- *  inodes - ino is an inode number, which is a disk block number.
+ * inode bitmap blocks (dense format) - whichblock is a block number
+ * within the inode bitmap.
+ */
+
+void
+sfs_readinomapblock(uint32_t whichblock, uint8_t *bits)
+{
+	diskread(bits, sb_inomapstart() + whichblock);
+	swapbits(bits);
+}
+
+void
+sfs_writeinomapblock(uint32_t whichblock, uint8_t *bits)
+{
+	swapbits(bits);
+	diskwrite(bits, sb_inomapstart() + whichblock);
+	swapbits(bits);
+}
+
+/*
+ *  inodes - ino is an inode number. In the original format that's a
+ *  disk block number; in the dense format it's a slot in the inode
+ *  table, and the part of the inode past SFS_DINODE_DENSESIZE reads
+ *  as zero.
  */
 
 void
 sfs_readinode(uint32_t ino, struct sfs_dinode *sfi)
 {
-	diskread(sfi, ino);
+	char block[SFS_MAXBLOCKSIZE];
+	uint32_t inoperblock = SFS_INOPERBLOCK(sb_blocksize());
+
+	if (sb_dense()) {
+		diskread(block, sb_itablestart() + ino / inoperblock);
+		bzero(sfi, sizeof(*sfi));
+		memcpy(sfi, block + (ino % inoperblock) *
+		       SFS_DINODE_DENSESIZE, SFS_DINODE_DENSESIZE);
+	}
+	else {
+		diskread(block, ino);
+		memcpy(sfi, block, sizeof(*sfi));
+	}
 	swapinode(sfi);
 }
 
 void
 sfs_writeinode(uint32_t ino, struct sfs_dinode *sfi)
 {
+	char block[SFS_MAXBLOCKSIZE];
+	uint32_t inoperblock = SFS_INOPERBLOCK(sb_blocksize());
+
 	swapinode(sfi);
-	diskwrite(sfi, ino);
+	if (sb_dense()) {
+		diskread(block, sb_itablestart() + ino / inoperblock);
+		memcpy(block + (ino % inoperblock) * SFS_DINODE_DENSESIZE,
+		       sfi, SFS_DINODE_DENSESIZE);
+		diskwrite(block, sb_itablestart() + ino / inoperblock);
+	}
+	else {
+		diskread(block, ino);
+		memcpy(block, sfi, sizeof(*sfi));
+		diskwrite(block, ino);
+	}
 	swapinode(sfi);
 }
 
@@ -274,7 +385,7 @@ static
 void
 sfs_readdirblock(struct sfs_direntry *d, uint32_t diskblock)
 {
-	const unsigned atonce = SFS_BLOCKSIZE/sizeof(struct sfs_direntry);
+	const unsigned atonce = sb_blocksize()/sizeof(struct sfs_direntry);
 	unsigned j;
 
 	if (diskblock != 0) {
@@ -285,7 +396,7 @@ sfs_readdirblock(struct sfs_direntry *d, uint32_t diskblock)
 	}
 	else {
 		warnx("Warning: sparse directory found");
-		bzero(d, SFS_BLOCKSIZE);
+		bzero(d, sb_blocksize());
 	}
 }
 
@@ -297,11 +408,11 @@ sfs_readdirblock(struct sfs_direntry *d, uint32_t diskblock)
 void
 sfs_readdir(struct sfs_dinode *sfi, struct sfs_direntry *d, unsigned nd)
 {
-	const unsigned atonce = SFS_BLOCKSIZE/sizeof(struct sfs_direntry);
+	const unsigned atonce = sb_blocksize()/sizeof(struct sfs_direntry);
 	unsigned nblocks = SFS_ROUNDUP(nd, atonce) / atonce;
 	unsigned i, j;
 	unsigned left, thismany;
-	struct sfs_direntry buffer[atonce];
+	struct sfs_direntry buffer[SFS_MAXBLOCKSIZE/sizeof(struct sfs_direntry)];
 	uint32_t diskblock;
 
 	left = nd;
@@ -330,7 +441,7 @@ static
 void
 sfs_writedirblock(struct sfs_direntry *d, uint32_t diskblock)
 {
-	const unsigned atonce = SFS_BLOCKSIZE/sizeof(struct sfs_direntry);
+	const unsigned atonce = sb_blocksize()/sizeof(struct sfs_direntry);
 	unsigned j, bad;
 
 	if (diskblock != 0) {
@@ -362,11 +473,11 @@ sfs_writedirblock(struct sfs_direntry *d, uint32_t diskblock)
 void
 sfs_writedir(const struct sfs_dinode *sfi, struct sfs_direntry *d, unsigned nd)
 {
-	const unsigned atonce = SFS_BLOCKSIZE/sizeof(struct sfs_direntry);
+	const unsigned atonce = sb_blocksize()/sizeof(struct sfs_direntry);
 	unsigned nblocks = SFS_ROUNDUP(nd, atonce) / atonce;
 	unsigned i, j;
 	unsigned left, thismany;
-	struct sfs_direntry buffer[atonce];
+	struct sfs_direntry buffer[SFS_MAXBLOCKSIZE/sizeof(struct sfs_direntry)];
 	uint32_t diskblock;
 
 	left = nd;
@@ -39,6 +39,7 @@
 #include <stdint.h>
 
 struct sfs_superblock;
+struct sfs_jheader;
 struct sfs_dinode;
 struct sfs_direntry;
 
@@ -53,10 +54,18 @@ void sfs_setup(void);
 void sfs_readsb(uint32_t blocknum, struct sfs_superblock *sb);
 void sfs_writesb(uint32_t blocknum, struct sfs_superblock *sb);
 
+/* journal header */
+void sfs_readjheader(uint32_t blocknum, struct sfs_jheader *jh);
+void sfs_writejheader(uint32_t blocknum, struct sfs_jheader *jh);
+
 /* freemap blocks; whichblock is the freemap block number (starts at 0) */
 void sfs_readfreemapblock(uint32_t whichblock, uint8_t *bits);
 void sfs_writefreemapblock(uint32_t whichblock, uint8_t *bits);
 
+/* inode bitmap blocks (dense format); whichblock starts at 0 */
+void sfs_readinomapblock(uint32_t whichblock, uint8_t *bits);
+void sfs_writeinomapblock(uint32_t whichblock, uint8_t *bits);
+
 /* inode */
 void sfs_readinode(uint32_t inum, struct sfs_dinode *sfi);
 void sfs_writeinode(uint32_t inum, struct sfs_dinode *sfi);
@@ -293,13 +293,44 @@ doclose(const char *path, int fd)
 	}
 }
 
+/*
+ * Reserve space for a file whose final size we know, so it doesn't
+ * get put together a block at a time. The size is left alone, so the
+ * checks that the writers produced it all still mean something. Not
+ * every filesystem can, so only other failures are worth a complaint;
+ * give up after one.
+ */
+static
+void
+doprealloc(const char *path, int fd, off_t size)
+{
+	static int noprealloc;
+	struct ioctl_prealloc ip;
+
+	if (noprealloc || size == 0) {
+		return;
+	}
+
+	ip.ip_offset = 0;
+	ip.ip_length = size;
+	ip.ip_flags = PREALLOC_KEEPSIZE;
+	if (ioctl(fd, IOCTL_PREALLOC, &ip) < 0) {
+		noprealloc = 1;
+		if (errno != ENOSYS && errno != EIOCTL &&
+		    errno != EINVAL) {
+			complain("%s: preallocate", path);
+		}
+	}
+}
+
 static
 void
-docreate(const char *path)
+docreate(const char *path, off_t size)
 {
 	int fd;
 
 	fd = doopen(path, O_WRONLY|O_CREAT|O_TRUNC, 0664);
+	doprealloc(path, fd, size);
 	doclose(path, fd);
 }
 
@@ -621,7 +652,7 @@ genkeys(void)
 	int i;
 
 	/* Create the file. */
-	docreate(PATH_KEYS);
+	docreate(PATH_KEYS, correctsize);
 
 	/* Generate random seeds for each subprocess. */
 	srandom(randomseed);
@@ -940,7 +971,7 @@ sort(void)
 
 	/* Step 4: assemble output file */
 	complainx("Assembling output file using %d procs", numprocs);
-	docreate(PATH_SORTED);
+	docreate(PATH_SORTED, correctsize);
 	doforkall("Final assembly", assemble);
 	if (getsize(PATH_SORTED) != correctsize) {
 		complainx("%s: file is wrong size", PATH_SORTED);